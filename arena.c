@@ -0,0 +1,84 @@
+#include "arena.h"
+#include <stdalign.h>
+#include <stdlib.h>
+
+static arena_chunk *arena_chunk_new(arena *a, size_t cap) {
+  arena_chunk *chunk = malloc(sizeof(arena_chunk) + cap);
+  chunk->next = NULL;
+  chunk->cap = cap;
+  chunk->used = 0;
+
+  a->reserved += cap;
+
+  return chunk;
+}
+
+arena *arena_new(size_t chunk_size) {
+  arena *a = malloc(sizeof(arena));
+  a->chunk_size = chunk_size;
+  a->used = 0;
+  a->peak = 0;
+  a->reserved = 0;
+  a->head = arena_chunk_new(a, chunk_size);
+  a->cur = a->head;
+
+  return a;
+}
+
+// arena_alloc returns size bytes (suitably aligned for anything) that stay
+// valid until the arena is rewound past them.
+void *arena_alloc(arena *a, size_t size) {
+  size_t align = alignof(max_align_t);
+  size = (size + align - 1) & ~(align - 1);
+
+  arena_chunk *chunk = a->cur;
+  if (chunk->cap - chunk->used < size) {
+    // Move on to the next chunk if it's big enough, or slot in a new one.
+    if (chunk->next != NULL && chunk->next->cap >= size) {
+      chunk = chunk->next;
+    } else {
+      arena_chunk *next =
+          arena_chunk_new(a, size > a->chunk_size ? size : a->chunk_size);
+      next->next = chunk->next;
+      chunk->next = next;
+      chunk = next;
+    }
+
+    chunk->used = 0;
+    a->cur = chunk;
+  }
+
+  void *ptr = chunk->data + chunk->used;
+  chunk->used += size;
+
+  a->used += size;
+  if (a->used > a->peak) {
+    a->peak = a->used;
+  }
+
+  return ptr;
+}
+
+// arena_save returns a mark to rewind the arena to later.
+arena_mark arena_save(arena *a) {
+  return (arena_mark){
+      .chunk = a->cur, .chunk_used = a->cur->used, .used = a->used};
+}
+
+// arena_restore releases everything allocated since the mark was taken.
+void arena_restore(arena *a, arena_mark mark) {
+  a->cur = mark.chunk;
+  a->cur->used = mark.chunk_used;
+  a->used = mark.used;
+}
+
+void arena_free(arena *a) {
+  arena_chunk *chunk = a->head;
+  while (chunk != NULL) {
+    arena_chunk *next = chunk->next;
+    free(chunk);
+    chunk = next;
+  }
+
+  free(a);
+}
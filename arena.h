@@ -0,0 +1,53 @@
+#pragma once
+
+#include <stddef.h>
+
+// arena_chunk is a block of an arena's memory.
+typedef struct arena_chunk {
+  struct arena_chunk *next;
+  size_t cap;
+  size_t used;
+  char data[];
+} arena_chunk;
+
+// arena is a bump allocator for scratch memory that only has to live as long
+// as the cmd that allocated it (e.g. the argv a term is run with).
+//
+// Nothing is freed on its own: rewinding to an earlier mark releases
+// everything allocated since in one go. Since cmds nest (a loop's body runs
+// inside the loop), each cmd rewinds to where it started, so a loop's scratch
+// is reused by every iteration instead of piling up. Chunks are kept around
+// for reuse rather than given back.
+//
+// Anything that outlives the cmd (vars, positional params, funcs) has to be
+// copied out, which is what var_value and cmd_func refs are for.
+typedef struct arena {
+  arena_chunk *head;
+  arena_chunk *cur;
+
+  // The size of a new chunk (unless an allocation needs a bigger one).
+  size_t chunk_size;
+
+  // The bytes currently allocated, the most that ever were at once and the
+  // bytes reserved for chunks.
+  size_t used;
+  size_t peak;
+  size_t reserved;
+} arena;
+
+// arena_mark is a point an arena can be rewound to.
+typedef struct arena_mark {
+  arena_chunk *chunk;
+  size_t chunk_used;
+  size_t used;
+} arena_mark;
+
+arena *arena_new(size_t chunk_size);
+
+void *arena_alloc(arena *a, size_t size);
+
+arena_mark arena_save(arena *a);
+
+void arena_restore(arena *a, arena_mark mark);
+
+void arena_free(arena *a);
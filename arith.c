@@ -0,0 +1,687 @@
+#include "arith.h"
+#include "glib.h"
+#include "var_store.h"
+#include <errno.h>
+#include <setjmp.h>
+#include <stdlib.h>
+#include <string.h>
+
+// arith_parser walks the source of an expression.
+typedef struct arith_parser {
+  const char *next;
+  const char *end;
+
+  // Every node allocated so far, so they can be freed on an error.
+  GPtrArray *nodes;
+
+  const char *err;
+  jmp_buf err_jmp;
+} arith_parser;
+
+// arith_binary_op is a binary operator's spelling and precedence (higher
+// binds tighter).
+typedef struct arith_binary_op {
+  const char *str;
+  arith_op op;
+  int prec;
+  bool right_assoc;
+} arith_binary_op;
+
+// Longer spellings come first so e.g. "<<" isn't read as "<".
+static const arith_binary_op binary_ops[] = {
+    {"**", ARITH_OP_POW, 11, true},  {"<<", ARITH_OP_SHL, 8, false},
+    {">>", ARITH_OP_SHR, 8, false},  {"<=", ARITH_OP_LE, 7, false},
+    {">=", ARITH_OP_GE, 7, false},   {"==", ARITH_OP_EQ, 6, false},
+    {"!=", ARITH_OP_NE, 6, false},   {"&&", ARITH_OP_AND, 2, false},
+    {"||", ARITH_OP_OR, 1, false},   {"*", ARITH_OP_MUL, 10, false},
+    {"/", ARITH_OP_DIV, 10, false},  {"%", ARITH_OP_MOD, 10, false},
+    {"+", ARITH_OP_ADD, 9, false},   {"-", ARITH_OP_SUB, 9, false},
+    {"<", ARITH_OP_LT, 7, false},    {">", ARITH_OP_GT, 7, false},
+    {"&", ARITH_OP_BIT_AND, 5, false}, {"^", ARITH_OP_BIT_XOR, 4, false},
+    {"|", ARITH_OP_BIT_OR, 3, false},
+};
+
+// The operators that can be combined with "=" (e.g. "+=").
+static const arith_binary_op assign_ops[] = {
+    {"<<=", ARITH_OP_SHL, 0, true},    {">>=", ARITH_OP_SHR, 0, true},
+    {"*=", ARITH_OP_MUL, 0, true},     {"/=", ARITH_OP_DIV, 0, true},
+    {"%=", ARITH_OP_MOD, 0, true},     {"+=", ARITH_OP_ADD, 0, true},
+    {"-=", ARITH_OP_SUB, 0, true},     {"&=", ARITH_OP_BIT_AND, 0, true},
+    {"^=", ARITH_OP_BIT_XOR, 0, true}, {"|=", ARITH_OP_BIT_OR, 0, true},
+    {"=", ARITH_OP_NONE, 0, true},
+};
+
+static arith_node *arith_parse_comma(arith_parser *parser);
+static arith_node *arith_parse_assign(arith_parser *parser);
+static arith_node *arith_parse_unary(arith_parser *parser);
+
+static void arith_parser_err(arith_parser *parser, const char *err) {
+  parser->err = err;
+  longjmp(parser->err_jmp, 1);
+}
+
+static arith_node *arith_node_new(arith_parser *parser, arith_node_type type,
+                                  arith_op op) {
+  arith_node *node = malloc(sizeof(arith_node));
+  *node = (arith_node){.type = type, .op = op, .slot = -1};
+  g_ptr_array_add(parser->nodes, node);
+
+  return node;
+}
+
+static void arith_skip_spaces(arith_parser *parser) {
+  while (parser->next < parser->end &&
+         (*parser->next == ' ' || *parser->next == '\t' ||
+          *parser->next == '\n')) {
+    parser->next++;
+  }
+}
+
+// arith_peek_str returns whether the source continues with str (after any
+// spaces).
+static bool arith_peek_str(arith_parser *parser, const char *str) {
+  arith_skip_spaces(parser);
+
+  size_t len = strlen(str);
+  return (size_t)(parser->end - parser->next) >= len &&
+         strncmp(parser->next, str, len) == 0;
+}
+
+static bool arith_consume_str(arith_parser *parser, const char *str) {
+  if (!arith_peek_str(parser, str)) {
+    return false;
+  }
+
+  parser->next += strlen(str);
+  return true;
+}
+
+static bool arith_is_name_char(char c) {
+  return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') ||
+         (c >= '0' && c <= '9') || c == '_';
+}
+
+// arith_peek_assign_op returns the assignment operator at the cursor (or NULL).
+static const arith_binary_op *arith_peek_assign_op(arith_parser *parser) {
+  for (size_t i = 0; i < G_N_ELEMENTS(assign_ops); i++) {
+    if (arith_peek_str(parser, assign_ops[i].str)) {
+      // "=" followed by "=" is a comparison.
+      if (assign_ops[i].op == ARITH_OP_NONE &&
+          parser->next + 1 < parser->end && parser->next[1] == '=') {
+        return NULL;
+      }
+
+      return &assign_ops[i];
+    }
+  }
+
+  return NULL;
+}
+
+// arith_peek_binary_op returns the binary operator at the cursor (or NULL if
+// there isn't one, or it's really an assignment like "+=").
+static const arith_binary_op *arith_peek_binary_op(arith_parser *parser) {
+  for (size_t i = 0; i < G_N_ELEMENTS(binary_ops); i++) {
+    if (!arith_peek_str(parser, binary_ops[i].str)) {
+      continue;
+    }
+
+    // e.g. the "+" of "+=".
+    const char *after = parser->next + strlen(binary_ops[i].str);
+    bool is_assign = false;
+    if (after < parser->end && *after == '=') {
+      for (size_t j = 0; j < G_N_ELEMENTS(assign_ops); j++) {
+        is_assign |= assign_ops[j].op == binary_ops[i].op;
+      }
+    }
+
+    return is_assign ? NULL : &binary_ops[i];
+  }
+
+  return NULL;
+}
+
+// arith_parse_num parses a number: decimal, octal ("0755"), hex ("0xff") or
+// in a given base ("2#1010").
+static arith_node *arith_parse_num(arith_parser *parser) {
+  const char *start = parser->next;
+  while (parser->next < parser->end &&
+         (arith_is_name_char(*parser->next) || *parser->next == '#' ||
+          *parser->next == '@')) {
+    parser->next++;
+  }
+
+  char buf[96];
+  size_t len = (size_t)(parser->next - start);
+  if (len >= sizeof(buf)) {
+    arith_parser_err(parser, "number too long");
+  }
+
+  memcpy(buf, start, len);
+  buf[len] = 0;
+
+  int base = 0;
+  char *digits = buf;
+  char *hash = strchr(buf, '#');
+  if (hash != NULL) {
+    *hash = 0;
+    base = atoi(buf);
+    digits = hash + 1;
+
+    if (base < 2 || base > 36) {
+      arith_parser_err(parser, "invalid arithmetic base");
+    }
+  }
+
+  char *end;
+  errno = 0;
+  int64_t num = (int64_t)strtoull(digits, &end, base);
+  if (*digits == 0 || *end != 0 || errno != 0) {
+    arith_parser_err(parser, "value too great for base");
+  }
+
+  arith_node *node = arith_node_new(parser, ARITH_NODE_NUM, ARITH_OP_NONE);
+  node->num = num;
+
+  return node;
+}
+
+// arith_parse_primary parses a number, var or parenthesized expression.
+static arith_node *arith_parse_primary(arith_parser *parser) {
+  if (arith_consume_str(parser, "(")) {
+    arith_node *node = arith_parse_comma(parser);
+    if (!arith_consume_str(parser, ")")) {
+      arith_parser_err(parser, "missing ')'");
+    }
+
+    return node;
+  }
+
+  arith_skip_spaces(parser);
+  if (parser->next >= parser->end) {
+    arith_parser_err(parser, "operand expected");
+  }
+
+  char c = *parser->next;
+  if (c >= '0' && c <= '9') {
+    return arith_parse_num(parser);
+  }
+
+  // Vars can be written with or without a '$'.
+  if (c == '$') {
+    parser->next++;
+    c = parser->next < parser->end ? *parser->next : 0;
+
+    if ((c >= '0' && c <= '9') || c == '#' || c == '?') {
+      parser->next++;
+
+      arith_node *node = arith_node_new(parser, ARITH_NODE_VAR, ARITH_OP_NONE);
+      node->special = c;
+
+      return node;
+    }
+  }
+
+  const char *start = parser->next;
+  while (parser->next < parser->end && arith_is_name_char(*parser->next)) {
+    parser->next++;
+  }
+
+  if (parser->next == start) {
+    arith_parser_err(parser, "operand expected");
+  }
+
+  arith_node *node = arith_node_new(parser, ARITH_NODE_VAR, ARITH_OP_NONE);
+  node->slot = var_store_intern(start, (size_t)(parser->next - start));
+
+  return node;
+}
+
+// arith_parse_postfix parses a primary followed by "++" or "--".
+static arith_node *arith_parse_postfix(arith_parser *parser) {
+  arith_node *node = arith_parse_primary(parser);
+
+  if (node->type == ARITH_NODE_VAR && node->special == 0) {
+    arith_op op = arith_consume_str(parser, "++")   ? ARITH_OP_POST_INC
+                  : arith_consume_str(parser, "--") ? ARITH_OP_POST_DEC
+                                                    : ARITH_OP_NONE;
+    if (op != ARITH_OP_NONE) {
+      arith_node *incdec = arith_node_new(parser, ARITH_NODE_INCDEC, op);
+      incdec->a = node;
+
+      return incdec;
+    }
+  }
+
+  return node;
+}
+
+// arith_parse_unary parses prefix operators.
+static arith_node *arith_parse_unary(arith_parser *parser) {
+  arith_op incdec = arith_consume_str(parser, "++")   ? ARITH_OP_PRE_INC
+                    : arith_consume_str(parser, "--") ? ARITH_OP_PRE_DEC
+                                                      : ARITH_OP_NONE;
+  if (incdec != ARITH_OP_NONE) {
+    arith_node *var = arith_parse_unary(parser);
+    if (var->type != ARITH_NODE_VAR || var->special != 0) {
+      arith_parser_err(parser, "'++' and '--' need a variable");
+    }
+
+    arith_node *node = arith_node_new(parser, ARITH_NODE_INCDEC, incdec);
+    node->a = var;
+
+    return node;
+  }
+
+  arith_op op = arith_consume_str(parser, "-")   ? ARITH_OP_NEG
+                : arith_consume_str(parser, "+") ? ARITH_OP_POS
+                : arith_consume_str(parser, "!") ? ARITH_OP_NOT
+                : arith_consume_str(parser, "~") ? ARITH_OP_BIT_NOT
+                                                 : ARITH_OP_NONE;
+  if (op != ARITH_OP_NONE) {
+    arith_node *node = arith_node_new(parser, ARITH_NODE_UNARY, op);
+    node->a = arith_parse_unary(parser);
+
+    return node;
+  }
+
+  return arith_parse_postfix(parser);
+}
+
+// arith_parse_binary parses binary operators binding at least as tightly as
+// min_prec, by precedence climbing.
+static arith_node *arith_parse_binary(arith_parser *parser, int min_prec) {
+  arith_node *lhs = arith_parse_unary(parser);
+
+  const arith_binary_op *op;
+  while ((op = arith_peek_binary_op(parser)) != NULL && op->prec >= min_prec) {
+    parser->next += strlen(op->str);
+
+    arith_node *node = arith_node_new(parser, ARITH_NODE_BINARY, op->op);
+    node->a = lhs;
+    node->b = arith_parse_binary(parser, op->right_assoc ? op->prec
+                                                         : op->prec + 1);
+    lhs = node;
+  }
+
+  return lhs;
+}
+
+// arith_parse_ternary parses "cond ? a : b".
+static arith_node *arith_parse_ternary(arith_parser *parser) {
+  arith_node *cond = arith_parse_binary(parser, 1);
+
+  if (!arith_consume_str(parser, "?")) {
+    return cond;
+  }
+
+  arith_node *node = arith_node_new(parser, ARITH_NODE_TERNARY, ARITH_OP_NONE);
+  node->a = cond;
+  node->b = arith_parse_assign(parser);
+
+  if (!arith_consume_str(parser, ":")) {
+    arith_parser_err(parser, "expected ':' in conditional expression");
+  }
+
+  node->c = arith_parse_ternary(parser);
+
+  return node;
+}
+
+// arith_parse_assign parses "var = expr" (and "var += expr" etc.), which is
+// right associative.
+static arith_node *arith_parse_assign(arith_parser *parser) {
+  arith_node *lhs = arith_parse_ternary(parser);
+
+  const arith_binary_op *op = arith_peek_assign_op(parser);
+  if (op == NULL) {
+    return lhs;
+  }
+
+  if (lhs->type != ARITH_NODE_VAR || lhs->special != 0) {
+    arith_parser_err(parser, "attempted assignment to non-variable");
+  }
+
+  parser->next += strlen(op->str);
+
+  arith_node *node = arith_node_new(parser, ARITH_NODE_ASSIGN, op->op);
+  node->a = lhs;
+  node->b = arith_parse_assign(parser);
+
+  return node;
+}
+
+// arith_parse_comma parses "expr, expr, ...".
+static arith_node *arith_parse_comma(arith_parser *parser) {
+  arith_node *lhs = arith_parse_assign(parser);
+
+  while (arith_consume_str(parser, ",")) {
+    arith_node *node =
+        arith_node_new(parser, ARITH_NODE_BINARY, ARITH_OP_COMMA);
+    node->a = lhs;
+    node->b = arith_parse_assign(parser);
+    lhs = node;
+  }
+
+  return lhs;
+}
+
+// arith_parse parses the expression in src[:len], returning NULL (with err set)
+// if it's malformed.
+//
+// An empty expression evaluates to 0.
+arith_node *arith_parse(const char *src, size_t len, const char **err) {
+  arith_parser parser = {
+      .next = src,
+      .end = src + len,
+      .nodes = g_ptr_array_new(),
+      .err = NULL,
+  };
+
+  if (setjmp(parser.err_jmp) != 0) {
+    for (guint i = 0; i < parser.nodes->len; i++) {
+      free(g_ptr_array_index(parser.nodes, i));
+    }
+    g_ptr_array_free(parser.nodes, true);
+
+    *err = parser.err;
+    return NULL;
+  }
+
+  arith_node *node;
+  arith_skip_spaces(&parser);
+  if (parser.next == parser.end) {
+    node = arith_node_new(&parser, ARITH_NODE_NUM, ARITH_OP_NONE);
+  } else {
+    node = arith_parse_comma(&parser);
+  }
+
+  arith_skip_spaces(&parser);
+  if (parser.next != parser.end) {
+    arith_parser_err(&parser, "syntax error in expression");
+  }
+
+  g_ptr_array_free(parser.nodes, true);
+
+  return node;
+}
+
+void arith_free(arith_node *node) {
+  if (node == NULL) {
+    return;
+  }
+
+  arith_free(node->a);
+  arith_free(node->b);
+  arith_free(node->c);
+  free(node);
+}
+
+// arith_evaluator is the state of a single evaluation.
+typedef struct arith_evaluator {
+  arith_vars *vars;
+  const char *err;
+} arith_evaluator;
+
+static int64_t arith_eval_node(arith_evaluator *ev, arith_node *node);
+
+// arith_var_value reads a var as a number (an unset or empty var is 0).
+static int64_t arith_var_value(arith_evaluator *ev, arith_node *var) {
+  const char *str = ev->vars->get(ev->vars->ctx, var->slot, var->special);
+  if (str == NULL) {
+    return 0;
+  }
+
+  while (*str == ' ' || *str == '\t' || *str == '\n') {
+    str++;
+  }
+
+  if (*str == 0) {
+    return 0;
+  }
+
+  char *end;
+  errno = 0;
+  int64_t num = (int64_t)strtoll(str, &end, 0);
+
+  while (*end == ' ' || *end == '\t' || *end == '\n') {
+    end++;
+  }
+
+  if (*end != 0 || errno != 0) {
+    ev->err = "invalid arithmetic operand";
+  }
+
+  return num;
+}
+
+// arith_apply applies a binary operator (with 64-bit wraparound, like bash).
+static int64_t arith_apply(arith_evaluator *ev, arith_op op, int64_t a,
+                           int64_t b) {
+  uint64_t ua = (uint64_t)a;
+  uint64_t ub = (uint64_t)b;
+
+  switch (op) {
+  case ARITH_OP_BIT_OR:
+    return a | b;
+  case ARITH_OP_BIT_XOR:
+    return a ^ b;
+  case ARITH_OP_BIT_AND:
+    return a & b;
+  case ARITH_OP_EQ:
+    return a == b;
+  case ARITH_OP_NE:
+    return a != b;
+  case ARITH_OP_LT:
+    return a < b;
+  case ARITH_OP_LE:
+    return a <= b;
+  case ARITH_OP_GT:
+    return a > b;
+  case ARITH_OP_GE:
+    return a >= b;
+  case ARITH_OP_SHL:
+    return (int64_t)(ua << (ub & 63));
+  case ARITH_OP_SHR:
+    return a >> (ub & 63);
+  case ARITH_OP_ADD:
+    return (int64_t)(ua + ub);
+  case ARITH_OP_SUB:
+    return (int64_t)(ua - ub);
+  case ARITH_OP_MUL:
+    return (int64_t)(ua * ub);
+  case ARITH_OP_DIV:
+  case ARITH_OP_MOD:
+    if (b == 0) {
+      ev->err = "division by 0";
+      return 0;
+    }
+
+    // INT64_MIN / -1 overflows.
+    if (b == -1) {
+      return op == ARITH_OP_DIV ? (int64_t)(0 - ua) : 0;
+    }
+
+    return op == ARITH_OP_DIV ? a / b : a % b;
+  case ARITH_OP_POW: {
+    if (b < 0) {
+      ev->err = "exponent less than 0";
+      return 0;
+    }
+
+    uint64_t res = 1;
+    for (; ub > 0; ub >>= 1) {
+      if (ub & 1) {
+        res *= ua;
+      }
+      ua *= ua;
+    }
+
+    return (int64_t)res;
+  }
+  // The rest aren't arithmetic binary operators (the logical ones and ","
+  // short-circuit in arith_eval_node).
+  case ARITH_OP_NONE:
+  case ARITH_OP_NEG:
+  case ARITH_OP_POS:
+  case ARITH_OP_NOT:
+  case ARITH_OP_BIT_NOT:
+  case ARITH_OP_COMMA:
+  case ARITH_OP_OR:
+  case ARITH_OP_AND:
+  case ARITH_OP_PRE_INC:
+  case ARITH_OP_PRE_DEC:
+  case ARITH_OP_POST_INC:
+  case ARITH_OP_POST_DEC:
+  default:
+    return b;
+  }
+}
+
+static int64_t arith_eval_node(arith_evaluator *ev, arith_node *node) {
+  if (ev->err != NULL) {
+    return 0;
+  }
+
+  switch (node->type) {
+  case ARITH_NODE_NUM:
+    return node->num;
+
+  case ARITH_NODE_VAR:
+    return arith_var_value(ev, node);
+
+  case ARITH_NODE_UNARY: {
+    int64_t a = arith_eval_node(ev, node->a);
+
+    switch (node->op) {
+    case ARITH_OP_NEG:
+      return (int64_t)(0 - (uint64_t)a);
+    case ARITH_OP_NOT:
+      return !a;
+    case ARITH_OP_BIT_NOT:
+      return ~a;
+    case ARITH_OP_POS:
+    case ARITH_OP_NONE:
+    case ARITH_OP_COMMA:
+    case ARITH_OP_OR:
+    case ARITH_OP_AND:
+    case ARITH_OP_BIT_OR:
+    case ARITH_OP_BIT_XOR:
+    case ARITH_OP_BIT_AND:
+    case ARITH_OP_EQ:
+    case ARITH_OP_NE:
+    case ARITH_OP_LT:
+    case ARITH_OP_LE:
+    case ARITH_OP_GT:
+    case ARITH_OP_GE:
+    case ARITH_OP_SHL:
+    case ARITH_OP_SHR:
+    case ARITH_OP_ADD:
+    case ARITH_OP_SUB:
+    case ARITH_OP_MUL:
+    case ARITH_OP_DIV:
+    case ARITH_OP_MOD:
+    case ARITH_OP_POW:
+    case ARITH_OP_PRE_INC:
+    case ARITH_OP_PRE_DEC:
+    case ARITH_OP_POST_INC:
+    case ARITH_OP_POST_DEC:
+    default:
+      return a;
+    }
+  }
+
+  case ARITH_NODE_BINARY: {
+    int64_t a = arith_eval_node(ev, node->a);
+
+    // Short-circuit the logical operators.
+    switch (node->op) {
+    case ARITH_OP_AND:
+      return a && arith_eval_node(ev, node->b);
+    case ARITH_OP_OR:
+      return a || arith_eval_node(ev, node->b);
+    case ARITH_OP_COMMA:
+      return arith_eval_node(ev, node->b);
+    case ARITH_OP_NONE:
+    case ARITH_OP_NEG:
+    case ARITH_OP_POS:
+    case ARITH_OP_NOT:
+    case ARITH_OP_BIT_NOT:
+    case ARITH_OP_BIT_OR:
+    case ARITH_OP_BIT_XOR:
+    case ARITH_OP_BIT_AND:
+    case ARITH_OP_EQ:
+    case ARITH_OP_NE:
+    case ARITH_OP_LT:
+    case ARITH_OP_LE:
+    case ARITH_OP_GT:
+    case ARITH_OP_GE:
+    case ARITH_OP_SHL:
+    case ARITH_OP_SHR:
+    case ARITH_OP_ADD:
+    case ARITH_OP_SUB:
+    case ARITH_OP_MUL:
+    case ARITH_OP_DIV:
+    case ARITH_OP_MOD:
+    case ARITH_OP_POW:
+    case ARITH_OP_PRE_INC:
+    case ARITH_OP_PRE_DEC:
+    case ARITH_OP_POST_INC:
+    case ARITH_OP_POST_DEC:
+    default:
+      return arith_apply(ev, node->op, a, arith_eval_node(ev, node->b));
+    }
+  }
+
+  case ARITH_NODE_TERNARY:
+    return arith_eval_node(ev, node->a) ? arith_eval_node(ev, node->b)
+                                        : arith_eval_node(ev, node->c);
+
+  case ARITH_NODE_ASSIGN: {
+    int64_t value = arith_eval_node(ev, node->b);
+    if (node->op != ARITH_OP_NONE) {
+      value = arith_apply(ev, node->op, arith_var_value(ev, node->a), value);
+    }
+
+    if (ev->err == NULL) {
+      ev->vars->set(ev->vars->ctx, node->a->slot, value);
+    }
+
+    return value;
+  }
+
+  case ARITH_NODE_INCDEC: {
+    int64_t before = arith_var_value(ev, node->a);
+    int64_t delta =
+        node->op == ARITH_OP_PRE_INC || node->op == ARITH_OP_POST_INC ? 1 : -1;
+    int64_t after = (int64_t)((uint64_t)before + (uint64_t)delta);
+
+    if (ev->err == NULL) {
+      ev->vars->set(ev->vars->ctx, node->a->slot, after);
+    }
+
+    return node->op == ARITH_OP_PRE_INC || node->op == ARITH_OP_PRE_DEC
+               ? after
+               : before;
+  }
+
+  default:
+    ev->err = "unknown expression";
+    return 0;
+  }
+}
+
+// arith_eval evaluates the expression, returning false (with err set) if it
+// couldn't be (e.g. for a division by 0).
+bool arith_eval(arith_node *node, arith_vars *vars, int64_t *res,
+                const char **err) {
+  arith_evaluator ev = {.vars = vars, .err = NULL};
+
+  *res = arith_eval_node(&ev, node);
+  if (ev.err != NULL) {
+    *err = ev.err;
+    return false;
+  }
+
+  return true;
+}
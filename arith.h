@@ -0,0 +1,92 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// arith parses shell arithmetic ("$(( ))" and "(( ))") into an expression tree
+// once, so evaluating it is just a walk over the tree with 64-bit ints.
+
+typedef enum arith_node_type {
+  ARITH_NODE_NUM,
+  ARITH_NODE_VAR,
+  ARITH_NODE_UNARY,
+  ARITH_NODE_BINARY,
+  ARITH_NODE_TERNARY,
+  ARITH_NODE_ASSIGN,
+
+  // ++x, --x, x++ and x--.
+  ARITH_NODE_INCDEC,
+} arith_node_type;
+
+typedef enum arith_op {
+  ARITH_OP_NONE,
+
+  ARITH_OP_NEG,
+  ARITH_OP_POS,
+  ARITH_OP_NOT,
+  ARITH_OP_BIT_NOT,
+
+  ARITH_OP_COMMA,
+  ARITH_OP_OR,
+  ARITH_OP_AND,
+  ARITH_OP_BIT_OR,
+  ARITH_OP_BIT_XOR,
+  ARITH_OP_BIT_AND,
+  ARITH_OP_EQ,
+  ARITH_OP_NE,
+  ARITH_OP_LT,
+  ARITH_OP_LE,
+  ARITH_OP_GT,
+  ARITH_OP_GE,
+  ARITH_OP_SHL,
+  ARITH_OP_SHR,
+  ARITH_OP_ADD,
+  ARITH_OP_SUB,
+  ARITH_OP_MUL,
+  ARITH_OP_DIV,
+  ARITH_OP_MOD,
+  ARITH_OP_POW,
+
+  ARITH_OP_PRE_INC,
+  ARITH_OP_PRE_DEC,
+  ARITH_OP_POST_INC,
+  ARITH_OP_POST_DEC,
+} arith_op;
+
+typedef struct arith_node {
+  arith_node_type type;
+
+  // The operator (for an ASSIGN, the one it combines with, e.g. ADD for "+=",
+  // or NONE for a plain "=").
+  arith_op op;
+
+  // For a NUM.
+  int64_t num;
+
+  // For a VAR: the var store slot, or the special param (e.g. '1' or '#').
+  int slot;
+  char special;
+
+  // The operands (the assigned or incremented var is always a).
+  struct arith_node *a;
+  struct arith_node *b;
+  struct arith_node *c;
+} arith_node;
+
+// arith_vars is how evaluation reads and writes the shell's vars.
+typedef struct arith_vars {
+  void *ctx;
+
+  // get returns the var's value (or NULL if it's unset).
+  const char *(*get)(void *ctx, int slot, char special);
+
+  void (*set)(void *ctx, int slot, int64_t value);
+} arith_vars;
+
+arith_node *arith_parse(const char *src, size_t len, const char **err);
+
+bool arith_eval(arith_node *node, arith_vars *vars, int64_t *res,
+                const char **err);
+
+void arith_free(arith_node *node);
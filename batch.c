@@ -0,0 +1,249 @@
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+#include "batch.h"
+#include "cmd.h"
+#include "cmd_executor.h"
+#include "cmd_parser.h"
+#include "fd_copy.h"
+#include "script_reader.h"
+#include "utils.h"
+#include <fcntl.h>
+#include <setjmp.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+// How many scripts can be finished but not yet printed per worker, which
+// bounds the capture fds held open when an early script is slow.
+#define BATCH_WINDOW_PER_JOB 16
+
+// batch_job is a script in a batch.
+typedef struct batch_job {
+  const char *path;
+
+  // Where the script's stdout and stderr are captured.
+  int out_fd;
+  int err_fd;
+
+  int status;
+
+  // When the script started and finished (in monotonic usecs).
+  gint64 started;
+  gint64 finished;
+
+  bool done;
+} batch_job;
+
+// batch is the state shared by a batch's workers.
+typedef struct batch {
+  GMutex lock;
+
+  // Signalled when a job is done.
+  GCond job_done;
+
+  int stdin_fd;
+} batch;
+
+// batch_read_manifest appends the script paths listed in the manifest at path
+// (one per line, skipping blank lines and "#" comments) to paths.
+void batch_read_manifest(const char *path, GPtrArray *paths) {
+  FILE *manifest = fopen(path, "r");
+  if (manifest == NULL) {
+    giveup("batch_read_manifest: failed to open '%s'", path);
+  }
+
+  char *line = NULL;
+  size_t cap = 0;
+  ssize_t len;
+
+  while ((len = getline(&line, &cap, manifest)) >= 0) {
+    while (len > 0 && strchr(" \t\r\n", line[len - 1]) != NULL) {
+      line[--len] = 0;
+    }
+
+    char *start = line + strspn(line, " \t");
+    if (*start != 0 && *start != '#') {
+      g_ptr_array_add(paths, strdup(start));
+    }
+  }
+
+  free(line);
+  fclose(manifest);
+}
+
+// batch_capture_fd returns a new fd to capture a script's output in.
+static int batch_capture_fd(void) {
+  int fd;
+
+#ifdef __linux__
+  if ((fd = memfd_create("turtle-batch", MFD_CLOEXEC)) >= 0) {
+    return fd;
+  }
+#endif
+
+  const char *tmpdir = getenv("TMPDIR");
+  char *template = g_strconcat(tmpdir != NULL ? tmpdir : "/tmp",
+                               "/turtle-batch.XXXXXX", NULL);
+
+  if ((fd = mkstemp(template)) < 0) {
+    giveup("batch_capture_fd: mkstemp failed");
+  }
+
+  unlink(template);
+  free(template);
+  fcntl(fd, F_SETFD, FD_CLOEXEC);
+
+  return fd;
+}
+
+// batch_exec_script runs the script from reader until a cmd fails, returning
+// its status (or 1 if the script doesn't parse).
+static int batch_exec_script(cmd_executor *executor, script_reader *reader) {
+  cmd_parser *parser = cmd_parser_new();
+
+  jmp_buf err_jmp;
+  parser->err_jmp = &err_jmp;
+
+  if (setjmp(err_jmp) != 0) {
+    dprintf(executor->stderr_fno, "%s", parser->err);
+    cmd_parser_free(parser);
+    return 1;
+  }
+
+  char *chunk;
+  while ((chunk = script_reader_next(reader)) != NULL) {
+    cmd_parser_set_next(parser, chunk);
+
+    cmd *c;
+    while ((c = cmd_parser_parse_next(parser)) != NULL) {
+      int status = cmd_executor_exec(executor, c);
+      cmd_free(c);
+
+      if (status != 0) {
+        cmd_parser_free(parser);
+        return status;
+      }
+    }
+  }
+
+  cmd_parser_free(parser);
+
+  return 0;
+}
+
+// batch_run_job runs a job's script on a worker thread.
+static void batch_run_job(gpointer data, gpointer user_data) {
+  batch_job *job = data;
+  batch *b = user_data;
+
+  job->started = g_get_monotonic_time();
+
+  int fd = open(job->path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    dprintf(job->err_fd, "turtle: failed to open '%s'\n", job->path);
+    job->status = 127;
+  } else {
+    cmd_executor *executor = cmd_executor_new();
+    executor->stdin_fno = b->stdin_fd;
+    executor->stdout_fno = job->out_fd;
+    executor->stderr_fno = job->err_fd;
+
+    char *args[] = {NULL};
+    cmd_executor_set_args(executor, job->path, args);
+
+    script_reader *reader = script_reader_new(fd);
+    job->status = batch_exec_script(executor, reader);
+
+    script_reader_free(reader);
+    cmd_executor_free(executor);
+  }
+
+  g_mutex_lock(&b->lock);
+  job->finished = g_get_monotonic_time();
+  job->done = true;
+  g_cond_broadcast(&b->job_done);
+  g_mutex_unlock(&b->lock);
+}
+
+// batch_print_output copies a captured stream to fd.
+static void batch_print_output(int capture_fd, int fd) {
+  lseek(capture_fd, 0, SEEK_SET);
+  fd_copy(capture_fd, fd);
+  close(capture_fd);
+}
+
+// batch_run runs the scripts at paths on jobs workers, returning 0 if they
+// all succeeded (or 1 if any didn't).
+int batch_run(GPtrArray *paths, int jobs) {
+  if (jobs < 1) {
+    jobs = (int)g_get_num_processors();
+  }
+
+  batch b;
+  g_mutex_init(&b.lock);
+  g_cond_init(&b.job_done);
+
+  if ((b.stdin_fd = open("/dev/null", O_RDONLY | O_CLOEXEC)) < 0) {
+    giveup("batch_run: failed to open /dev/null");
+  }
+
+  GThreadPool *pool = g_thread_pool_new(batch_run_job, &b, jobs, true, NULL);
+
+  guint len = paths->len;
+  batch_job *batch_jobs = calloc(len, sizeof(batch_job));
+  guint window = (guint)jobs * BATCH_WINDOW_PER_JOB;
+  guint queued = 0;
+
+  gint64 started = g_get_monotonic_time();
+
+  // Keep the pool fed, printing each script's output in order as soon as it's
+  // done.
+  for (guint next = 0; next < len; next++) {
+    for (; queued < len && queued < next + window; queued++) {
+      batch_job *job = &batch_jobs[queued];
+      job->path = g_ptr_array_index(paths, queued);
+      job->out_fd = batch_capture_fd();
+      job->err_fd = batch_capture_fd();
+
+      g_thread_pool_push(pool, job, NULL);
+    }
+
+    batch_job *job = &batch_jobs[next];
+
+    g_mutex_lock(&b.lock);
+    while (!job->done) {
+      g_cond_wait(&b.job_done, &b.lock);
+    }
+    g_mutex_unlock(&b.lock);
+
+    batch_print_output(job->out_fd, STDOUT_FILENO);
+    batch_print_output(job->err_fd, STDERR_FILENO);
+  }
+
+  g_thread_pool_free(pool, false, true);
+
+  guint failed = 0;
+  for (guint i = 0; i < len; i++) {
+    batch_job *job = &batch_jobs[i];
+    if (job->status != 0) {
+      failed++;
+    }
+
+    dprintf(STDERR_FILENO, "turtle: batch: %3d %8.3fs  %s\n", job->status,
+            (double)(job->finished - job->started) / 1e6, job->path);
+  }
+
+  dprintf(STDERR_FILENO, "turtle: batch: %u scripts, %u failed, %.3fs\n", len,
+          failed, (double)(g_get_monotonic_time() - started) / 1e6);
+
+  close(b.stdin_fd);
+  free(batch_jobs);
+  g_cond_clear(&b.job_done);
+  g_mutex_clear(&b.lock);
+
+  return failed > 0 ? 1 : 0;
+}
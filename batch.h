@@ -0,0 +1,16 @@
+#pragma once
+
+#include "glib.h"
+
+// A batch runs many independent scripts in one process, on a pool of worker
+// threads, so each doesn't pay for process startup and all the cores are kept
+// busy.
+//
+// Every script gets its own executor, with stdin from /dev/null and its stdout
+// and stderr captured. The captured output is printed in the order the scripts
+// were given (each as soon as it and the scripts before it are done), followed
+// by a summary of each script's status and wall time on stderr.
+
+void batch_read_manifest(const char *path, GPtrArray *paths);
+
+int batch_run(GPtrArray *paths, int jobs);
@@ -0,0 +1,374 @@
+#!/usr/bin/env bash
+
+usage() {
+    echo "usage: $0 [--no-build]"
+}
+
+now_ms() {
+    echo $(($(date +%s%N) / 1000000))
+}
+
+# b runs a turtle script and reports its wall time (and throughput, if given
+# the number of bytes it moves), failing if its output doesn't match what's
+# expected.
+b() {
+    name=$1
+    script=$2
+    expected=$3
+    bytes=$4
+
+    start=$(now_ms)
+    actual=$(./build/turtle "$script")
+    end=$(now_ms)
+
+    if [[ "$actual" != "$expected" ]]; then
+        echo "- FAIL: $name"
+        echo "  - expected: $expected"
+        echo "  - actual  : $actual"
+        return
+    fi
+
+    if [[ -n "$bytes" ]]; then
+        echo "- $name: $((end - start))ms ($((bytes * 1000 / 1048576 / (end - start + 1)))MB/s)"
+        return
+    fi
+
+    echo "- $name: $((end - start))ms"
+}
+
+bench_append() {
+    local script
+    script=$(mktemp)
+
+    # Build a 10 MiB var out of 10240 1 KiB appends.
+    {
+        printf 'line=%01024d\n' 0
+        for ((i = 0; i < 10240; i++)); do
+            echo 'x="$x$line"'
+        done
+        echo 'echo done'
+    } >"$script"
+
+    b 'append - 10 MiB in 1 KiB appends' "$script" 'done'
+
+    rm -f "$script"
+}
+
+bench_cat() {
+    local data script bytes
+    data=$(mktemp)
+    script=$(mktemp)
+
+    # Push 512 MiB through a two-stage pipeline.
+    head -c $((512 * 1048576)) /dev/zero >"$data"
+    bytes=$(wc -c <"$data")
+
+    echo "cat $data | cat > /dev/null; echo done" >"$script"
+    b 'cat - builtin pipeline' "$script" 'done' "$bytes"
+
+    echo "/bin/cat $data | /bin/cat > /dev/null; echo done" >"$script"
+    b 'cat - /bin/cat pipeline' "$script" 'done' "$bytes"
+
+    rm -f "$data" "$script"
+}
+
+bench_builtin_pipeline() {
+    local script
+    script=$(mktemp)
+
+    # Run 2000 three-stage pipelines of builtins and of external cmds.
+    for ((i = 0; i < 2000; i++)); do
+        echo 'echo foo | cat | cat > /dev/null'
+    done >"$script"
+    echo 'echo done' >>"$script"
+    b 'builtin pipeline - 2000 x echo | cat | cat' "$script" 'done'
+
+    for ((i = 0; i < 2000; i++)); do
+        echo '/bin/echo foo | /bin/cat | /bin/cat > /dev/null'
+    done >"$script"
+    echo 'echo done' >>"$script"
+    b 'builtin pipeline - 2000 x /bin/echo | /bin/cat | /bin/cat' "$script" 'done'
+
+    rm -f "$script"
+}
+
+bench_pipesize() {
+    local data script bytes
+    data=$(mktemp)
+    script=$(mktemp)
+
+    # Push 512 MiB between two external cmds with the default and a 1 MiB pipe.
+    head -c $((512 * 1048576)) /dev/zero >"$data"
+    bytes=$(wc -c <"$data")
+
+    echo "/bin/cat $data | /bin/cat > /dev/null; echo done" >"$script"
+    b 'pipesize - default' "$script" 'done' "$bytes"
+
+    echo "set -o pipesize=1M; /bin/cat $data | /bin/cat > /dev/null; echo done" >"$script"
+    b 'pipesize - 1M' "$script" 'done' "$bytes"
+
+    rm -f "$data" "$script"
+}
+
+bench_loop() {
+    local script
+    script=$(mktemp)
+
+    # Run 100000 iterations of five nested loops around a builtin, none of
+    # which should fork.
+    {
+        d='0 1 2 3 4 5 6 7 8 9'
+        echo "for a in $d; do for b in $d; do for c in $d; do for d in $d; do for e in $d; do"
+        echo '  if [ $e = 9 ]; then continue; fi; :'
+        echo 'done; done; done; done; done'
+        echo 'echo done'
+    } >"$script"
+    b 'loop - 100000 nested builtin iterations' "$script" 'done'
+
+    rm -f "$script"
+}
+
+bench_func() {
+    local script
+    script=$(mktemp)
+
+    # Call a function 100000 times, none of which should fork.
+    {
+        d='0 1 2 3 4 5 6 7 8 9'
+        echo 'f() { local x=$1; :; }'
+        echo "for a in $d; do for b in $d; do for c in $d; do for d in $d; do for e in $d; do"
+        echo '  f $e'
+        echo 'done; done; done; done; done'
+        echo 'echo done'
+    } >"$script"
+    b 'func - 100000 calls' "$script" 'done'
+
+    rm -f "$script"
+}
+
+bench_arith() {
+    local script
+    script=$(mktemp)
+
+    # Count to 100000 with arithmetic expansion, none of which should fork.
+    {
+        echo 'i=0; while [ $i -lt 100000 ]; do i=$((i + 1)); done'
+        echo 'echo $i'
+    } >"$script"
+    b 'arith - 100000 increments' "$script" '100000'
+
+    rm -f "$script"
+}
+
+bench_glob() {
+    local dir script
+    dir=$(mktemp -d)
+    script=$(mktemp)
+
+    # Expand three globs over a 100000 file directory, which should only be
+    # read once.
+    (cd "$dir" && seq -f '%06g.log' 50000 | xargs touch && seq -f '%06g.gz' 50000 | xargs touch)
+    echo "echo $dir/*.log $dir/*.gz $dir/0000*.log | wc -w" >"$script"
+    b 'glob - 3 globs over 100000 files' "$script" '100099'
+
+    rm -rf "$dir" "$script"
+}
+
+bench_split() {
+    local data script
+    data=$(mktemp)
+    script=$(mktemp)
+
+    # Split a 200000 line cmd sub into fields, both for a loop and as args.
+    seq 200000 >"$data"
+    {
+        echo "n=0; for f in \$(cat $data); do n=\$((n + 1)); done; echo \$n"
+        echo "echo \$(cat $data) | wc -w"
+    } >"$script"
+    b 'split - 200000 fields' "$script" "$(printf '200000\n200000')"
+
+    rm -f "$data" "$script"
+}
+
+bench_read() {
+    local data script bytes
+    data=$(mktemp)
+    script=$(mktemp)
+
+    # Read a 500000 line file with "while read", from the file and from a pipe.
+    seq 500000 | sed 's/$/ some more words/' >"$data"
+    bytes=$(wc -c <"$data")
+
+    echo "n=0; while read -r a b; do n=\$((n + 1)); done < $data; echo \$n" \
+        >"$script"
+    b 'read - 500000 lines from a file' "$script" '500000' "$bytes"
+
+    echo "cat $data | while read -r a b; do n=\$((n + 1)); done; echo done" \
+        >"$script"
+    b 'read - 500000 lines from a pipe' "$script" 'done' "$bytes"
+
+    rm -f "$data" "$script"
+}
+
+# startup_us prints the average wall time (in usecs) of n runs of a cmd.
+startup_us() {
+    local n=$1
+    shift
+
+    local start end
+    start=$(date +%s%N)
+    for ((i = 0; i < n; i++)); do
+        "$@"
+    done
+    end=$(date +%s%N)
+
+    echo $(((end - start) / 1000 / n))
+}
+
+bench_startup() {
+    if ! command -v dash >/dev/null || [[ ! -r /proc/self/stat ]]; then
+        echo '- startup: skipped (needs dash and /proc)'
+        return
+    fi
+
+    # Compare how long "-c true" takes from exec to exit, and how many page
+    # faults a shell takes by its first cmd, against dash. turtle should stay
+    # within 1.5x dash's time and 2x its faults.
+    local n=1000
+    local turtle_us dash_us
+    turtle_us=$(startup_us $n ./build/turtle -c true)
+    dash_us=$(startup_us $n dash -c true)
+
+    # The probe reports its parent's (i.e. the shell's) minor faults so far.
+    local probe turtle_faults dash_faults
+    probe=$(mktemp)
+    echo 'cut -d" " -f10 /proc/$PPID/stat' >"$probe"
+    turtle_faults=$(./build/turtle -c "sh $probe; true")
+    dash_faults=$(dash -c "sh $probe; true")
+    rm -f "$probe"
+
+    local result="${turtle_us}us (dash ${dash_us}us), $turtle_faults faults (dash $dash_faults)"
+    if ((turtle_us * 2 > dash_us * 3 || turtle_faults > dash_faults * 2)); then
+        echo "- FAIL: startup - -c true: $result"
+        return
+    fi
+
+    echo "- startup - -c true: $result"
+}
+
+bench_batch() {
+    local dir script
+    dir=$(mktemp -d)
+    script=$(mktemp)
+
+    # Run 500 small scripts with a turtle each and as one batch.
+    for ((i = 0; i < 500; i++)); do
+        echo 'x=0; for i in 1 2 3 4 5; do x=$((x + i)); done; echo $x' >"$dir/$i.sh"
+    done
+
+    echo "for f in $dir/*.sh; do ./build/turtle \$f; done | wc -l" >"$script"
+    b 'batch - 500 scripts, one turtle each' "$script" '500'
+
+    echo "./build/turtle --batch $dir/*.sh 2>/dev/null | wc -l" >"$script"
+    b 'batch - 500 scripts, --batch' "$script" '500'
+
+    rm -rf "$dir" "$script"
+}
+
+bench_parse_jobs() {
+    local big script bytes
+    big=$(mktemp)
+    script=$(mktemp)
+
+    # Run an 8 MiB generated script that's mostly parsing, parsed on the main
+    # thread and on 2, 4 and 8 threads.
+    {
+        echo 'f() { x=$((x + $1)); }'
+        for ((i = 0; i < 120000; i++)); do
+            echo "if false; then echo \"a \$x b\" | grep -q foo && echo \$x; fi; f $i"
+        done
+        echo 'echo $x'
+    } >"$big"
+    bytes=$(wc -c <"$big")
+
+    for jobs in 0 2 4 8; do
+        echo "./build/turtle --parse-jobs $jobs $big" >"$script"
+        b "parse jobs - 8 MiB script, --parse-jobs $jobs" "$script" '7199940000' \
+            "$bytes"
+    done
+
+    rm -f "$big" "$script"
+}
+
+bench_cache() {
+    local dir script
+    dir=$(mktemp -d)
+    script=$(mktemp)
+
+    # Run the same cmd sub 500 times as is, memoized in memory, and memoized
+    # on disk by 100 turtles.
+    echo 'for i in $(seq 500); do h=$(uname -n); done; echo done' >"$script"
+    b 'cache - 500 cmd subs' "$script" 'done'
+
+    echo 'for i in $(seq 500); do h=$(cache uname -n); done; echo done' \
+        >"$script"
+    b 'cache - 500 cmd subs, cached' "$script" 'done'
+
+    echo "for i in \$(seq 100); do TURTLE_CACHE_DIR=$dir ./build/turtle -c 'h=\$(cache uname -n)'; done; echo done" \
+        >"$script"
+    b 'cache - 100 turtles, cached on disk' "$script" 'done'
+
+    rm -rf "$dir" "$script"
+}
+
+benches() {
+    bench_startup
+    bench_append
+    bench_cat
+    bench_builtin_pipeline
+    bench_pipesize
+    bench_loop
+    bench_func
+    bench_arith
+    bench_glob
+    bench_split
+    bench_read
+    bench_batch
+    bench_parse_jobs
+    bench_cache
+}
+
+main() {
+    skip_build=
+    while :; do
+        case $1 in
+        '--no-build')
+            skip_build=true
+            ;;
+        '')
+            break
+            ;;
+        *)
+            usage
+            exit 1
+            ;;
+        esac
+
+        shift
+    done
+
+    if [[ "$skip_build" != 'true' ]]; then
+        # Build turtle.
+        echo "building..."
+        build_output=$(./bin/build.sh 2>&1)
+        if [[ $? != 0 ]]; then
+            echo 'build failed'
+            echo "$build_output"
+            exit 1
+        fi
+    fi
+
+    benches
+}
+
+main "$@"
@@ -4,6 +4,27 @@ usage() {
     echo "usage: $1 [--debug]"
 }
 
+# readline_libs prints the flags to link readline with: statically where its
+# archives are installed (and the linker can mix static and shared libs),
+# since it's only used interactively and loading it and its deps as shared
+# objects is a good part of what "turtle -c" spends starting up.
+readline_libs() {
+    local libdir
+    libdir=$(pkg-config --variable=libdir readline)
+
+    local libs=()
+    for lib in $(pkg-config --static --libs-only-l readline); do
+        if [[ "$(uname)" != 'Linux' || ! -f "$libdir/lib${lib#-l}.a" ]]; then
+            pkg-config --libs readline
+            return
+        fi
+
+        libs+=("$lib")
+    done
+
+    echo "-L$libdir -Wl,-Bstatic ${libs[*]} -Wl,-Bdynamic"
+}
+
 main() {
     flags=()
     debug=
@@ -66,7 +87,9 @@ main() {
 
     clang *.c \
         "${flags[@]}" \
-        $(pkg-config --cflags --libs glib-2.0 readline) \
+        $(pkg-config --cflags glib-2.0 readline) \
+        $(pkg-config --libs glib-2.0) \
+        $(readline_libs) \
         -o ./build/turtle
 }
 
@@ -0,0 +1,98 @@
+#!/usr/bin/env bash
+
+usage() {
+    echo "usage: $0 [--no-build] [--cmds n]"
+}
+
+# peak_rss_kb runs a turtle loop that executes about n cmds (a mix of
+# assignments, expansions, builtins, functions, subs, pipes and here-docs) and
+# prints the peak RSS it reported.
+peak_rss_kb() {
+    local n=$1
+    local script
+
+    script=$(mktemp)
+    cat >"$script" <<'EOF'
+f() {
+    local v=$1
+    echo "$v" $((v * 2))
+}
+
+i=0
+while (( i < $1 )); do
+    x="a $i"
+    f $i >/dev/null
+    s=$(echo x y)
+    for w in $s; do
+        case $w in
+        x) : ;;
+        *) : ;;
+        esac
+    done
+    echo $x | cat >/dev/null
+    cat <<END >/dev/null
+body $i
+END
+    true && false || true
+    (( i++ ))
+done
+EOF
+
+    # Each iteration runs about 20 cmds.
+    TURTLE_MEMSTATS=1 ./build/turtle "$script" $((n / 20)) 2>&1 >/dev/null |
+        grep peak_rss_kb | cut -d' ' -f4
+
+    rm -f "$script"
+}
+
+main() {
+    skip_build=
+    cmds=1000000
+    while :; do
+        case $1 in
+        '--no-build')
+            skip_build=true
+            ;;
+        '--cmds')
+            shift
+            cmds=$1
+            ;;
+        '')
+            break
+            ;;
+        *)
+            usage
+            exit 1
+            ;;
+        esac
+
+        shift
+    done
+
+    if [[ "$skip_build" != 'true' ]]; then
+        echo "building..."
+        build_output=$(./bin/build.sh 2>&1)
+        if [[ $? != 0 ]]; then
+            echo 'build failed'
+            echo "$build_output"
+            exit 1
+        fi
+    fi
+
+    # Memory is flat if running ten times the cmds doesn't grow the peak RSS
+    # by more than a little noise.
+    small=$(peak_rss_kb $((cmds / 10)))
+    large=$(peak_rss_kb "$cmds")
+
+    echo "- $((cmds / 10)) cmds: ${small}KB peak rss"
+    echo "- $cmds cmds: ${large}KB peak rss"
+
+    if (( large > small + small / 10 + 1024 )); then
+        echo "- FAIL: memory grew with the number of cmds"
+        exit 1
+    fi
+
+    echo "- PASS: memory is flat"
+}
+
+main "$@"
@@ -53,9 +53,85 @@ t() {
 tests() {
     t 'vars' 'foo=bar; echo $foo'
     t 'vars - env' 'foo=bar echo $foo'
+    t 'vars - reassign' 'x=1; y=$x; x=2; echo $x $y "$y"'
+    t 'vars - from environment' 'echo $HOME'
+    t 'vars - append' 'x=a; x="$x"b; y=$x; x=$x$x; x="$x-$y"; echo $x $y'
+    t 'vars - env passed to cmd' 'foo=bar env | grep ^foo='
+    t 'export' 'export foo=bar; env | grep ^foo=; foo=baz; env | grep ^foo='
     t 'pipes' 'echo world | xargs -I{} echo "hello {}!"'
+    t 'pipes - followed by stmt' 'echo foo | cat; echo bar'
+    t 'pipes - more than a pipe buffer' 'seq 100000 | wc -l'
+    t 'pipes - builtin stages' 'echo foo bar | cat | cat - | cat'
+    t 'pipes - builtin stages into cmds' 'seq 3 | cat | cat -n | cat | wc -l'
+    t 'pipes - reader exits early' 'yes | cat | cat | head -2'
+    t 'pipes - builtin stage redirected' 'f=$(mktemp); echo foo > $f | cat; cat /etc/hostname >> $f | cat; echo bar; cat $f; rm $f'
+    t 'set - pipesize' 'set -o pipesize=1M 2>/dev/null; seq 100000 | cat | wc -l; x=$(seq 20000); echo "$x" | tail -1'
+    t 'timeout' 'timeout 0.2 sleep 5 || echo timed out'
+    t 'timeout - finishes in time' 'timeout 5 echo ok'
+    t 'timeout - pipeline' 'timeout 0.2 sh -c "sleep 5 | sleep 5" || echo timed out'
+    t 'echo - options' 'echo -n foo; echo -nx bar; echo -e "a\tb" -n'
+    t 'if' 'if false; then echo a; elif true; then echo b; else echo c; fi; if true; then echo d; fi'
+    t 'while and until' 'x=; while [ "$x" != aaa ]; do x=a$x; echo $x; done; until true; do echo no; done'
+    t 'for' 'for i in 1 "2 3" $(echo 4); do echo "[$i]"; done'
+    t 'case' 'for f in a.c b.h c.txt; do case $f in *.c|*.h) echo src $f;; *) echo other $f;; esac; done'
+    t 'break and continue' 'for i in 1 2 3 4 5; do if [ $i = 2 ]; then continue; fi; if [ $i = 4 ]; then break; fi; echo $i; done; for i in 1 2; do for j in a b c; do if [ $j = b ]; then continue 2; fi; echo $i$j; done; done'
+    t 'test' '[ 1 -lt 2 ] && [ -n x ] && [ ! -z x ] && [ a != b -a 3 -ge 3 ] && test "(" 1 -eq 1 -o 1 -eq 2 ")" && [ -d /tmp ] && echo yes; [ -f /nonexistent ] || echo no'
+    t 'negation' '! false && echo a; ! true || echo b; ! echo c | grep -q d && echo e'
+    t 'compound - redirect and pipe' 'for i in 3 1 2; do echo $i; done | sort; if true; then echo foo; fi > /tmp/turtle-test-out; cat /tmp/turtle-test-out; echo x | if true; then cat; fi | cat'
+    t 'compound - script' 'printf "for i in 1 2\ndo\n  echo loop\ndone\ncase a in\n  a)\n    echo A\n    ;;\nesac\n" | ./build/turtle'
+    t 'compound - redirect after a failed expansion' 'printf "if case \044(false) in *) :;; esac >/dev/null; then :; fi\necho visible\n" | ./build/turtle | grep -c visible || echo "$0: lost stdout"'
+    t 'functions' 'f() { echo "$# $1 $2 [$@]"; }; f a b; f; g() { return 3; }; g || echo status $?'
+    t 'functions - local' 'x=outer; f() { local x=inner y; x=changed; echo $x; }; f; echo $x'
+    t 'functions - recursion' 'count() { if [ $1 -gt 0 ]; then echo $1; count $(expr $1 - 1); fi; }; count 3'
+    t 'functions - in pipelines' 'up() { tr a-z A-Z; }; echo foo | up | cat; seq 3 | up'
+    t 'functions - for over args' 'each() { for a; do echo "<$a>"; done; }; each x "y z"'
+    t 'groups' '{ echo a; echo b; } | wc -l; { echo c; } > /tmp/turtle-test-out; cat /tmp/turtle-test-out'
+    t 'arith - operators' 'echo $((1+2*3)) $((2**10)) $(( (1+2)*3 )) $((7/2)) $((-7%3)) $((1<<4)) $((5>3 && 2>1)) $((~0 ^ 5))'
+    t 'arith - assignment' 'x=5; echo $((x+=2)) $x $((x++)) $x $((++x)) $((x<<=1)) $x'
+    t 'arith - vars and bases' 'x=4; echo "v=$((x*2))" $((0x1f)) $((2#101)) $((010)) $((x>1?7:8)) $((a=1, a+2)) $a $((y+1))'
+    t 'arith - cmd' 'x=5; (( x > 3 )) && echo big; (( x - 5 )) || echo zero; i=0; while (( i < 3 )); do echo $i; (( i++ )); done'
+    t 'arith - in subs and args' 'f() { echo $(( $# + $1 )); }; f 10 20; echo $(echo $((3+4)))'
+    t 'arith - cmd error' '(( 1/0 )) 2>/dev/null || echo fallback; if (( 1/0 )) >/dev/null 2>&1; then echo t; else echo f; fi; echo visible'
+    t 'glob' 'rm -rf /tmp/turtle-test-glob; mkdir -p /tmp/turtle-test-glob/d1 /tmp/turtle-test-glob/d2; touch /tmp/turtle-test-glob/a.c /tmp/turtle-test-glob/b.c /tmp/turtle-test-glob/c.h /tmp/turtle-test-glob/.hidden /tmp/turtle-test-glob/d1/x.c /tmp/turtle-test-glob/d2/y.c; echo /tmp/turtle-test-glob/*.c /tmp/turtle-test-glob/* /tmp/turtle-test-glob/d?/*.c /tmp/turtle-test-glob/[ab].c /tmp/turtle-test-glob/[!a].c /tmp/turtle-test-glob/*/'
+    t 'glob - quoted and no match' 'rm -rf /tmp/turtle-test-glob; mkdir -p /tmp/turtle-test-glob; touch /tmp/turtle-test-glob/a.c; echo "/tmp/turtle-test-glob/*.c" /tmp/turtle-test-glob/"*".c /tmp/turtle-test-glob/*."c" /tmp/turtle-test-glob/nomatch*'
+    t 'glob - for and case' 'rm -rf /tmp/turtle-test-glob; mkdir -p /tmp/turtle-test-glob; touch /tmp/turtle-test-glob/a.c /tmp/turtle-test-glob/b.h; for f in /tmp/turtle-test-glob/*; do case $f in *.h) echo h $f;; "*.c") echo quoted;; *.c) echo c $f;; esac; done'
+    t 'split - vars and subs' 'x="a b  c"; for w in $x; do echo "[$w]"; done; echo $(printf "one\ntwo  three\n"); e=; echo a $e b; y=" l t "; for w in pre$y; do echo "<$w>"; done'
+    t 'split - args' 'f() { for a in "$@"; do echo "arg=$a"; done; for a in $@; do echo "u=$a"; done; for a in x"$@"y; do echo "[$a]"; done; }; f "1 2" 3 ""; f'
+    t 'split - IFS' 'IFS=:; z="a::b:"; for w in $z; do echo "<$w>"; done; IFS=" :"; z=" a : b  c:"; for w in $z; do echo "<$w>"; done; IFS=; x="a b"; for w in $x; do echo "<$w>"; done'
+    t 'heredoc' 'x=world; cat <<EOF
+hello $x "q" $((1+2))
+\$x \\ $1 end
+EOF
+cat <<"EOF" | wc -c
+lit $x
+EOF'
+    t 'heredoc - tabs and several' 'cat <<-END; cat <<A
+		tabbed
+	END
+a
+A
+echo after'
+    t 'heredoc - in sub and pipe' 'x=$(cat <<EOF
+in sub
+EOF
+); echo "[$x]"; cat <<EOF | tr a-z A-Z
+piped
+EOF'
+    t 'heredoc - large' 'big=$(seq 1 30000); cat <<EOF | md5sum
+$big
+EOF'
+    t 'heredoc - script' 'printf "cat <<EOF\nif (x\nEOF\necho done\n" | ./build/turtle'
+    # Both sides feed the script to ./build/turtle, so a wrong count only differs
+    # by $0.
+    t 'heredoc - unterminated' 'n=$(printf "cat <<EOF\na\nb" | ./build/turtle | wc -c); [ $n -eq 4 ] || echo "$0: kept $n bytes"'
+    t 'herestring' 'x="a b"; cat <<<$x; cat <<< "q $x" | wc -c; tr a-z A-Z <<<hi'
+    t 'cat - files and stdin' 'echo foo > /tmp/turtle-test-cat; echo bar | cat /tmp/turtle-test-cat - /tmp/turtle-test-cat'
+    t 'cat - into a file' 'seq 50000 > /tmp/turtle-test-cat; cat /tmp/turtle-test-cat /tmp/turtle-test-cat > /tmp/turtle-test-out; wc -l < /tmp/turtle-test-out'
+    t 'cat - options' 'echo foo | cat -n'
+    t 'command sub - large output' 'seq 20000 > /tmp/turtle-test-out; x=$(cat /tmp/turtle-test-out); echo "$x" | wc -c'
     t 'comments' 'echo foo bar baz #foo bar'
     t 'command sub' 'echo $(echo foo) $(echo bar)'
+    t 'command sub - trailing newlines' 'echo [$(printf "a b\n\n\n")]'
     t 'proc sub' 'cat <(echo foo bar)'
     t 'multiple stmts' 'echo foo; echo bar;'
     t 'and - true' 'true && echo foo'
@@ -63,6 +139,32 @@ tests() {
     t 'or - true' 'true || echo foo'
     t 'or - false' 'false || echo foo'
     t 'dot source' '. <(echo "echo foo")'
+    t 'redirect - out and in' 'echo foo > /tmp/turtle-test-out; echo bar >>/tmp/turtle-test-out; cat < /tmp/turtle-test-out'
+    t 'redirect - stderr to stdout' 'sh -c "echo err >&2; echo out" 2>&1 | sort'
+    t 'redirect - order' 'sh -c "echo err >&2; echo out" 2>&1 >/dev/null | cat'
+    t 'redirect - high fd' 'echo foo 3>/tmp/turtle-test-out 1>&3; cat /tmp/turtle-test-out'
+    t 'redirect - quoted' 'echo "a > b | c"'
+    t 'read - fields' 'read a b <<< "  x   y  z  "; echo "[$a][$b]"'
+    t 'read - reply' 'read <<< "  x  y  "; echo "[$REPLY]"'
+    t 'read - ifs' 'IFS=: read a b c <<< "x:y:z:"; IFS=": " read d e <<< " p : q : "; echo "[$a][$b][$c][$d][$e]"'
+    t 'read - escapes' 'read a b <<< "x\ y z"; read -r c <<< "p\q"; echo "[$a][$b][$c]"'
+    t 'read - delim' 'printf "a,b,c" > /tmp/turtle-test-out; { read -d , a; read -d , b; read -d , c; echo "[$a][$b][$c] $?"; } < /tmp/turtle-test-out'
+    t 'read - while' 'seq 5 > /tmp/turtle-test-out; while read -r n; do echo "<$n>"; done < /tmp/turtle-test-out'
+    t 'read - while, shared stdin' 'seq 6 > /tmp/turtle-test-out; while read -r n; do echo "<$n>"; head -1; done < /tmp/turtle-test-out'
+    t 'read - pipe' 'seq 3 | while read -r n; do echo "<$n>"; done'
+    t 'script - stdin' 'echo "echo foo; echo bar" | ./build/turtle'
+    t 'script - long line' 'printf "echo %09000d\n" 1 | ./build/turtle'
+    t 'script - shifts and #' 'printf "echo \044((1<<2)) a#b \047x\ny\047\necho \042\n2\n\042\n" | ./build/turtle'
+    t 'batch' 'd=$(mktemp -d); printf "sleep 0.2; echo a\n" > $d/a.sh; printf "echo b; echo e >&2; false; echo no\n" > $d/b.sh; ./build/turtle --batch -j 2 $d/a.sh $d/b.sh 2>&1 | grep -v "turtle: batch"; rm -r $d'
+    t 'batch - manifest' 'd=$(mktemp -d); echo "echo x" > $d/x.sh; printf "# c\n\n$d/x.sh\n$d/x.sh\n" > $d/m; ./build/turtle --batch --manifest $d/m 2>&1 | grep -c "x.sh"; rm -r $d'
+    t 'parse jobs' 'f=$(mktemp); printf "f() { echo \042\044@\042; }\n" > $f; for i in $(seq 3000); do printf "x=\044((x + %d)); f %d \044x\n" $i $i; if [ $((i % 500)) = 0 ]; then printf "cat <<E\n\044x\nE\n"; fi; done >> $f; a=$(./build/turtle $f); b=$(./build/turtle --parse-jobs 4 $f); [ "$a" = "$b" ] && echo "$b" | tail -3; rm $f'
+    t 'parse jobs - error' 'f=$(mktemp); for i in $(seq 3000); do echo "echo $i"; done > $f; echo "if then" >> $f; ./build/turtle --parse-jobs 2 $f 2>/dev/null | tail -1; ./build/turtle --parse-jobs 2 $f 2>&1 >/dev/null || echo failed; rm $f'
+    t 'coproc' 'printf "coproc cat\necho hi >&\044COPROC_1\nread -r l <&\044COPROC_0\necho \042got \044l\042\n" | ./build/turtle'
+    t 'coproc - named' 'printf "coproc UP { while read -r l; do echo \042up:\044l\042; done; }\necho a >&\044UP_1\necho b >&\044UP_1\nread -r x <&\044UP_0\nhead -n 1 <&\044UP_0\necho \044x\n" | ./build/turtle'
+    t 'coproc - exit' 'printf "coproc { read -r x || echo eof >&2; }\necho done\n" | ./build/turtle 2>&1'
+    t 'cache' 'printf "a=\044(cache date +%%N); b=\044(cache date +%%N); [ \044a = \044b ] && echo same; cache false || echo failed\n" | ./build/turtle'
+    t 'cache - ttl and env' 'printf "a=\044(cache --ttl 0.001 date +%%N); sleep 0.01; b=\044(cache --ttl 0.001 date +%%N); [ \044a != \044b ] && echo expired; c=\044(cache --env x date +%%N); x=2; d=\044(cache --env x date +%%N); [ \044c != \044d ] && echo keyed\n" | ./build/turtle'
+    t 'cache - disk' 'd=$(mktemp -d); printf "cache date +%%N\n" > $d/s; a=$(TURTLE_CACHE_DIR=$d/c ./build/turtle $d/s); b=$(TURTLE_CACHE_DIR=$d/c ./build/turtle $d/s); [ "$a" = "$b" ] && echo same; rm -r $d'
 }
 
 main() {
@@ -0,0 +1,516 @@
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+
+#include "child_wait.h"
+#include "utils.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <sys/syscall.h>
+#include <sys/timerfd.h>
+#endif
+
+// child_wait_now returns the monotonic clock in seconds.
+double child_wait_now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+// child_wait_setpgid puts the child in its own process group so a timeout
+// can signal everything it started; it's called from both the parent and the
+// child, so it's in place whichever runs first.
+void child_wait_setpgid(pid_t pid) { setpgid(pid, pid); }
+
+static int child_wait_status(int status) {
+  return WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+}
+
+// child_wait_reap waits for a child that's already exited (or blocks for one
+// that hasn't, if hang is set), returning 0 if it's still running.
+static pid_t child_wait_reap(pid_t pid, int *status, bool hang) {
+  pid_t res;
+  while ((res = waitpid(pid, status, hang ? 0 : WNOHANG)) < 0 &&
+         errno == EINTR) {
+  }
+
+  if (res < 0) {
+    giveup("child_wait: waitpid failed with pid=%d", pid);
+  }
+
+  return res;
+}
+
+// child_wait_escalate signals the child's process group once its deadline
+// passes: SIGTERM first, then SIGKILL. Returns the seconds until the next
+// escalation (or 0 if there isn't one).
+static double child_wait_escalate(pid_t pid, int *signals_sent,
+                                  double kill_after) {
+  if (*signals_sent == 0) {
+    kill(-pid, SIGTERM);
+    kill(pid, SIGTERM);
+    (*signals_sent)++;
+
+    return kill_after;
+  }
+
+  kill(-pid, SIGKILL);
+  kill(pid, SIGKILL);
+  (*signals_sent)++;
+
+  return 0;
+}
+
+#ifdef __linux__
+static int child_wait_pidfd_open(pid_t pid) {
+#ifdef SYS_pidfd_open
+  return (int)syscall(SYS_pidfd_open, pid, 0);
+#else
+  errno = ENOSYS;
+  return -1;
+#endif
+}
+
+static void child_wait_arm(int timer_fd, double secs) {
+  struct itimerspec spec = {0};
+  spec.it_value.tv_sec = (time_t)secs;
+  spec.it_value.tv_nsec = (long)((secs - (double)(time_t)secs) * 1e9);
+
+  // A zero it_value disarms the timer, so fire "now" as soon as possible.
+  if (spec.it_value.tv_sec == 0 && spec.it_value.tv_nsec == 0) {
+    spec.it_value.tv_nsec = 1;
+  }
+
+  timerfd_settime(timer_fd, 0, &spec, NULL);
+}
+
+// child_wait_epoll waits on the child's pidfd and the deadline's timerfd,
+// returning -1 (with errno set) if pidfds aren't supported.
+static int child_wait_epoll(pid_t pid, double started, double timeout,
+                            double kill_after, bool *timed_out) {
+  int pid_fd = child_wait_pidfd_open(pid);
+  if (pid_fd < 0) {
+    return -1;
+  }
+
+  int ep_fd = epoll_create1(EPOLL_CLOEXEC);
+  if (ep_fd < 0) {
+    giveup("child_wait: epoll_create1 failed");
+  }
+
+  struct epoll_event ev = {.events = EPOLLIN, .data.fd = pid_fd};
+  epoll_ctl(ep_fd, EPOLL_CTL_ADD, pid_fd, &ev);
+
+  int timer_fd = -1;
+  if (timeout > 0) {
+    timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+    if (timer_fd < 0) {
+      giveup("child_wait: timerfd_create failed");
+    }
+
+    double remaining = started + timeout - child_wait_now();
+    child_wait_arm(timer_fd, remaining > 0 ? remaining : 0);
+
+    ev = (struct epoll_event){.events = EPOLLIN, .data.fd = timer_fd};
+    epoll_ctl(ep_fd, EPOLL_CTL_ADD, timer_fd, &ev);
+  }
+
+  int signals_sent = 0;
+  int status;
+
+  for (;;) {
+    struct epoll_event events[2];
+    int n = epoll_wait(ep_fd, events, 2, -1);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+
+    if (n < 0) {
+      giveup("child_wait: epoll_wait failed");
+    }
+
+    bool exited = false;
+    for (int i = 0; i < n; i++) {
+      if (events[i].data.fd == pid_fd) {
+        exited = true;
+        continue;
+      }
+
+      uint64_t expirations;
+      if (read(timer_fd, &expirations, sizeof(expirations)) < 0) {
+        continue;
+      }
+
+      *timed_out = true;
+
+      double next = child_wait_escalate(pid, &signals_sent, kill_after);
+      if (next > 0) {
+        child_wait_arm(timer_fd, next);
+      }
+    }
+
+    if (exited && child_wait_reap(pid, &status, false) == pid) {
+      break;
+    }
+  }
+
+  if (timer_fd >= 0) {
+    close(timer_fd);
+  }
+  close(ep_fd);
+  close(pid_fd);
+
+  return child_wait_status(status);
+}
+#endif
+
+int child_wait(pid_t pid, double started, double timeout, double kill_after,
+               bool *timed_out) {
+  *timed_out = false;
+
+#ifdef __linux__
+  int res = child_wait_epoll(pid, started, timeout, kill_after, timed_out);
+  if (res >= 0) {
+    return res;
+  }
+#endif
+
+  int status;
+  if (timeout <= 0) {
+    child_wait_reap(pid, &status, true);
+    return child_wait_status(status);
+  }
+
+  // Without pidfds, poll for the child at a short interval instead.
+  double deadline = started + timeout;
+  int signals_sent = 0;
+
+  while (child_wait_reap(pid, &status, false) == 0) {
+    if (signals_sent < 2 && child_wait_now() >= deadline) {
+      *timed_out = true;
+
+      double next = child_wait_escalate(pid, &signals_sent, kill_after);
+      if (next > 0) {
+        deadline = child_wait_now() + next;
+      } else {
+        signals_sent = 2;
+      }
+    }
+
+    struct timespec interval = {.tv_sec = 0, .tv_nsec = 10 * 1000 * 1000};
+    nanosleep(&interval, NULL);
+  }
+
+  return child_wait_status(status);
+}
+
+// child_wait_member is a child watched by a child_wait_group.
+typedef struct child_wait_member {
+  pid_t pid;
+
+  // The child's pidfd and deadline timerfd (or -1 if it's polled for).
+  int pid_fd;
+  int timer_fd;
+
+  double kill_after;
+
+  // When the child is next signalled, for a polled child.
+  double deadline;
+  int signals_sent;
+
+  bool timed_out;
+  bool exited;
+  int status;
+} child_wait_member;
+
+// The epoll data for the group's stop pipe; a member's is its index times two,
+// plus one for its timerfd.
+#define CHILD_WAIT_STOP UINT64_MAX
+
+// The interval the watcher polls children without pidfds at.
+#define CHILD_WAIT_POLL_MS 10
+
+// child_wait_member_exited records a member's exit status and drops its fds.
+static void child_wait_member_exited(child_wait_group *group,
+                                     child_wait_member *member, int status) {
+  member->status = child_wait_status(status);
+  member->exited = true;
+
+#ifdef __linux__
+  if (member->pid_fd >= 0) {
+    epoll_ctl(group->ep_fd, EPOLL_CTL_DEL, member->pid_fd, NULL);
+    epoll_ctl(group->ep_fd, EPOLL_CTL_DEL, member->timer_fd, NULL);
+    close(member->pid_fd);
+    close(member->timer_fd);
+    member->pid_fd = -1;
+    member->timer_fd = -1;
+  }
+#endif
+
+  g_cond_broadcast(&group->exited);
+}
+
+// child_wait_group_poll reaps (or signals, once their deadlines pass) the
+// members the watcher has to poll for.
+static void child_wait_group_poll(child_wait_group *group) {
+  double now = child_wait_now();
+
+  for (guint i = 0; i < group->members->len; i++) {
+    child_wait_member *member = g_ptr_array_index(group->members, i);
+    if (member->exited || member->pid_fd >= 0) {
+      continue;
+    }
+
+    int status;
+    if (child_wait_reap(member->pid, &status, false) == member->pid) {
+      child_wait_member_exited(group, member, status);
+      continue;
+    }
+
+    if (member->signals_sent < 2 && now >= member->deadline) {
+      member->timed_out = true;
+
+      double next = child_wait_escalate(member->pid, &member->signals_sent,
+                                        member->kill_after);
+      member->deadline = next > 0 ? now + next : now;
+      if (next <= 0) {
+        member->signals_sent = 2;
+      }
+    }
+  }
+}
+
+#ifdef __linux__
+// child_wait_group_handle handles an epoll event for a member's pidfd or
+// timerfd.
+static void child_wait_group_handle(child_wait_group *group, uint64_t data) {
+  child_wait_member *member = g_ptr_array_index(group->members, data / 2);
+  if (member->exited) {
+    return;
+  }
+
+  if (data % 2 == 0) {
+    int status;
+    if (child_wait_reap(member->pid, &status, false) == member->pid) {
+      child_wait_member_exited(group, member, status);
+    }
+
+    return;
+  }
+
+  uint64_t expirations;
+  if (read(member->timer_fd, &expirations, sizeof(expirations)) < 0) {
+    return;
+  }
+
+  member->timed_out = true;
+
+  double next = child_wait_escalate(member->pid, &member->signals_sent,
+                                    member->kill_after);
+  if (next > 0) {
+    child_wait_arm(member->timer_fd, next);
+  }
+}
+#endif
+
+// child_wait_group_watch is the group's watcher thread, which runs until
+// child_wait_group_free stops it.
+static gpointer child_wait_group_watch(gpointer data) {
+  child_wait_group *group = data;
+  bool polling = false;
+
+  for (;;) {
+#ifdef __linux__
+    struct epoll_event events[16];
+    int n = epoll_wait(group->ep_fd, events, 16,
+                       polling ? CHILD_WAIT_POLL_MS : -1);
+    if (n < 0 && errno != EINTR) {
+      giveup("child_wait: epoll_wait failed");
+    }
+
+    g_mutex_lock(&group->lock);
+    for (int i = 0; i < n; i++) {
+      if (events[i].data.u64 != CHILD_WAIT_STOP) {
+        child_wait_group_handle(group, events[i].data.u64);
+        continue;
+      }
+
+      char buf[16];
+      while (read(group->stop_fds[0], buf, sizeof(buf)) > 0) {
+      }
+    }
+#else
+    struct timespec interval = {.tv_sec = 0,
+                                .tv_nsec = CHILD_WAIT_POLL_MS * 1000 * 1000};
+    nanosleep(&interval, NULL);
+
+    g_mutex_lock(&group->lock);
+#endif
+
+    if ((polling = group->polling)) {
+      child_wait_group_poll(group);
+    }
+
+    bool stopping = group->stopping;
+    g_mutex_unlock(&group->lock);
+
+    if (stopping) {
+      return NULL;
+    }
+  }
+}
+
+child_wait_group *child_wait_group_new(void) {
+  child_wait_group *group = malloc(sizeof(child_wait_group));
+  g_mutex_init(&group->lock);
+  g_cond_init(&group->exited);
+  group->members = g_ptr_array_new_with_free_func(free);
+  group->ep_fd = -1;
+  group->stopping = false;
+  group->polling = false;
+
+  if (pipe(group->stop_fds) < 0) {
+    giveup("child_wait: pipe failed");
+  }
+
+  for (int i = 0; i < 2; i++) {
+    fcntl(group->stop_fds[i], F_SETFD, FD_CLOEXEC);
+  }
+  fcntl(group->stop_fds[0], F_SETFL, O_NONBLOCK);
+
+#ifdef __linux__
+  if ((group->ep_fd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+    giveup("child_wait: epoll_create1 failed");
+  }
+
+  struct epoll_event ev = {.events = EPOLLIN, .data.u64 = CHILD_WAIT_STOP};
+  epoll_ctl(group->ep_fd, EPOLL_CTL_ADD, group->stop_fds[0], &ev);
+#else
+  group->polling = true;
+#endif
+
+  group->watcher = g_thread_new("child-wait", child_wait_group_watch, group);
+
+  return group;
+}
+
+// child_wait_group_free stops the watcher. Every child should have been
+// waited for by now: any that haven't are left unreaped.
+void child_wait_group_free(child_wait_group *group) {
+  g_mutex_lock(&group->lock);
+  group->stopping = true;
+  g_mutex_unlock(&group->lock);
+
+  while (write(group->stop_fds[1], "", 1) < 0 && errno == EINTR) {
+  }
+
+  g_thread_join(group->watcher);
+
+  for (guint i = 0; i < group->members->len; i++) {
+    child_wait_member *member = g_ptr_array_index(group->members, i);
+    if (member->pid_fd >= 0) {
+      close(member->pid_fd);
+      close(member->timer_fd);
+    }
+  }
+
+  if (group->ep_fd >= 0) {
+    close(group->ep_fd);
+  }
+  close(group->stop_fds[0]);
+  close(group->stop_fds[1]);
+
+  g_ptr_array_free(group->members, true);
+  g_cond_clear(&group->exited);
+  g_mutex_clear(&group->lock);
+  free(group);
+}
+
+// child_wait_group_add has the group watch a child started at started, which
+// is signalled (see child_wait) once it's been running for timeout seconds.
+void child_wait_group_add(child_wait_group *group, pid_t pid, double started,
+                          double timeout, double kill_after) {
+  child_wait_member *member = malloc(sizeof(child_wait_member));
+  *member = (child_wait_member){
+      .pid = pid,
+      .pid_fd = -1,
+      .timer_fd = -1,
+      .kill_after = kill_after,
+      .deadline = started + timeout,
+      .signals_sent = 0,
+      .timed_out = false,
+      .exited = false,
+      .status = 0,
+  };
+
+  g_mutex_lock(&group->lock);
+  g_ptr_array_add(group->members, member);
+
+#ifdef __linux__
+  uint64_t index = group->members->len - 1;
+  if ((member->pid_fd = child_wait_pidfd_open(pid)) >= 0) {
+    member->timer_fd =
+        timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+    if (member->timer_fd < 0) {
+      giveup("child_wait: timerfd_create failed");
+    }
+
+    double remaining = member->deadline - child_wait_now();
+    child_wait_arm(member->timer_fd, remaining > 0 ? remaining : 0);
+
+    struct epoll_event ev = {.events = EPOLLIN, .data.u64 = index * 2};
+    epoll_ctl(group->ep_fd, EPOLL_CTL_ADD, member->pid_fd, &ev);
+
+    ev = (struct epoll_event){.events = EPOLLIN, .data.u64 = index * 2 + 1};
+    epoll_ctl(group->ep_fd, EPOLL_CTL_ADD, member->timer_fd, &ev);
+  }
+#endif
+
+  // Wake the watcher so it starts polling at its next pass.
+  if (member->pid_fd < 0 && !group->polling) {
+    group->polling = true;
+    while (write(group->stop_fds[1], "", 1) < 0 && errno == EINTR) {
+    }
+  }
+
+  g_mutex_unlock(&group->lock);
+}
+
+// child_wait_group_wait waits for a child added to the group to exit, and
+// returns its status like child_wait.
+int child_wait_group_wait(child_wait_group *group, pid_t pid,
+                          bool *timed_out) {
+  g_mutex_lock(&group->lock);
+
+  child_wait_member *member = NULL;
+  for (guint i = 0; i < group->members->len && member == NULL; i++) {
+    child_wait_member *m = g_ptr_array_index(group->members, i);
+    if (m->pid == pid) {
+      member = m;
+    }
+  }
+
+  if (member == NULL) {
+    giveup("child_wait: pid=%d isn't in the group", pid);
+  }
+
+  while (!member->exited) {
+    g_cond_wait(&group->exited, &group->lock);
+  }
+
+  *timed_out = member->timed_out;
+  int status = member->status;
+  g_mutex_unlock(&group->lock);
+
+  return status;
+}
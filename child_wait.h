@@ -0,0 +1,59 @@
+#pragma once
+
+#include "glib.h"
+#include <stdbool.h>
+#include <sys/types.h>
+
+// child_wait waits for a child to exit and returns its status (its exit code,
+// or 128 + the signal that killed it).
+//
+// If timeout is positive, the child's process group (see child_wait_setpgid)
+// is sent SIGTERM once it's been running for timeout seconds since started,
+// then SIGKILL if it's still around kill_after seconds later; timed_out is set
+// if either was needed.
+//
+// On Linux, the child is waited on through a pidfd in an epoll set alongside
+// a timerfd for the deadline, so waiting never polls or relies on SIGCHLD.
+int child_wait(pid_t pid, double started, double timeout, double kill_after,
+               bool *timed_out);
+
+// child_wait_group watches a pipeline's timed children from a single watcher
+// thread, so each is signalled at its deadline even while the shell is busy
+// with the rest of the pipeline (or waiting on another stage).
+//
+// On Linux, one epoll set holds a pidfd and a deadline timerfd for every
+// child; elsewhere (or without pidfds), the watcher polls them instead.
+typedef struct child_wait_group {
+  GMutex lock;
+
+  // Signalled whenever a child exits.
+  GCond exited;
+
+  // child_wait_member*[], in the order they were added.
+  GPtrArray *members;
+
+  // The epoll set (or -1), and a pipe written to to wake the watcher (to stop
+  // it, or to start polling).
+  int ep_fd;
+  int stop_fds[2];
+  bool stopping;
+
+  // Whether any child is polled for rather than watched through a pidfd.
+  bool polling;
+
+  GThread *watcher;
+} child_wait_group;
+
+child_wait_group *child_wait_group_new(void);
+
+void child_wait_group_free(child_wait_group *group);
+
+void child_wait_group_add(child_wait_group *group, pid_t pid, double started,
+                          double timeout, double kill_after);
+
+int child_wait_group_wait(child_wait_group *group, pid_t pid,
+                          bool *timed_out);
+
+void child_wait_setpgid(pid_t pid);
+
+double child_wait_now(void);
@@ -18,7 +18,7 @@ cmd_word_part *cmd_word_part_new(cmd_word_part_type type,
 cmd *cmd_new(void) {
   cmd *c = malloc(sizeof(cmd));
   c->parts = NULL;
-  c->env_vars = g_hash_table_new(g_str_hash, g_str_equal);
+  c->negated = false;
 
   return c;
 }
@@ -35,6 +35,11 @@ void cmd_word_part_str_part_free(cmd_word_part_str_part *part) {
     free(part->value.var);
     break;
   }
+
+  case CMD_WORD_PART_STR_PART_TYPE_ARITH: {
+    arith_free(part->value.arith);
+    break;
+  }
   }
 
   free(part);
@@ -48,9 +53,6 @@ void cmd_word_part_free(cmd_word_part *part) {
   }
 
   case CMD_WORD_PART_TYPE_STR: {
-    for (GList *node = part->value.str->parts; node != NULL;
-         node = node->next) {
-    }
     g_list_free_full(part->value.str->parts,
                      (GDestroyNotify)cmd_word_part_str_part_free);
     free(part->value.str);
@@ -68,6 +70,16 @@ void cmd_word_part_free(cmd_word_part *part) {
     break;
   }
 
+  case CMD_WORD_PART_TYPE_PROC_SUB: {
+    cmd_free(part->value.proc_sub);
+    break;
+  }
+
+  case CMD_WORD_PART_TYPE_ARITH: {
+    arith_free(part->value.arith);
+    break;
+  }
+
   default:
     fprintf(stderr, "cmd_word_part_free: unknown word part type\n");
   }
@@ -80,6 +92,22 @@ void cmd_word_free(cmd_word *word) {
   free(word);
 }
 
+void cmd_list_free(GList *cmds) {
+  g_list_free_full(cmds, (GDestroyNotify)cmd_free);
+}
+
+void cmd_if_clause_free(cmd_if_clause *clause) {
+  cmd_list_free(clause->cond);
+  cmd_list_free(clause->body);
+  free(clause);
+}
+
+void cmd_case_item_free(cmd_case_item *item) {
+  g_list_free_full(item->patterns, (GDestroyNotify)cmd_word_free);
+  cmd_list_free(item->body);
+  free(item);
+}
+
 void cmd_part_free(cmd_part *part) {
   switch (part->type) {
   case CMD_PART_TYPE_VAR_ASSIGN: {
@@ -94,11 +122,80 @@ void cmd_part_free(cmd_part *part) {
     break;
   }
 
+  case CMD_PART_TYPE_REDIRECT: {
+    cmd_word_free(part->value.redirect->target);
+    free(part->value.redirect);
+    break;
+  }
+
   case CMD_PART_TYPE_PIPE: {
     cmd_free(part->value.piped_cmd);
     break;
   }
 
+  case CMD_PART_TYPE_OR: {
+    cmd_free(part->value.or_cmd);
+    break;
+  }
+
+  case CMD_PART_TYPE_AND: {
+    cmd_free(part->value.and_cmd);
+    break;
+  }
+
+  case CMD_PART_TYPE_IF: {
+    g_list_free_full(part->value.if_cmd->clauses,
+                     (GDestroyNotify)cmd_if_clause_free);
+    free(part->value.if_cmd);
+    break;
+  }
+
+  case CMD_PART_TYPE_LOOP: {
+    cmd_list_free(part->value.loop->cond);
+    cmd_list_free(part->value.loop->body);
+    free(part->value.loop);
+    break;
+  }
+
+  case CMD_PART_TYPE_FOR: {
+    free(part->value.for_cmd->name);
+    g_list_free_full(part->value.for_cmd->words,
+                     (GDestroyNotify)cmd_word_free);
+    cmd_list_free(part->value.for_cmd->body);
+    free(part->value.for_cmd);
+    break;
+  }
+
+  case CMD_PART_TYPE_CASE: {
+    cmd_word_free(part->value.case_cmd->word);
+    g_list_free_full(part->value.case_cmd->items,
+                     (GDestroyNotify)cmd_case_item_free);
+    free(part->value.case_cmd);
+    break;
+  }
+
+  case CMD_PART_TYPE_GROUP: {
+    cmd_list_free(part->value.group);
+    break;
+  }
+
+  case CMD_PART_TYPE_FUNC_DEF: {
+    cmd_func_unref(part->value.func_def);
+    break;
+  }
+
+  case CMD_PART_TYPE_ARITH: {
+    arith_free(part->value.arith);
+    break;
+  }
+
+  case CMD_PART_TYPE_COPROC: {
+    free(part->value.coproc->name);
+    cmd_free(part->value.coproc->body);
+    free(part->value.coproc);
+    break;
+  }
+
   default:
     fprintf(stderr, "cmd_word_free: unknown part type\n");
   }
@@ -106,6 +203,22 @@ void cmd_part_free(cmd_part *part) {
   free(part);
 }
 
+cmd_func *cmd_func_ref(cmd_func *func) {
+  g_atomic_int_inc(&func->refs);
+
+  return func;
+}
+
+void cmd_func_unref(cmd_func *func) {
+  if (!g_atomic_int_dec_and_test(&func->refs)) {
+    return;
+  }
+
+  free(func->name);
+  cmd_part_free(func->body);
+  free(func);
+}
+
 void cmd_free(cmd *cmd) {
   g_list_free_full(cmd->parts, (GDestroyNotify)cmd_part_free);
   free(cmd);
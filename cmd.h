@@ -1,25 +1,44 @@
 #pragma once
 
+#include "arith.h"
 #include "glib.h"
 #include <stdbool.h>
 
 typedef struct cmd {
   GList *parts;
-  GHashTable *env_vars;
+
+  // Whether the cmd's status is inverted ("! cmd").
+  bool negated;
 } cmd;
 
 typedef struct cmd_word {
   // GList<cmd_word_part*>;
   GList *parts;
+
+  // Whether an unquoted literal part has a "*", "?" or "[...]", so the word
+  // is expanded as a glob.
+  bool glob;
+
+  // Whether the word has an unquoted var or cmd sub (whose result is split on
+  // IFS) or a "$@", so it can expand to any number of fields.
+  bool split;
 } cmd_word;
 
 typedef struct cmd_word_part_var {
   GString *name;
+
+  // The var store slot the name was interned to.
+  int slot;
+
+  // For a special param (e.g. "$1", "$#" or "$@"), the char after the '$' (or
+  // 0 for a regular var).
+  char special;
 } cmd_word_part_var;
 
 typedef enum cmd_word_part_str_part_type {
   CMD_WORD_PART_STR_PART_TYPE_LITERAL,
   CMD_WORD_PART_STR_PART_TYPE_VAR,
+  CMD_WORD_PART_STR_PART_TYPE_ARITH,
 } cmd_word_part_str_part_type;
 
 typedef struct cmd_word_part_str_part {
@@ -28,6 +47,7 @@ typedef struct cmd_word_part_str_part {
   union cmd_word_part_str_part_value {
     GString *literal;
     cmd_word_part_var *var;
+    arith_node *arith;
   } value;
 } cmd_word_part_str_part;
 
@@ -42,6 +62,7 @@ typedef enum cmd_word_part_type {
   CMD_WORD_PART_TYPE_VAR,
   CMD_WORD_PART_TYPE_CMD_SUB,
   CMD_WORD_PART_TYPE_PROC_SUB,
+  CMD_WORD_PART_TYPE_ARITH,
 } cmd_word_part_type;
 
 typedef union cmd_word_part_value {
@@ -50,6 +71,9 @@ typedef union cmd_word_part_value {
   cmd_word_part_var *var;
   cmd *cmd_sub;
   cmd *proc_sub;
+
+  // The parsed expression of a "$(( ))".
+  arith_node *arith;
 } cmd_word_part_value;
 
 typedef struct cmd_word_part {
@@ -61,27 +85,146 @@ typedef struct cmd_word_part {
 typedef enum cmd_part_type {
   CMD_PART_TYPE_WORD,
   CMD_PART_TYPE_VAR_ASSIGN,
+  CMD_PART_TYPE_REDIRECT,
   CMD_PART_TYPE_PIPE,
   CMD_PART_TYPE_OR,
   CMD_PART_TYPE_AND,
+  CMD_PART_TYPE_IF,
+  CMD_PART_TYPE_LOOP,
+  CMD_PART_TYPE_FOR,
+  CMD_PART_TYPE_CASE,
+  CMD_PART_TYPE_GROUP,
+  CMD_PART_TYPE_FUNC_DEF,
+  CMD_PART_TYPE_ARITH,
+  CMD_PART_TYPE_COPROC,
 } cmd_part_type;
 
 typedef struct cmd_var_assign {
   char *name;
+  int slot;
   cmd_word *value;
 } cmd_var_assign;
 
-typedef struct cmd_part {
+typedef enum cmd_redirect_type {
+  // [n]<word
+  CMD_REDIRECT_TYPE_IN,
+  // [n]>word
+  CMD_REDIRECT_TYPE_OUT,
+  // [n]>>word
+  CMD_REDIRECT_TYPE_APPEND,
+  // [n]>&word or [n]<&word (where word is an fd or '-')
+  CMD_REDIRECT_TYPE_DUP,
+  // [n]<<word or [n]<<-word (where the target is the here-doc's body)
+  CMD_REDIRECT_TYPE_HEREDOC,
+  // [n]<<<word
+  CMD_REDIRECT_TYPE_HERESTRING,
+} cmd_redirect_type;
+
+typedef struct cmd_redirect {
+  cmd_redirect_type type;
+  int fd;
+  cmd_word *target;
+} cmd_redirect;
+
+// cmd_if_clause is an "if"/"elif" condition and its body (or, with no
+// condition, an "else" body).
+typedef struct cmd_if_clause {
+  // GList<cmd*>, or NULL for "else".
+  GList *cond;
+
+  // GList<cmd*>
+  GList *body;
+} cmd_if_clause;
+
+typedef struct cmd_if {
+  // GList<cmd_if_clause*>
+  GList *clauses;
+} cmd_if;
+
+// cmd_loop is a "while" (or "until") loop.
+typedef struct cmd_loop {
+  bool until;
+
+  // GList<cmd*>
+  GList *cond;
+  GList *body;
+} cmd_loop;
+
+typedef struct cmd_for {
+  char *name;
+  int slot;
+
+  // GList<cmd_word*> to iterate over (if has_words).
+  GList *words;
+  bool has_words;
+
+  // GList<cmd*>
+  GList *body;
+} cmd_for;
+
+typedef struct cmd_case_item {
+  // GList<cmd_word*>
+  GList *patterns;
+
+  // GList<cmd*>
+  GList *body;
+} cmd_case_item;
+
+typedef struct cmd_case {
+  cmd_word *word;
+
+  // GList<cmd_case_item*>
+  GList *items;
+} cmd_case;
+
+// cmd_coproc is a "coproc [name] cmd", run alongside the shell with its stdin
+// and stdout connected to pipes the shell holds.
+typedef struct cmd_coproc {
+  char *name;
+  cmd *body;
+} cmd_coproc;
+
+typedef struct cmd_part cmd_part;
+
+// cmd_func is a function definition ("name() { ...; }").
+//
+// It's refcounted since the executor holds on to it after the cmd that defined
+// it has been freed.
+typedef struct cmd_func {
+  int refs;
+
+  char *name;
+
+  // The compound cmd run when the function is called.
+  cmd_part *body;
+} cmd_func;
+
+struct cmd_part {
   cmd_part_type type;
 
   union cmd_part_value {
     cmd_word *word;
     cmd_var_assign *var_assign;
+    cmd_redirect *redirect;
     cmd *piped_cmd;
     cmd *or_cmd;
     cmd *and_cmd;
+    cmd_if *if_cmd;
+    cmd_loop *loop;
+    cmd_for *for_cmd;
+    cmd_case *case_cmd;
+
+    // GList<cmd*> of a "{ ...; }" group.
+    GList *group;
+
+    cmd_func *func_def;
+
+    // The parsed expression of a "(( ))" cmd.
+    arith_node *arith;
+
+    cmd_coproc *coproc;
   } value;
-} cmd_part;
+};
 
 cmd_word_part *cmd_word_part_new(cmd_word_part_type type,
                                  cmd_word_part_value val);
@@ -92,4 +235,8 @@ cmd_word *cmd_word_new(cmd_word_part *parts);
 
 void cmd_free(cmd *cmd);
 
+cmd_func *cmd_func_ref(cmd_func *func);
+
+void cmd_func_unref(cmd_func *func);
+
 void cmd_set_var(cmd *cmd, cmd_var_assign *var);
@@ -0,0 +1,978 @@
+#include "cmd_builtins.h"
+#include "cmd_executor.h"
+#include "cmd_test.h"
+#include "fd_copy.h"
+#include "var_store.h"
+#include <ctype.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// cmd_builtin_export marks each named var as exported, assigning it first for
+// "name=value" args.
+static int cmd_builtin_export(cmd_executor *executor, char **argv) {
+  for (argv++; *argv != NULL; argv++) {
+    char *eq = strchr(*argv, '=');
+    size_t name_len = eq != NULL ? (size_t)(eq - *argv) : strlen(*argv);
+
+    int slot = var_store_intern(*argv, name_len);
+    if (eq != NULL) {
+      var_store_set(executor->vars, slot,
+                    var_value_new(eq + 1, strlen(eq + 1)));
+    }
+
+    var_store_export(executor->vars, slot);
+  }
+
+  return 0;
+}
+
+// The buffer size for copies that go through a ring.
+#define CMD_BUILTIN_BUF_SIZE (128 * 1024)
+
+// cmd_builtin_write writes all of buf to stdout (or the stdout ring).
+static ssize_t cmd_builtin_write(cmd_executor *executor, const char *buf,
+                                 size_t len) {
+  executor->stdout_bytes += len;
+
+  if (executor->stdout_ring != NULL) {
+    return ring_buffer_write(executor->stdout_ring, buf, len);
+  }
+
+  for (size_t written = 0; written < len;) {
+    ssize_t n = write(executor->stdout_fno, buf + written, len - written);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+
+    if (n < 0) {
+      return -1;
+    }
+
+    written += (size_t)n;
+  }
+
+  return (ssize_t)len;
+}
+
+// cmd_builtin_copy copies everything from in_ring (or fd, if it's NULL) to
+// stdout, leaving it to fd_copy when neither end is a ring.
+static ssize_t cmd_builtin_copy(cmd_executor *executor, int fd,
+                                ring_buffer *in_ring) {
+  if (in_ring == NULL && executor->stdout_ring == NULL) {
+    ssize_t n = fd_copy(fd, executor->stdout_fno);
+    if (n > 0) {
+      executor->stdout_bytes += (size_t)n;
+    }
+
+    return n;
+  }
+
+  // Move data straight between the rings' memory where we can.
+  ssize_t total = 0;
+  for (;;) {
+    char *span;
+    ssize_t n;
+
+    if (in_ring != NULL) {
+      if ((n = (ssize_t)ring_buffer_read_peek(in_ring, &span)) == 0) {
+        return total;
+      }
+
+      if (cmd_builtin_write(executor, span, (size_t)n) < 0) {
+        return -1;
+      }
+
+      ring_buffer_read_consume(in_ring, (size_t)n);
+    } else {
+      size_t len = ring_buffer_write_reserve(executor->stdout_ring, &span);
+      if (len == 0) {
+        errno = EPIPE;
+        return -1;
+      }
+
+      while ((n = read(fd, span, len)) < 0 && errno == EINTR) {
+      }
+
+      if (n <= 0) {
+        return n < 0 ? -1 : total;
+      }
+
+      ring_buffer_write_commit(executor->stdout_ring, (size_t)n);
+      executor->stdout_bytes += (size_t)n;
+    }
+
+    total += n;
+  }
+}
+
+// cmd_builtin_echo_passes returns whether echo leaves argv to the external
+// echo, which it does for escapes (-e).
+static bool cmd_builtin_echo_passes(char **argv) {
+  for (argv++; *argv != NULL && (*argv)[0] == '-' && (*argv)[1] != 0;
+       argv++) {
+    if (strspn(*argv + 1, "neE") != strlen(*argv + 1)) {
+      return false;
+    }
+
+    if (strpbrk(*argv + 1, "eE") != NULL) {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+// cmd_builtin_echo writes its args separated by spaces and followed by a
+// newline (unless -n is given).
+//
+// Escapes (-e) are left to the external echo.
+static int cmd_builtin_echo(cmd_executor *executor, char **argv) {
+  if (cmd_builtin_echo_passes(argv)) {
+    return CMD_BUILTIN_PASS;
+  }
+
+  bool newline = true;
+
+  // Like bash, an arg is only taken as options if it's entirely made of them.
+  for (argv++; *argv != NULL && (*argv)[0] == '-' && (*argv)[1] != 0;
+       argv++) {
+    if (strspn(*argv + 1, "neE") != strlen(*argv + 1)) {
+      break;
+    }
+
+    newline = false;
+  }
+
+  GString *out = g_string_new(NULL);
+  for (char **arg = argv; *arg != NULL; arg++) {
+    if (arg != argv) {
+      g_string_append_c(out, ' ');
+    }
+
+    g_string_append(out, *arg);
+  }
+
+  if (newline) {
+    g_string_append_c(out, '\n');
+  }
+
+  ssize_t n = cmd_builtin_write(executor, out->str, out->len);
+  g_string_free(out, true);
+
+  return n < 0 ? 1 : 0;
+}
+
+// cmd_builtin_cat_passes returns whether cat leaves argv to the external cat,
+// which it does for any options.
+static bool cmd_builtin_cat_passes(char **argv) {
+  for (char **arg = argv + 1; *arg != NULL; arg++) {
+    if ((*arg)[0] == '-' && (*arg)[1] != 0) {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+// cmd_builtin_cat copies each file (or stdin for none or "-") to stdout with
+// fd_copy, so the data never passes through user space when the kernel can
+// move it directly.
+//
+// Any options are left to the external cat.
+static int cmd_builtin_cat(cmd_executor *executor, char **argv) {
+  if (cmd_builtin_cat_passes(argv)) {
+    return CMD_BUILTIN_PASS;
+  }
+
+  char *stdin_args[] = {"-", NULL};
+  char **files = argv[1] != NULL ? argv + 1 : stdin_args;
+
+  int status = 0;
+  for (char **file = files; *file != NULL; file++) {
+    bool is_stdin = strcmp(*file, "-") == 0;
+
+    int fd = is_stdin ? executor->stdin_fno
+                      : openat(cmd_executor_dirfd(executor), *file,
+                               O_RDONLY | O_CLOEXEC);
+    ring_buffer *in_ring = is_stdin ? executor->stdin_ring : NULL;
+    if (fd < 0) {
+      dprintf(executor->stderr_fno, "cat: %s: %s\n", *file, strerror(errno));
+      status = 1;
+      continue;
+    }
+
+    // Copying a file onto itself (e.g. "cat f >> f") would never finish.
+    struct stat in_st, out_st;
+    if (in_ring == NULL && executor->stdout_ring == NULL &&
+        fstat(fd, &in_st) == 0 && fstat(executor->stdout_fno, &out_st) == 0 &&
+        S_ISREG(in_st.st_mode) && in_st.st_dev == out_st.st_dev &&
+        in_st.st_ino == out_st.st_ino) {
+      dprintf(executor->stderr_fno, "cat: %s: input file is output file\n",
+              *file);
+      status = 1;
+    } else if (cmd_builtin_copy(executor, fd, in_ring) < 0) {
+      // Quietly stop once the reader's gone, like an external cat killed by
+      // SIGPIPE.
+      if (errno == EPIPE) {
+        if (!is_stdin) {
+          close(fd);
+        }
+
+        return 1;
+      }
+
+      dprintf(executor->stderr_fno, "cat: %s: %s\n", *file, strerror(errno));
+      status = 1;
+    }
+
+    if (!is_stdin) {
+      close(fd);
+    }
+  }
+
+  return status;
+}
+
+// cmd_builtin_parse_size parses a byte count with an optional K, M or G
+// suffix.
+static bool cmd_builtin_parse_size(const char *str, size_t *size) {
+  char *end;
+  errno = 0;
+  unsigned long long n = strtoull(str, &end, 10);
+  if (errno != 0 || end == str) {
+    return false;
+  }
+
+  switch (*end) {
+  case 'k':
+  case 'K':
+    n <<= 10;
+    end++;
+    break;
+
+  case 'm':
+  case 'M':
+    n <<= 20;
+    end++;
+    break;
+
+  case 'g':
+  case 'G':
+    n <<= 30;
+    end++;
+    break;
+  }
+
+  if (*end != 0) {
+    return false;
+  }
+
+  *size = (size_t)n;
+  return true;
+}
+
+// cmd_builtin_parse_duration parses a number of seconds with an optional s,
+// m, h or d suffix, like timeout(1).
+static bool cmd_builtin_parse_duration(const char *str, double *secs) {
+  char *end;
+  errno = 0;
+  double n = strtod(str, &end);
+  if (errno != 0 || end == str || n < 0) {
+    return false;
+  }
+
+  switch (*end) {
+  case 's':
+    end++;
+    break;
+
+  case 'm':
+    n *= 60;
+    end++;
+    break;
+
+  case 'h':
+    n *= 60 * 60;
+    end++;
+    break;
+
+  case 'd':
+    n *= 24 * 60 * 60;
+    end++;
+    break;
+  }
+
+  if (*end != 0) {
+    return false;
+  }
+
+  *secs = n;
+  return true;
+}
+
+// cmd_builtin_timeout runs a cmd (in a child, even if it's a builtin), sending
+// its process group SIGTERM if it runs too long and SIGKILL if it's still
+// running -k seconds after that:
+//
+//   timeout [-k DURATION] DURATION CMD [ARG]...
+//
+// Like timeout(1), it exits with 124 if the cmd timed out.
+static int cmd_builtin_timeout(cmd_executor *executor, char **argv) {
+  cmd_timeout timeout = {.secs = 0, .kill_after = 0, .report = false};
+
+  argv++;
+  if (*argv != NULL && strcmp(*argv, "-k") == 0) {
+    if (argv[1] == NULL ||
+        !cmd_builtin_parse_duration(argv[1], &timeout.kill_after)) {
+      dprintf(executor->stderr_fno, "timeout: invalid kill duration\n");
+      return 125;
+    }
+
+    argv += 2;
+  }
+
+  if (*argv == NULL || argv[1] == NULL) {
+    dprintf(executor->stderr_fno,
+            "timeout: usage: timeout [-k DURATION] DURATION CMD [ARG]...\n");
+    return 125;
+  }
+
+  if (!cmd_builtin_parse_duration(*argv, &timeout.secs)) {
+    dprintf(executor->stderr_fno, "timeout: invalid time interval '%s'\n",
+            *argv);
+    return 125;
+  }
+
+  return cmd_executor_exec_timed(executor, argv + 1, &timeout);
+}
+
+// cmd_builtin_cache_key builds the key a cmd's cached output is stored under:
+// the directory it runs in, the named vars (as "name=value", or just "name"
+// if unset) and its args, each ended with a NUL (which none of them can hold).
+static GString *cmd_builtin_cache_key(cmd_executor *executor,
+                                      GPtrArray *env_names, char **argv) {
+  GString *key = g_string_new(NULL);
+
+  if (executor->cwd != NULL) {
+    g_string_append(key, executor->cwd);
+  } else {
+    char *cwd = getcwd(NULL, 0);
+    if (cwd != NULL) {
+      g_string_append(key, cwd);
+      free(cwd);
+    }
+  }
+  g_string_append_c(key, 0);
+
+  for (guint i = 0; i < env_names->len; i++) {
+    const char *name = g_ptr_array_index(env_names, i);
+    int slot = var_store_intern(name, strlen(name));
+
+    var_value *value = NULL;
+    if (executor->term_env_vars != NULL) {
+      value = g_hash_table_lookup(executor->term_env_vars,
+                                  GINT_TO_POINTER(slot));
+    }
+    if (value == NULL) {
+      value = var_store_get(executor->vars, slot);
+    }
+
+    g_string_append(key, name);
+    if (value != NULL) {
+      g_string_append_c(key, '=');
+      g_string_append_len(key, var_value_str(value), (gssize)value->len);
+    }
+    g_string_append_c(key, 0);
+  }
+
+  for (; *argv != NULL; argv++) {
+    g_string_append(key, *argv);
+    g_string_append_c(key, 0);
+  }
+
+  return key;
+}
+
+// cmd_builtin_cache runs a cmd, or replays its output from an earlier run of
+// it with the same args in the same directory:
+//
+//   cache [--ttl DURATION] [--env NAME]... [--] CMD [ARG]...
+//
+// Output older than --ttl is thrown away, and each --env adds a var the
+// output depends on to its key. Only output from runs that succeed is cached,
+// in memory (see the cachesize option) and, if TURTLE_CACHE_DIR is set, in
+// files there that other shells pick up too.
+static int cmd_builtin_cache(cmd_executor *executor, char **argv) {
+  double ttl = 0;
+  GPtrArray *env_names = g_ptr_array_new();
+  bool ok = true;
+
+  for (argv++; ok && *argv != NULL && **argv == '-'; argv++) {
+    if (strcmp(*argv, "--") == 0) {
+      argv++;
+      break;
+    }
+
+    if (strcmp(*argv, "--ttl") == 0) {
+      ok = argv[1] != NULL && cmd_builtin_parse_duration(argv[1], &ttl);
+      argv++;
+    } else if (strcmp(*argv, "--env") == 0 && argv[1] != NULL) {
+      g_ptr_array_add(env_names, *++argv);
+    } else {
+      ok = false;
+    }
+  }
+
+  if (!ok || *argv == NULL) {
+    dprintf(executor->stderr_fno, "turtle: cache: usage: cache [--ttl "
+                                  "DURATION] [--env NAME]... CMD [ARG]...\n");
+    g_ptr_array_free(env_names, true);
+    return 2;
+  }
+
+  if (executor->cache == NULL) {
+    executor->cache = cmd_cache_new(executor->cache_size);
+  }
+
+  var_value *dir_value = var_store_get(
+      executor->vars, var_store_intern("TURTLE_CACHE_DIR", 16));
+  const char *dir = dir_value != NULL && dir_value->len > 0
+                        ? var_value_str(dir_value)
+                        : NULL;
+
+  GString *key = cmd_builtin_cache_key(executor, env_names, argv);
+  g_ptr_array_free(env_names, true);
+
+  bool from_disk;
+  int status = 0;
+  var_value *out = cmd_cache_get(executor->cache, key, ttl, dir, &from_disk);
+
+  if (executor->stats != NULL) {
+    cmd_stats_add_cache(executor->stats, out != NULL, from_disk);
+  }
+
+  if (out == NULL) {
+    status = cmd_executor_exec_captured(executor, argv, &out);
+    if (status == 0) {
+      cmd_cache_put(executor->cache, key, out, dir);
+    }
+  }
+
+  cmd_builtin_write(executor, var_value_str(out), out->len);
+
+  var_value_unref(out);
+  g_string_free(key, true);
+
+  return status;
+}
+
+static bool cmd_builtin_set_cachesize(cmd_executor *executor,
+                                      const char *value) {
+  if (!cmd_builtin_parse_size(value, &executor->cache_size)) {
+    return false;
+  }
+
+  if (executor->cache != NULL) {
+    cmd_cache_set_cap(executor->cache, executor->cache_size);
+  }
+
+  return true;
+}
+
+static void cmd_builtin_print_cachesize(cmd_executor *executor) {
+  dprintf(executor->stdout_fno, "cachesize\t%zu\n", executor->cache_size);
+}
+
+static bool cmd_builtin_set_cmdtimeout(cmd_executor *executor,
+                                       const char *value) {
+  return cmd_builtin_parse_duration(value, &executor->timeout.secs);
+}
+
+static void cmd_builtin_print_cmdtimeout(cmd_executor *executor) {
+  dprintf(executor->stdout_fno, "cmdtimeout\t%g\n", executor->timeout.secs);
+}
+
+static bool cmd_builtin_set_pipesize(cmd_executor *executor,
+                                     const char *value) {
+  return cmd_builtin_parse_size(value, &executor->pipe_size);
+}
+
+static void cmd_builtin_print_pipesize(cmd_executor *executor) {
+  dprintf(executor->stdout_fno, "pipesize\t%zu\n", executor->pipe_size);
+}
+
+typedef struct cmd_builtin_option {
+  const char *name;
+  bool (*set)(cmd_executor *executor, const char *value);
+  void (*print)(cmd_executor *executor);
+} cmd_builtin_option;
+
+static const cmd_builtin_option options[] = {
+    {"cachesize", cmd_builtin_set_cachesize, cmd_builtin_print_cachesize},
+    {"cmdtimeout", cmd_builtin_set_cmdtimeout, cmd_builtin_print_cmdtimeout},
+    {"pipesize", cmd_builtin_set_pipesize, cmd_builtin_print_pipesize},
+};
+
+// cmd_builtin_set sets each shell option given as "-o name=value", or prints
+// them all given just "-o".
+static int cmd_builtin_set(cmd_executor *executor, char **argv) {
+  if (argv[1] != NULL && strcmp(argv[1], "-o") == 0 && argv[2] == NULL) {
+    for (size_t i = 0; i < G_N_ELEMENTS(options); i++) {
+      options[i].print(executor);
+    }
+
+    return 0;
+  }
+
+  for (argv++; *argv != NULL; argv++) {
+    if (strcmp(*argv, "-o") != 0 || argv[1] == NULL) {
+      dprintf(executor->stderr_fno, "turtle: set: usage: set -o name=value\n");
+      return 2;
+    }
+
+    argv++;
+
+    char *eq = strchr(*argv, '=');
+    size_t name_len = eq != NULL ? (size_t)(eq - *argv) : strlen(*argv);
+
+    const cmd_builtin_option *option = NULL;
+    for (size_t i = 0; i < G_N_ELEMENTS(options); i++) {
+      if (strlen(options[i].name) == name_len &&
+          strncmp(options[i].name, *argv, name_len) == 0) {
+        option = &options[i];
+      }
+    }
+
+    if (option == NULL) {
+      dprintf(executor->stderr_fno, "turtle: set: %.*s: invalid option name\n",
+              (int)name_len, *argv);
+      return 1;
+    }
+
+    if (eq == NULL || !option->set(executor, eq + 1)) {
+      dprintf(executor->stderr_fno, "turtle: set: %s: invalid value\n", *argv);
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+static int cmd_builtin_true(cmd_executor *executor, char **argv) { return 0; }
+
+static int cmd_builtin_false(cmd_executor *executor, char **argv) { return 1; }
+
+// cmd_builtin_test evaluates a test(1) expression; as "[", it must end in "]".
+static int cmd_builtin_test(cmd_executor *executor, char **argv) {
+  int argc = 0;
+  while (argv[argc + 1] != NULL) {
+    argc++;
+  }
+
+  if (strcmp(argv[0], "[") == 0) {
+    if (argc == 0 || strcmp(argv[argc], "]") != 0) {
+      dprintf(executor->stderr_fno, "turtle: [: missing ']'\n");
+      return 2;
+    }
+
+    argc--;
+  }
+
+  const char *err;
+  int status =
+      cmd_test(cmd_executor_dirfd(executor), argv + 1, argc, &err);
+  if (status == 2) {
+    dprintf(executor->stderr_fno, "turtle: %s: %s\n", argv[0], err);
+  }
+
+  return status;
+}
+
+// cmd_builtin_loop_control implements "break [n]" and "continue [n]" by
+// flagging how many enclosing loops should stop (see cmd_executor_loop_done).
+static int cmd_builtin_loop_control(cmd_executor *executor, char **argv) {
+  long n = 1;
+  if (argv[1] != NULL) {
+    char *end;
+    n = strtol(argv[1], &end, 10);
+
+    if (*argv[1] == 0 || *end != 0 || n < 1) {
+      dprintf(executor->stderr_fno, "turtle: %s: %s: loop count out of range\n",
+              argv[0], argv[1]);
+      return 1;
+    }
+  }
+
+  if (executor->loop_depth == 0) {
+    dprintf(executor->stderr_fno,
+            "turtle: %s: only meaningful in a 'for', 'while', or 'until' "
+            "loop\n",
+            argv[0]);
+    return 0;
+  }
+
+  int count = (int)MIN(n, executor->loop_depth);
+  if (argv[0][0] == 'b') {
+    executor->breaking = count;
+  } else {
+    executor->continuing = count;
+  }
+
+  return 0;
+}
+
+// cmd_builtin_local makes each named var local to the function being run,
+// assigning it first for "name=value" args.
+static int cmd_builtin_local(cmd_executor *executor, char **argv) {
+  if (executor->func_depth == 0) {
+    dprintf(executor->stderr_fno,
+            "turtle: local: can only be used in a function\n");
+    return 1;
+  }
+
+  for (argv++; *argv != NULL; argv++) {
+    char *eq = strchr(*argv, '=');
+    size_t name_len = eq != NULL ? (size_t)(eq - *argv) : strlen(*argv);
+
+    int slot = var_store_intern(*argv, name_len);
+    cmd_executor_set_local(executor, slot,
+                           eq != NULL ? var_value_new(eq + 1, strlen(eq + 1))
+                                      : NULL);
+  }
+
+  return 0;
+}
+
+// cmd_read_line is a line read by the read builtin.
+typedef struct cmd_read_line {
+  GString *str;
+
+  // Whether each char of str was escaped, so it isn't split on (or NULL for
+  // -r).
+  GString *escaped;
+
+  field_split_ifs *ifs;
+} cmd_read_line;
+
+// cmd_builtin_read_line reads a line (up to delim) from stdin.
+//
+// Unless it's -r, a backslash escapes the char after it, and a
+// backslash-newline continues the line.
+static bool cmd_builtin_read_line(cmd_executor *executor, char delim,
+                                  cmd_read_line *line) {
+  fd_reader *reader = cmd_executor_get_reader(executor, executor->stdin_fno);
+  if (line->escaped == NULL) {
+    return fd_reader_read(reader, delim, line->str);
+  }
+
+  GString *raw = g_string_new(NULL);
+  bool found;
+
+  for (;;) {
+    g_string_truncate(raw, 0);
+    found = fd_reader_read(reader, delim, raw);
+
+    bool pending = false;
+    for (size_t i = 0; i < raw->len; i++) {
+      if (!pending && raw->str[i] == '\\') {
+        pending = true;
+        continue;
+      }
+
+      g_string_append_c(line->str, raw->str[i]);
+      g_string_append_c(line->escaped, pending);
+      pending = false;
+    }
+
+    // A trailing backslash escapes the delim itself.
+    if (!pending || !found) {
+      break;
+    }
+
+    if (delim != '\n') {
+      g_string_append_c(line->str, delim);
+      g_string_append_c(line->escaped, true);
+    }
+  }
+
+  g_string_free(raw, true);
+
+  return found;
+}
+
+// cmd_read_line_is returns whether the char at i is in set (and wasn't
+// escaped).
+static inline bool cmd_read_line_is(cmd_read_line *line, const bool *set,
+                                    size_t i) {
+  return (line->escaped == NULL || !line->escaped->str[i]) &&
+         set[(unsigned char)line->str->str[i]];
+}
+
+// cmd_read_line_skip_space returns the index of the first char at or after i
+// that isn't IFS whitespace.
+static size_t cmd_read_line_skip_space(cmd_read_line *line, size_t i) {
+  while (i < line->str->len && cmd_read_line_is(line, line->ifs->space, i)) {
+    i++;
+  }
+
+  return i;
+}
+
+// cmd_read_line_skip_sep returns the index just past the separator at i: any
+// IFS whitespace, at most one other IFS char, and any whitespace after that.
+static size_t cmd_read_line_skip_sep(cmd_read_line *line, size_t i) {
+  i = cmd_read_line_skip_space(line, i);
+
+  if (i < line->str->len && cmd_read_line_is(line, line->ifs->delim, i)) {
+    i = cmd_read_line_skip_space(line, i + 1);
+  }
+
+  return i;
+}
+
+// cmd_read_line_field_end returns the index of the first IFS char at or
+// after i.
+static size_t cmd_read_line_field_end(cmd_read_line *line, size_t i) {
+  while (i < line->str->len && !cmd_read_line_is(line, line->ifs->space, i) &&
+         !cmd_read_line_is(line, line->ifs->delim, i)) {
+    i++;
+  }
+
+  return i;
+}
+
+// cmd_builtin_read_set sets the named var to len bytes of str.
+static void cmd_builtin_read_set(cmd_executor *executor, const char *name,
+                                 const char *str, size_t len) {
+  var_store_set(executor->vars, var_store_intern(name, strlen(name)),
+                var_value_new(str, len));
+}
+
+// cmd_builtin_read_split splits the line on IFS into the named vars, the last
+// of which gets the rest of the line.
+static void cmd_builtin_read_split(cmd_executor *executor, char **names,
+                                   cmd_read_line *line) {
+  const char *str = line->str->str;
+
+  if (line->ifs->empty) {
+    cmd_builtin_read_set(executor, *names, str, line->str->len);
+
+    for (names++; *names != NULL; names++) {
+      cmd_builtin_read_set(executor, *names, "", 0);
+    }
+
+    return;
+  }
+
+  size_t i = cmd_read_line_skip_space(line, 0);
+
+  for (; names[1] != NULL; names++) {
+    size_t end = cmd_read_line_field_end(line, i);
+    cmd_builtin_read_set(executor, *names, str + i, end - i);
+
+    i = cmd_read_line_skip_sep(line, end);
+  }
+
+  // Like bash, the rest loses any trailing whitespace, or its separator too
+  // if it's just one field.
+  size_t end = cmd_read_line_field_end(line, i);
+  if (cmd_read_line_skip_sep(line, end) < line->str->len) {
+    end = line->str->len;
+    while (end > i && cmd_read_line_is(line, line->ifs->space, end - 1)) {
+      end--;
+    }
+  }
+
+  cmd_builtin_read_set(executor, *names, str + i, end - i);
+}
+
+// cmd_builtin_read reads a line from stdin and splits it on IFS into the
+// named vars, or sets REPLY to the whole line if there are none:
+//
+//   read [-r] [-d DELIM] [NAME]...
+//
+// Like bash, it returns 1 if it hit EOF before the delim (after still
+// setting the vars to whatever it read).
+static int cmd_builtin_read(cmd_executor *executor, char **argv) {
+  bool raw = false;
+  char delim = '\n';
+
+  for (argv++; *argv != NULL && (*argv)[0] == '-' && (*argv)[1] != 0;
+       argv++) {
+    if (strcmp(*argv, "--") == 0) {
+      argv++;
+      break;
+    }
+
+    for (char *opt = *argv + 1; *opt != 0; opt++) {
+      if (*opt == 'r') {
+        raw = true;
+      } else if (*opt == 'd' && (opt[1] != 0 || argv[1] != NULL)) {
+        // The delim is the first char of the rest of the arg (or of the next
+        // one), where "" means NUL.
+        delim = opt[1] != 0 ? opt[1] : **++argv;
+        break;
+      } else {
+        dprintf(executor->stderr_fno,
+                "turtle: read: usage: read [-r] [-d delim] [name ...]\n");
+        return 2;
+      }
+    }
+  }
+
+  for (char **name = argv; *name != NULL; name++) {
+    const char *c = *name;
+    bool valid = isalpha((unsigned char)*c) || *c == '_';
+    for (c++; valid && *c != 0; c++) {
+      valid = isalnum((unsigned char)*c) || *c == '_';
+    }
+
+    if (!valid) {
+      dprintf(executor->stderr_fno,
+              "turtle: read: `%s': not a valid identifier\n", *name);
+      return 1;
+    }
+  }
+
+  cmd_read_line line = {
+      .str = g_string_new(NULL),
+      .escaped = raw ? NULL : g_string_new(NULL),
+      .ifs = cmd_executor_ifs(executor),
+  };
+
+  // Split on the IFS given just for read (e.g. "IFS=: read a b") instead.
+  field_split_ifs term_ifs;
+  var_value *ifs_value =
+      executor->term_env_vars != NULL
+          ? g_hash_table_lookup(executor->term_env_vars,
+                                GINT_TO_POINTER(executor->ifs_slot))
+          : NULL;
+  if (ifs_value != NULL) {
+    field_split_ifs_init(&term_ifs, var_value_str(ifs_value), ifs_value->len);
+    line.ifs = &term_ifs;
+  }
+
+  bool found = cmd_builtin_read_line(executor, delim, &line);
+
+  if (*argv == NULL) {
+    cmd_builtin_read_set(executor, "REPLY", line.str->str, line.str->len);
+  } else {
+    cmd_builtin_read_split(executor, argv, &line);
+  }
+
+  g_string_free(line.str, true);
+  if (line.escaped != NULL) {
+    g_string_free(line.escaped, true);
+  }
+
+  return found ? 0 : 1;
+}
+
+// cmd_builtin_return returns from the function being run with the given
+// status (or the last cmd's).
+static int cmd_builtin_return(cmd_executor *executor, char **argv) {
+  if (executor->func_depth == 0) {
+    dprintf(executor->stderr_fno,
+            "turtle: return: can only be used in a function\n");
+    return 1;
+  }
+
+  int status = executor->last_status;
+  if (argv[1] != NULL) {
+    char *end;
+    long n = strtol(argv[1], &end, 10);
+
+    if (*argv[1] == 0 || *end != 0) {
+      dprintf(executor->stderr_fno,
+              "turtle: return: %s: numeric argument required\n", argv[1]);
+      n = 2;
+    }
+
+    status = (int)(n & 0xff);
+  }
+
+  executor->returning = true;
+
+  return status;
+}
+
+typedef struct cmd_builtin_entry {
+  const char *name;
+  cmd_builtin fn;
+
+  // Whether the builtin only touches its fds (and rings), so it can run on a
+  // pipeline thread alongside the rest of the shell.
+  bool threadable;
+
+  // Whether a threadable builtin would pass argv on to the external cmd (or
+  // NULL if it never does), so the shell can start the child itself instead.
+  bool (*passes)(char **argv);
+} cmd_builtin_entry;
+
+static const cmd_builtin_entry builtins[] = {
+    {":", cmd_builtin_true, false, NULL},
+    {"[", cmd_builtin_test, false, NULL},
+    {"break", cmd_builtin_loop_control, false, NULL},
+    {"cache", cmd_builtin_cache, false, NULL},
+    {"cat", cmd_builtin_cat, true, cmd_builtin_cat_passes},
+    {"continue", cmd_builtin_loop_control, false, NULL},
+    {"echo", cmd_builtin_echo, true, cmd_builtin_echo_passes},
+    {"export", cmd_builtin_export, false, NULL},
+    {"false", cmd_builtin_false, false, NULL},
+    {"local", cmd_builtin_local, false, NULL},
+    {"read", cmd_builtin_read, false, NULL},
+    {"return", cmd_builtin_return, false, NULL},
+    {"set", cmd_builtin_set, false, NULL},
+    {"test", cmd_builtin_test, false, NULL},
+    {"timeout", cmd_builtin_timeout, false, NULL},
+    {"true", cmd_builtin_true, false, NULL},
+};
+
+static const cmd_builtin_entry *cmd_builtins_find(const char *name) {
+  for (size_t i = 0; i < G_N_ELEMENTS(builtins); i++) {
+    if (strcmp(builtins[i].name, name) == 0) {
+      return &builtins[i];
+    }
+  }
+
+  return NULL;
+}
+
+cmd_builtin cmd_builtins_lookup(const char *name) {
+  const cmd_builtin_entry *entry = cmd_builtins_find(name);
+
+  return entry != NULL ? entry->fn : NULL;
+}
+
+// cmd_builtins_lookup_threadable looks up a builtin that can run on a pipeline
+// thread.
+cmd_builtin cmd_builtins_lookup_threadable(const char *name) {
+  const cmd_builtin_entry *entry = cmd_builtins_find(name);
+
+  return entry != NULL && entry->threadable ? entry->fn : NULL;
+}
+
+// cmd_builtins_passes returns whether the builtin name would pass argv on to
+// the external cmd of the same name.
+bool cmd_builtins_passes(const char *name, char **argv) {
+  const cmd_builtin_entry *entry = cmd_builtins_find(name);
+
+  return entry != NULL && entry->passes != NULL && entry->passes(argv);
+}
+
+// cmd_builtins_complete appends copies of the names of the builtins that start
+// with prefix to matches.
+void cmd_builtins_complete(const char *prefix, GPtrArray *matches) {
+  size_t len = strlen(prefix);
+
+  for (size_t i = 0; i < G_N_ELEMENTS(builtins); i++) {
+    if (strncmp(builtins[i].name, prefix, len) == 0) {
+      g_ptr_array_add(matches, strdup(builtins[i].name));
+    }
+  }
+}
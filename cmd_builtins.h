@@ -0,0 +1,21 @@
+#pragma once
+
+#include "cmd_executor.h"
+
+// CMD_BUILTIN_PASS is returned by a builtin that can't handle its args and
+// wants the external cmd of the same name run instead.
+#define CMD_BUILTIN_PASS -1
+
+// cmd_builtin runs a builtin in-process against the executor's fds (or rings),
+// returning its exit status (or CMD_BUILTIN_PASS).
+//
+// A builtin that passes must do so before touching any of its fds.
+typedef int (*cmd_builtin)(cmd_executor *executor, char **argv);
+
+cmd_builtin cmd_builtins_lookup(const char *name);
+
+cmd_builtin cmd_builtins_lookup_threadable(const char *name);
+
+bool cmd_builtins_passes(const char *name, char **argv);
+
+void cmd_builtins_complete(const char *prefix, GPtrArray *matches);
@@ -0,0 +1,286 @@
+#include "cmd_cache.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// The most we read from a cache file at once.
+#define CMD_CACHE_READ_SIZE (64 * 1024)
+
+// cmd_cache_hash_key hashes a key (which can hold NULs) with FNV-1a.
+static uint64_t cmd_cache_hash_key(const GString *key) {
+  uint64_t hash = 14695981039346656037ULL;
+  for (gsize i = 0; i < key->len; i++) {
+    hash ^= (unsigned char)key->str[i];
+    hash *= 1099511628211ULL;
+  }
+
+  return hash;
+}
+
+static guint cmd_cache_hash(gconstpointer key) {
+  return (guint)cmd_cache_hash_key(key);
+}
+
+static gboolean cmd_cache_equal(gconstpointer a, gconstpointer b) {
+  const GString *x = a;
+  const GString *y = b;
+
+  return x->len == y->len && memcmp(x->str, y->str, x->len) == 0;
+}
+
+static void cmd_cache_entry_free(cmd_cache_entry *entry) {
+  g_string_free(entry->key, true);
+  var_value_unref(entry->out);
+  free(entry);
+}
+
+// cmd_cache_now returns the time in secs since the epoch.
+static double cmd_cache_now(void) { return (double)g_get_real_time() / 1e6; }
+
+cmd_cache *cmd_cache_new(size_t cap) {
+  cmd_cache *cache = malloc(sizeof(cmd_cache));
+  cache->entries = g_hash_table_new_full(cmd_cache_hash, cmd_cache_equal, NULL,
+                                         (GDestroyNotify)cmd_cache_entry_free);
+  cache->lru = NULL;
+  cache->lru_tail = NULL;
+  cache->cap = cap;
+
+  return cache;
+}
+
+void cmd_cache_free(cmd_cache *cache) {
+  g_hash_table_destroy(cache->entries);
+  g_list_free(cache->lru);
+  free(cache);
+}
+
+// cmd_cache_remove drops an entry from memory.
+static void cmd_cache_remove(cmd_cache *cache, cmd_cache_entry *entry) {
+  if (cache->lru_tail == entry->node) {
+    cache->lru_tail = entry->node->prev;
+  }
+
+  cache->lru = g_list_delete_link(cache->lru, entry->node);
+  g_hash_table_remove(cache->entries, entry->key);
+}
+
+// cmd_cache_touch makes an entry the most recently used.
+static void cmd_cache_touch(cmd_cache *cache, cmd_cache_entry *entry) {
+  if (entry->node == cache->lru) {
+    return;
+  }
+
+  if (cache->lru_tail == entry->node) {
+    cache->lru_tail = entry->node->prev;
+  }
+
+  cache->lru = g_list_delete_link(cache->lru, entry->node);
+  cache->lru = g_list_prepend(cache->lru, entry);
+  entry->node = cache->lru;
+}
+
+// cmd_cache_evict drops the least recently used entries until there are no
+// more than cap.
+static void cmd_cache_evict(cmd_cache *cache) {
+  while (g_hash_table_size(cache->entries) > cache->cap &&
+         cache->lru_tail != NULL) {
+    cmd_cache_remove(cache, cache->lru_tail->data);
+  }
+}
+
+// cmd_cache_insert holds a ref to out in memory as key's output, stored at
+// stored.
+static void cmd_cache_insert(cmd_cache *cache, GString *key, var_value *out,
+                             double stored) {
+  cmd_cache_entry *existing = g_hash_table_lookup(cache->entries, key);
+  if (existing != NULL) {
+    cmd_cache_remove(cache, existing);
+  }
+
+  cmd_cache_entry *entry = malloc(sizeof(cmd_cache_entry));
+  entry->key = g_string_new_len(key->str, (gssize)key->len);
+  entry->out = var_value_ref(out);
+  entry->stored = stored;
+
+  cache->lru = g_list_prepend(cache->lru, entry);
+  entry->node = cache->lru;
+  if (cache->lru_tail == NULL) {
+    cache->lru_tail = entry->node;
+  }
+
+  g_hash_table_insert(cache->entries, entry->key, entry);
+  cmd_cache_evict(cache);
+}
+
+// cmd_cache_path returns the path of key's file in dir.
+static char *cmd_cache_path(const char *dir, const GString *key) {
+  return g_strdup_printf("%s/%016" PRIx64, dir, cmd_cache_hash_key(key));
+}
+
+// cmd_cache_load reads key's output from its file in dir, returning NULL if
+// there isn't one for key that was stored within ttl secs of now.
+static var_value *cmd_cache_load(const GString *key, double ttl,
+                                 const char *dir, double now, double *stored) {
+  char *path = cmd_cache_path(dir, key);
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  free(path);
+
+  if (fd < 0) {
+    return NULL;
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) < 0 || (ttl > 0 && now - (double)st.st_mtime > ttl)) {
+    close(fd);
+    return NULL;
+  }
+
+  var_value *file = var_value_new("", 0);
+  for (;;) {
+    size_t avail;
+    char *buf = var_value_reserve(file, CMD_CACHE_READ_SIZE, &avail);
+
+    ssize_t n = read(fd, buf, avail);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+
+    if (n <= 0) {
+      break;
+    }
+
+    var_value_commit(file, (size_t)n);
+  }
+
+  close(fd);
+
+  // The file starts with the key's length and the key itself.
+  const char *str = var_value_str(file);
+  char *end;
+  unsigned long long key_len = strtoull(str, &end, 10);
+
+  var_value *out = NULL;
+  size_t off = (size_t)(end - str) + 1;
+  if (end != str && *end == '\n' && key_len == key->len &&
+      off + key->len <= file->len &&
+      memcmp(str + off, key->str, key->len) == 0) {
+    off += key->len;
+    out = var_value_new(str + off, file->len - off);
+    *stored = (double)st.st_mtime;
+  }
+
+  var_value_unref(file);
+
+  return out;
+}
+
+// cmd_cache_write_all writes all of buf to fd, returning false if it
+// couldn't.
+static bool cmd_cache_write_all(int fd, const char *buf, size_t len) {
+  for (size_t written = 0; written < len;) {
+    ssize_t n = write(fd, buf + written, len - written);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+
+    if (n < 0) {
+      return false;
+    }
+
+    written += (size_t)n;
+  }
+
+  return true;
+}
+
+// cmd_cache_store writes key's output to its file in dir, going through a
+// temp file so other shells never read a partial one.
+//
+// The cache is only ever an optimization, so failing to is ignored.
+static void cmd_cache_store(const GString *key, var_value *out,
+                            const char *dir) {
+  mkdir(dir, 0700);
+
+  char *tmp_path = g_strdup_printf("%s/.tmp.XXXXXX", dir);
+  int fd = mkstemp(tmp_path);
+  if (fd < 0) {
+    free(tmp_path);
+    return;
+  }
+
+  char header[32];
+  int header_len = snprintf(header, sizeof(header), "%zu\n", key->len);
+
+  bool ok = cmd_cache_write_all(fd, header, (size_t)header_len) &&
+            cmd_cache_write_all(fd, key->str, key->len) &&
+            cmd_cache_write_all(fd, var_value_str(out), out->len);
+  close(fd);
+
+  char *path = cmd_cache_path(dir, key);
+  if (!ok || rename(tmp_path, path) < 0) {
+    unlink(tmp_path);
+  }
+
+  free(path);
+  free(tmp_path);
+}
+
+// cmd_cache_get returns a ref to key's output if it was stored within ttl
+// secs (or at all, if ttl is 0), looking in dir (if it isn't NULL) when it's
+// not in memory, or NULL if it's a miss.
+//
+// from_disk is set if the output came from dir.
+var_value *cmd_cache_get(cmd_cache *cache, GString *key, double ttl,
+                         const char *dir, bool *from_disk) {
+  *from_disk = false;
+  double now = cmd_cache_now();
+
+  cmd_cache_entry *entry = g_hash_table_lookup(cache->entries, key);
+  if (entry != NULL && ttl > 0 && now - entry->stored > ttl) {
+    cmd_cache_remove(cache, entry);
+    entry = NULL;
+  }
+
+  if (entry != NULL) {
+    cmd_cache_touch(cache, entry);
+    return var_value_ref(entry->out);
+  }
+
+  if (dir == NULL) {
+    return NULL;
+  }
+
+  double stored;
+  var_value *out = cmd_cache_load(key, ttl, dir, now, &stored);
+  if (out == NULL) {
+    return NULL;
+  }
+
+  *from_disk = true;
+  cmd_cache_insert(cache, key, out, stored);
+
+  return out;
+}
+
+// cmd_cache_put stores out as key's output, in memory and in dir (if it isn't
+// NULL).
+void cmd_cache_put(cmd_cache *cache, GString *key, var_value *out,
+                   const char *dir) {
+  cmd_cache_insert(cache, key, out, cmd_cache_now());
+
+  if (dir != NULL) {
+    cmd_cache_store(key, out, dir);
+  }
+}
+
+// cmd_cache_set_cap changes how many entries are held in memory.
+void cmd_cache_set_cap(cmd_cache *cache, size_t cap) {
+  cache->cap = cap;
+  cmd_cache_evict(cache);
+}
@@ -0,0 +1,49 @@
+#pragma once
+
+#include "glib.h"
+#include "var_store.h"
+#include <stdbool.h>
+#include <stddef.h>
+
+// cmd_cache_entry is a cmd's cached output.
+typedef struct cmd_cache_entry {
+  GString *key;
+  var_value *out;
+
+  // When the output was stored (in secs since the epoch).
+  double stored;
+
+  // The entry's node in the cache's lru list.
+  GList *node;
+} cmd_cache_entry;
+
+// cmd_cache memoizes the output of cmds run by the cache builtin (e.g.
+// "$(cache git rev-parse HEAD)"), keyed on whatever the caller says the output
+// depends on (see cmd_builtin_cache).
+//
+// Entries are held in memory, where the least recently used goes once there
+// are more than cap, and optionally in a directory that other shells share,
+// where each is a file named for its key's hash (holding the key, to tell
+// collisions apart, then the output) whose mtime is when it was stored.
+typedef struct cmd_cache {
+  // GHashTable<GString* key, cmd_cache_entry*>
+  GHashTable *entries;
+
+  // GList<cmd_cache_entry*>, most recently used first, and its last node.
+  GList *lru;
+  GList *lru_tail;
+
+  size_t cap;
+} cmd_cache;
+
+cmd_cache *cmd_cache_new(size_t cap);
+
+void cmd_cache_free(cmd_cache *cache);
+
+var_value *cmd_cache_get(cmd_cache *cache, GString *key, double ttl,
+                         const char *dir, bool *from_disk);
+
+void cmd_cache_put(cmd_cache *cache, GString *key, var_value *out,
+                   const char *dir);
+
+void cmd_cache_set_cap(cmd_cache *cache, size_t cap);
@@ -1,264 +1,2839 @@
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+
 #include "cmd_executor.h"
 #include "cmd.h"
+#include "cmd_builtins.h"
 #include "cmd_parser.h"
+#include "child_wait.h"
+#include "path_index.h"
+#include "pattern.h"
 #include "utils.h"
+#include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
 #include <setjmp.h>
+#include <signal.h>
 #include <stdio.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
 #include <unistd.h>
 
-static char *cmd_executor_word_to_str(cmd_executor *executor, cmd *c,
-                                      cmd_word *word);
+extern char **environ;
+
+// The size of the rings connecting builtin pipeline stages.
+#define CMD_EXECUTOR_RING_SIZE (256 * 1024)
+
+// The seconds a child that's hit the cmdtimeout gets to exit after SIGTERM
+// before it's sent SIGKILL.
+#define CMD_EXECUTOR_KILL_AFTER 5
+
+// The least we read from a cmd sub at once.
+#define CMD_EXECUTOR_READ_SIZE (64 * 1024)
+
+// The PATH searched when it's unset.
+#define CMD_EXECUTOR_PATH "/usr/bin:/bin"
+
+// The size of each chunk of the executor's scratch arena.
+#define CMD_EXECUTOR_ARENA_CHUNK_SIZE (64 * 1024)
+
+// The lowest fd the shell's ends of a coproc's pipes are moved to, so they
+// stay clear of the fds scripts redirect by number (e.g. "3>file").
+#define CMD_EXECUTOR_COPROC_MIN_FD 10
+
+// The seconds coprocs get to exit once their pipes are closed (see
+// cmd_executor_close_coprocs) before they're sent SIGTERM.
+#define CMD_EXECUTOR_COPROC_GRACE 1
+
+// The number of outputs the cache builtin holds in memory by default (see
+// the cachesize option).
+#define CMD_EXECUTOR_CACHE_SIZE 128
+
+static var_value *cmd_executor_word_to_value(cmd_executor *executor,
+                                             cmd_word *word);
+
+int cmd_executor_exec_term(cmd_executor *executor, GHashTable *env_vars,
+                           char *term, char **argv);
+
+// cmd_local_save is a var's value from before it was made local to a function
+// call.
+typedef struct cmd_local_save {
+  int slot;
+  var_value *value;
+} cmd_local_save;
+
+static void cmd_executor_error(cmd_executor *executor, int status) {
+  longjmp(executor->err_jmp, status);
+}
+
+// The PATH index shared by every executor in the process, which is created
+// the first time one needs it.
+static path_index *cmd_executor_path_index = NULL;
+static pthread_once_t cmd_executor_path_index_once = PTHREAD_ONCE_INIT;
+
+// A fork while another thread holds the index's lock would leave it locked
+// forever in the child, so hold it across forks.
+static void cmd_executor_path_index_prefork(void) {
+  g_mutex_lock(&cmd_executor_path_index->lock);
+}
+
+static void cmd_executor_path_index_postfork(void) {
+  g_mutex_unlock(&cmd_executor_path_index->lock);
+}
+
+static void cmd_executor_init_path_index(void) {
+  cmd_executor_path_index = path_index_new();
+  pthread_atfork(cmd_executor_path_index_prefork,
+                 cmd_executor_path_index_postfork,
+                 cmd_executor_path_index_postfork);
+}
+
+// cmd_executor_get_path_index returns the shared PATH index, creating it if
+// this is the first time it's needed (so a run that never looks up a cmd never
+// sets it up).
+static path_index *cmd_executor_get_path_index(cmd_executor *executor) {
+  if (executor->path_index == NULL) {
+    pthread_once(&cmd_executor_path_index_once, cmd_executor_init_path_index);
+    executor->path_index = cmd_executor_path_index;
+  }
+
+  return executor->path_index;
+}
+
+cmd_executor *cmd_executor_new() {
+  return cmd_executor_new_with_env(environ);
+}
+
+// cmd_executor_new_with_env creates an executor whose vars (and exported
+// environment) start out as envp.
+cmd_executor *cmd_executor_new_with_env(char **envp) {
+  cmd_executor *executor = malloc(sizeof(cmd_executor));
+  executor->vars = var_store_new();
+  executor->stdin_fno = STDIN_FILENO;
+  executor->stdout_fno = STDOUT_FILENO;
+  executor->stderr_fno = STDERR_FILENO;
+  executor->fd_routes = g_array_new(false, false, sizeof(cmd_fd_route));
+  executor->readers = NULL;
+  executor->coprocs = NULL;
+  executor->cache = NULL;
+  executor->cache_size = CMD_EXECUTOR_CACHE_SIZE;
+  executor->cwd = NULL;
+  executor->cwd_fd = -1;
+  executor->stdin_ring = NULL;
+  executor->stdout_ring = NULL;
+  executor->timeout = (cmd_timeout){
+      .secs = 0, .kill_after = CMD_EXECUTOR_KILL_AFTER, .report = true};
+  executor->wait_group = NULL;
+  executor->term_env_vars = NULL;
+  executor->pipe_size = 0;
+  executor->stdout_bytes = 0;
+  executor->stats = NULL;
+  executor->loop_depth = 0;
+  executor->breaking = 0;
+  executor->continuing = 0;
+  executor->funcs = g_hash_table_new_full(g_str_hash, g_str_equal, NULL,
+                                          (GDestroyNotify)cmd_func_unref);
+  executor->args =
+      g_ptr_array_new_with_free_func((GDestroyNotify)var_value_unref);
+  executor->arg0 = var_value_new("turtle", 6);
+  executor->args_joined = NULL;
+  executor->last_status = 0;
+  executor->local_saves = g_array_new(false, false, sizeof(cmd_local_save));
+  executor->locals_base = 0;
+  executor->func_depth = 0;
+  executor->returning = false;
+  executor->scratch = NULL;
+  executor->arena = arena_new(CMD_EXECUTOR_ARENA_CHUNK_SIZE);
+  executor->glob_cache = NULL;
+
+  executor->spawn_lock = malloc(sizeof(GMutex));
+  g_mutex_init(executor->spawn_lock);
+
+  // Import the environment once so lookups never have to scan environ.
+  var_store_import_env(executor->vars, envp);
+  executor->path_slot = var_store_intern("PATH", 4);
+  executor->path_index = NULL;
+  executor->ifs_slot = var_store_intern("IFS", 3);
+  executor->ifs = NULL;
+  executor->ifs_value = NULL;
+  executor->slices = g_array_new(false, false, sizeof(field_split_slice));
+
+  return executor;
+}
+
+void cmd_executor_free(cmd_executor *executor) {
+  cmd_executor_close_coprocs(executor);
+  if (executor->coprocs != NULL) {
+    g_array_free(executor->coprocs, true);
+  }
+
+  if (executor->cache != NULL) {
+    cmd_cache_free(executor->cache);
+  }
+
+  var_store_free(executor->vars);
+  g_array_free(executor->fd_routes, true);
+  if (executor->readers != NULL) {
+    g_hash_table_destroy(executor->readers);
+  }
+  g_mutex_clear(executor->spawn_lock);
+  free(executor->spawn_lock);
+  if (executor->stats != NULL) {
+    cmd_stats_free(executor->stats);
+  }
+
+  g_hash_table_destroy(executor->funcs);
+  g_ptr_array_free(executor->args, true);
+  var_value_unref(executor->arg0);
+  var_value_unref(executor->args_joined);
+  g_array_free(executor->local_saves, true);
+  var_value_unref(executor->scratch);
+  arena_free(executor->arena);
+  if (executor->glob_cache != NULL) {
+    path_glob_cache_free(executor->glob_cache);
+  }
+  free(executor->ifs);
+  var_value_unref(executor->ifs_value);
+  g_array_free(executor->slices, true);
+
+  free(executor);
+}
+
+// cmd_executor_get_fd returns the fd the executor routes to fd in children.
+int cmd_executor_get_fd(cmd_executor *executor, int fd) {
+  switch (fd) {
+  case STDIN_FILENO:
+    return executor->stdin_fno;
+
+  case STDOUT_FILENO:
+    return executor->stdout_fno;
+
+  case STDERR_FILENO:
+    return executor->stderr_fno;
+
+  default:
+    for (guint i = 0; i < executor->fd_routes->len; i++) {
+      cmd_fd_route *route =
+          &g_array_index(executor->fd_routes, cmd_fd_route, i);
+      if (route->fd == fd) {
+        return route->src;
+      }
+    }
+
+    return fd;
+  }
+}
+
+// cmd_executor_set_fd routes src to fd in children (and for builtins).
+void cmd_executor_set_fd(cmd_executor *executor, int fd, int src) {
+  switch (fd) {
+  case STDIN_FILENO:
+    executor->stdin_fno = src;
+    return;
+
+  case STDOUT_FILENO:
+    executor->stdout_fno = src;
+    return;
+
+  case STDERR_FILENO:
+    executor->stderr_fno = src;
+    return;
+
+  default:
+    for (guint i = 0; i < executor->fd_routes->len; i++) {
+      cmd_fd_route *route =
+          &g_array_index(executor->fd_routes, cmd_fd_route, i);
+      if (route->fd == fd) {
+        if (src == fd) {
+          g_array_remove_index_fast(executor->fd_routes, i);
+        } else {
+          route->src = src;
+        }
+
+        return;
+      }
+    }
+
+    if (src != fd) {
+      cmd_fd_route route = {.fd = fd, .src = src};
+      g_array_append_val(executor->fd_routes, route);
+    }
+  }
+}
+
+// cmd_executor_get_reader returns the reader for fd, creating it the first
+// time fd is read from.
+fd_reader *cmd_executor_get_reader(cmd_executor *executor, int fd) {
+  if (executor->readers == NULL) {
+    executor->readers = g_hash_table_new_full(
+        g_direct_hash, NULL, NULL, (GDestroyNotify)fd_reader_free);
+  }
+
+  fd_reader *reader =
+      g_hash_table_lookup(executor->readers, GINT_TO_POINTER(fd));
+  if (reader == NULL) {
+    reader = fd_reader_new(fd);
+    g_hash_table_insert(executor->readers, GINT_TO_POINTER(fd), reader);
+  }
+
+  return reader;
+}
+
+// cmd_executor_close closes an fd the executor opened, dropping its reader
+// (since the fd number can be reused for something else).
+static void cmd_executor_close(cmd_executor *executor, int fd) {
+  if (executor->readers != NULL) {
+    g_hash_table_remove(executor->readers, GINT_TO_POINTER(fd));
+  }
+
+  close(fd);
+}
+
+// cmd_int_cmp compares ints for qsort.
+static int cmd_int_cmp(const void *a, const void *b) {
+  int x = *(const int *)a;
+  int y = *(const int *)b;
+
+  return (x > y) - (x < y);
+}
+
+// cmd_executor_close_fds closes every fd from first to last (inclusive).
+static void cmd_executor_close_fds(int first, int last) {
+  if (first > last) {
+    return;
+  }
+
+#ifdef SYS_close_range
+  if (syscall(SYS_close_range, (unsigned)first, (unsigned)last, 0) == 0) {
+    return;
+  }
+#endif
+
+  int max_fd = (int)MIN(sysconf(_SC_OPEN_MAX), (long)last);
+  for (int fd = first; fd <= max_fd; fd++) {
+    close(fd);
+  }
+}
+
+// cmd_executor_route_child_fds dup2s each of the executor's fds into place in
+// a freshly forked child.
+static void cmd_executor_route_child_fds(cmd_executor *executor) {
+  guint len = 3 + executor->fd_routes->len;
+  int targets[len];
+  int srcs[len];
+
+  int max_target = STDERR_FILENO;
+  for (guint i = 0; i < len; i++) {
+    targets[i] = i < 3 ? (int)i
+                       : g_array_index(executor->fd_routes, cmd_fd_route, i - 3)
+                             .fd;
+    srcs[i] = cmd_executor_get_fd(executor, targets[i]);
+    max_target = MAX(max_target, targets[i]);
+  }
+
+  // Move any source that's also a target out of the way first, so routing one
+  // fd can't clobber the source of another (e.g. "2>&1 >out").
+  for (guint i = 0; i < len; i++) {
+    if (srcs[i] >= 0 && srcs[i] != targets[i] && srcs[i] <= max_target) {
+      srcs[i] = fcntl(srcs[i], F_DUPFD_CLOEXEC, max_target + 1);
+    }
+  }
+
+  for (guint i = 0; i < len; i++) {
+    if (srcs[i] < 0) {
+      close(targets[i]);
+    } else if (srcs[i] != targets[i]) {
+      dup2(srcs[i], targets[i]);
+    }
+  }
+}
+
+static var_value *cmd_executor_get_var(cmd_executor *executor,
+                                       cmd_word_part_var *var) {
+  if (var->special == 0) {
+    return var_store_get(executor->vars, var->slot);
+  }
+
+  GPtrArray *args = executor->args;
+
+  switch (var->special) {
+  case '0':
+    return executor->arg0;
+
+  case '#':
+  case '?': {
+    char buf[16];
+    int len = snprintf(buf, sizeof(buf), "%d",
+                       var->special == '#' ? (int)args->len
+                                           : executor->last_status);
+
+    var_value_unref(executor->scratch);
+    executor->scratch = var_value_new(buf, (size_t)len);
+
+    return executor->scratch;
+  }
+
+  case '@':
+  case '*':
+    if (executor->args_joined == NULL) {
+      executor->args_joined = var_value_new("", 0);
+
+      for (guint i = 0; i < args->len; i++) {
+        var_value *arg = g_ptr_array_index(args, i);
+        if (i > 0) {
+          executor->args_joined =
+              var_value_append(executor->args_joined, " ", 1);
+        }
+
+        executor->args_joined = var_value_append(
+            executor->args_joined, var_value_str(arg), arg->len);
+      }
+    }
+
+    return executor->args_joined;
+
+  default: {
+    guint i = (guint)(var->special - '1');
+
+    return i < args->len ? g_ptr_array_index(args, i) : NULL;
+  }
+  }
+}
+
+// cmd_executor_set_args sets $0 and the positional params (from the
+// NULL-terminated args).
+void cmd_executor_set_args(cmd_executor *executor, const char *arg0,
+                           char **args) {
+  var_value_unref(executor->arg0);
+  executor->arg0 = var_value_new(arg0, strlen(arg0));
+
+  g_ptr_array_set_size(executor->args, 0);
+  for (; *args != NULL; args++) {
+    g_ptr_array_add(executor->args, var_value_new(*args, strlen(*args)));
+  }
+
+  var_value_unref(executor->args_joined);
+  executor->args_joined = NULL;
+}
+
+// cmd_executor_set_local sets the var for the rest of the innermost function
+// call, saving its current value to restore once the call returns.
+void cmd_executor_set_local(cmd_executor *executor, int slot,
+                            var_value *value) {
+  bool saved = false;
+  for (guint i = executor->locals_base; i < executor->local_saves->len; i++) {
+    if (g_array_index(executor->local_saves, cmd_local_save, i).slot == slot) {
+      saved = true;
+      break;
+    }
+  }
+
+  if (!saved) {
+    var_value *original = var_store_get(executor->vars, slot);
+    cmd_local_save save = {
+        .slot = slot,
+        .value = original != NULL ? var_value_ref(original) : NULL,
+    };
+
+    g_array_append_val(executor->local_saves, save);
+  }
+
+  var_store_set(executor->vars, slot, value);
+}
+
+// cmd_executor_restore_locals restores the vars the innermost function call
+// made local.
+static void cmd_executor_restore_locals(cmd_executor *executor) {
+  for (guint i = executor->local_saves->len; i > executor->locals_base; i--) {
+    cmd_local_save *save =
+        &g_array_index(executor->local_saves, cmd_local_save, i - 1);
+
+    var_store_set(executor->vars, save->slot, save->value);
+  }
+
+  g_array_set_size(executor->local_saves, executor->locals_base);
+}
+
+// cmd_executor_arith_get reads a var for an arithmetic expression.
+static const char *cmd_executor_arith_get(void *ctx, int slot, char special) {
+  cmd_word_part_var var = {.name = NULL, .slot = slot, .special = special};
+  var_value *val = cmd_executor_get_var(ctx, &var);
+
+  return val != NULL ? var_value_str(val) : NULL;
+}
+
+// cmd_executor_arith_set assigns a var from an arithmetic expression.
+static void cmd_executor_arith_set(void *ctx, int slot, int64_t value) {
+  cmd_executor *executor = ctx;
+
+  char buf[24];
+  int len = snprintf(buf, sizeof(buf), "%lld", (long long)value);
+  var_store_set(executor->vars, slot, var_value_new(buf, (size_t)len));
+}
+
+// cmd_executor_try_arith evaluates an arithmetic expression into res,
+// reporting why (and returning false) if it can't be (e.g. on a division by
+// zero).
+static bool cmd_executor_try_arith(cmd_executor *executor, arith_node *arith,
+                                   int64_t *res) {
+  arith_vars vars = {
+      .ctx = executor,
+      .get = cmd_executor_arith_get,
+      .set = cmd_executor_arith_set,
+  };
+
+  const char *err;
+  if (!arith_eval(arith, &vars, res, &err)) {
+    dprintf(executor->stderr_fno, "turtle: arithmetic: %s\n", err);
+    return false;
+  }
+
+  return true;
+}
+
+// cmd_executor_eval_arith evaluates an arithmetic expansion, failing the cmd
+// if it can't be (see cmd_executor_try_arith).
+static int64_t cmd_executor_eval_arith(cmd_executor *executor,
+                                       arith_node *arith) {
+  int64_t res;
+  if (!cmd_executor_try_arith(executor, arith, &res)) {
+    cmd_executor_error(executor, 1);
+  }
+
+  return res;
+}
+
+// cmd_executor_append_arith evaluates an arithmetic expansion onto res.
+static var_value *cmd_executor_append_arith(cmd_executor *executor,
+                                            arith_node *arith,
+                                            var_value *res) {
+  char buf[24];
+  int len = snprintf(buf, sizeof(buf), "%lld",
+                     (long long)cmd_executor_eval_arith(executor, arith));
+
+  return var_value_append(res, buf, (size_t)len);
+}
+
+// cmd_word_single_var returns the var if the word is exactly `$var` or
+// `"$var"` (and NULL otherwise).
+static cmd_word_part_var *cmd_word_single_var(cmd_word *word) {
+  if (word->parts == NULL || word->parts->next != NULL) {
+    return NULL;
+  }
+
+  cmd_word_part *part = word->parts->data;
+  switch (part->type) {
+  case CMD_WORD_PART_TYPE_VAR:
+    return part->value.var;
+
+  case CMD_WORD_PART_TYPE_STR: {
+    cmd_word_part_str *str = part->value.str;
+    if (!str->quoted || str->parts == NULL || str->parts->next != NULL) {
+      return NULL;
+    }
+
+    cmd_word_part_str_part *str_part = str->parts->data;
+    if (str_part->type != CMD_WORD_PART_STR_PART_TYPE_VAR) {
+      return NULL;
+    }
+
+    return str_part->value.var;
+  }
+
+  default:
+    return NULL;
+  }
+}
+
+// cmd_executor_append_str_parts expands the string parts in the list (starting
+// at str_node) onto res.
+static var_value *cmd_executor_append_str_parts(cmd_executor *executor,
+                                                GList *str_node, bool quoted,
+                                                var_value *res) {
+  for (; str_node != NULL; str_node = str_node->next) {
+    cmd_word_part_str_part *str_part = str_node->data;
+
+    switch (str_part->type) {
+    case CMD_WORD_PART_STR_PART_TYPE_LITERAL: {
+      res = var_value_append(res, str_part->value.literal->str,
+                             str_part->value.literal->len);
+      break;
+    }
+
+    case CMD_WORD_PART_STR_PART_TYPE_VAR: {
+      if (!quoted) {
+        giveup("cmd_executor_append_str_parts: unexpected var");
+      }
+
+      var_value *val = cmd_executor_get_var(executor, str_part->value.var);
+      if (val != NULL) {
+        res = var_value_append(res, var_value_str(val), val->len);
+      }
+
+      break;
+    }
+
+    case CMD_WORD_PART_STR_PART_TYPE_ARITH: {
+      res = cmd_executor_append_arith(executor, str_part->value.arith, res);
+      break;
+    }
+
+    default:
+      giveup("str part type not implemented");
+    }
+  }
+
+  return res;
+}
+
+// cmd_executor_pipe creates a pipe whose ends are closed on exec, so children
+// only ever hold the end they've been routed, sized per the pipesize option.
+//
+// Returns the pipe's buffer size (or 0 if it can't be determined).
+static size_t cmd_executor_pipe(cmd_executor *executor, int pipe_fnos[2]) {
+#ifdef __linux__
+  if (pipe2(pipe_fnos, O_CLOEXEC) < 0) {
+    giveup("cmd_executor_pipe: pipe failed");
+  }
+
+  // Growing past /proc/sys/fs/pipe-max-size needs privileges, so settle for
+  // the default if we can't.
+  if (executor->pipe_size > 0) {
+    fcntl(pipe_fnos[1], F_SETPIPE_SZ, (int)executor->pipe_size);
+  }
+
+  int capacity = fcntl(pipe_fnos[1], F_GETPIPE_SZ);
+
+  return capacity > 0 ? (size_t)capacity : 0;
+#else
+  if (pipe(pipe_fnos) < 0) {
+    giveup("cmd_executor_pipe: pipe failed");
+  }
+
+  fcntl(pipe_fnos[0], F_SETFD, FD_CLOEXEC);
+  fcntl(pipe_fnos[1], F_SETFD, FD_CLOEXEC);
+
+  return 0;
+#endif
+}
+
+// cmd_literal_term returns the first word of c if it's a plain literal (or
+// NULL).
+static const char *cmd_literal_term(cmd *c) {
+  if (c->parts == NULL) {
+    return NULL;
+  }
+
+  cmd_part *first = c->parts->data;
+  if (first->type != CMD_PART_TYPE_WORD) {
+    return NULL;
+  }
+
+  GList *word_parts = first->value.word->parts;
+  if (word_parts == NULL || word_parts->next != NULL) {
+    return NULL;
+  }
+
+  cmd_word_part *word_part = word_parts->data;
+  if (word_part->type != CMD_WORD_PART_TYPE_LIT) {
+    return NULL;
+  }
+
+  return word_part->value.literal->str;
+}
+
+// cmd_sub_reader collects the output of a cmd sub.
+typedef struct cmd_sub_reader {
+  int fd;
+  var_value *out;
+
+  // The bytes read, including trailing newlines.
+  size_t bytes;
+} cmd_sub_reader;
+
+// cmd_executor_read_cmd_sub reads a cmd sub's output from its pipe until EOF
+// straight into the result.
+static gpointer cmd_executor_read_cmd_sub(gpointer data) {
+  cmd_sub_reader *reader = data;
+
+  for (;;) {
+    size_t avail;
+    char *buf = var_value_reserve(reader->out, CMD_EXECUTOR_READ_SIZE, &avail);
+
+    ssize_t n = read(reader->fd, buf, avail);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+
+    if (n <= 0) {
+      break;
+    }
+
+    var_value_commit(reader->out, (size_t)n);
+  }
+
+  reader->bytes = reader->out->len;
+
+  return NULL;
+}
+
+// cmd_executor_exec_captured runs argv like cmd_executor_exec_term, with its
+// stdout captured in out (which the caller unrefs), and returns its status.
+int cmd_executor_exec_captured(cmd_executor *executor, char **argv,
+                               var_value **out) {
+  int original_stdout_fno = executor->stdout_fno;
+
+  // Drain the pipe as it's written, since builtins run in-process.
+  int pipe_fnos[2];
+  cmd_executor_pipe(executor, pipe_fnos);
+
+  cmd_sub_reader reader = {.fd = pipe_fnos[0], .out = var_value_new("", 0)};
+  GThread *reader_thread =
+      g_thread_new("capture", cmd_executor_read_cmd_sub, &reader);
+
+  executor->stdout_fno = pipe_fnos[1];
+  int status = cmd_executor_exec_term(executor, executor->term_env_vars,
+                                      argv[0], argv);
+
+  executor->stdout_fno = original_stdout_fno;
+  close(pipe_fnos[1]);
+
+  g_thread_join(reader_thread);
+  close(pipe_fnos[0]);
+
+  *out = reader.out;
+
+  return status;
+}
+
+// cmd_executor_append_word_part expands the word part onto res.
+static var_value *cmd_executor_append_word_part(cmd_executor *executor,
+                                                cmd_word_part *part,
+                                                var_value *res) {
+  switch (part->type) {
+  case CMD_WORD_PART_TYPE_LIT: {
+    res = var_value_append(res, part->value.literal->str,
+                           part->value.literal->len);
+    break;
+  }
+
+  case CMD_WORD_PART_TYPE_STR: {
+    cmd_word_part_str *str = part->value.str;
+    res = cmd_executor_append_str_parts(executor, str->parts, str->quoted,
+                                        res);
+    break;
+  }
+
+  case CMD_WORD_PART_TYPE_VAR: {
+    var_value *val = cmd_executor_get_var(executor, part->value.var);
+    if (val != NULL) {
+      res = var_value_append(res, var_value_str(val), val->len);
+    }
+
+    break;
+  }
+
+  case CMD_WORD_PART_TYPE_ARITH: {
+    res = cmd_executor_append_arith(executor, part->value.arith, res);
+    break;
+  }
+
+  case CMD_WORD_PART_TYPE_CMD_SUB: {
+    // Keep track of the original fnos.
+    int original_fnos[2] = {executor->stdin_fno, executor->stdout_fno};
+
+    // Create a pipe and start draining it, since the cmd sub may run
+    // builtins in-process that write more than the pipe can hold.
+    int pipe_fnos[2];
+    size_t capacity = cmd_executor_pipe(executor, pipe_fnos);
+
+    cmd_sub_reader reader = {.fd = pipe_fnos[0],
+                             .out = var_value_new("", 0)};
+    GThread *reader_thread =
+        g_thread_new("cmd-sub", cmd_executor_read_cmd_sub, &reader);
+
+    int status;
+
+    // Write to the write end of the pipe.
+    executor->stdout_fno = pipe_fnos[1];
+    status = cmd_executor_exec(executor, part->value.cmd_sub);
+
+    // Restore the executor's stdout and close the write end of the pipe.
+    executor->stdout_fno = original_fnos[1];
+    close(pipe_fnos[1]);
+
+    // Wait for the reader to hit EOF and close the read end of the pipe.
+    g_thread_join(reader_thread);
+    close(pipe_fnos[0]);
+
+    size_t len = reader.out->len;
+    while (len > 0 && reader.out->str[len - 1] == '\n') {
+      len--;
+    }
+    var_value_truncate(reader.out, len);
+
+    if (executor->stats != NULL) {
+      const char *name = cmd_literal_term(part->value.cmd_sub);
+      cmd_stats_add_pipe(executor->stats, "cmd-sub",
+                         g_strdup_printf("$(%s)", name != NULL ? name : "?"),
+                         reader.bytes, true, capacity);
+    }
+
+    if (status != 0) {
+      var_value_unref(reader.out);
+      cmd_executor_error(executor, status);
+    }
+
+    if (res->len == 0 && res->refs == 1) {
+      var_value_unref(res);
+      res = reader.out;
+    } else {
+      res = var_value_append(res, var_value_str(reader.out),
+                             reader.out->len);
+      var_value_unref(reader.out);
+    }
+
+    break;
+  }
+
+  case CMD_WORD_PART_TYPE_PROC_SUB: {
+    char file_name[] = "/tmp/turtle-proc-XXXXXX";
+    int fd;
+    if ((fd = mkstemp(file_name)) < 0) {
+      giveup("cmd_executor_exec: proc sub file creation failed");
+    }
+
+    // Give permission rwx permissions to everyone.
+    if (chmod(file_name, 0777) < 0) {
+      giveup("cmd_executor_exec: proc sub file chmod failed");
+    }
+
+    int original_out_fd = executor->stdout_fno;
+
+    // Redirect executor output to the write end of the pipe.
+    executor->stdout_fno = fd;
+
+    // Execute the command.
+    int status;
+    if ((status = cmd_executor_exec(executor, part->value.proc_sub)) != 0) {
+      close(fd);
+
+      executor->stdout_fno = original_out_fd;
+
+      cmd_executor_error(executor, status);
+    }
+
+    // Close the file.
+    close(fd);
+
+    // Reopen the file with the correct flags.
+    if ((fd = open(file_name, O_RDONLY)) < 0) {
+      giveup("cmd_executor_exec: proc_sub reopen failed");
+    }
+
+    // Restore the original stdout fd.
+    executor->stdout_fno = original_out_fd;
+
+    // Append "/dev/fd/{pipe_read_end_fd}"
+    res = var_value_append(res, file_name, strlen(file_name));
+
+    break;
+  }
+
+  default:
+    giveup("cmd_executor_exec: unimplemented cmd_word_part_type");
+  }
+
+  return res;
+}
+
+// cmd_executor_append_word_parts expands the word parts in the list (starting
+// at node) onto res.
+static var_value *cmd_executor_append_word_parts(cmd_executor *executor,
+                                                 GList *node, var_value *res) {
+  for (; node != NULL; node = node->next) {
+    res = cmd_executor_append_word_part(executor, node->data, res);
+  }
+
+  return res;
+}
+
+// cmd_executor_word_to_value expands the word and returns a new ref to the
+// result.
+//
+// Words that are just a var expansion share the var's value instead of
+// copying it.
+static var_value *cmd_executor_word_to_value(cmd_executor *executor,
+                                             cmd_word *word) {
+  cmd_word_part_var *single_var = cmd_word_single_var(word);
+  if (single_var != NULL) {
+    var_value *val = cmd_executor_get_var(executor, single_var);
+
+    return val != NULL ? var_value_ref(val) : var_value_new("", 0);
+  }
+
+  return cmd_executor_append_word_parts(executor, word->parts,
+                                        var_value_new("", 0));
+}
+
+// cmd_executor_append_escaped appends str onto res with "\" before any chars
+// that would otherwise be special in a pattern.
+static var_value *cmd_executor_append_escaped(var_value *res, const char *str,
+                                              size_t len) {
+  const char *run = str;
+
+  for (const char *c = str; c < str + len; c++) {
+    if (*c == '*' || *c == '?' || *c == '[' || *c == '\\') {
+      res = var_value_append(res, run, (size_t)(c - run));
+      res = var_value_append(res, "\\", 1);
+      run = c;
+    }
+  }
+
+  return var_value_append(res, run, (size_t)(str + len - run));
+}
+
+// cmd_executor_word_to_pattern expands the word into a pattern, in which
+// whatever came from quotes is escaped so it only matches itself.
+static var_value *cmd_executor_word_to_pattern(cmd_executor *executor,
+                                               cmd_word *word) {
+  var_value *res = var_value_new("", 0);
+
+  for (GList *node = word->parts; node != NULL; node = node->next) {
+    cmd_word_part *part = node->data;
+
+    if (part->type != CMD_WORD_PART_TYPE_STR) {
+      res = cmd_executor_append_word_part(executor, part, res);
+      continue;
+    }
+
+    cmd_word_part_str *str = part->value.str;
+    var_value *quoted = cmd_executor_append_str_parts(
+        executor, str->parts, str->quoted, var_value_new("", 0));
+
+    res = cmd_executor_append_escaped(res, var_value_str(quoted), quoted->len);
+    var_value_unref(quoted);
+  }
+
+  return res;
+}
+
+// cmd_executor_add_field appends a field to args, keeping the ref to the value
+// it points into in values.
+static void cmd_executor_add_field(GPtrArray *args, GList **values,
+                                   var_value *value, char *field) {
+  g_ptr_array_add(args, field);
+  *values = g_list_prepend(*values, value);
+}
+
+// cmd_executor_add_glob appends the paths a pattern matches to args (or, if it
+// isn't a glob or there aren't any, the pattern itself with its escapes
+// removed), taking over the ref to the pattern.
+static void cmd_executor_add_glob(cmd_executor *executor, GPtrArray *args,
+                                  GList **values, var_value *glob) {
+  const char *str = var_value_str(glob);
+
+  if (pattern_has_meta(str, glob->len)) {
+    if (executor->glob_cache == NULL) {
+      executor->glob_cache = path_glob_cache_new();
+    }
+
+    GPtrArray *paths = g_ptr_array_new();
+    path_glob_expand(executor->glob_cache, cmd_executor_dirfd(executor), str,
+                     glob->len, paths);
+
+    for (guint i = 0; i < paths->len; i++) {
+      char *path = g_ptr_array_index(paths, i);
+      var_value *value = var_value_new(path, strlen(path));
+      free(path);
+
+      cmd_executor_add_field(args, values, value, value->str);
+    }
+
+    size_t matched = paths->len;
+    g_ptr_array_free(paths, true);
+
+    if (matched > 0) {
+      var_value_unref(glob);
+      return;
+    }
+  }
+
+  // The pattern is ours alone, so it can be unescaped in place.
+  if (memchr(str, '\\', glob->len) != NULL) {
+    var_value_truncate(glob, pattern_unescape(glob->str, glob->len));
+  }
+
+  cmd_executor_add_field(args, values, glob, glob->str);
+}
+
+// cmd_executor_dirfd returns the directory the shell resolves relative paths
+// against, as a dirfd for the *at calls.
+int cmd_executor_dirfd(cmd_executor *executor) {
+  return executor->cwd_fd >= 0 ? executor->cwd_fd : AT_FDCWD;
+}
+
+// cmd_executor_ifs returns the current IFS, prepared for splitting.
+field_split_ifs *cmd_executor_ifs(cmd_executor *executor) {
+  var_value *value = var_store_get(executor->vars, executor->ifs_slot);
+
+  // The ref we hold keeps the value from being reused (or appended to in
+  // place), so it's only a different value if IFS has been reassigned.
+  if (executor->ifs == NULL || value != executor->ifs_value) {
+    if (executor->ifs == NULL) {
+      executor->ifs = malloc(sizeof(field_split_ifs));
+    }
+
+    var_value_unref(executor->ifs_value);
+    executor->ifs_value = value != NULL ? var_value_ref(value) : NULL;
+
+    field_split_ifs_init(executor->ifs,
+                         value != NULL ? var_value_str(value) : NULL,
+                         value != NULL ? value->len : 0);
+  }
+
+  return executor->ifs;
+}
+
+// cmd_executor_split_value splits an unquoted expansion's value into fields
+// and appends them to args, taking over the ref to the value.
+//
+// The fields are slices of the value, terminated in place (after copying it
+// once, if it's shared), so even a cmd sub with many thousands of fields
+// costs no more than one allocation.
+static void cmd_executor_split_value(cmd_executor *executor, GPtrArray *args,
+                                     GList **values, var_value *value) {
+  const char *str = var_value_str(value);
+
+  GArray *slices = executor->slices;
+  g_array_set_size(slices, 0);
+  field_split(cmd_executor_ifs(executor), str, value->len, slices);
+
+  if (slices->len == 0) {
+    var_value_unref(value);
+    return;
+  }
+
+  field_split_slice *first = &g_array_index(slices, field_split_slice, 0);
+  if (slices->len == 1 && first->len == value->len) {
+    if (pattern_has_meta(str, value->len)) {
+      cmd_executor_add_glob(executor, args, values,
+                            var_value_new(str, value->len));
+      var_value_unref(value);
+    } else {
+      cmd_executor_add_field(args, values, value, value->str);
+    }
+
+    return;
+  }
+
+  if (value->refs > 1) {
+    var_value *copy = var_value_new(str, value->len);
+    var_value_unref(value);
+    value = copy;
+  }
+
+  *values = g_list_prepend(*values, value);
+
+  for (guint i = 0; i < slices->len; i++) {
+    field_split_slice *slice = &g_array_index(slices, field_split_slice, i);
+    char *field = value->str + slice->start;
+    field[slice->len] = 0;
+
+    if (pattern_has_meta(field, slice->len)) {
+      cmd_executor_add_glob(executor, args, values,
+                            var_value_new(field, slice->len));
+    } else {
+      g_ptr_array_add(args, field);
+    }
+  }
+}
+
+// cmd_fields_builder builds up the fields of a word that doesn't fit one of
+// cmd_executor_expand_fields' fast paths.
+//
+// Fields are built as patterns (see cmd_executor_word_to_pattern), so they
+// can be globbed once they're complete.
+typedef struct cmd_fields_builder {
+  cmd_executor *executor;
+  GPtrArray *args;
+  GList **values;
+
+  // The field being built (or NULL if the last one has been ended and
+  // another hasn't been started).
+  var_value *field;
+} cmd_fields_builder;
+
+// cmd_fields_builder_end ends the field being built (if there is one).
+static void cmd_fields_builder_end(cmd_fields_builder *builder) {
+  if (builder->field != NULL) {
+    cmd_executor_add_glob(builder->executor, builder->args, builder->values,
+                          builder->field);
+    builder->field = NULL;
+  }
+}
+
+// cmd_fields_builder_append appends to the field being built (starting one if
+// needed), escaping the bytes if they're not meant to be a pattern.
+static void cmd_fields_builder_append(cmd_fields_builder *builder,
+                                      const char *str, size_t len,
+                                      bool escape) {
+  if (builder->field == NULL) {
+    builder->field = var_value_new("", 0);
+  }
+
+  builder->field = escape
+                       ? cmd_executor_append_escaped(builder->field, str, len)
+                       : var_value_append(builder->field, str, len);
+}
+
+// cmd_fields_builder_split appends an unquoted expansion's value, ending the
+// field being built at each IFS separator in it.
+static void cmd_fields_builder_split(cmd_fields_builder *builder,
+                                     var_value *value) {
+  const char *str = var_value_str(value);
+  if (value->len == 0) {
+    return;
+  }
+
+  field_split_ifs *ifs = cmd_executor_ifs(builder->executor);
+  GArray *slices = builder->executor->slices;
+  g_array_set_size(slices, 0);
+  field_split(ifs, str, value->len, slices);
+
+  // Leading whitespace separates the value from whatever came before it
+  // (a leading non-whitespace separator shows up as an empty first field).
+  if (ifs->space[(unsigned char)str[0]]) {
+    cmd_fields_builder_end(builder);
+  }
+
+  size_t end = 0;
+  for (guint i = 0; i < slices->len; i++) {
+    field_split_slice *slice = &g_array_index(slices, field_split_slice, i);
+    if (i > 0) {
+      cmd_fields_builder_end(builder);
+    }
+
+    // Only escape backslashes, so the value's pattern chars stay live.
+    cmd_fields_builder_append(builder, "", 0, false);
+    const char *run = str + slice->start;
+    const char *slice_end = run + slice->len;
+    for (const char *c = run; c < slice_end; c++) {
+      if (*c == '\\') {
+        builder->field =
+            var_value_append(builder->field, run, (size_t)(c - run));
+        builder->field = var_value_append(builder->field, "\\", 1);
+        run = c;
+      }
+    }
+    builder->field =
+        var_value_append(builder->field, run, (size_t)(slice_end - run));
+
+    end = slice->start + slice->len;
+  }
+
+  // So does a trailing separator.
+  if (slices->len == 0 || end < value->len) {
+    cmd_fields_builder_end(builder);
+  }
+}
+
+// cmd_fields_builder_add_str appends a string part, where "$@" in quotes
+// expands to a field per arg.
+static void cmd_fields_builder_add_str(cmd_fields_builder *builder,
+                                       cmd_word_part_str *str) {
+  cmd_executor *executor = builder->executor;
+
+  // Even an empty string makes a field.
+  cmd_fields_builder_append(builder, "", 0, true);
+
+  for (GList *node = str->parts; node != NULL; node = node->next) {
+    cmd_word_part_str_part *str_part = node->data;
+
+    if (str_part->type == CMD_WORD_PART_STR_PART_TYPE_VAR &&
+        str_part->value.var->special == '@') {
+      GPtrArray *args = executor->args;
+
+      // With no args, "$@" is no fields at all (unless there's more to the
+      // field than that).
+      if (args->len == 0 && str->parts->next == NULL &&
+          var_value_str(builder->field)[0] == 0) {
+        var_value_unref(builder->field);
+        builder->field = NULL;
+      }
+
+      for (guint i = 0; i < args->len; i++) {
+        var_value *arg = g_ptr_array_index(args, i);
+        if (i > 0) {
+          cmd_fields_builder_end(builder);
+        }
+
+        cmd_fields_builder_append(builder, var_value_str(arg), arg->len, true);
+      }
+
+      continue;
+    }
+
+    // Expand just this part (append_str_parts would carry on to the rest).
+    GList part_node = {.data = str_part, .next = NULL, .prev = NULL};
+    var_value *value = cmd_executor_append_str_parts(
+        executor, &part_node, str->quoted, var_value_new("", 0));
+
+    cmd_fields_builder_append(builder, var_value_str(value), value->len, true);
+    var_value_unref(value);
+  }
+}
+
+// cmd_executor_expand_fields expands a word that may be split or globbed into
+// its fields, appending them to args (and keeping refs to what they point
+// into in values).
+static void cmd_executor_expand_fields(cmd_executor *executor, cmd_word *word,
+                                       GPtrArray *args, GList **values) {
+  cmd_word_part *single =
+      word->parts != NULL && word->parts->next == NULL ? word->parts->data
+                                                       : NULL;
+
+  if (!word->split) {
+    cmd_executor_add_glob(executor, args, values,
+                          cmd_executor_word_to_pattern(executor, word));
+    return;
+  }
+
+  // "$@" shares the args themselves.
+  cmd_word_part_var *single_var = cmd_word_single_var(word);
+  if (single_var != NULL && single_var->special == '@' &&
+      single->type == CMD_WORD_PART_TYPE_STR) {
+    for (guint i = 0; i < executor->args->len; i++) {
+      var_value *arg = g_ptr_array_index(executor->args, i);
+      var_value_str(arg);
+      cmd_executor_add_field(args, values, var_value_ref(arg), arg->str);
+    }
+
+    return;
+  }
+
+  // A lone unquoted var or cmd sub is split straight out of its value.
+  if (single != NULL && single->type == CMD_WORD_PART_TYPE_VAR) {
+    var_value *value = cmd_executor_get_var(executor, single->value.var);
+    if (value != NULL) {
+      cmd_executor_split_value(executor, args, values, var_value_ref(value));
+    }
+
+    return;
+  }
+
+  if (single != NULL && single->type == CMD_WORD_PART_TYPE_CMD_SUB) {
+    cmd_executor_split_value(
+        executor, args, values,
+        cmd_executor_append_word_part(executor, single, var_value_new("", 0)));
+    return;
+  }
+
+  cmd_fields_builder builder = {
+      .executor = executor, .args = args, .values = values, .field = NULL};
+
+  for (GList *node = word->parts; node != NULL; node = node->next) {
+    cmd_word_part *part = node->data;
+
+    switch (part->type) {
+    case CMD_WORD_PART_TYPE_LIT:
+      cmd_fields_builder_append(&builder, part->value.literal->str,
+                                part->value.literal->len, !word->glob);
+      break;
+
+    case CMD_WORD_PART_TYPE_STR:
+      cmd_fields_builder_add_str(&builder, part->value.str);
+      break;
+
+    case CMD_WORD_PART_TYPE_VAR:
+    case CMD_WORD_PART_TYPE_CMD_SUB: {
+      var_value *value =
+          cmd_executor_append_word_part(executor, part, var_value_new("", 0));
+      cmd_fields_builder_split(&builder, value);
+      var_value_unref(value);
+      break;
+    }
+
+    default: {
+      var_value *value =
+          cmd_executor_append_word_part(executor, part, var_value_new("", 0));
+      cmd_fields_builder_append(&builder, var_value_str(value), value->len,
+                                true);
+      var_value_unref(value);
+      break;
+    }
+    }
+  }
+
+  cmd_fields_builder_end(&builder);
+}
+
+// cmd_str_parts_use_slot returns whether expanding the string parts could read
+// the var in the slot.
+static bool cmd_str_parts_use_slot(GList *str_node, int slot) {
+  for (; str_node != NULL; str_node = str_node->next) {
+    cmd_word_part_str_part *str_part = str_node->data;
+
+    if (str_part->type == CMD_WORD_PART_STR_PART_TYPE_VAR &&
+        str_part->value.var->slot == slot) {
+      return true;
+    }
+
+    // Arithmetic can name any var.
+    if (str_part->type == CMD_WORD_PART_STR_PART_TYPE_ARITH) {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+// cmd_word_parts_use_slot returns whether expanding the word parts could read
+// the var in the slot (subs and arithmetic are assumed to).
+static bool cmd_word_parts_use_slot(GList *node, int slot) {
+  for (; node != NULL; node = node->next) {
+    cmd_word_part *part = node->data;
+
+    switch (part->type) {
+    case CMD_WORD_PART_TYPE_LIT:
+      break;
+
+    case CMD_WORD_PART_TYPE_STR:
+      if (cmd_str_parts_use_slot(part->value.str->parts, slot)) {
+        return true;
+      }
+      break;
+
+    case CMD_WORD_PART_TYPE_VAR:
+      if (part->value.var->slot == slot) {
+        return true;
+      }
+      break;
+
+    case CMD_WORD_PART_TYPE_CMD_SUB:
+    case CMD_WORD_PART_TYPE_PROC_SUB:
+    case CMD_WORD_PART_TYPE_ARITH:
+    default:
+      return true;
+    }
+  }
+
+  return false;
+}
+
+// cmd_executor_assign_value expands the value of an executor var assignment.
+//
+// Assignments that append to the var itself (x=$x$y or x="$x$y") take the
+// var's value out of the store and append to it, so it can grow in place
+// rather than being copied on every assignment.
+static var_value *cmd_executor_assign_value(cmd_executor *executor,
+                                            cmd_var_assign *var) {
+  GList *parts = var->value->parts;
+  if (parts == NULL || var_store_get(executor->vars, var->slot) == NULL) {
+    return cmd_executor_word_to_value(executor, var->value);
+  }
+
+  // Find where the rest of the value starts after a leading $var.
+  cmd_word_part *first = parts->data;
+  GList *rest_str_parts = NULL;
+  bool self_append = false;
+
+  if (first->type == CMD_WORD_PART_TYPE_VAR) {
+    self_append = first->value.var->slot == var->slot;
+  } else if (first->type == CMD_WORD_PART_TYPE_STR &&
+             first->value.str->quoted && first->value.str->parts != NULL) {
+    cmd_word_part_str_part *str_part = first->value.str->parts->data;
+
+    self_append = str_part->type == CMD_WORD_PART_STR_PART_TYPE_VAR &&
+                  str_part->value.var->slot == var->slot;
+    rest_str_parts = first->value.str->parts->next;
+  }
+
+  if (!self_append || cmd_str_parts_use_slot(rest_str_parts, var->slot) ||
+      cmd_word_parts_use_slot(parts->next, var->slot)) {
+    return cmd_executor_word_to_value(executor, var->value);
+  }
+
+  var_value *res = var_store_take(executor->vars, var->slot);
+  res = cmd_executor_append_str_parts(executor, rest_str_parts, true, res);
+  res = cmd_executor_append_word_parts(executor, parts->next, res);
+
+  return res;
+}
+
+// cmd_executor_reset_child_signals undoes, in a child about to exec, what the
+// shell did to SIGPIPE for itself: it's ignored by the server and blocked on
+// pipeline threads, and either would be inherited by the exec'd cmd (so e.g.
+// "yes | head -1" would report a broken pipe rather than quietly die).
+static void cmd_executor_reset_child_signals(void) {
+  signal(SIGPIPE, SIG_DFL);
+
+  sigset_t set;
+  sigemptyset(&set);
+  sigaddset(&set, SIGPIPE);
+  pthread_sigmask(SIG_UNBLOCK, &set, NULL);
+}
+
+// cmd_executor_execve execs term with the given environment, searching PATH
+// (as execvp would) when term doesn't contain a '/'.
+//
+// If the PATH index has already found term's file, that's tried first; PATH
+// is still searched if it's gone since.
+//
+// Only returns if every exec failed.
+static void cmd_executor_execve(char *term, char *resolved, char **argv,
+                                char **envp, const char *path) {
+  char file[PATH_MAX];
+  char **sh_argv;
+
+  if (resolved != NULL) {
+    execve(resolved, argv, envp);
+  }
+
+  if (resolved != NULL && errno == ENOEXEC) {
+    term = resolved;
+  } else if (strchr(term, '/') != NULL) {
+    execve(term, argv, envp);
+  } else {
+    bool denied = false;
+    for (const char *dir = path;; dir++) {
+      const char *end = strchr(dir, ':');
+      int dir_len = end != NULL ? (int)(end - dir) : (int)strlen(dir);
+
+      snprintf(file, sizeof(file), "%.*s/%s", dir_len > 0 ? dir_len : 1,
+               dir_len > 0 ? dir : ".", term);
+      execve(file, argv, envp);
+
+      if (errno == EACCES) {
+        denied = true;
+      } else if (errno == ENOEXEC) {
+        term = file;
+        break;
+      }
+
+      if (end == NULL) {
+        if (denied) {
+          errno = EACCES;
+        }
+
+        return;
+      }
+
+      dir = end;
+    }
+  }
+
+  if (errno != ENOEXEC) {
+    return;
+  }
+
+  // Like execvp, hand files without a recognized format to the system shell.
+  int argc = 0;
+  while (argv[argc] != NULL) {
+    argc++;
+  }
+
+  sh_argv = malloc((size_t)(argc + 2) * sizeof(char *));
+  sh_argv[0] = "sh";
+  sh_argv[1] = term;
+  memcpy(sh_argv + 2, argv + 1, (size_t)argc * sizeof(char *));
+
+  execve("/bin/sh", sh_argv, envp);
+}
+
+// cmd_child is a child we've started (and have yet to wait for).
+typedef struct cmd_child {
+  pid_t pid;
+  const char *term;
+
+  // When the child was started (see child_wait_now).
+  double started;
+
+  cmd_timeout timeout;
+
+  // The group watching the child (or NULL to wait for it directly).
+  child_wait_group *group;
+} cmd_child;
+
+// cmd_executor_spawn_term forks a child to run term (as a builtin if there is
+// one, otherwise as an external cmd) with the executor's fds, and fills in
+// child without waiting for it.
+//
+// A child with a timeout is put in its own process group so the timeout can
+// signal anything it starts too.
+//
+// close_fd (if it's >= 0) is closed in the child: it's the read end of a pipe
+// the child is writing to, which a builtin child would otherwise keep open.
+static void cmd_executor_spawn_term(cmd_executor *executor,
+                                    GHashTable *env_vars, char *term,
+                                    char **argv, int close_fd,
+                                    cmd_child *child) {
+  // Build the entries for the cmd's own vars (e.g. "foo=bar cmd") up front so
+  // the child only has to patch them into its copy of the cached envp.
+  guint overlay_len = env_vars != NULL ? g_hash_table_size(env_vars) : 0;
+
+  g_mutex_lock(executor->spawn_lock);
+  char **envp = var_store_envp(executor->vars, overlay_len);
+  size_t envc = executor->vars->envc;
+
+  char **overlay = NULL;
+  int *overlay_indexes = NULL;
+  if (overlay_len > 0) {
+    overlay = malloc(overlay_len * sizeof(char *));
+    overlay_indexes = malloc(overlay_len * sizeof(int));
+
+    GHashTableIter iter;
+    gpointer slot, value;
+    guint i = 0;
+
+    g_hash_table_iter_init(&iter, env_vars);
+    while (g_hash_table_iter_next(&iter, &slot, &value)) {
+      overlay[i] = var_store_env_entry(GPOINTER_TO_INT(slot), value);
+      overlay_indexes[i] =
+          var_store_env_index(executor->vars, GPOINTER_TO_INT(slot));
+      i++;
+    }
+  }
+
+  var_value *path_value = var_store_get(executor->vars, executor->path_slot);
+  const char *path =
+      path_value != NULL ? var_value_str(path_value) : CMD_EXECUTOR_PATH;
+  cmd_builtin builtin = cmd_builtins_lookup(term);
+
+  // Find an external term's file up front, so the child only has to exec it
+  // once rather than trying each directory in PATH.
+  char *resolved = NULL;
+  if (builtin == NULL && strchr(term, '/') == NULL) {
+    resolved = path_index_lookup(cmd_executor_get_path_index(executor), path,
+                                 term);
+  }
+
+  bool own_group = executor->timeout.secs > 0;
+  double started = child_wait_now();
+
+  pid_t pid;
+  if ((pid = fork()) == 0) {
+    if (own_group) {
+      child_wait_setpgid(0);
+    }
+
+    if (close_fd >= 0) {
+      close(close_fd);
+    }
+
+    if (builtin != NULL) {
+      int status = builtin(executor, argv);
+      if (status != CMD_BUILTIN_PASS) {
+        _exit(status);
+      }
+    }
+
+    cmd_executor_route_child_fds(executor);
+
+    if (executor->cwd != NULL && chdir(executor->cwd) < 0) {
+      giveup("cmd_executor_exec_term: chdir to '%s' failed", executor->cwd);
+    }
+
+    for (guint i = 0; i < overlay_len; i++) {
+      if (overlay_indexes[i] >= 0) {
+        envp[overlay_indexes[i]] = overlay[i];
+      } else {
+        envp[envc++] = overlay[i];
+      }
+    }
+    envp[envc] = NULL;
+
+    cmd_executor_reset_child_signals();
+    cmd_executor_execve(term, resolved, argv, envp, path);
+    giveup("cmd_executor_exec_term: exec '%s' failed", term);
+    exit(1);
+  }
+
+  g_mutex_unlock(executor->spawn_lock);
+
+  if (pid < 0) {
+    giveup("cmd_executor_spawn_term: fork failed");
+  }
+
+  if (own_group) {
+    child_wait_setpgid(pid);
+  }
+
+  for (guint i = 0; i < overlay_len; i++) {
+    free(overlay[i]);
+  }
+  free(overlay);
+  free(overlay_indexes);
+  free(resolved);
+
+  *child = (cmd_child){.pid = pid,
+                       .term = term,
+                       .started = started,
+                       .timeout = executor->timeout,
+                       .group = NULL};
+}
+
+// cmd_executor_wait waits for the child and returns its exit status, which is
+// 124 if it had to be timed out (or 137 if that took SIGKILL), like timeout(1).
+static int cmd_executor_wait(cmd_executor *executor, cmd_child *child) {
+  bool timed_out;
+  int status =
+      child->group != NULL
+          ? child_wait_group_wait(child->group, child->pid, &timed_out)
+          : child_wait(child->pid, child->started, child->timeout.secs,
+                       child->timeout.kill_after, &timed_out);
+
+  double elapsed = child_wait_now() - child->started;
+
+  if (timed_out) {
+    if (child->timeout.report) {
+      dprintf(executor->stderr_fno, "turtle: %s: timed out after %.3fs\n",
+              child->term, elapsed);
+    }
+
+    if (status != 128 + SIGKILL) {
+      status = 124;
+    }
+  }
+
+  if (executor->stats != NULL) {
+    cmd_stats_add_cmd(executor->stats, child->term, elapsed, timed_out);
+  }
+
+  return status;
+}
+
+// cmd_ring_pump moves data between a ring and a pipe for a child that's
+// reading from or writing to a ring.
+typedef struct cmd_ring_pump {
+  ring_buffer *ring;
+  int fd;
+} cmd_ring_pump;
+
+// cmd_executor_block_sigpipe blocks SIGPIPE on the calling thread, so writes
+// to a pipe whose reader has gone fail with EPIPE instead of killing the
+// shell.
+static void cmd_executor_block_sigpipe(void) {
+  sigset_t set;
+  sigemptyset(&set);
+  sigaddset(&set, SIGPIPE);
+  pthread_sigmask(SIG_BLOCK, &set, NULL);
+}
+
+// cmd_executor_pump_from_ring copies the ring into the pipe until the ring's
+// writer is done (or the pipe's reader is), then closes the pipe.
+static gpointer cmd_executor_pump_from_ring(gpointer data) {
+  cmd_ring_pump *pump = data;
+  cmd_executor_block_sigpipe();
+
+  char *span;
+  size_t len;
+  while ((len = ring_buffer_read_peek(pump->ring, &span)) > 0) {
+    ssize_t n;
+    while ((n = write(pump->fd, span, len)) < 0 && errno == EINTR) {
+    }
+
+    if (n < 0) {
+      break;
+    }
+
+    ring_buffer_read_consume(pump->ring, (size_t)n);
+  }
+
+  ring_buffer_close_read(pump->ring);
+  close(pump->fd);
+
+  return NULL;
+}
+
+// cmd_executor_pump_to_ring copies the pipe into the ring until EOF.
+static gpointer cmd_executor_pump_to_ring(gpointer data) {
+  cmd_ring_pump *pump = data;
+
+  char *span;
+  size_t len;
+  while ((len = ring_buffer_write_reserve(pump->ring, &span)) > 0) {
+    ssize_t n;
+    while ((n = read(pump->fd, span, len)) < 0 && errno == EINTR) {
+    }
+
+    if (n <= 0) {
+      break;
+    }
+
+    ring_buffer_write_commit(pump->ring, (size_t)n);
+  }
+
+  ring_buffer_close_write(pump->ring);
+
+  return NULL;
+}
+
+// cmd_forked is a child started by cmd_executor_start_forked, along with the
+// threads (if any) bridging its stdin and stdout to rings.
+typedef struct cmd_forked {
+  cmd_child child;
+
+  cmd_ring_pump in_pump;
+  cmd_ring_pump out_pump;
+  GThread *in_thread;
+  GThread *out_thread;
+} cmd_forked;
+
+// cmd_executor_start_forked starts term in a child without waiting for it,
+// bridging any rings the executor's stdin/stdout are attached to through real
+// pipes (each of which the pump closes once its side is done).
+//
+// close_fd (if it's >= 0) is closed in the child (see cmd_executor_spawn_term).
+static void cmd_executor_start_forked(cmd_executor *executor,
+                                      GHashTable *env_vars, char *term,
+                                      char **argv, int close_fd,
+                                      cmd_forked *forked) {
+  forked->in_thread = NULL;
+  forked->out_thread = NULL;
+
+  if (executor->stdin_ring == NULL && executor->stdout_ring == NULL) {
+    cmd_executor_spawn_term(executor, env_vars, term, argv, close_fd,
+                            &forked->child);
+    return;
+  }
+
+  cmd_executor child_executor = *executor;
+  child_executor.stdin_ring = NULL;
+  child_executor.stdout_ring = NULL;
+
+  int pipe_fnos[2];
+
+  if (executor->stdin_ring != NULL) {
+    cmd_executor_pipe(executor, pipe_fnos);
+
+    forked->in_pump =
+        (cmd_ring_pump){.ring = executor->stdin_ring, .fd = pipe_fnos[1]};
+    forked->in_thread = g_thread_new("ring-in", cmd_executor_pump_from_ring,
+                                     &forked->in_pump);
+    child_executor.stdin_fno = pipe_fnos[0];
+  }
+
+  if (executor->stdout_ring != NULL) {
+    cmd_executor_pipe(executor, pipe_fnos);
+
+    forked->out_pump =
+        (cmd_ring_pump){.ring = executor->stdout_ring, .fd = pipe_fnos[0]};
+    forked->out_thread = g_thread_new("ring-out", cmd_executor_pump_to_ring,
+                                      &forked->out_pump);
+    child_executor.stdout_fno = pipe_fnos[1];
+  }
+
+  cmd_executor_spawn_term(&child_executor, env_vars, term, argv, close_fd,
+                          &forked->child);
+
+  // Drop our copies of the child's ends so the pumps see EOF/EPIPE once it's
+  // done with them.
+  if (forked->in_thread != NULL) {
+    close(child_executor.stdin_fno);
+  }
+
+  if (forked->out_thread != NULL) {
+    close(child_executor.stdout_fno);
+  }
+}
+
+// cmd_executor_join_pumps waits for a started child's pumps to finish.
+static void cmd_executor_join_pumps(cmd_forked *forked) {
+  if (forked->in_thread != NULL) {
+    g_thread_join(forked->in_thread);
+    forked->in_thread = NULL;
+  }
+
+  if (forked->out_thread != NULL) {
+    g_thread_join(forked->out_thread);
+    close(forked->out_pump.fd);
+    forked->out_thread = NULL;
+  }
+}
+
+// cmd_executor_exec_forked runs term in a child and waits for it (see
+// cmd_executor_start_forked).
+static int cmd_executor_exec_forked(cmd_executor *executor,
+                                    GHashTable *env_vars, char *term,
+                                    char **argv) {
+  cmd_forked forked;
+  cmd_executor_start_forked(executor, env_vars, term, argv, -1, &forked);
+
+  int status = cmd_executor_wait(executor, &forked.child);
+  cmd_executor_join_pumps(&forked);
+
+  return status;
+}
+
+static int cmd_executor_exec_compound(cmd_executor *executor, cmd_part *part);
+
+// cmd_executor_unwinding returns whether a "break", "continue" or "return" is
+// skipping the rest of the cmds around it.
+static bool cmd_executor_unwinding(cmd_executor *executor) {
+  return executor->breaking > 0 || executor->continuing > 0 ||
+         executor->returning;
+}
+
+// cmd_executor_call_func calls the function in-process with argv as its
+// positional params.
+static int cmd_executor_call_func(cmd_executor *executor, cmd_func *func,
+                                  GHashTable *env_vars, char **argv) {
+  // Hold on to the function in case it redefines itself.
+  cmd_func_ref(func);
+
+  GPtrArray *original_args = executor->args;
+  var_value *original_args_joined = executor->args_joined;
+  guint original_locals_base = executor->locals_base;
+  int original_loop_depth = executor->loop_depth;
+
+  executor->args =
+      g_ptr_array_new_with_free_func((GDestroyNotify)var_value_unref);
+  for (char **arg = argv + 1; *arg != NULL; arg++) {
+    g_ptr_array_add(executor->args, var_value_new(*arg, strlen(*arg)));
+  }
+
+  executor->args_joined = NULL;
+  executor->locals_base = executor->local_saves->len;
+  executor->loop_depth = 0;
+  executor->func_depth++;
+
+  // Vars given to the call (e.g. "foo=bar fn") are local to it.
+  if (env_vars != NULL) {
+    GHashTableIter iter;
+    gpointer slot, value;
+
+    g_hash_table_iter_init(&iter, env_vars);
+    while (g_hash_table_iter_next(&iter, &slot, &value)) {
+      cmd_executor_set_local(executor, GPOINTER_TO_INT(slot),
+                             var_value_ref(value));
+    }
+  }
+
+  int status = cmd_executor_exec_compound(executor, func->body);
+
+  cmd_executor_restore_locals(executor);
+
+  g_ptr_array_free(executor->args, true);
+  var_value_unref(executor->args_joined);
+
+  executor->args = original_args;
+  executor->args_joined = original_args_joined;
+  executor->locals_base = original_locals_base;
+  executor->loop_depth = original_loop_depth;
+  executor->func_depth--;
+  executor->returning = false;
+
+  cmd_func_unref(func);
+
+  return status;
+}
+
+// cmd_executor_exec_term executes term and waits for it to finish, running
+// builtins in-process.
+int cmd_executor_exec_term(cmd_executor *executor, GHashTable *env_vars,
+                           char *term, char **argv) {
+  if (strcmp(term, ".") == 0) {
+    argv++;
+
+    return cmd_executor_exec_term(executor, env_vars, argv[0], argv);
+  }
+
+  cmd_func *func = g_hash_table_lookup(executor->funcs, term);
+  if (func != NULL) {
+    return cmd_executor_call_func(executor, func, env_vars, argv);
+  }
+
+  cmd_builtin builtin = cmd_builtins_lookup(term);
+  if (builtin != NULL) {
+    GHashTable *original_env_vars = executor->term_env_vars;
+    executor->term_env_vars = env_vars;
+
+    int status = builtin(executor, argv);
+
+    executor->term_env_vars = original_env_vars;
+
+    if (status != CMD_BUILTIN_PASS) {
+      return status;
+    }
+  }
+
+  return cmd_executor_exec_forked(executor, env_vars, term, argv);
+}
+
+// cmd_executor_exec_timed runs argv in a child (even if it's a builtin) with
+// the given timeout instead of the executor's, and waits for it.
+int cmd_executor_exec_timed(cmd_executor *executor, char **argv,
+                            cmd_timeout *timeout) {
+  cmd_timeout original_timeout = executor->timeout;
+  executor->timeout = *timeout;
+
+  int status = cmd_executor_exec_forked(executor, executor->term_env_vars,
+                                        argv[0], argv);
+
+  executor->timeout = original_timeout;
+
+  return status;
+}
+
+// cmd_pipe_stage is a pipeline stage that's been started without waiting for
+// it, either as a child or (for threadable builtins) on a thread with its own
+// copy of the executor.
+typedef struct cmd_pipe_stage {
+  cmd_forked forked;
+  GThread *thread;
+
+  cmd_executor executor;
+  GHashTable *env_vars;
+  char *term;
+  char **argv;
+  int status;
+
+  // The write end of the pipe to the next stage (or -1 for a ring), which a
+  // thread closes once it's done. A redirect can point the stage's stdout
+  // somewhere else, so this isn't necessarily its stdout.
+  int pipe_fd;
+
+  // Whether a builtin wrote the stage's output (so we know how much it was).
+  bool metered;
+} cmd_pipe_stage;
+
+// cmd_executor_run_stage runs a stage's builtin on its thread, then closes its
+// end of the ring or pipe it writes to (and the ring it reads from) so its
+// neighbours see it's done.
+//
+// The builtin only ever touches its argv and fds (and rings): anything that
+// needs the shell's vars (e.g. starting a child when the builtin passes) was
+// decided on the shell's thread, which keeps expanding the next stages.
+static gpointer cmd_executor_run_stage(gpointer data) {
+  cmd_pipe_stage *stage = data;
+  cmd_executor *executor = &stage->executor;
+
+  cmd_executor_block_sigpipe();
+
+  cmd_builtin builtin = cmd_builtins_lookup_threadable(stage->term);
+  stage->status = builtin(executor, stage->argv);
+  stage->metered = true;
+
+  if (executor->stdout_ring != NULL) {
+    ring_buffer_close_write(executor->stdout_ring);
+  } else if (stage->pipe_fd >= 0) {
+    close(stage->pipe_fd);
+  }
+
+  if (executor->stdin_ring != NULL) {
+    ring_buffer_close_read(executor->stdin_ring);
+  }
+
+  return NULL;
+}
+
+// cmd_executor_watch_stage has the pipeline's wait group watch a timed stage's
+// child, so its deadline is enforced even while we're busy with the rest of
+// the pipeline.
+static void cmd_executor_watch_stage(cmd_executor *executor,
+                                     cmd_pipe_stage *stage) {
+  cmd_child *child = &stage->forked.child;
+  if (executor->wait_group == NULL || child->pid <= 0 ||
+      child->timeout.secs <= 0) {
+    return;
+  }
+
+  child_wait_group_add(executor->wait_group, child->pid, child->started,
+                       child->timeout.secs, child->timeout.kill_after);
+  child->group = executor->wait_group;
+}
+
+// cmd_executor_isolate_child_fds routes the executor's fds into place in a
+// freshly forked child that keeps running shell code, and closes every other
+// fd it inherited.
+//
+// Without exec, O_CLOEXEC doesn't drop the child's copies of the shell's own
+// fds (e.g. the write end of a pipe feeding a stage on another thread), which
+// would keep the child from ever seeing EOF on its stdin.
+static void cmd_executor_isolate_child_fds(cmd_executor *executor) {
+  cmd_executor_route_child_fds(executor);
+
+  executor->stdin_fno = STDIN_FILENO;
+  executor->stdout_fno = STDOUT_FILENO;
+  executor->stderr_fno = STDERR_FILENO;
+
+  // The readers are keyed by the fds we've just moved.
+  if (executor->readers != NULL) {
+    g_hash_table_remove_all(executor->readers);
+  }
+
+  // The coprocs are the shell's to tear down, not ours.
+  if (executor->coprocs != NULL) {
+    g_array_set_size(executor->coprocs, 0);
+  }
+
+  // Every route now points at itself, so all we need are the fds to keep.
+  guint len = executor->fd_routes->len;
+  int keep[len + 1];
+  for (guint i = 0; i < len; i++) {
+    keep[i] = g_array_index(executor->fd_routes, cmd_fd_route, i).fd;
+  }
+  g_array_set_size(executor->fd_routes, 0);
+
+  qsort(keep, len, sizeof(int), cmd_int_cmp);
+
+  int from = STDERR_FILENO + 1;
+  for (guint i = 0; i < len; i++) {
+    if (keep[i] >= from) {
+      cmd_executor_close_fds(from, keep[i] - 1);
+      from = keep[i] + 1;
+    }
+  }
+  cmd_executor_close_fds(from, INT_MAX);
+}
+
+// cmd_executor_fork_stage forks a child to run shell code (e.g. a compound cmd
+// or a function) as a pipeline stage, returning 0 in the child and filling in
+// stage in the parent.
+static pid_t cmd_executor_fork_stage(cmd_executor *executor, const char *name,
+                                     int close_fd, cmd_pipe_stage *stage) {
+  stage->thread = NULL;
+  stage->status = 0;
+  stage->metered = false;
+
+  bool own_group = executor->timeout.secs > 0;
+  double started = child_wait_now();
+
+  g_mutex_lock(executor->spawn_lock);
+
+  pid_t pid;
+  if ((pid = fork()) == 0) {
+    // Only this thread made it into the child, so nothing else can be holding
+    // the lock.
+    g_mutex_init(executor->spawn_lock);
+
+    if (own_group) {
+      child_wait_setpgid(0);
+    }
+
+    if (close_fd >= 0) {
+      close(close_fd);
+    }
+
+    // The child's own children are timed from here, as one cmd (and the wait
+    // group's watcher didn't make it into the child).
+    executor->timeout.secs = 0;
+    executor->wait_group = NULL;
+
+    // The child can simply move to the cwd, rather than keep resolving paths
+    // against an fd for it.
+    if (executor->cwd != NULL && chdir(executor->cwd) < 0) {
+      giveup("cmd_executor_fork_stage: chdir to '%s' failed", executor->cwd);
+    }
+    executor->cwd_fd = -1;
+
+    cmd_executor_isolate_child_fds(executor);
+
+    return 0;
+  }
+
+  g_mutex_unlock(executor->spawn_lock);
+
+  if (pid < 0) {
+    giveup("cmd_executor_fork_stage: fork failed");
+  }
+
+  if (own_group) {
+    child_wait_setpgid(pid);
+  }
+
+  stage->forked.in_thread = NULL;
+  stage->forked.out_thread = NULL;
+  stage->forked.child = (cmd_child){.pid = pid,
+                                    .term = name,
+                                    .started = started,
+                                    .timeout = executor->timeout,
+                                    .group = NULL};
+  cmd_executor_watch_stage(executor, stage);
+
+  return pid;
+}
+
+// cmd_executor_start_stage starts term as a pipeline stage writing to the
+// executor's stdout (or stdout ring).
+//
+// A threadable builtin runs on a thread, which owns the pipe's write end;
+// anything else (including a builtin that would pass its args on to the
+// external cmd) runs in a child, in which close_fd (the pipe's read end) is
+// closed.
+static void cmd_executor_start_stage(cmd_executor *executor,
+                                     GHashTable *env_vars, char *term,
+                                     char **argv, int close_fd,
+                                     cmd_pipe_stage *stage) {
+  while (term != NULL && strcmp(term, ".") == 0) {
+    term = *++argv;
+  }
+
+  stage->forked.child.pid = -1;
+  stage->forked.in_thread = NULL;
+  stage->forked.out_thread = NULL;
+  stage->thread = NULL;
+  stage->status = 0;
+  stage->metered = false;
+
+  if (term == NULL) {
+    return;
+  }
+
+  // Functions run in a child, since they can do anything the shell can.
+  cmd_func *func = g_hash_table_lookup(executor->funcs, term);
+  if (func != NULL) {
+    if (cmd_executor_fork_stage(executor, term, close_fd, stage) == 0) {
+      _exit(cmd_executor_call_func(executor, func, env_vars, argv));
+    }
+
+    return;
+  }
+
+  if (cmd_builtins_lookup_threadable(term) == NULL ||
+      cmd_builtins_passes(term, argv)) {
+    cmd_executor_start_forked(executor, env_vars, term, argv, close_fd,
+                              &stage->forked);
+    cmd_executor_watch_stage(executor, stage);
+
+    return;
+  }
+
+  // Give the thread its own copy of the fd routes, since ours are restored
+  // once the stage has started.
+  stage->executor = *executor;
+  stage->executor.fd_routes =
+      g_array_sized_new(false, false, sizeof(cmd_fd_route),
+                        executor->fd_routes->len);
+  g_array_append_vals(stage->executor.fd_routes, executor->fd_routes->data,
+                      executor->fd_routes->len);
+
+  stage->executor.stdout_bytes = 0;
+  stage->env_vars = env_vars;
+  stage->term = term;
+  stage->argv = argv;
+
+  // The thread's copy of the executor shares our vars, so finish importing the
+  // env now rather than leave the first read (on whichever thread) to do it.
+  var_store_import_pending(executor->vars);
+  stage->thread = g_thread_new("stage", cmd_executor_run_stage, stage);
+}
+
+// cmd_executor_finish_stage waits for a started stage and returns its status.
+static int cmd_executor_finish_stage(cmd_executor *executor,
+                                     cmd_pipe_stage *stage) {
+  if (stage->thread != NULL) {
+    g_thread_join(stage->thread);
+    g_array_free(stage->executor.fd_routes, true);
 
-static void cmd_executor_error(cmd_executor *executor, int status) {
-  longjmp(executor->err_jmp, status);
-}
+    return stage->status;
+  }
 
-cmd_executor *cmd_executor_new() {
-  cmd_executor *executor = malloc(sizeof(cmd_executor));
-  executor->vars = g_hash_table_new(g_str_hash, g_str_equal);
-  executor->stdin_fno = STDIN_FILENO;
-  executor->stdout_fno = STDOUT_FILENO;
+  if (stage->forked.child.pid > 0) {
+    stage->status = cmd_executor_wait(executor, &stage->forked.child);
+  }
 
-  return executor;
+  cmd_executor_join_pumps(&stage->forked);
+
+  return stage->status;
+}
+
+// cmd_executor_threadable returns whether term is a threadable builtin (and
+// not a function that's replaced it).
+static bool cmd_executor_threadable(cmd_executor *executor, const char *term) {
+  return cmd_builtins_lookup_threadable(term) != NULL &&
+         !g_hash_table_contains(executor->funcs, term);
 }
 
-static char *cmd_executor_get_var(cmd_executor *executor,
-                                  cmd_word_part_var *var) {
-  // Check if we have a var def for the command.
-  char *var_val = g_hash_table_lookup(executor->vars, var->name->str);
-  if (var_val != NULL) {
-    return var_val;
+// cmd_threadable_stage returns whether the first stage of c is a threadable
+// builtin with nothing (e.g. redirections or vars) that needs its fds.
+static bool cmd_threadable_stage(cmd_executor *executor, cmd *c) {
+  const char *name = cmd_literal_term(c);
+  if (name == NULL || !cmd_executor_threadable(executor, name)) {
+    return false;
   }
 
-  // Fallback to the environment.
-  return getenv(var->name->str);
-}
+  GList *node = c->parts;
+  for (node = node->next; node != NULL; node = node->next) {
+    switch (((cmd_part *)node->data)->type) {
+    case CMD_PART_TYPE_WORD:
+      continue;
 
-static void set_var(cmd_executor *executor, cmd *c, cmd_var_assign *var,
-                    GHashTable *vars) {
-  char *value = cmd_executor_word_to_str(executor, c, var->value);
+    case CMD_PART_TYPE_PIPE:
+    case CMD_PART_TYPE_AND:
+    case CMD_PART_TYPE_OR:
+      return true;
 
-  // Copy the name and value so they don't reference memory owned by the
-  // cmd (which will be freed later).
-  char *name_cpy = malloc((strlen(var->name) + 1) * sizeof(char));
-  char *value_cpy = malloc((strlen(value) + 1) * sizeof(char));
-  strcpy(name_cpy, var->name);
-  strcpy(value_cpy, value);
+    default:
+      return false;
+    }
+  }
 
-  g_hash_table_insert(vars, name_cpy, value_cpy);
+  return true;
 }
 
-static char *cmd_executor_word_to_str(cmd_executor *executor, cmd *c,
-                                      cmd_word *word) {
-  GString *res = g_string_new(NULL);
+// cmd_executor_exec_list executes each cmd in turn (stopping early for a
+// "break", "continue" or "return") and returns the last one's status.
+static int cmd_executor_exec_list(cmd_executor *executor, GList *cmds) {
+  int status = 0;
 
-  for (GList *node = word->parts; node != NULL; node = node->next) {
-    cmd_word_part *part = (cmd_word_part *)node->data;
+  for (GList *node = cmds; node != NULL; node = node->next) {
+    status = cmd_executor_exec(executor, node->data);
 
-    switch (part->type) {
-    case CMD_WORD_PART_TYPE_LIT: {
-      res = g_string_append(res, part->value.literal->str);
+    if (cmd_executor_unwinding(executor)) {
       break;
     }
+  }
+
+  return status;
+}
+
+// cmd_executor_loop_done handles any "break" or "continue" after a loop's body
+// has run, returning whether the loop should stop.
+//
+// "break n" and "continue n" count down as they pass each enclosing loop; the
+// loop that takes the count to 0 is the one that breaks or continues.
+static bool cmd_executor_loop_done(cmd_executor *executor) {
+  if (executor->returning) {
+    return true;
+  }
+
+  if (executor->breaking > 0) {
+    executor->breaking--;
+    return true;
+  }
 
-    case CMD_WORD_PART_TYPE_STR: {
-      cmd_word_part_str *str = part->value.str;
-      if (str->quoted) {
-        for (GList *str_node = str->parts; str_node != NULL;
-             str_node = str_node->next) {
-          cmd_word_part_str_part *str_part = str_node->data;
+  if (executor->continuing > 0) {
+    executor->continuing--;
+    return executor->continuing > 0;
+  }
 
-          switch (str_part->type) {
-          case CMD_WORD_PART_STR_PART_TYPE_LITERAL: {
-            res = g_string_append(res, str_part->value.literal->str);
-            break;
-          }
+  return false;
+}
 
-          case CMD_WORD_PART_STR_PART_TYPE_VAR: {
-            char *val = cmd_executor_get_var(executor, str_part->value.var);
-            if (val != NULL) {
-              res = g_string_append(res, val);
-            }
+static int cmd_executor_exec_if(cmd_executor *executor, cmd_if *if_cmd) {
+  for (GList *node = if_cmd->clauses; node != NULL; node = node->next) {
+    cmd_if_clause *clause = node->data;
 
-            break;
-          }
+    if (clause->cond != NULL) {
+      int status = cmd_executor_exec_list(executor, clause->cond);
 
-          default:
-            giveup("str part type not implemented");
-          }
-        }
-      } else {
-        for (GList *str_node = str->parts; str_node != NULL;
-             str_node = str_node->next) {
-          cmd_word_part_str_part *str_part = str_node->data;
-
-          switch (str_part->type) {
-          case CMD_WORD_PART_STR_PART_TYPE_LITERAL: {
-            res = g_string_append(res, str_part->value.literal->str);
-            break;
-          }
-
-          case CMD_WORD_PART_STR_PART_TYPE_VAR:
-            giveup("cmd_executor_word_to_str: unexpected var");
-
-          default:
-            giveup("str part type not implemented");
-          }
-        }
+      if (cmd_executor_unwinding(executor)) {
+        return status;
       }
 
-      break;
+      if (status != 0) {
+        continue;
+      }
     }
 
-    case CMD_WORD_PART_TYPE_VAR: {
-      char *val = cmd_executor_get_var(executor, part->value.var);
-      if (val != NULL) {
-        res = g_string_append(res, val);
-      }
+    return cmd_executor_exec_list(executor, clause->body);
+  }
+
+  return 0;
+}
+
+static int cmd_executor_exec_loop(cmd_executor *executor, cmd_loop *loop) {
+  int status = 0;
 
+  executor->loop_depth++;
+
+  for (;;) {
+    int cond_status = cmd_executor_exec_list(executor, loop->cond);
+    if (cmd_executor_loop_done(executor) ||
+        (cond_status == 0) == loop->until) {
       break;
     }
 
-    case CMD_WORD_PART_TYPE_CMD_SUB: {
-      // Keep track of the original fnos.
-      int original_fnos[2] = {executor->stdin_fno, executor->stdout_fno};
+    status = cmd_executor_exec_list(executor, loop->body);
+    if (cmd_executor_loop_done(executor)) {
+      break;
+    }
+  }
 
-      // Create a pipe.
-      int pipe_fnos[2];
-      if (pipe(pipe_fnos) < 0) {
-        giveup("cmd_executor_exec: pipe failed");
-      }
+  executor->loop_depth--;
 
-      int status;
+  return status;
+}
 
-      // Write to the write end of the pipe.
-      executor->stdout_fno = pipe_fnos[1];
-      status = cmd_executor_exec(executor, part->value.cmd_sub);
+static int cmd_executor_exec_for(cmd_executor *executor, cmd_for *for_cmd) {
+  // Expand the words up front, since the body may change what they refer to.
+  GPtrArray *values =
+      g_ptr_array_new_with_free_func((GDestroyNotify)var_value_unref);
+  for (GList *node = for_cmd->words; node != NULL; node = node->next) {
+    cmd_word *word = node->data;
 
-      // Restore the executor's stdout and close the write end of the pipe.
-      executor->stdout_fno = original_fnos[1];
-      close(pipe_fnos[1]);
+    if (!word->glob && !word->split) {
+      g_ptr_array_add(values, cmd_executor_word_to_value(executor, word));
+      continue;
+    }
 
-      if (status != 0) {
-        cmd_executor_error(executor, status);
-      }
+    GPtrArray *fields = g_ptr_array_new();
+    GList *field_values = NULL;
+    cmd_executor_expand_fields(executor, word, fields, &field_values);
+
+    for (guint i = 0; i < fields->len; i++) {
+      char *field = g_ptr_array_index(fields, i);
+      g_ptr_array_add(values, var_value_new(field, strlen(field)));
+    }
 
-      // Read from the read end of the pipe.
-      GString *arg = g_string_new(NULL);
-      {
-        char buf[BUFSIZ];
+    g_ptr_array_free(fields, true);
+    g_list_free_full(field_values, (GDestroyNotify)var_value_unref);
+  }
 
-        ssize_t n;
-        while ((n = read(pipe_fnos[0], buf, BUFSIZ)) != 0) {
-          // Remove trailing newline.
-          if (n < BUFSIZ) {
-            buf[n - 1] = 0;
-          }
+  // Without "in", loop over the positional params.
+  if (!for_cmd->has_words) {
+    for (guint i = 0; i < executor->args->len; i++) {
+      g_ptr_array_add(values,
+                      var_value_ref(g_ptr_array_index(executor->args, i)));
+    }
+  }
 
-          arg = g_string_append(arg, buf);
-        }
-      }
+  int status = 0;
 
-      // Close the read end of the pipe.
-      close(pipe_fnos[0]);
+  executor->loop_depth++;
 
-      res = g_string_append(res, arg->str);
+  for (guint i = 0; i < values->len; i++) {
+    var_store_set(executor->vars, for_cmd->slot,
+                  var_value_ref(g_ptr_array_index(values, i)));
 
+    status = cmd_executor_exec_list(executor, for_cmd->body);
+    if (cmd_executor_loop_done(executor)) {
       break;
     }
+  }
 
-    case CMD_WORD_PART_TYPE_PROC_SUB: {
-      char file_name[] = "/tmp/turtle-proc-XXXXXX";
-      int fd;
-      if ((fd = mkstemp(file_name)) < 0) {
-        giveup("cmd_executor_exec: proc sub file creation failed");
-      }
+  executor->loop_depth--;
 
-      // Give permission rwx permissions to everyone.
-      if (chmod(file_name, 0777) < 0) {
-        giveup("cmd_executor_exec: proc sub file chmod failed");
+  g_ptr_array_free(values, true);
+
+  return status;
+}
+
+static int cmd_executor_exec_case(cmd_executor *executor, cmd_case *case_cmd) {
+  var_value *word = cmd_executor_word_to_value(executor, case_cmd->word);
+  const char *str = var_value_str(word);
+
+  cmd_case_item *match = NULL;
+  for (GList *node = case_cmd->items; node != NULL && match == NULL;
+       node = node->next) {
+    cmd_case_item *item = node->data;
+
+    for (GList *pattern_node = item->patterns; pattern_node != NULL;
+         pattern_node = pattern_node->next) {
+      var_value *pattern_value =
+          cmd_executor_word_to_pattern(executor, pattern_node->data);
+      pattern *pat = pattern_compile(var_value_str(pattern_value),
+                                     pattern_value->len);
+      bool matched = pattern_match(pat, str, word->len);
+      pattern_free(pat);
+      var_value_unref(pattern_value);
+
+      if (matched) {
+        match = item;
+        break;
       }
+    }
+  }
 
-      int original_out_fd = executor->stdout_fno;
+  var_value_unref(word);
 
-      // Redirect executor output to the write end of the pipe.
-      executor->stdout_fno = fd;
+  return match != NULL ? cmd_executor_exec_list(executor, match->body) : 0;
+}
 
-      // Execute the command.
-      int status;
-      if ((status = cmd_executor_exec(executor, part->value.proc_sub)) != 0) {
-        close(fd);
+// cmd_executor_exec_compound executes a compound cmd in-process.
+static int cmd_executor_exec_compound(cmd_executor *executor, cmd_part *part) {
+  switch (part->type) {
+  case CMD_PART_TYPE_IF:
+    return cmd_executor_exec_if(executor, part->value.if_cmd);
 
-        executor->stdout_fno = original_out_fd;
+  case CMD_PART_TYPE_LOOP:
+    return cmd_executor_exec_loop(executor, part->value.loop);
 
-        cmd_executor_error(executor, status);
-      }
+  case CMD_PART_TYPE_FOR:
+    return cmd_executor_exec_for(executor, part->value.for_cmd);
 
-      // Close the file.
-      close(fd);
+  case CMD_PART_TYPE_CASE:
+    return cmd_executor_exec_case(executor, part->value.case_cmd);
 
-      // Reopen the file with the correct flags.
-      if ((fd = open(file_name, O_RDONLY)) < 0) {
-        giveup("cmd_executor_exec: proc_sub reopen failed");
-      }
+  case CMD_PART_TYPE_GROUP:
+    return cmd_executor_exec_list(executor, part->value.group);
 
-      // Restore the original stdout fd.
-      executor->stdout_fno = original_out_fd;
+  case CMD_PART_TYPE_ARITH: {
+    // Like bash, an error only fails the "(( ))" itself.
+    int64_t res;
+    return cmd_executor_try_arith(executor, part->value.arith, &res) && res != 0
+               ? 0
+               : 1;
+  }
 
-      // Append "/dev/fd/{pipe_read_end_fd}"
-      g_string_append_printf(res, "%s", file_name);
+  default:
+    giveup("cmd_executor_exec_compound: not a compound cmd");
+    return 1;
+  }
+}
 
-      break;
+// cmd_compound_name returns the keyword a compound cmd starts with.
+static const char *cmd_compound_name(cmd_part *part) {
+  switch (part->type) {
+  case CMD_PART_TYPE_IF:
+    return "if";
+
+  case CMD_PART_TYPE_LOOP:
+    return part->value.loop->until ? "until" : "while";
+
+  case CMD_PART_TYPE_FOR:
+    return "for";
+
+  case CMD_PART_TYPE_GROUP:
+    return "{";
+
+  case CMD_PART_TYPE_ARITH:
+    return "((";
+
+  default:
+    return "case";
+  }
+}
+
+// cmd_executor_start_compound_stage starts a compound cmd as a pipeline stage
+// in a child, since it may run anything (including builtins that would
+// otherwise change the shell) alongside the rest of the pipeline.
+static void cmd_executor_start_compound_stage(cmd_executor *executor,
+                                              cmd_part *part, int close_fd,
+                                              cmd_pipe_stage *stage) {
+  if (cmd_executor_fork_stage(executor, cmd_compound_name(part), close_fd,
+                              stage) == 0) {
+    _exit(cmd_executor_exec_compound(executor, part));
+  }
+}
+
+// cmd_executor_coproc_fd moves fd up to where the shell keeps its ends of
+// coprocs' pipes.
+static int cmd_executor_coproc_fd(int fd) {
+  int moved = fcntl(fd, F_DUPFD_CLOEXEC, CMD_EXECUTOR_COPROC_MIN_FD);
+  if (moved < 0) {
+    giveup("cmd_executor_coproc_fd: fcntl failed");
+  }
+
+  close(fd);
+
+  return moved;
+}
+
+// cmd_executor_set_coproc_var sets the var named name and suffix to value.
+static void cmd_executor_set_coproc_var(cmd_executor *executor,
+                                        const char *name, const char *suffix,
+                                        long value) {
+  char *var_name = g_strconcat(name, suffix, NULL);
+  char *str = g_strdup_printf("%ld", value);
+
+  var_store_set(executor->vars, var_store_intern(var_name, strlen(var_name)),
+                var_value_new(str, strlen(str)));
+
+  free(str);
+  free(var_name);
+}
+
+// cmd_executor_start_coproc starts a coproc in a child with its stdin and
+// stdout connected to pipes the shell holds on to until it exits.
+//
+// Since there are no arrays, the fds go in NAME_0 (to read its stdout from)
+// and NAME_1 (to write its stdin to), for bash's ${NAME[0]} and ${NAME[1]},
+// along with NAME_PID.
+static int cmd_executor_start_coproc(cmd_executor *executor,
+                                     cmd_coproc *coproc) {
+  int in_fnos[2];
+  int out_fnos[2];
+  cmd_executor_pipe(executor, in_fnos);
+  cmd_executor_pipe(executor, out_fnos);
+
+  int original_fnos[2] = {executor->stdin_fno, executor->stdout_fno};
+  executor->stdin_fno = in_fnos[0];
+  executor->stdout_fno = out_fnos[1];
+
+  // The coproc outlives the cmd that started it, so it's never timed out.
+  double timeout_secs = executor->timeout.secs;
+  executor->timeout.secs = 0;
+
+  // It gets its own process group so tearing it down reaches whatever it's
+  // started too.
+  cmd_pipe_stage stage;
+  pid_t pid = cmd_executor_fork_stage(executor, "coproc", -1, &stage);
+  if (pid == 0) {
+    child_wait_setpgid(0);
+    _exit(cmd_executor_exec(executor, coproc->body));
+  }
+
+  child_wait_setpgid(pid);
+
+  executor->timeout.secs = timeout_secs;
+  executor->stdin_fno = original_fnos[0];
+  executor->stdout_fno = original_fnos[1];
+
+  close(in_fnos[0]);
+  close(out_fnos[1]);
+
+  cmd_coproc_proc proc = {.pid = pid,
+                          .read_fd = cmd_executor_coproc_fd(out_fnos[0]),
+                          .write_fd = cmd_executor_coproc_fd(in_fnos[1])};
+
+  if (executor->coprocs == NULL) {
+    executor->coprocs = g_array_new(false, false, sizeof(cmd_coproc_proc));
+  }
+  g_array_append_val(executor->coprocs, proc);
+
+  cmd_executor_set_coproc_var(executor, coproc->name, "_PID", (long)pid);
+  cmd_executor_set_coproc_var(executor, coproc->name, "_0", proc.read_fd);
+  cmd_executor_set_coproc_var(executor, coproc->name, "_1", proc.write_fd);
+
+  return 0;
+}
+
+// cmd_executor_close_coprocs closes the shell's ends of its coprocs' pipes and
+// waits for them to exit, sending any still running after a grace period
+// SIGTERM (then SIGKILL).
+//
+// Every pipe is closed before any coproc is waited for, so one that's reading
+// another's output sees EOF too.
+void cmd_executor_close_coprocs(cmd_executor *executor) {
+  if (executor->coprocs == NULL) {
+    return;
+  }
+
+  for (guint i = 0; i < executor->coprocs->len; i++) {
+    cmd_coproc_proc *proc =
+        &g_array_index(executor->coprocs, cmd_coproc_proc, i);
+    close(proc->write_fd);
+    cmd_executor_close(executor, proc->read_fd);
+  }
+
+  double started = child_wait_now();
+  for (guint i = 0; i < executor->coprocs->len; i++) {
+    bool timed_out;
+    child_wait(g_array_index(executor->coprocs, cmd_coproc_proc, i).pid,
+               started, CMD_EXECUTOR_COPROC_GRACE, CMD_EXECUTOR_KILL_AFTER,
+               &timed_out);
+  }
+
+  g_array_set_size(executor->coprocs, 0);
+}
+
+// cmd_exec_frame holds what a single cmd_executor_exec allocates for the cmd
+// it's running, so the cmd tree itself is never written to (and can be shared,
+// e.g. by cached scripts).
+typedef struct cmd_exec_frame {
+  // var_value* refs for the expanded words.
+  GList *values;
+
+  // GList<char*> of the cmd's args (which point into values).
+  GList *args;
+
+  // GHashTable<slot, var_value*> of vars set just for the cmd (or NULL).
+  GHashTable *env_vars;
+
+  // cmd_exec_redirect[] for the cmd, in order (or NULL).
+  GArray *redirects;
+
+  // The compound cmd (e.g. an "if") the cmd runs instead of a term (or NULL).
+  cmd_part *compound;
+} cmd_exec_frame;
+
+// cmd_exec_redirect is an evaluated redirection.
+typedef struct cmd_exec_redirect {
+  int fd;
+
+  // The fd to route to fd (or -1 to close it)...
+  int src;
+
+  // ...unless this is >= 0, in which case it's whatever fd dup_of is routed to
+  // when the redirection is applied.
+  int dup_of;
+
+  // Whether src was opened for this cmd (and needs to be closed after).
+  bool opened;
+
+  // What fd was routed to before the redirection was applied.
+  int saved;
+} cmd_exec_redirect;
+
+// cmd_executor_write_all writes all of buf to fd, returning false if it
+// couldn't.
+static bool cmd_executor_write_all(int fd, const char *buf, size_t len) {
+  for (size_t written = 0; written < len;) {
+    ssize_t n = write(fd, buf + written, len - written);
+    if (n < 0 && errno == EINTR) {
+      continue;
     }
 
-    default:
-      giveup("cmd_executor_exec: unimplemented cmd_word_part_type");
+    if (n < 0) {
+      return false;
     }
+
+    written += (size_t)n;
   }
 
-  return res->str;
+  return true;
 }
 
-int cmd_executor_exec_term(cmd_executor *executor, char *term, char **argv) {
-  if (strcmp(term, ".") == 0) {
-    argv++;
+// cmd_heredoc_writer is a here-doc body too big for a pipe's buffer, being fed
+// into one by its own thread.
+typedef struct cmd_heredoc_writer {
+  int fd;
+  char *buf;
+  size_t len;
+} cmd_heredoc_writer;
+
+static gpointer cmd_executor_heredoc_write(gpointer data) {
+  cmd_heredoc_writer *writer = data;
+  cmd_executor_block_sigpipe();
+
+  cmd_executor_write_all(writer->fd, writer->buf, writer->len);
+
+  close(writer->fd);
+  free(writer->buf);
+  free(writer);
+
+  return NULL;
+}
 
-    return cmd_executor_exec_term(executor, argv[0], argv);
+// cmd_executor_heredoc_fd returns an fd to read a here-doc's body from.
+//
+// A body that fits in a pipe's buffer is written straight into one, so no one
+// waits on anyone. A bigger one goes into a sealed memfd (falling back to a
+// pipe fed by a writer thread where there isn't one), so nothing is ever
+// written to disk.
+static int cmd_executor_heredoc_fd(cmd_executor *executor, const char *body,
+                                   size_t len) {
+  int pipe_fnos[2];
+  size_t capacity = cmd_executor_pipe(executor, pipe_fnos);
+  if (capacity == 0) {
+    capacity = PIPE_BUF;
   }
 
-  pid_t pid;
-  if ((pid = fork()) == 0) {
-    if (executor->stdin_fno != STDIN_FILENO) {
-      close(STDIN_FILENO);
-      dup(executor->stdin_fno);
+  if (len <= capacity) {
+    cmd_executor_write_all(pipe_fnos[1], body, len);
+    close(pipe_fnos[1]);
+
+    return pipe_fnos[0];
+  }
+
+#if defined(__linux__) && defined(MFD_ALLOW_SEALING)
+  int fd = memfd_create("turtle-heredoc", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+  if (fd >= 0) {
+    close(pipe_fnos[0]);
+    close(pipe_fnos[1]);
+
+    if (!cmd_executor_write_all(fd, body, len)) {
+      close(fd);
+      return -1;
     }
 
-    if (executor->stdout_fno != STDOUT_FILENO) {
-      close(STDOUT_FILENO);
-      dup(executor->stdout_fno);
+    // The reader gets a read-only fd onto a body that can't change under it.
+    fcntl(fd, F_ADD_SEALS,
+          F_SEAL_WRITE | F_SEAL_GROW | F_SEAL_SHRINK | F_SEAL_SEAL);
+    lseek(fd, 0, SEEK_SET);
+
+    return fd;
+  }
+#endif
+
+  cmd_heredoc_writer *writer = malloc(sizeof(cmd_heredoc_writer));
+  writer->fd = pipe_fnos[1];
+  writer->buf = malloc(len);
+  writer->len = len;
+  memcpy(writer->buf, body, len);
+
+  g_thread_unref(g_thread_new("heredoc", cmd_executor_heredoc_write, writer));
+
+  return pipe_fnos[0];
+}
+
+// cmd_executor_eval_redirect opens the redirection's target (if it's a file)
+// and adds it to the frame to be applied when the cmd's term is executed.
+static void cmd_executor_eval_redirect(cmd_executor *executor,
+                                       cmd_exec_frame *frame,
+                                       cmd_redirect *redirect) {
+  var_value *target = cmd_executor_word_to_value(executor, redirect->target);
+  frame->values = g_list_prepend(frame->values, target);
+
+  const char *path = var_value_str(target);
+
+  cmd_exec_redirect res = {
+      .fd = redirect->fd,
+      .src = -1,
+      .dup_of = -1,
+      .opened = false,
+      .saved = -1,
+  };
+
+  switch (redirect->type) {
+  case CMD_REDIRECT_TYPE_IN:
+    res.src = openat(cmd_executor_dirfd(executor), path, O_RDONLY | O_CLOEXEC);
+    res.opened = true;
+    break;
+
+  case CMD_REDIRECT_TYPE_OUT:
+    res.src = openat(cmd_executor_dirfd(executor), path,
+                     O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+    res.opened = true;
+    break;
+
+  case CMD_REDIRECT_TYPE_APPEND:
+    res.src = openat(cmd_executor_dirfd(executor), path,
+                     O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0666);
+    res.opened = true;
+    break;
+
+  case CMD_REDIRECT_TYPE_HEREDOC:
+  case CMD_REDIRECT_TYPE_HERESTRING:
+    res.src = cmd_executor_heredoc_fd(executor, path, target->len);
+    res.opened = true;
+    break;
+
+  case CMD_REDIRECT_TYPE_DUP: {
+    if (strcmp(path, "-") == 0) {
+      break;
     }
 
-    execvp(term, argv);
-    giveup("cmd_executor_exec_term: exec '%s' failed", term);
-    exit(1);
+    char *end;
+    long dup_of = strtol(path, &end, 10);
+    if (*path == 0 || *end != 0 || dup_of < 0 || dup_of > INT_MAX) {
+      dprintf(executor->stderr_fno, "turtle: %s: bad file descriptor\n", path);
+      cmd_executor_error(executor, 1);
+    }
+
+    res.dup_of = (int)dup_of;
+    break;
   }
 
-  int status;
-  if ((pid = waitpid(pid, &status, 0)) < 0) {
-    giveup("cmd_executor_exec_term: waitpid failed with pid=%d,status=%d", pid,
-           status);
+  default:
+    giveup("cmd_executor_eval_redirect: unknown redirect type");
+  }
+
+  if (res.opened && res.src < 0) {
+    dprintf(executor->stderr_fno, "turtle: %s: %s\n", path, strerror(errno));
+    cmd_executor_error(executor, 1);
+  }
+
+  if (frame->redirects == NULL) {
+    frame->redirects = g_array_new(false, false, sizeof(cmd_exec_redirect));
+  }
+
+  g_array_append_val(frame->redirects, res);
+}
+
+// cmd_executor_argv returns the NULL-terminated argv for args, allocated in
+// the arena so it goes away with the rest of the cmd's scratch.
+static char **cmd_executor_argv(cmd_executor *executor, GList *args,
+                                int argc) {
+  char **argv =
+      arena_alloc(executor->arena, (size_t)(argc + 1) * sizeof(char *));
+
+  int i = 0;
+  for (GList *node = args; node != NULL; node = node->next) {
+    argv[i++] = node->data;
+  }
+  argv[i] = NULL;
+
+  return argv;
+}
+
+// cmd_executor_run_frame_term runs the cmd's term (if it has one), or starts it
+// as a pipeline stage if stage is set (see cmd_executor_start_stage).
+static int cmd_executor_run_frame_term(cmd_executor *executor,
+                                       cmd_exec_frame *frame, char *term,
+                                       int argc, cmd_pipe_stage *stage,
+                                       int close_fd) {
+  if (stage != NULL && frame->compound != NULL) {
+    cmd_executor_start_compound_stage(executor, frame->compound, close_fd,
+                                      stage);
+  } else if (stage != NULL) {
+    char **argv = cmd_executor_argv(executor, frame->args, argc);
+    cmd_executor_start_stage(executor, frame->env_vars, term, argv, close_fd,
+                             stage);
+  } else if (frame->compound != NULL) {
+    return cmd_executor_exec_compound(executor, frame->compound);
+  } else if (term != NULL) {
+    char **argv = cmd_executor_argv(executor, frame->args, argc);
+    return cmd_executor_exec_term(executor, frame->env_vars, term, argv);
+  }
+
+  return 0;
+}
+
+// cmd_executor_restore_redirects puts back the fds the frame's redirections
+// replaced, in reverse.
+static void cmd_executor_restore_redirects(cmd_executor *executor,
+                                           cmd_exec_frame *frame) {
+  for (guint i = frame->redirects->len; i > 0; i--) {
+    cmd_exec_redirect *redirect =
+        &g_array_index(frame->redirects, cmd_exec_redirect, i - 1);
+
+    cmd_executor_set_fd(executor, redirect->fd, redirect->saved);
+  }
+}
+
+// cmd_executor_exec_frame_term executes the cmd's term (if it has one) with the
+// cmd's redirections applied to the executor's fds for its duration.
+//
+// If stage is set, the term is started as a pipeline stage which isn't waited
+// for (see cmd_executor_start_stage).
+static int cmd_executor_exec_frame_term(cmd_executor *executor,
+                                        cmd_exec_frame *frame, char *term,
+                                        int argc, cmd_pipe_stage *stage,
+                                        int close_fd) {
+  guint redirects_len = frame->redirects != NULL ? frame->redirects->len : 0;
+  if (redirects_len == 0) {
+    return cmd_executor_run_frame_term(executor, frame, term, argc, stage,
+                                       close_fd);
+  }
+
+  for (guint i = 0; i < redirects_len; i++) {
+    cmd_exec_redirect *redirect =
+        &g_array_index(frame->redirects, cmd_exec_redirect, i);
+
+    redirect->saved = cmd_executor_get_fd(executor, redirect->fd);
+    cmd_executor_set_fd(executor, redirect->fd,
+                        redirect->dup_of >= 0
+                            ? cmd_executor_get_fd(executor, redirect->dup_of)
+                            : redirect->src);
+  }
+
+  // An error while running the term (e.g. a failed cmd sub in a compound's
+  // words) jumps past us, and the frame then closes what the redirections
+  // opened, so put the fds back before passing it on.
+  jmp_buf err_jmp;
+  memcpy(err_jmp, executor->err_jmp, sizeof(jmp_buf));
+
+  int err_status;
+  if ((err_status = setjmp(executor->err_jmp)) != 0) {
+    memcpy(executor->err_jmp, err_jmp, sizeof(jmp_buf));
+    cmd_executor_restore_redirects(executor, frame);
+    cmd_executor_error(executor, err_status);
   }
 
+  int status = cmd_executor_run_frame_term(executor, frame, term, argc, stage,
+                                           close_fd);
+
+  memcpy(executor->err_jmp, err_jmp, sizeof(jmp_buf));
+  cmd_executor_restore_redirects(executor, frame);
+
   return status;
 }
 
-int cmd_executor_exec(cmd_executor *executor, cmd *cmd) {
+// cmd_executor_exec_parts executes the cmd, keeping everything it allocates in
+// frame so the caller can release it once it's done.
+static int cmd_executor_exec_parts(cmd_executor *executor, cmd *c,
+                                   cmd_exec_frame *frame) {
   char *term = NULL;
 
   int argc = 0;
-  GList *gargs = NULL;
 
   // Set up executor err jump.
   int err_status;
@@ -266,7 +2841,7 @@ int cmd_executor_exec(cmd_executor *executor, cmd *cmd) {
     return err_status;
   }
 
-  for (GList *node = cmd->parts; node != NULL; node = node->next) {
+  for (GList *node = c->parts; node != NULL; node = node->next) {
     cmd_part *part = (cmd_part *)node->data;
 
     switch (part->type) {
@@ -276,86 +2851,199 @@ int cmd_executor_exec(cmd_executor *executor, cmd *cmd) {
       // If this is the only part of the command, set the var as an executor
       // var.
       if (node->next == NULL) {
-        set_var(executor, cmd, var, executor->vars);
+        var_store_set(executor->vars, var->slot,
+                      cmd_executor_assign_value(executor, var));
       }
       // Otherwise, set it as a var for the environment for the command.
       else {
-        set_var(executor, cmd, var, cmd->env_vars);
+        if (frame->env_vars == NULL) {
+          frame->env_vars =
+              g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL,
+                                    (GDestroyNotify)var_value_unref);
+        }
+
+        g_hash_table_replace(frame->env_vars, GINT_TO_POINTER(var->slot),
+                             cmd_executor_word_to_value(executor, var->value));
       }
 
       break;
     }
 
     case CMD_PART_TYPE_WORD: {
-      char *word = cmd_executor_word_to_str(executor, cmd, part->value.word);
+      cmd_word *word = part->value.word;
+
+      if (word->glob || word->split) {
+        GPtrArray *fields = g_ptr_array_new();
+        cmd_executor_expand_fields(executor, word, fields, &frame->values);
+
+        // Build the fields' args up separately, since appending each one to
+        // the args would be quadratic for a glob over a big directory (or a
+        // cmd sub with many fields).
+        GList *field_args = NULL;
+        for (guint i = fields->len; i > 0; i--) {
+          field_args =
+              g_list_prepend(field_args, g_ptr_array_index(fields, i - 1));
+        }
+
+        argc += (int)fields->len;
+        frame->args = g_list_concat(frame->args, field_args);
+        g_ptr_array_free(fields, true);
+
+        // A word that expands to nothing leaves the next one to be the term.
+        if (term == NULL && frame->args != NULL) {
+          term = frame->args->data;
+        }
+
+        break;
+      }
+
+      var_value *value = cmd_executor_word_to_value(executor, word);
+      frame->values = g_list_prepend(frame->values, value);
+
+      // var_value_str flattens the value into its own str.
+      var_value_str(value);
+      char *arg = value->str;
       if (term == NULL) {
         argc++;
 
-        term = word;
-        gargs = g_list_append(gargs, term);
+        term = arg;
+        frame->args = g_list_append(frame->args, term);
       } else {
         argc++;
 
-        gargs = g_list_append(gargs, word);
+        frame->args = g_list_append(frame->args, arg);
       }
 
       break;
     }
 
-    case CMD_PART_TYPE_PIPE: {
-      int status;
+    case CMD_PART_TYPE_REDIRECT: {
+      cmd_executor_eval_redirect(executor, frame, part->value.redirect);
+      break;
+    }
+
+    case CMD_PART_TYPE_IF:
+    case CMD_PART_TYPE_LOOP:
+    case CMD_PART_TYPE_FOR:
+    case CMD_PART_TYPE_CASE:
+    case CMD_PART_TYPE_GROUP:
+    case CMD_PART_TYPE_ARITH: {
+      // Run once any redirections that follow it have been evaluated.
+      frame->compound = part;
+      break;
+    }
+
+    case CMD_PART_TYPE_COPROC: {
+      return cmd_executor_start_coproc(executor, part->value.coproc);
+    }
+
+    case CMD_PART_TYPE_FUNC_DEF: {
+      cmd_func *func = part->value.func_def;
+      g_hash_table_replace(executor->funcs, func->name, cmd_func_ref(func));
+      break;
+    }
 
-      // Keep track of the original fnos.
+    case CMD_PART_TYPE_PIPE: {
+      // Keep track of the original fnos and rings.
       int original_fnos[2] = {executor->stdin_fno, executor->stdout_fno};
+      ring_buffer *original_stdin_ring = executor->stdin_ring;
+
+      // The outermost pipeline watches all its timed stages with one group.
+      child_wait_group *wait_group = NULL;
+      if (executor->timeout.secs > 0 && executor->wait_group == NULL) {
+        wait_group = executor->wait_group = child_wait_group_new();
+      }
 
-      // Create a pipe.
-      int pipe_fnos[2];
-      if (pipe(pipe_fnos) < 0) {
-        giveup("cmd_executor_exec: pipe failed");
+      // If both sides are builtins we can run in-process, connect them with a
+      // ring instead of a pipe.
+      ring_buffer *ring = NULL;
+      int pipe_fnos[2] = {-1, -1};
+      size_t capacity;
+
+      guint redirects_len =
+          frame->redirects != NULL ? frame->redirects->len : 0;
+      if (term != NULL && cmd_executor_threadable(executor, term) &&
+          redirects_len == 0 &&
+          cmd_threadable_stage(executor, part->value.piped_cmd)) {
+        ring =
+            ring_buffer_new(MAX(executor->pipe_size, CMD_EXECUTOR_RING_SIZE));
+        capacity = ring->cap;
+      } else {
+        capacity = cmd_executor_pipe(executor, pipe_fnos);
       }
 
-      // Have the executor write to output of the pipe.
-      executor->stdout_fno = pipe_fnos[1];
+      // Start the cmd we built writing to the ring or pipe, without waiting
+      // for it so it runs alongside the piped cmd.
+      executor->stdout_fno = ring != NULL ? original_fnos[1] : pipe_fnos[1];
+      executor->stdout_ring = ring;
 
-      // Execute the cmd we built.
-      if ((status = cmd_executor_exec_term(
-               executor, term, g_list_charptr_to_argv(gargs, argc))) != 0) {
-        close(pipe_fnos[0]);
+      cmd_pipe_stage stage;
+      stage.pipe_fd = pipe_fnos[1];
+      cmd_executor_exec_frame_term(executor, frame, term, argc, &stage,
+                                   pipe_fnos[0]);
+
+      // Restore the executor's stdout; the pipe output is the stage's now if
+      // it's on a thread.
+      executor->stdout_fno = original_fnos[1];
+      executor->stdout_ring = NULL;
+      if (ring == NULL && stage.thread == NULL) {
         close(pipe_fnos[1]);
+      }
 
-        executor->stdin_fno = original_fnos[0];
-        executor->stdout_fno = original_fnos[1];
+      // Have the executor read from the other end.
+      executor->stdin_fno = ring != NULL ? original_fnos[0] : pipe_fnos[0];
+      executor->stdin_ring = ring;
 
-        return status;
+      // Execute the piped cmd; its status is the pipeline's.
+      int status = cmd_executor_exec(executor, part->value.piped_cmd);
+
+      // Close the reading end (so the stage stops if it's still writing) and
+      // reset the executor stdin.
+      if (ring != NULL) {
+        ring_buffer_close_read(ring);
+      } else {
+        close(pipe_fnos[0]);
       }
 
-      // Close the pipe output.
-      close(pipe_fnos[1]);
+      executor->stdin_fno = original_fnos[0];
+      executor->stdin_ring = original_stdin_ring;
 
-      // Have the executor read from the input of the pipe and write to the
-      // original out.
-      executor->stdin_fno = pipe_fnos[0];
-      executor->stdout_fno = original_fnos[1];
+      cmd_executor_finish_stage(executor, &stage);
 
-      // Execute the piped cmd.
-      status = cmd_executor_exec(executor, part->value.piped_cmd);
+      if (wait_group != NULL) {
+        child_wait_group_free(wait_group);
+        executor->wait_group = NULL;
+      }
 
-      // Close the pipe input.
-      close(pipe_fnos[0]);
+      if (executor->stats != NULL) {
+        const char *piped_term = cmd_literal_term(part->value.piped_cmd);
+        cmd_stats_add_pipe(
+            executor->stats, ring != NULL ? "ring" : "pipe",
+            g_strdup_printf("%s | %s", term != NULL ? term : "",
+                            piped_term != NULL ? piped_term : "?"),
+            ring != NULL   ? atomic_load(&ring->tail)
+            : stage.metered ? stage.executor.stdout_bytes
+                            : 0,
+            ring != NULL || stage.metered, capacity);
+      }
 
-      // Reset the executor stdin.
-      executor->stdin_fno = original_fnos[0];
+      if (ring != NULL) {
+        ring_buffer_free(ring);
+      }
 
       return status;
     }
 
     case CMD_PART_TYPE_OR: {
       // Execute the command as-is.
-      char **argv = g_list_charptr_to_argv(gargs, argc);
-      int status = cmd_executor_exec_term(executor, term, argv);
+      int status =
+          cmd_executor_exec_frame_term(executor, frame, term, argc, NULL, -1);
+      if (c->negated) {
+        status = !status;
+      }
 
-      // If the result is 0, we're done!
-      if (status == 0) {
+      // If the result is 0 (or we're breaking out of a loop), we're done!
+      if (status == 0 || cmd_executor_unwinding(executor)) {
         return status;
       }
 
@@ -365,11 +3053,14 @@ int cmd_executor_exec(cmd_executor *executor, cmd *cmd) {
 
     case CMD_PART_TYPE_AND: {
       // Execute the command as-is.
-      char **argv = g_list_charptr_to_argv(gargs, argc);
-      int status = cmd_executor_exec_term(executor, term, argv);
+      int status =
+          cmd_executor_exec_frame_term(executor, frame, term, argc, NULL, -1);
+      if (c->negated) {
+        status = !status;
+      }
 
-      // If the result non-zero, bail!
-      if (status != 0) {
+      // If the result non-zero (or we're breaking out of a loop), bail!
+      if (status != 0 || cmd_executor_unwinding(executor)) {
         return status;
       }
 
@@ -382,10 +3073,80 @@ int cmd_executor_exec(cmd_executor *executor, cmd *cmd) {
     }
   }
 
-  if (term == NULL) {
-    return 0;
+  int status =
+      cmd_executor_exec_frame_term(executor, frame, term, argc, NULL, -1);
+
+  return c->negated ? !status : status;
+}
+
+// cmd_executor_complete_cmd appends copies of the names of the cmds (builtins,
+// functions and executables in PATH) that start with prefix to matches.
+void cmd_executor_complete_cmd(cmd_executor *executor, const char *prefix,
+                               GPtrArray *matches) {
+  cmd_builtins_complete(prefix, matches);
+
+  size_t len = strlen(prefix);
+  GHashTableIter iter;
+  gpointer name;
+
+  g_hash_table_iter_init(&iter, executor->funcs);
+  while (g_hash_table_iter_next(&iter, &name, NULL)) {
+    if (strncmp(name, prefix, len) == 0) {
+      g_ptr_array_add(matches, strdup(name));
+    }
+  }
+
+  var_value *path = var_store_get(executor->vars, executor->path_slot);
+  path_index_complete(cmd_executor_get_path_index(executor),
+                      path != NULL ? var_value_str(path) : CMD_EXECUTOR_PATH,
+                      prefix, matches);
+}
+
+int cmd_executor_exec(cmd_executor *executor, cmd *c) {
+  cmd_exec_frame frame = {
+      .values = NULL,
+      .args = NULL,
+      .env_vars = NULL,
+      .redirects = NULL,
+      .compound = NULL,
+  };
+
+  // Nested execs (e.g. for subs) set their own err jump, so restore ours once
+  // they return.
+  jmp_buf err_jmp;
+  memcpy(err_jmp, executor->err_jmp, sizeof(jmp_buf));
+
+  arena_mark mark = arena_save(executor->arena);
+
+  int status = cmd_executor_exec_parts(executor, c, &frame);
+  executor->last_status = status;
+
+  // Globs are only cached for the cmd they're expanded for.
+  if (executor->glob_cache != NULL) {
+    path_glob_cache_clear(executor->glob_cache);
+  }
+
+  memcpy(executor->err_jmp, err_jmp, sizeof(jmp_buf));
+
+  arena_restore(executor->arena, mark);
+
+  g_list_free(frame.args);
+  g_list_free_full(frame.values, (GDestroyNotify)var_value_unref);
+  if (frame.env_vars != NULL) {
+    g_hash_table_destroy(frame.env_vars);
+  }
+
+  if (frame.redirects != NULL) {
+    for (guint i = 0; i < frame.redirects->len; i++) {
+      cmd_exec_redirect *redirect =
+          &g_array_index(frame.redirects, cmd_exec_redirect, i);
+      if (redirect->opened) {
+        cmd_executor_close(executor, redirect->src);
+      }
+    }
+
+    g_array_free(frame.redirects, true);
   }
 
-  char **argv = g_list_charptr_to_argv(gargs, argc);
-  return cmd_executor_exec_term(executor, term, argv);
+  return status;
 }
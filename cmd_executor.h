@@ -1,18 +1,195 @@
 #pragma once
 
+#include "arena.h"
+#include "child_wait.h"
 #include "cmd.h"
+#include "cmd_cache.h"
+#include "cmd_stats.h"
+#include "fd_reader.h"
+#include "field_split.h"
 #include "glib.h"
+#include "path_glob.h"
+#include "path_index.h"
+#include "ring_buffer.h"
+#include "var_store.h"
 #include <setjmp.h>
 
+// cmd_fd_route routes src to fd in children (-1 closes fd).
+typedef struct cmd_fd_route {
+  int fd;
+  int src;
+} cmd_fd_route;
+
+// cmd_coproc_proc is a coproc the shell has started.
+typedef struct cmd_coproc_proc {
+  pid_t pid;
+
+  // The shell's ends of the pipes to the coproc's stdout and stdin.
+  int read_fd;
+  int write_fd;
+} cmd_coproc_proc;
+
+// cmd_timeout bounds how long children may run (see child_wait).
+typedef struct cmd_timeout {
+  // The seconds a child may run before it's sent SIGTERM (0 for no limit).
+  double secs;
+
+  // The seconds after SIGTERM before it's sent SIGKILL (0 for never).
+  double kill_after;
+
+  // Whether to say on stderr when a child is timed out.
+  bool report;
+} cmd_timeout;
+
 typedef struct cmd_executor {
-  GHashTable *vars;
+  var_store *vars;
+
+  // The slot PATH is interned to, for exec lookups.
+  int path_slot;
+
+  // The slot IFS is interned to, and IFS prepared for splitting (or NULL
+  // until something's been split) along with a ref to the value it was
+  // prepared from, to tell when it's been reassigned.
+  int ifs_slot;
+  field_split_ifs *ifs;
+  var_value *ifs_value;
+
+  // field_split_slice[] reused for each expansion that's split.
+  GArray *slices;
 
   int stdin_fno;
   int stdout_fno;
+  int stderr_fno;
+
+  // The rings a builtin running on a pipeline thread reads stdin from and
+  // writes stdout to instead of the fds (or NULL).
+  ring_buffer *stdin_ring;
+  ring_buffer *stdout_ring;
+
+  // cmd_fd_route[] for any fds above stderr that children should get.
+  GArray *fd_routes;
+
+  // GHashTable<fd, fd_reader*> of the fds the read builtin has read from (or
+  // NULL until it's first run), each dropped once we close its fd.
+  GHashTable *readers;
+
+  // cmd_coproc_proc[] of the coprocs started (or NULL until the first one),
+  // torn down by cmd_executor_close_coprocs.
+  GArray *coprocs;
+
+  // The outputs the cache builtin has memoized (or NULL until it's first
+  // run), and how many it holds in memory (from the cachesize option).
+  cmd_cache *cache;
+  size_t cache_size;
+
+  // The directory children are started in (or NULL for the shell's own), and
+  // an fd for it (or -1), against which the shell resolves the paths it opens
+  // itself (e.g. for redirects, globs and builtins), since only children chdir.
+  char *cwd;
+  int cwd_fd;
+
+  // The timeout for each child (from the cmdtimeout option).
+  cmd_timeout timeout;
+
+  // What watches the timed stages of the pipeline being run (or NULL).
+  child_wait_group *wait_group;
+
+  // The vars given to the cmd being run (e.g. "foo=bar timeout 1 cmd"), for
+  // builtins that run cmds.
+  GHashTable *term_env_vars;
+
+  // The buffer size to give the pipes we create (0 for the kernel's default).
+  size_t pipe_size;
+
+  // The bytes builtins have written to stdout, for stats.
+  size_t stdout_bytes;
+
+  // The number of loops we're in, and how many of them a "break" or
+  // "continue" has asked to stop (see cmd_executor_loop_done).
+  int loop_depth;
+  int breaking;
+  int continuing;
+
+  // GHashTable<char* name, cmd_func*> of the functions defined so far.
+  GHashTable *funcs;
+
+  // The positional params ($1, $2, ...) as var_value* refs, and $0.
+  GPtrArray *args;
+  var_value *arg0;
+
+  // The args joined for "$@" (or NULL until it's first expanded).
+  var_value *args_joined;
+
+  // The status of the last cmd ("$?").
+  int last_status;
+
+  // cmd_local_save[] of the values that "local" (or a function call's own
+  // vars) replaced, restored when the call that saved them returns; the
+  // innermost call's saves start at locals_base.
+  GArray *local_saves;
+  guint locals_base;
+
+  // The number of function calls we're in, and whether a "return" is
+  // unwinding the innermost one.
+  int func_depth;
+  bool returning;
+
+  // The value of the last special param that had to be formatted (e.g. "$#").
+  var_value *scratch;
+
+  // Scratch memory for the cmds being executed, each of which rewinds it to
+  // where it started once it's done (see cmd_executor_exec).
+  arena *arena;
+
+  // The index of PATH's executables (shared by every executor in the
+  // process), or NULL until it's first needed.
+  path_index *path_index;
+
+  // The directory listings read for the current cmd's globs (or NULL if there
+  // haven't been any yet).
+  path_glob_cache *glob_cache;
+
+  // The stats being collected (or NULL if they're disabled).
+  cmd_stats *stats;
+
+  // Held while building a child's envp and forking it, since pipeline threads
+  // can start children too.
+  GMutex *spawn_lock;
 
   jmp_buf err_jmp;
 } cmd_executor;
 
 cmd_executor *cmd_executor_new(void);
 
-int cmd_executor_exec(cmd_executor *executor, cmd *cmd);
\ No newline at end of file
+cmd_executor *cmd_executor_new_with_env(char **envp);
+
+void cmd_executor_free(cmd_executor *executor);
+
+int cmd_executor_get_fd(cmd_executor *executor, int fd);
+
+void cmd_executor_set_fd(cmd_executor *executor, int fd, int src);
+
+fd_reader *cmd_executor_get_reader(cmd_executor *executor, int fd);
+
+int cmd_executor_dirfd(cmd_executor *executor);
+
+field_split_ifs *cmd_executor_ifs(cmd_executor *executor);
+
+void cmd_executor_close_coprocs(cmd_executor *executor);
+
+int cmd_executor_exec_captured(cmd_executor *executor, char **argv,
+                               var_value **out);
+
+int cmd_executor_exec(cmd_executor *executor, cmd *c);
+
+void cmd_executor_complete_cmd(cmd_executor *executor, const char *prefix,
+                               GPtrArray *matches);
+
+void cmd_executor_set_args(cmd_executor *executor, const char *arg0,
+                           char **args);
+
+void cmd_executor_set_local(cmd_executor *executor, int slot,
+                            var_value *value);
+
+int cmd_executor_exec_timed(cmd_executor *executor, char **argv,
+                            cmd_timeout *timeout);
\ No newline at end of file
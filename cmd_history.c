@@ -0,0 +1,325 @@
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+#include "cmd_history.h"
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// cmd_history_hash hashes a record (FNV-1a).
+static uint32_t cmd_history_hash(const char *str, size_t len) {
+  uint32_t hash = 2166136261u;
+
+  for (size_t i = 0; i < len; i++) {
+    hash = (hash ^ (unsigned char)str[i]) * 16777619u;
+  }
+
+  return hash;
+}
+
+// cmd_history_encode escapes line into a record (with its trailing newline).
+static GString *cmd_history_encode(const char *line) {
+  GString *record = g_string_sized_new(strlen(line) + 1);
+
+  for (const char *c = line; *c != 0; c++) {
+    if (*c == '\\') {
+      g_string_append(record, "\\\\");
+    } else if (*c == '\n') {
+      g_string_append(record, "\\n");
+    } else {
+      g_string_append_c(record, *c);
+    }
+  }
+
+  g_string_append_c(record, '\n');
+
+  return record;
+}
+
+// cmd_history_decode returns the line a record (without its newline) is for.
+static char *cmd_history_decode(const char *record, size_t len) {
+  char *line = malloc(len + 1);
+  size_t j = 0;
+
+  for (size_t i = 0; i < len; i++) {
+    if (record[i] == '\\' && i + 1 < len) {
+      i++;
+      line[j++] = record[i] == 'n' ? '\n' : record[i];
+      continue;
+    }
+
+    line[j++] = record[i];
+  }
+
+  line[j] = 0;
+
+  return line;
+}
+
+// cmd_history_reset forgets the map and everything indexed from it.
+static void cmd_history_reset(cmd_history *h) {
+  if (h->map != NULL) {
+    munmap(h->map, h->map_len);
+  }
+
+  h->map = NULL;
+  h->map_len = 0;
+  h->indexed = 0;
+  g_array_set_size(h->entries, 0);
+
+  if (h->latest != NULL) {
+    memset(h->latest, 0, h->latest_cap * sizeof(uint32_t));
+  }
+}
+
+// cmd_history_sync maps whatever's been appended to the file (by any session)
+// since it was last mapped.
+static void cmd_history_sync(cmd_history *h) {
+  struct stat st;
+  if (fstat(h->fd, &st) != 0) {
+    return;
+  }
+
+  size_t size = (size_t)st.st_size;
+  if (size == h->map_len) {
+    return;
+  }
+
+  // The file only shrinks if it was truncated or replaced behind our back, in
+  // which case none of the offsets mean anything anymore.
+  if (size < h->map_len) {
+    cmd_history_reset(h);
+    if (size == 0) {
+      return;
+    }
+  }
+
+  char *map = mmap(NULL, size, PROT_READ, MAP_SHARED, h->fd, 0);
+  if (map == MAP_FAILED) {
+    return;
+  }
+
+  if (h->map != NULL) {
+    munmap(h->map, h->map_len);
+  }
+
+  h->map = map;
+  h->map_len = size;
+}
+
+// cmd_history_latest_slot returns the slot in the latest table for hash: the
+// one holding the latest entry with that hash, or the empty one it would go
+// in.
+static uint32_t *cmd_history_latest_slot(cmd_history *h, uint32_t hash) {
+  size_t mask = h->latest_cap - 1;
+  size_t i = hash & mask;
+
+  while (h->latest[i] != 0 &&
+         g_array_index(h->entries, cmd_history_entry, h->latest[i] - 1).hash !=
+             hash) {
+    i = (i + 1) & mask;
+  }
+
+  return &h->latest[i];
+}
+
+// cmd_history_latest_grow doubles the latest table, so it's never more than
+// half full.
+static void cmd_history_latest_grow(cmd_history *h) {
+  free(h->latest);
+  h->latest_cap = h->latest_cap == 0 ? 1024 : h->latest_cap * 2;
+  h->latest = calloc(h->latest_cap, sizeof(uint32_t));
+
+  for (guint i = 0; i < h->entries->len; i++) {
+    cmd_history_entry *entry =
+        &g_array_index(h->entries, cmd_history_entry, i);
+    *cmd_history_latest_slot(h, entry->hash) = i + 1;
+  }
+}
+
+// cmd_history_index indexes the complete records mapped since the last call,
+// marking any earlier copies of them as dups.
+static void cmd_history_index(cmd_history *h) {
+  const char *end = h->map + h->map_len;
+  const char *c = h->map + h->indexed;
+
+  const char *nl;
+  while (c < end && (nl = memchr(c, '\n', (size_t)(end - c))) != NULL) {
+    cmd_history_entry entry = {
+        .start = (size_t)(c - h->map),
+        .len = (size_t)(nl - c),
+        .hash = cmd_history_hash(c, (size_t)(nl - c)),
+        .dup = false,
+    };
+
+    if ((h->entries->len + 1) * 2 > h->latest_cap) {
+      cmd_history_latest_grow(h);
+    }
+
+    uint32_t *slot = cmd_history_latest_slot(h, entry.hash);
+    if (*slot != 0) {
+      cmd_history_entry *earlier =
+          &g_array_index(h->entries, cmd_history_entry, *slot - 1);
+
+      if (earlier->len == entry.len &&
+          memcmp(h->map + earlier->start, c, entry.len) == 0) {
+        earlier->dup = true;
+      }
+    }
+
+    g_array_append_val(h->entries, entry);
+    *slot = h->entries->len;
+
+    c = nl + 1;
+  }
+
+  h->indexed = (size_t)(c - h->map);
+}
+
+// cmd_history_open opens (creating if need be) the history file at filename,
+// returning NULL if it can't be.
+cmd_history *cmd_history_open(const char *filename) {
+  int fd = open(filename, O_RDWR | O_APPEND | O_CREAT | O_CLOEXEC, 0600);
+  if (fd < 0) {
+    return NULL;
+  }
+
+  cmd_history *h = malloc(sizeof(cmd_history));
+  h->fd = fd;
+  h->map = NULL;
+  h->map_len = 0;
+  h->indexed = 0;
+  h->entries = g_array_new(false, false, sizeof(cmd_history_entry));
+  h->latest = NULL;
+  h->latest_cap = 0;
+  h->last = NULL;
+
+  cmd_history_sync(h);
+
+  return h;
+}
+
+// cmd_history_recent appends the last max lines (oldest first, without repeats
+// in a row) to lines.
+//
+// It reads back from the end of the file, so it costs the same however long
+// the file is.
+void cmd_history_recent(cmd_history *h, size_t max, GPtrArray *lines) {
+  GPtrArray *recent = g_ptr_array_new();
+
+  const char *end = h->map + h->map_len;
+
+  // Skip a record a concurrent append is partway through.
+  while (end > h->map && end[-1] != '\n') {
+    end--;
+  }
+
+  while (end > h->map && recent->len < max) {
+    const char *start = end - 1;
+    while (start > h->map && start[-1] != '\n') {
+      start--;
+    }
+
+    char *line = cmd_history_decode(start, (size_t)(end - 1 - start));
+    const char *newer =
+        recent->len > 0 ? g_ptr_array_index(recent, recent->len - 1) : NULL;
+
+    if (*line == 0 || (newer != NULL && strcmp(line, newer) == 0)) {
+      free(line);
+    } else {
+      g_ptr_array_add(recent, line);
+    }
+
+    end = start;
+  }
+
+  if (recent->len > 0 && h->last == NULL) {
+    h->last = strdup(g_ptr_array_index(recent, 0));
+  }
+
+  for (guint i = recent->len; i > 0; i--) {
+    g_ptr_array_add(lines, g_ptr_array_index(recent, i - 1));
+  }
+
+  g_ptr_array_free(recent, true);
+}
+
+// cmd_history_add appends line to the file, unless it's empty or the same as
+// the line last added.
+void cmd_history_add(cmd_history *h, const char *line) {
+  if (*line == 0 || (h->last != NULL && strcmp(line, h->last) == 0)) {
+    return;
+  }
+
+  free(h->last);
+  h->last = strdup(line);
+
+  // One write per record, so O_APPEND puts it after every other session's
+  // whole records.
+  GString *record = cmd_history_encode(line);
+  ssize_t written = write(h->fd, record->str, record->len);
+  (void)written;
+  g_string_free(record, true);
+}
+
+// cmd_history_search finds the latest line before *pos (an index from a
+// previous search, or SIZE_MAX for the latest of all) containing query,
+// returning it and setting *pos to where it was found (or NULL if none does).
+//
+// Repeats of a line are skipped, so each line is found at most once.
+char *cmd_history_search(cmd_history *h, const char *query, size_t *pos) {
+  if (*query == 0) {
+    return NULL;
+  }
+
+  cmd_history_sync(h);
+  cmd_history_index(h);
+
+  // Records are escaped, so look for the escaped query (and decode matches
+  // with escapes to make sure they didn't only match across one).
+  GString *needle = cmd_history_encode(query);
+  g_string_truncate(needle, needle->len - 1);
+
+  size_t i = MIN(*pos, (size_t)h->entries->len);
+  char *found = NULL;
+
+  while (found == NULL && i > 0) {
+    i--;
+
+    cmd_history_entry *entry = &g_array_index(h->entries, cmd_history_entry, i);
+    const char *record = h->map + entry->start;
+
+    if (entry->dup ||
+        memmem(record, entry->len, needle->str, needle->len) == NULL) {
+      continue;
+    }
+
+    char *line = cmd_history_decode(record, entry->len);
+    if (memchr(record, '\\', entry->len) == NULL ||
+        strstr(line, query) != NULL) {
+      found = line;
+      *pos = i;
+    } else {
+      free(line);
+    }
+  }
+
+  g_string_free(needle, true);
+
+  return found;
+}
+
+void cmd_history_close(cmd_history *h) {
+  if (h->map != NULL) {
+    munmap(h->map, h->map_len);
+  }
+
+  close(h->fd);
+  g_array_free(h->entries, true);
+  free(h->latest);
+  free(h->last);
+  free(h);
+}
@@ -0,0 +1,62 @@
+#pragma once
+
+#include "glib.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// cmd_history_entry is a record in the history file, by its bytes in the map.
+typedef struct cmd_history_entry {
+  size_t start;
+  size_t len;
+
+  // A hash of the record, to find earlier copies of it.
+  uint32_t hash;
+
+  // Whether a later copy of the record has replaced this one.
+  bool dup;
+} cmd_history_entry;
+
+// cmd_history is the cmd lines entered interactively, kept in an append-only
+// file shared by every session.
+//
+// Each line is one record: its text with "\" and newlines escaped and a
+// newline at the end, written with a single write() to a file opened with
+// O_APPEND so concurrent sessions' records never interleave.
+//
+// The file is mmapped rather than read, so opening it costs the same however
+// long it is. Only the most recent lines are decoded up front (for the
+// up-arrow); the rest are only indexed, and only when first searched.
+typedef struct cmd_history {
+  int fd;
+
+  // The file's bytes as of the last sync (NULL if it was empty).
+  char *map;
+  size_t map_len;
+
+  // How much of the map has been indexed (up to the end of the last complete
+  // record, since a concurrent append may be partway through).
+  size_t indexed;
+
+  // GArray<cmd_history_entry> of the indexed records, oldest first.
+  GArray *entries;
+
+  // An open-addressed table (by hash) of the index + 1 of the latest record
+  // with each hash (or 0 for an empty slot). There's one slot per distinct
+  // hash, so a collision only means a repeat isn't recognized as one.
+  uint32_t *latest;
+  size_t latest_cap;
+
+  // The line last added, so a repeat isn't added again.
+  char *last;
+} cmd_history;
+
+cmd_history *cmd_history_open(const char *filename);
+
+void cmd_history_recent(cmd_history *h, size_t max, GPtrArray *lines);
+
+void cmd_history_add(cmd_history *h, const char *line);
+
+char *cmd_history_search(cmd_history *h, const char *query, size_t *pos);
+
+void cmd_history_close(cmd_history *h);
@@ -1,7 +1,9 @@
 #include "cmd_parser.h"
 #include "cmd.h"
 #include "glib.h"
+#include "pattern.h"
 #include "utils.h"
+#include "var_store.h"
 #include <stdbool.h>
 #include <stdio.h>
 #include <unistd.h>
@@ -12,6 +14,8 @@
 #define VAR_ASSIGN '='
 #define PIPE '|'
 #define COMMENT '#'
+#define REDIRECT_IN '<'
+#define REDIRECT_OUT '>'
 
 static bool is_alpha(char c) {
   return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z');
@@ -31,14 +35,47 @@ static bool is_var_name_char(char c) {
 
 static bool is_end_of_line(char c) { return c == '\n' || c == '\0'; }
 
+// is_redirect_start returns whether str starts a redirection (e.g. ">foo",
+// "2>&1" or "<foo", but not "<(...)").
+static bool is_redirect_start(const char *str) {
+  while (is_numeric(*str)) {
+    str++;
+  }
+
+  return *str == REDIRECT_OUT || (*str == REDIRECT_IN && *(str + 1) != '(');
+}
+
+// is_word_end returns whether c ends an unquoted word.
+static bool is_word_end(char c) {
+  return c == ' ' || c == '\n' || c == ';' || c == '\0' || c == ')' ||
+         c == PIPE || c == '&' || c == REDIRECT_IN || c == REDIRECT_OUT;
+}
+
+// Reserved words that start a compound cmd.
+static const char *const compound_keywords[] = {"if",   "while", "until", "for",
+                                               "case", "{",     NULL};
+
+// Reserved words that end a list inside a compound cmd.
+static const char *const list_end_keywords[] = {
+    "then", "elif", "else", "fi", "do", "done", "esac", "}", NULL};
+
+// keyword_in returns whether keyword is one of keywords.
+static bool keyword_in(const char *keyword, const char *const *keywords) {
+  for (; *keywords != NULL; keywords++) {
+    if (strcmp(keyword, *keywords) == 0) {
+      return true;
+    }
+  }
+
+  return false;
+}
+
 static inline void parser_consume_to_end_of_line(cmd_parser *parser) {
   while (!is_end_of_line(*parser->next)) {
     parser->next++;
   }
 }
 
-#pragma clang diagnostic ignored "-Wunused-parameter"
-#pragma clang diagnostic push
 static void cmd_parser_err(cmd_parser *parser, char *fmt, ...) {
   va_list args;
   va_start(args, fmt);
@@ -46,12 +83,24 @@ static void cmd_parser_err(cmd_parser *parser, char *fmt, ...) {
   char full_format[BUFSIZ];
   snprintf(full_format, BUFSIZ, "parser error: %s\n", fmt);
 
+  // Whoever catches the error reports it, so parsers on other threads don't
+  // print out of turn.
+  if (parser->err_jmp != NULL) {
+    char msg[BUFSIZ];
+    vsnprintf(msg, BUFSIZ, full_format, args);
+    va_end(args);
+
+    free(parser->err);
+    parser->err = strdup(msg);
+
+    longjmp(*parser->err_jmp, 1);
+  }
+
   vfprintf(stderr, full_format, args);
   va_end(args);
 
   exit(1);
 }
-#pragma clang diagnostic pop
 
 // cmd_parser_parse_var_expand parses a variable expansion.
 //
@@ -62,6 +111,19 @@ cmd_word_part_var *cmd_parser_parse_var_expand(cmd_parser *parser) {
 
   cmd_word_part_var *var = malloc(sizeof(cmd_word_part_var));
   var->name = g_string_new(NULL);
+  var->special = 0;
+
+  // Special params are always a single char (e.g. "$10" is "$1" then "0").
+  char special = *parser->next;
+  if (is_numeric(special) || special == '@' || special == '*' ||
+      special == '#' || special == '?') {
+    var->special = special;
+    var->name = g_string_append_c(var->name, special);
+    var->slot = var_store_intern(var->name->str, var->name->len);
+    parser->next++;
+
+    return var;
+  }
 
   while (*parser->next != 0) {
     char c = *parser->next;
@@ -75,6 +137,8 @@ cmd_word_part_var *cmd_parser_parse_var_expand(cmd_parser *parser) {
     parser->next++;
   }
 
+  var->slot = var_store_intern(var->name->str, var->name->len);
+
   return var;
 }
 
@@ -98,13 +162,10 @@ GString *cmd_parser_parse_word_literal(cmd_parser *parser) {
       }
 
       literal = g_string_append_c(literal, c);
-    } else if (c == ' ' || c == '\n') {
-      return literal;
-    } else if (c == ';') {
-      return literal;
     } else {
-      cmd_parser_err(parser, "word_literal: unexpected character %c", c);
-      return NULL;
+      // Let the caller decide what to do with whatever follows the literal
+      // (e.g. the '$' in "foo$bar").
+      return literal;
     }
 
     parser->next++;
@@ -158,7 +219,7 @@ cmd_word_part_str *cmd_parser_parse_str_unquoted(cmd_parser *parser) {
 }
 
 static bool is_str_quoted_lit_char(char c) {
-  return is_literal_char(c) || c == ' ' || c == ';';
+  return c != STR_QUOTED && c != VAR_EXPAND_START;
 }
 
 // cmd_parser_parse_sub parses a command or process substitution.
@@ -177,9 +238,58 @@ cmd *cmd_parser_parse_sub(cmd_parser *parser) {
   cmd *cmd = cmd_parser_parse(parser, parser->next);
   parser->in_sub = was_in_sub;
 
+  // A cmd ended by a newline (e.g. one whose here-doc body follows it) leaves
+  // the sub's ')' still to come.
+  if (*(parser->next - 1) == '\n') {
+    while (*parser->next == ' ' || *parser->next == '\n') {
+      parser->next++;
+    }
+
+    if (*parser->next == ')') {
+      parser->next++;
+    }
+  }
+
   return cmd;
 }
 
+// cmd_parser_parse_arith parses the expression of a "(( ))" (or of the
+// "$(( ))" whose '$' has been skipped).
+//
+// The cursor will be placed after the closing "))".
+static arith_node *cmd_parser_parse_arith(cmd_parser *parser) {
+  parser->next += 2;
+
+  // Find the "))" that isn't closing a paren inside the expression.
+  char *end = parser->next;
+  int depth = 0;
+  for (; *end != 0; end++) {
+    if (*end == '(') {
+      depth++;
+    } else if (*end == ')') {
+      if (depth == 0 && *(end + 1) == ')') {
+        break;
+      }
+      depth--;
+    }
+  }
+
+  if (*end == 0) {
+    cmd_parser_err(parser, "syntax error: expected '))' before end of input");
+  }
+
+  const char *err = NULL;
+  arith_node *arith =
+      arith_parse(parser->next, (size_t)(end - parser->next), &err);
+  if (arith == NULL) {
+    cmd_parser_err(parser, "arithmetic: %s", err);
+  }
+
+  parser->next = end + 2;
+
+  return arith;
+}
+
 // cmd_parser_parse_str_quoted parses a quoted string.
 //
 // The cursor will be placed after the string.
@@ -199,6 +309,15 @@ cmd_word_part_str *cmd_parser_parse_str_quoted(cmd_parser *parser) {
       cmd_word_part_str_part *part =
           cmd_parser_parse_str_literal(parser, is_str_quoted_lit_char);
 
+      res->parts = g_list_append(res->parts, part);
+    } else if (c == VAR_EXPAND_START && parser->next[1] == '(' &&
+               parser->next[2] == '(') {
+      parser->next++;
+
+      cmd_word_part_str_part *part = malloc(sizeof(cmd_word_part_str_part));
+      part->type = CMD_WORD_PART_STR_PART_TYPE_ARITH;
+      part->value.arith = cmd_parser_parse_arith(parser);
+
       res->parts = g_list_append(res->parts, part);
     } else if (c == VAR_EXPAND_START) {
       cmd_word_part_var *var = cmd_parser_parse_var_expand(parser);
@@ -250,6 +369,8 @@ cmd_word_part_str *cmd_parser_parse_str(cmd_parser *parser) {
 cmd_word *cmd_parser_parse_word(cmd_parser *parser) {
   cmd_word *word = malloc(sizeof(cmd_word));
   word->parts = NULL;
+  word->glob = false;
+  word->split = false;
 
   while (*parser->next != '\0') {
     char c = *parser->next;
@@ -263,6 +384,26 @@ cmd_word *cmd_parser_parse_word(cmd_parser *parser) {
       return word;
     }
 
+    if (c == PIPE || c == '&' || c == REDIRECT_OUT ||
+        (c == REDIRECT_IN && *(parser->next + 1) != '(')) {
+      return word;
+    }
+
+    // Check if this is an arithmetic expansion.
+    if (c == VAR_EXPAND_START && parser->next[1] == '(' &&
+        parser->next[2] == '(') {
+      parser->next++;
+
+      cmd_word_part_value val = {
+          .arith = cmd_parser_parse_arith(parser),
+      };
+      cmd_word_part *part = cmd_word_part_new(CMD_WORD_PART_TYPE_ARITH, val);
+
+      word->parts = g_list_append(word->parts, part);
+
+      continue;
+    }
+
     // Check if this is a command sub.
     if (c == VAR_EXPAND_START && *(parser->next + 1) == '(') {
       cmd_word_part_value val = {
@@ -271,6 +412,7 @@ cmd_word *cmd_parser_parse_word(cmd_parser *parser) {
       cmd_word_part *part = cmd_word_part_new(CMD_WORD_PART_TYPE_CMD_SUB, val);
 
       word->parts = g_list_append(word->parts, part);
+      word->split = true;
 
       continue;
     }
@@ -293,6 +435,10 @@ cmd_word *cmd_parser_parse_word(cmd_parser *parser) {
       };
       cmd_word_part *part = cmd_word_part_new(CMD_WORD_PART_TYPE_LIT, val);
 
+      if (pattern_has_meta(val.literal->str, val.literal->len)) {
+        word->glob = true;
+      }
+
       word->parts = g_list_append(word->parts, part);
     } else if (c == STR_UNQUOTED || c == STR_QUOTED) {
       cmd_word_part_value val = {
@@ -301,6 +447,15 @@ cmd_word *cmd_parser_parse_word(cmd_parser *parser) {
       cmd_word_part *part = cmd_word_part_new(CMD_WORD_PART_TYPE_STR, val);
 
       word->parts = g_list_append(word->parts, part);
+
+      // "$@" expands to a field per arg, even in quotes.
+      for (GList *node = val.str->parts; node != NULL; node = node->next) {
+        cmd_word_part_str_part *str_part = node->data;
+        if (str_part->type == CMD_WORD_PART_STR_PART_TYPE_VAR &&
+            str_part->value.var->special == '@') {
+          word->split = true;
+        }
+      }
     } else if (c == VAR_EXPAND_START) {
       cmd_word_part_value val = {
           .var = cmd_parser_parse_var_expand(parser),
@@ -308,6 +463,7 @@ cmd_word *cmd_parser_parse_word(cmd_parser *parser) {
       cmd_word_part *part = cmd_word_part_new(CMD_WORD_PART_TYPE_VAR, val);
 
       word->parts = g_list_append(word->parts, part);
+      word->split = true;
     } else {
       cmd_parser_err(parser, "parse_word: unexpected character %c", c);
     }
@@ -316,16 +472,751 @@ cmd_word *cmd_parser_parse_word(cmd_parser *parser) {
   return word;
 }
 
+// cmd_parser_skip_blanks skips spaces.
+static void cmd_parser_skip_blanks(cmd_parser *parser) {
+  while (*parser->next == ' ') {
+    parser->next++;
+  }
+}
+
+// cmd_parser_line_end returns where the line c is on ends (just past its
+// newline, or at the NUL if it's the last line), skipping over any quoted
+// strings and comments.
+static char *cmd_parser_line_end(char *c) {
+  char quote = 0;
+
+  for (; *c != 0; c++) {
+    if (quote != 0) {
+      if (*c == quote) {
+        quote = 0;
+      }
+    } else if (*c == STR_UNQUOTED || *c == STR_QUOTED) {
+      quote = *c;
+    } else if (*c == COMMENT && *(c - 1) == ' ') {
+      while (!is_end_of_line(*c)) {
+        c++;
+      }
+
+      return *c != 0 ? c + 1 : c;
+    } else if (*c == '\n') {
+      return c + 1;
+    }
+  }
+
+  return c;
+}
+
+// cmd_parser_str_literal_part returns a str part holding literal.
+static cmd_word_part_str_part *cmd_parser_str_literal_part(GString *literal) {
+  cmd_word_part_str_part *part = malloc(sizeof(cmd_word_part_str_part));
+  part->type = CMD_WORD_PART_STR_PART_TYPE_LITERAL;
+  part->value.literal = literal;
+
+  return part;
+}
+
+// cmd_parser_parse_heredoc_body parses the expansions in an unquoted here-doc's
+// body, where '"' and '\'' are literal and '\\' only escapes '$', '`', '\\'
+// and newlines.
+//
+// The text between expansions is collected up front, so a body with none is a
+// single literal that costs nothing to expand.
+static GList *cmd_parser_parse_heredoc_body(cmd_parser *parser, char *body) {
+  char *saved_next = parser->next;
+  parser->next = body;
+
+  GList *parts = NULL;
+  GString *literal = g_string_new(NULL);
+
+  while (*parser->next != 0) {
+    char c = *parser->next;
+    char after = *(parser->next + 1);
+
+    bool is_arith = c == VAR_EXPAND_START && after == '(' &&
+                    *(parser->next + 2) == '(';
+    bool is_var = c == VAR_EXPAND_START && after != 0 &&
+                  (is_var_name_char(after) || strchr("@*#?", after) != NULL);
+
+    if (!is_arith && !is_var) {
+      if (c == '\\' && after != 0 && strchr("$`\\\n", after) != NULL) {
+        if (after != '\n') {
+          g_string_append_c(literal, after);
+        }
+
+        parser->next += 2;
+        continue;
+      }
+
+      g_string_append_c(literal, c);
+      parser->next++;
+      continue;
+    }
+
+    if (literal->len > 0) {
+      parts = g_list_append(parts, cmd_parser_str_literal_part(literal));
+      literal = g_string_new(NULL);
+    }
+
+    cmd_word_part_str_part *part = malloc(sizeof(cmd_word_part_str_part));
+    if (is_arith) {
+      parser->next++;
+      part->type = CMD_WORD_PART_STR_PART_TYPE_ARITH;
+      part->value.arith = cmd_parser_parse_arith(parser);
+    } else {
+      part->type = CMD_WORD_PART_STR_PART_TYPE_VAR;
+      part->value.var = cmd_parser_parse_var_expand(parser);
+    }
+
+    parts = g_list_append(parts, part);
+  }
+
+  if (literal->len > 0 || parts == NULL) {
+    parts = g_list_append(parts, cmd_parser_str_literal_part(literal));
+  } else {
+    g_string_free(literal, true);
+  }
+
+  parser->next = saved_next;
+
+  return parts;
+}
+
+// cmd_parser_parse_heredoc parses a here-doc's delimiter (just after the "<<")
+// and reads its body from the lines after the current one (or after the
+// bodies of the line's earlier here-docs), returning it as a quoted word.
+//
+// The cursor will be placed after the delimiter; parsing skips the bodies once
+// it reaches the end of the line (see cmd_parser_skip_newline).
+static cmd_word *cmd_parser_parse_heredoc(cmd_parser *parser) {
+  bool strip_tabs = *parser->next == '-';
+  if (strip_tabs) {
+    parser->next++;
+  }
+
+  cmd_parser_skip_blanks(parser);
+
+  // Quoting any of the delimiter means the body is taken literally.
+  GString *delim = g_string_new(NULL);
+  bool quoted = false;
+  char quote = 0;
+
+  for (; *parser->next != 0; parser->next++) {
+    char c = *parser->next;
+
+    if (quote != 0) {
+      if (c == quote) {
+        quote = 0;
+      } else {
+        g_string_append_c(delim, c);
+      }
+    } else if (c == STR_UNQUOTED || c == STR_QUOTED) {
+      quote = c;
+      quoted = true;
+    } else if (c == '\\' && *(parser->next + 1) != 0) {
+      quoted = true;
+      g_string_append_c(delim, *++parser->next);
+    } else if (is_word_end(c)) {
+      break;
+    } else {
+      g_string_append_c(delim, c);
+    }
+  }
+
+  if (delim->len == 0 && !quoted) {
+    cmd_parser_err(parser, "parse_redirect: missing here-doc delimiter");
+  }
+
+  char *line = parser->heredoc_end != NULL ? parser->heredoc_end
+                                           : cmd_parser_line_end(parser->next);
+  GString *body = g_string_new(NULL);
+
+  // Without a delimiter line, the body runs to the end of the input.
+  while (*line != 0) {
+    if (strip_tabs) {
+      while (*line == '\t') {
+        line++;
+      }
+    }
+
+    char *end = strchr(line, '\n');
+    char *next_line = end != NULL ? end + 1 : line + strlen(line);
+    size_t len = (size_t)((end != NULL ? end : next_line) - line);
+
+    if (len == delim->len && memcmp(line, delim->str, len) == 0) {
+      line = next_line;
+      break;
+    }
+
+    g_string_append_len(body, line, (gssize)(next_line - line));
+    line = next_line;
+
+    // Like bash, the last line keeps its newline even if the input doesn't.
+    if (end == NULL) {
+      g_string_append_c(body, '\n');
+    }
+  }
+
+  parser->heredoc_end = line;
+  g_string_free(delim, true);
+
+  cmd_word_part_str *str = malloc(sizeof(cmd_word_part_str));
+  str->quoted = true;
+
+  if (quoted) {
+    str->parts = g_list_append(NULL, cmd_parser_str_literal_part(body));
+  } else {
+    str->parts = cmd_parser_parse_heredoc_body(parser, body->str);
+    g_string_free(body, true);
+  }
+
+  cmd_word_part_value val = {.str = str};
+
+  cmd_word *word = malloc(sizeof(cmd_word));
+  word->parts = g_list_append(NULL, cmd_word_part_new(CMD_WORD_PART_TYPE_STR,
+                                                      val));
+  word->glob = false;
+  word->split = false;
+
+  return word;
+}
+
+// cmd_parser_parse_redirect parses a redirection.
+//
+// The cursor will be placed after the redirection's target
+// (e.g. "2>&1" will be returned and the cursor will be at ' ' in "2>&1 foo").
+cmd_redirect *cmd_parser_parse_redirect(cmd_parser *parser) {
+  cmd_redirect *redirect = malloc(sizeof(cmd_redirect));
+  redirect->fd = -1;
+
+  if (is_numeric(*parser->next)) {
+    redirect->fd = 0;
+    while (is_numeric(*parser->next)) {
+      redirect->fd = redirect->fd * 10 + (*parser->next - '0');
+      parser->next++;
+    }
+  }
+
+  char c = *parser->next++;
+  if (redirect->fd < 0) {
+    redirect->fd = c == REDIRECT_IN ? STDIN_FILENO : STDOUT_FILENO;
+  }
+
+  if (c == REDIRECT_IN && *parser->next == REDIRECT_IN) {
+    parser->next++;
+
+    if (*parser->next != REDIRECT_IN) {
+      redirect->type = CMD_REDIRECT_TYPE_HEREDOC;
+      redirect->target = cmd_parser_parse_heredoc(parser);
+
+      return redirect;
+    }
+
+    redirect->type = CMD_REDIRECT_TYPE_HERESTRING;
+    parser->next++;
+  } else if (*parser->next == '&') {
+    redirect->type = CMD_REDIRECT_TYPE_DUP;
+    parser->next++;
+  } else if (c == REDIRECT_OUT && *parser->next == REDIRECT_OUT) {
+    redirect->type = CMD_REDIRECT_TYPE_APPEND;
+    parser->next++;
+  } else {
+    redirect->type =
+        c == REDIRECT_IN ? CMD_REDIRECT_TYPE_IN : CMD_REDIRECT_TYPE_OUT;
+  }
+
+  while (*parser->next == ' ') {
+    parser->next++;
+  }
+
+  redirect->target = cmd_parser_parse_word(parser);
+  if (redirect->target->parts == NULL) {
+    cmd_parser_err(parser, "parse_redirect: missing target");
+  }
+
+  // A here-string's input is the word and a newline.
+  if (redirect->type == CMD_REDIRECT_TYPE_HERESTRING) {
+    cmd_word_part_value val = {.literal = g_string_new("\n")};
+    redirect->target->parts = g_list_append(
+        redirect->target->parts,
+        cmd_word_part_new(CMD_WORD_PART_TYPE_LIT, val));
+  }
+
+  return redirect;
+}
+
+// cmd_parser_peek_keyword returns the reserved word at the cursor (or NULL if
+// there isn't one), without consuming it.
+static const char *cmd_parser_peek_keyword(cmd_parser *parser) {
+  static const char *const keywords[] = {
+      "if",  "then", "elif", "else", "fi",   "while", "until", "for",
+      "in",  "do",   "done", "case", "esac", "{",     "}",     NULL};
+
+  for (const char *const *keyword = keywords; *keyword != NULL; keyword++) {
+    size_t len = strlen(*keyword);
+    if (strncmp(parser->next, *keyword, len) == 0 &&
+        is_word_end(parser->next[len])) {
+      return *keyword;
+    }
+  }
+
+  return NULL;
+}
+
+// cmd_parser_skip_newline consumes the newline at the cursor, along with the
+// bodies of any here-docs on the line it ends.
+static void cmd_parser_skip_newline(cmd_parser *parser) {
+  parser->next++;
+
+  if (parser->heredoc_end != NULL) {
+    parser->next = parser->heredoc_end;
+    parser->heredoc_end = NULL;
+  }
+}
+
+// cmd_parser_skip_separators skips anything between cmds in a list: blanks,
+// newlines, comments and ';' (but not ";;", which ends a case item).
+static void cmd_parser_skip_separators(cmd_parser *parser) {
+  for (;;) {
+    char c = *parser->next;
+
+    if (c == '\n') {
+      cmd_parser_skip_newline(parser);
+    } else if (c == ' ' || (c == ';' && parser->next[1] != ';')) {
+      parser->next++;
+    } else if (c == COMMENT) {
+      parser_consume_to_end_of_line(parser);
+    } else {
+      return;
+    }
+  }
+}
+
+// cmd_parser_expect_keyword consumes the reserved word keyword (after any
+// separators), failing if it's something else.
+static void cmd_parser_expect_keyword(cmd_parser *parser, const char *keyword) {
+  cmd_parser_skip_separators(parser);
+
+  const char *found = cmd_parser_peek_keyword(parser);
+  if (found == NULL || strcmp(found, keyword) != 0) {
+    cmd_parser_err(parser, "syntax error: expected '%s' near: %.16s", keyword,
+                   *parser->next != 0 ? parser->next : "end of input");
+  }
+
+  parser->next += strlen(keyword);
+}
+
+// cmd_parser_parse_list parses cmds up to (but not including) the first of
+// the reserved words in ends (or ";;" if it's one of them).
+//
+// The cursor will be placed at the word that ended the list.
+static GList *cmd_parser_parse_list(cmd_parser *parser,
+                                    const char *const *ends) {
+  GList *cmds = NULL;
+
+  parser->depth++;
+
+  for (;;) {
+    cmd_parser_skip_separators(parser);
+
+    if (*parser->next == '\0' || (parser->in_sub && *parser->next == ')')) {
+      cmd_parser_err(parser, "syntax error: expected '%s' before end of input",
+                     ends[0]);
+    }
+
+    if (parser->next[0] == ';' && parser->next[1] == ';' &&
+        keyword_in(";;", ends)) {
+      break;
+    }
+
+    const char *keyword = cmd_parser_peek_keyword(parser);
+    if (keyword != NULL && keyword_in(keyword, ends)) {
+      break;
+    }
+
+    cmd *c = cmd_parser_parse(parser, parser->next);
+    if (c->parts == NULL) {
+      cmd_free(c);
+
+      cmd_parser_err(parser, "syntax error near: %.16s", parser->next);
+    }
+
+    cmds = g_list_append(cmds, c);
+  }
+
+  parser->depth--;
+
+  return cmds;
+}
+
+// cmd_parser_parse_if parses an "if" cmd, starting after the "if".
+//
+// The cursor will be placed after the "fi".
+static cmd_if *cmd_parser_parse_if(cmd_parser *parser) {
+  static const char *const cond_ends[] = {"then", NULL};
+  static const char *const body_ends[] = {"fi", "elif", "else", NULL};
+  static const char *const else_ends[] = {"fi", NULL};
+
+  cmd_if *if_cmd = malloc(sizeof(cmd_if));
+  if_cmd->clauses = NULL;
+
+  const char *keyword = "if";
+  while (strcmp(keyword, "fi") != 0) {
+    cmd_if_clause *clause = malloc(sizeof(cmd_if_clause));
+    clause->cond = NULL;
+
+    if (strcmp(keyword, "else") == 0) {
+      clause->body = cmd_parser_parse_list(parser, else_ends);
+    } else {
+      clause->cond = cmd_parser_parse_list(parser, cond_ends);
+      cmd_parser_expect_keyword(parser, "then");
+      clause->body = cmd_parser_parse_list(parser, body_ends);
+    }
+
+    if_cmd->clauses = g_list_append(if_cmd->clauses, clause);
+
+    keyword = cmd_parser_peek_keyword(parser);
+    parser->next += strlen(keyword);
+  }
+
+  return if_cmd;
+}
+
+// cmd_parser_parse_do_group parses a loop body ("do ...; done").
+//
+// The cursor will be placed after the "done".
+static GList *cmd_parser_parse_do_group(cmd_parser *parser) {
+  static const char *const body_ends[] = {"done", NULL};
+
+  cmd_parser_expect_keyword(parser, "do");
+  GList *body = cmd_parser_parse_list(parser, body_ends);
+  cmd_parser_expect_keyword(parser, "done");
+
+  return body;
+}
+
+// cmd_parser_parse_loop parses a "while" or "until" loop, starting after the
+// keyword.
+//
+// The cursor will be placed after the "done".
+static cmd_loop *cmd_parser_parse_loop(cmd_parser *parser, bool until) {
+  static const char *const cond_ends[] = {"do", NULL};
+
+  cmd_loop *loop = malloc(sizeof(cmd_loop));
+  loop->until = until;
+  loop->cond = cmd_parser_parse_list(parser, cond_ends);
+  loop->body = cmd_parser_parse_do_group(parser);
+
+  return loop;
+}
+
+// cmd_parser_parse_for parses a "for" loop, starting after the "for".
+//
+// The cursor will be placed after the "done".
+static cmd_for *cmd_parser_parse_for(cmd_parser *parser) {
+  cmd_parser_skip_blanks(parser);
+
+  char *name_start = parser->next;
+  while (is_var_name_char(*parser->next)) {
+    parser->next++;
+  }
+
+  size_t name_len = (size_t)(parser->next - name_start);
+  if (name_len == 0 || !is_word_end(*parser->next)) {
+    cmd_parser_err(parser, "syntax error: bad for loop variable near: %.16s",
+                   name_start);
+  }
+
+  cmd_for *for_cmd = malloc(sizeof(cmd_for));
+  for_cmd->name = g_strndup(name_start, name_len);
+  for_cmd->slot = var_store_intern(name_start, name_len);
+  for_cmd->words = NULL;
+  for_cmd->has_words = false;
+
+  // Look for "in" (possibly on the next line).
+  char *after_name = parser->next;
+  cmd_parser_skip_blanks(parser);
+  if (*parser->next == '\n') {
+    cmd_parser_skip_separators(parser);
+  }
+
+  const char *keyword = cmd_parser_peek_keyword(parser);
+  if (keyword != NULL && strcmp(keyword, "in") == 0) {
+    parser->next += 2;
+    for_cmd->has_words = true;
+
+    for (;;) {
+      cmd_parser_skip_blanks(parser);
+
+      char c = *parser->next;
+      if (c == ';' || c == '\n' || c == '\0' || c == COMMENT) {
+        break;
+      }
+
+      cmd_word *word = cmd_parser_parse_word(parser);
+      if (word->parts == NULL) {
+        cmd_parser_err(parser, "syntax error in for loop near: %.16s",
+                       parser->next);
+      }
+
+      for_cmd->words = g_list_append(for_cmd->words, word);
+    }
+  } else {
+    parser->next = after_name;
+  }
+
+  for_cmd->body = cmd_parser_parse_do_group(parser);
+
+  return for_cmd;
+}
+
+// cmd_parser_parse_case parses a "case" cmd, starting after the "case".
+//
+// The cursor will be placed after the "esac".
+static cmd_case *cmd_parser_parse_case(cmd_parser *parser) {
+  static const char *const item_ends[] = {"esac", ";;", NULL};
+
+  cmd_parser_skip_blanks(parser);
+
+  cmd_case *case_cmd = malloc(sizeof(cmd_case));
+  case_cmd->word = cmd_parser_parse_word(parser);
+  case_cmd->items = NULL;
+
+  if (case_cmd->word->parts == NULL) {
+    cmd_parser_err(parser, "syntax error: missing case word");
+  }
+
+  cmd_parser_expect_keyword(parser, "in");
+
+  for (;;) {
+    cmd_parser_skip_separators(parser);
+
+    const char *keyword = cmd_parser_peek_keyword(parser);
+    if (keyword != NULL && strcmp(keyword, "esac") == 0) {
+      parser->next += 4;
+      break;
+    }
+
+    if (*parser->next == '\0') {
+      cmd_parser_err(parser,
+                     "syntax error: expected 'esac' before end of input");
+    }
+
+    cmd_case_item *item = malloc(sizeof(cmd_case_item));
+    item->patterns = NULL;
+
+    if (*parser->next == '(') {
+      parser->next++;
+    }
+
+    // Patterns end at ')', like a sub.
+    bool was_in_sub = parser->in_sub;
+    parser->in_sub = true;
+
+    for (;;) {
+      cmd_parser_skip_blanks(parser);
+
+      cmd_word *word = cmd_parser_parse_word(parser);
+      if (word->parts == NULL) {
+        cmd_parser_err(parser, "syntax error in case pattern near: %.16s",
+                       parser->next);
+      }
+
+      item->patterns = g_list_append(item->patterns, word);
+
+      cmd_parser_skip_blanks(parser);
+      if (*parser->next != PIPE) {
+        break;
+      }
+
+      parser->next++;
+    }
+
+    parser->in_sub = was_in_sub;
+
+    if (*parser->next != ')') {
+      cmd_parser_err(parser, "syntax error: expected ')' in case near: %.16s",
+                     parser->next);
+    }
+    parser->next++;
+
+    item->body = cmd_parser_parse_list(parser, item_ends);
+    case_cmd->items = g_list_append(case_cmd->items, item);
+
+    if (parser->next[0] == ';' && parser->next[1] == ';') {
+      parser->next += 2;
+    }
+  }
+
+  return case_cmd;
+}
+
+// cmd_parser_parse_compound parses the compound cmd starting with keyword.
+static cmd_part *cmd_parser_parse_compound(cmd_parser *parser,
+                                           const char *keyword) {
+  parser->next += strlen(keyword);
+  parser->depth++;
+
+  cmd_part *part = malloc(sizeof(cmd_part));
+
+  if (strcmp(keyword, "if") == 0) {
+    part->type = CMD_PART_TYPE_IF;
+    part->value.if_cmd = cmd_parser_parse_if(parser);
+  } else if (strcmp(keyword, "while") == 0 || strcmp(keyword, "until") == 0) {
+    part->type = CMD_PART_TYPE_LOOP;
+    part->value.loop = cmd_parser_parse_loop(parser, keyword[0] == 'u');
+  } else if (strcmp(keyword, "for") == 0) {
+    part->type = CMD_PART_TYPE_FOR;
+    part->value.for_cmd = cmd_parser_parse_for(parser);
+  } else if (strcmp(keyword, "{") == 0) {
+    static const char *const group_ends[] = {"}", NULL};
+
+    part->type = CMD_PART_TYPE_GROUP;
+    part->value.group = cmd_parser_parse_list(parser, group_ends);
+    cmd_parser_expect_keyword(parser, "}");
+  } else {
+    part->type = CMD_PART_TYPE_CASE;
+    part->value.case_cmd = cmd_parser_parse_case(parser);
+  }
+
+  parser->depth--;
+
+  return part;
+}
+
+// cmd_parser_func_def_name_len returns the length of the function name if the
+// cursor is at a function definition's "name()" (or 0 if it isn't).
+static size_t cmd_parser_func_def_name_len(cmd_parser *parser) {
+  char *c = parser->next;
+  if (is_numeric(*c)) {
+    return 0;
+  }
+
+  while (is_var_name_char(*c) || *c == '-') {
+    c++;
+  }
+
+  size_t len = (size_t)(c - parser->next);
+  while (*c == ' ') {
+    c++;
+  }
+
+  if (len == 0 || *c++ != '(') {
+    return 0;
+  }
+
+  while (*c == ' ') {
+    c++;
+  }
+
+  return *c == ')' ? len : 0;
+}
+
+// cmd_parser_parse_func_def parses a function definition ("name() compound").
+//
+// The cursor will be placed after the function's body.
+static cmd_part *cmd_parser_parse_func_def(cmd_parser *parser,
+                                           size_t name_len) {
+  cmd_func *func = malloc(sizeof(cmd_func));
+  func->refs = 1;
+  func->name = g_strndup(parser->next, name_len);
+
+  parser->next = strchr(parser->next, ')') + 1;
+
+  // The body can start on the next line.
+  cmd_parser_skip_separators(parser);
+
+  const char *keyword = cmd_parser_peek_keyword(parser);
+  if (keyword == NULL || !keyword_in(keyword, compound_keywords)) {
+    cmd_parser_err(parser, "syntax error: expected function body for '%s'",
+                   func->name);
+  }
+
+  func->body = cmd_parser_parse_compound(parser, keyword);
+
+  cmd_part *part = malloc(sizeof(cmd_part));
+  part->type = CMD_PART_TYPE_FUNC_DEF;
+  part->value.func_def = func;
+
+  return part;
+}
+
+// cmd_parser_is_coproc returns whether the cursor is at a "coproc".
+static bool cmd_parser_is_coproc(cmd_parser *parser) {
+  return strncmp(parser->next, "coproc", 6) == 0 &&
+         is_word_end(parser->next[6]);
+}
+
+// cmd_parser_parse_coproc parses a "coproc [name] cmd", where (like bash) only
+// a compound cmd can be given a name, and the rest are named COPROC.
+//
+// The coproc's cmd consumes the rest of the statement (including its
+// terminator).
+static cmd_part *cmd_parser_parse_coproc(cmd_parser *parser) {
+  parser->next += 6;
+  cmd_parser_skip_blanks(parser);
+
+  char *name_end = parser->next;
+  while (is_var_name_char(*name_end)) {
+    name_end++;
+  }
+
+  char *name = NULL;
+  if (name_end > parser->next && !is_numeric(*parser->next) &&
+      *name_end == ' ') {
+    char *after = parser->next;
+    parser->next = name_end;
+    cmd_parser_skip_blanks(parser);
+
+    const char *keyword = cmd_parser_peek_keyword(parser);
+    if (keyword != NULL && keyword_in(keyword, compound_keywords)) {
+      name = g_strndup(after, (gsize)(name_end - after));
+    } else {
+      parser->next = after;
+    }
+  }
+
+  cmd *body = cmd_parser_parse(parser, parser->next);
+  if (body == NULL || body->parts == NULL) {
+    if (body != NULL) {
+      cmd_free(body);
+    }
+
+    free(name);
+    cmd_parser_err(parser, "syntax error: expected a cmd after 'coproc'");
+  }
+
+  cmd_coproc *coproc = malloc(sizeof(cmd_coproc));
+  coproc->name = name != NULL ? name : strdup("COPROC");
+  coproc->body = body;
+
+  cmd_part *part = malloc(sizeof(cmd_part));
+  part->type = CMD_PART_TYPE_COPROC;
+  part->value.coproc = coproc;
+
+  return part;
+}
+
 cmd_parser *cmd_parser_new() {
   cmd_parser *parser = malloc(sizeof(cmd_parser));
   parser->in_sub = false;
+  parser->depth = 0;
+  parser->err_jmp = NULL;
+  parser->err = NULL;
+  parser->heredoc_end = NULL;
 
   return parser;
 }
 
+void cmd_parser_free(cmd_parser *parser) {
+  free(parser->err);
+  free(parser);
+}
+
 void cmd_parser_set_next(cmd_parser* parser, char* next) {
   parser->in_sub = false;
+  parser->depth = 0;
   parser->next = next;
+  parser->heredoc_end = NULL;
 }
 
 // cmd_parser_parse parses the provided input and returns an executable cmd*.
@@ -339,6 +1230,7 @@ cmd *cmd_parser_parse(cmd_parser *parser, char *input) {
   parser->next = input;
 
   bool can_set_vars = true;
+  bool is_compound = false;
   while (*parser->next != '\0') {
     char c = *parser->next;
 
@@ -351,61 +1243,135 @@ cmd *cmd_parser_parse(cmd_parser *parser, char *input) {
       return res;
     }
 
-    if (c == '\n' || c == ';' || (parser->in_sub && c == ')')) {
+    // Leave ";;" for the case item it ends.
+    if (c == ';' && *(parser->next + 1) == ';') {
+      if (parser->depth == 0) {
+        cmd_parser_err(parser, "syntax error near unexpected token ';;'");
+      }
+
+      return res;
+    }
+
+    if (c == '\n') {
+      cmd_parser_skip_newline(parser);
+      return res;
+    }
+
+    if (c == ';' || (parser->in_sub && c == ')')) {
       parser->next++;
       return res;
     }
 
-    // Check if this is a var assignment.
-    if (can_set_vars && is_literal_char(c)) {
-      // Peek to the ' '
-      char *space_ch = strstr(parser->next, " ");
+    // Check for reserved words and "!" where a cmd name would go.
+    if (res->parts == NULL) {
+      const char *keyword = cmd_parser_peek_keyword(parser);
 
-      // If that failed, try '\n'
-      if (space_ch == NULL) {
-        space_ch = strstr(parser->next, "\n");
+      if (keyword != NULL && keyword_in(keyword, compound_keywords)) {
+        res->parts = g_list_append(res->parts,
+                                   cmd_parser_parse_compound(parser, keyword));
+        can_set_vars = false;
+        is_compound = true;
+        continue;
       }
 
-      // If that failed, try NULL
-      if (space_ch == NULL) {
-        space_ch = strstr(parser->next, "\0");
+      if (keyword != NULL && keyword_in(keyword, list_end_keywords)) {
+        if (parser->depth == 0) {
+          cmd_parser_err(parser, "syntax error near unexpected token '%s'",
+                         keyword);
+        }
+
+        // Leave it for the compound cmd whose list it ends.
+        return res;
       }
 
-      if (space_ch != NULL) {
-        size_t space_index = (size_t)(space_ch - parser->next);
+      if (c == '(' && *(parser->next + 1) == '(') {
+        cmd_part *part = malloc(sizeof(cmd_part));
+        part->type = CMD_PART_TYPE_ARITH;
+        part->value.arith = cmd_parser_parse_arith(parser);
 
-        // Peek to the '='.
-        char *var_assign_ch = strnstr(parser->next, "=", space_index - 1);
-        if (var_assign_ch != NULL) {
-          size_t var_assign_index = (size_t)(var_assign_ch - parser->next);
+        res->parts = g_list_append(res->parts, part);
+        can_set_vars = false;
+        is_compound = true;
+        continue;
+      }
 
-          // Grab the name.
-          char *name = malloc((var_assign_index + 1) * sizeof(char));
-          memcpy(name, parser->next, var_assign_index);
-          name[var_assign_index] = 0;
+      if (c == '!' && is_word_end(*(parser->next + 1))) {
+        res->negated = !res->negated;
+        parser->next++;
+        continue;
+      }
 
-          // Read the value as the next word on the other side of the '='.
-          parser->next = var_assign_ch + 1;
-          cmd_word *value = cmd_parser_parse_word(parser);
+      if (cmd_parser_is_coproc(parser)) {
+        res->parts =
+            g_list_append(res->parts, cmd_parser_parse_coproc(parser));
+        return res;
+      }
 
-          cmd_var_assign *var = malloc(sizeof(cmd_var_assign));
-          var->name = name;
-          var->value = value;
+      size_t func_name_len = cmd_parser_func_def_name_len(parser);
+      if (func_name_len > 0) {
+        res->parts = g_list_append(
+            res->parts, cmd_parser_parse_func_def(parser, func_name_len));
+        can_set_vars = false;
+        is_compound = true;
+        continue;
+      }
+    }
 
-          cmd_part *part = malloc(sizeof(cmd_part));
-          part->type = CMD_PART_TYPE_VAR_ASSIGN;
-          part->value.var_assign = var;
+    // Check if this is a redirection.
+    if (is_redirect_start(parser->next)) {
+      cmd_part *part = malloc(sizeof(cmd_part));
+      part->type = CMD_PART_TYPE_REDIRECT;
+      part->value.redirect = cmd_parser_parse_redirect(parser);
 
-          res->parts = g_list_append(res->parts, part);
+      res->parts = g_list_append(res->parts, part);
+      continue;
+    }
 
-          continue;
-        }
+    // Check if this is a var assignment.
+    if (can_set_vars && is_literal_char(c)) {
+      // Peek to the '=' without leaving the current word (the input may be an
+      // entire script, so we can't look any further than that).
+      char *var_assign_ch = parser->next;
+      while (is_literal_char(*var_assign_ch) && *var_assign_ch != VAR_ASSIGN &&
+             *var_assign_ch != '\0') {
+        var_assign_ch++;
+      }
+
+      if (*var_assign_ch == VAR_ASSIGN) {
+        size_t var_assign_index = (size_t)(var_assign_ch - parser->next);
+
+        // Grab the name.
+        char *name = malloc((var_assign_index + 1) * sizeof(char));
+        memcpy(name, parser->next, var_assign_index);
+        name[var_assign_index] = 0;
+
+        // Read the value as the next word on the other side of the '='.
+        parser->next = var_assign_ch + 1;
+        cmd_word *value = cmd_parser_parse_word(parser);
+
+        cmd_var_assign *var = malloc(sizeof(cmd_var_assign));
+        var->name = name;
+        var->slot = var_store_intern(name, var_assign_index);
+        var->value = value;
+
+        cmd_part *part = malloc(sizeof(cmd_part));
+        part->type = CMD_PART_TYPE_VAR_ASSIGN;
+        part->value.var_assign = var;
+
+        res->parts = g_list_append(res->parts, part);
+
+        continue;
       }
     }
 
     // Check if this is a word.
     if (is_literal_char(c) || c == STR_UNQUOTED || c == STR_QUOTED ||
         c == VAR_EXPAND_START || c == '<') {
+      // Only redirections can follow a compound cmd.
+      if (is_compound) {
+        cmd_parser_err(parser, "syntax error near: %.16s", parser->next);
+      }
+
       can_set_vars = false;
 
       cmd_part *part = malloc(sizeof(cmd_part));
@@ -434,10 +1400,12 @@ cmd *cmd_parser_parse(cmd_parser *parser, char *input) {
 
         res->parts = g_list_append(res->parts, part);
       } else {
-        giveup("parse: background procs not implemented");
+        cmd_parser_err(parser, "parse: background procs not implemented");
       }
 
-      continue;
+      // The AND'd cmd consumed the rest of the statement (including its
+      // terminator), so this cmd is done.
+      return res;
     }
 
     // Check if this is a pipe or an OR.
@@ -461,6 +1429,11 @@ cmd *cmd_parser_parse(cmd_parser *parser, char *input) {
         // Read everything to the right of the pipe as its own cmd.
         cmd *piped_cmd = cmd_parser_parse(parser, parser->next);
 
+        // A pipeline's status is its last cmd's, so that's what "!" negates.
+        if (piped_cmd != NULL && res->negated) {
+          piped_cmd->negated = !piped_cmd->negated;
+        }
+
         cmd_part *part = malloc(sizeof(cmd_part));
         part->type = CMD_PART_TYPE_PIPE;
         part->value.piped_cmd = piped_cmd;
@@ -468,7 +1441,9 @@ cmd *cmd_parser_parse(cmd_parser *parser, char *input) {
         res->parts = g_list_append(res->parts, part);
       }
 
-      continue;
+      // The piped or OR'd cmd consumed the rest of the statement (including
+      // its terminator), so this cmd is done.
+      return res;
     }
 
     cmd_parser_err(parser, "parse: unexpected char %c", c);
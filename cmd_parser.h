@@ -1,15 +1,32 @@
 #pragma once
 
 #include "cmd.h"
+#include <setjmp.h>
 
 typedef struct cmd_parser {
   char *next;
 
   bool in_sub;
+
+  // The number of compound cmds (e.g. "if" or "while") being parsed, inside
+  // which reserved words like "fi" end the current list instead of being an
+  // error.
+  int depth;
+
+  // If set, parse errors jump here (with a status of 1) instead of exiting,
+  // leaving the error's message in err rather than printing it.
+  jmp_buf *err_jmp;
+  char *err;
+
+  // Where the bodies of the here-docs started on the current line end (or
+  // NULL if there aren't any), which is where parsing resumes after the line.
+  char *heredoc_end;
 } cmd_parser;
 
 cmd_parser *cmd_parser_new();
 
+void cmd_parser_free(cmd_parser *parser);
+
 void cmd_parser_set_next(cmd_parser* parser, char* next);
 
 cmd *cmd_parser_parse(cmd_parser *parser, char *input);
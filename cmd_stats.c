@@ -0,0 +1,144 @@
+#include "cmd_stats.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+cmd_stats *cmd_stats_new(void) {
+  cmd_stats *stats = malloc(sizeof(cmd_stats));
+  stats->pipes = g_array_new(false, false, sizeof(cmd_pipe_stat));
+  stats->terms = g_hash_table_new(g_str_hash, g_str_equal);
+  stats->cache_hits = 0;
+  stats->cache_disk_hits = 0;
+  stats->cache_misses = 0;
+  g_mutex_init(&stats->lock);
+
+  return stats;
+}
+
+void cmd_stats_free(cmd_stats *stats) {
+  for (guint i = 0; i < stats->pipes->len; i++) {
+    g_free(g_array_index(stats->pipes, cmd_pipe_stat, i).label);
+  }
+
+  g_array_free(stats->pipes, true);
+
+  GHashTableIter iter;
+  gpointer term_stat;
+  g_hash_table_iter_init(&iter, stats->terms);
+  while (g_hash_table_iter_next(&iter, NULL, &term_stat)) {
+    g_free(((cmd_term_stat *)term_stat)->term);
+    free(term_stat);
+  }
+
+  g_hash_table_destroy(stats->terms);
+  g_mutex_clear(&stats->lock);
+  free(stats);
+}
+
+// cmd_stats_add_pipe records a pipe, taking ownership of label.
+void cmd_stats_add_pipe(cmd_stats *stats, const char *kind, char *label,
+                        size_t bytes, bool metered, size_t capacity) {
+  cmd_pipe_stat stat = {.kind = kind,
+                        .label = label,
+                        .bytes = bytes,
+                        .metered = metered,
+                        .capacity = capacity};
+
+  g_mutex_lock(&stats->lock);
+  g_array_append_val(stats->pipes, stat);
+  g_mutex_unlock(&stats->lock);
+}
+
+// cmd_stats_add_cmd records a run of a child started for term.
+void cmd_stats_add_cmd(cmd_stats *stats, const char *term, double elapsed,
+                       bool timed_out) {
+  g_mutex_lock(&stats->lock);
+
+  cmd_term_stat *stat = g_hash_table_lookup(stats->terms, term);
+  if (stat == NULL) {
+    stat = calloc(1, sizeof(cmd_term_stat));
+    stat->term = g_strdup(term);
+    g_hash_table_insert(stats->terms, stat->term, stat);
+  }
+
+  stat->runs++;
+  stat->timeouts += timed_out ? 1 : 0;
+  stat->total += elapsed;
+  stat->max = MAX(stat->max, elapsed);
+
+  g_mutex_unlock(&stats->lock);
+}
+
+// cmd_stats_add_cache records a lookup by the cache builtin.
+void cmd_stats_add_cache(cmd_stats *stats, bool hit, bool from_disk) {
+  g_mutex_lock(&stats->lock);
+
+  if (hit) {
+    stats->cache_hits++;
+    stats->cache_disk_hits += from_disk ? 1 : 0;
+  } else {
+    stats->cache_misses++;
+  }
+
+  g_mutex_unlock(&stats->lock);
+}
+
+// cmd_term_stat_cmp orders term stats by total time, longest first.
+static int cmd_term_stat_cmp(const void *a, const void *b) {
+  const cmd_term_stat *x = *(cmd_term_stat *const *)a;
+  const cmd_term_stat *y = *(cmd_term_stat *const *)b;
+
+  return x->total < y->total ? 1 : x->total > y->total ? -1 : 0;
+}
+
+void cmd_stats_print(cmd_stats *stats, int fd) {
+  size_t total = 0;
+
+  dprintf(fd, "turtle: stats: %u pipes\n", stats->pipes->len);
+  for (guint i = 0; i < stats->pipes->len; i++) {
+    cmd_pipe_stat *stat = &g_array_index(stats->pipes, cmd_pipe_stat, i);
+
+    dprintf(fd, "turtle: stats:   %-7s %-24s ", stat->kind, stat->label);
+    if (stat->metered) {
+      dprintf(fd, "%12zu bytes", stat->bytes);
+      total += stat->bytes;
+    } else {
+      dprintf(fd, "%12s      ", "-");
+    }
+
+    if (stat->capacity > 0) {
+      dprintf(fd, " (%zu byte buffer)", stat->capacity);
+    }
+
+    dprintf(fd, "\n");
+  }
+
+  dprintf(fd, "turtle: stats: %zu bytes metered\n", total);
+
+  guint terms_len = g_hash_table_size(stats->terms);
+  cmd_term_stat **terms = malloc(MAX(terms_len, 1) * sizeof(cmd_term_stat *));
+
+  GHashTableIter iter;
+  gpointer term_stat;
+  guint i = 0;
+  g_hash_table_iter_init(&iter, stats->terms);
+  while (g_hash_table_iter_next(&iter, NULL, &term_stat)) {
+    terms[i++] = term_stat;
+  }
+  qsort(terms, terms_len, sizeof(cmd_term_stat *), cmd_term_stat_cmp);
+
+  dprintf(fd, "turtle: stats: %u cmds\n", terms_len);
+  for (i = 0; i < terms_len; i++) {
+    dprintf(fd,
+            "turtle: stats:   %-32s %8zu runs %10.3fs total %10.3fs max "
+            "%6zu timeouts\n",
+            terms[i]->term, terms[i]->runs, terms[i]->total, terms[i]->max,
+            terms[i]->timeouts);
+  }
+
+  free(terms);
+
+  if (stats->cache_hits + stats->cache_misses > 0) {
+    dprintf(fd, "turtle: stats: cache %zu hits (%zu from disk) %zu misses\n",
+            stats->cache_hits, stats->cache_disk_hits, stats->cache_misses);
+  }
+}
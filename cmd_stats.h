@@ -0,0 +1,68 @@
+#pragma once
+
+#include "glib.h"
+#include <stdbool.h>
+#include <stddef.h>
+
+// cmd_pipe_stat records what went through one pipe (or ring) the executor
+// created.
+typedef struct cmd_pipe_stat {
+  // What the pipe was for ("pipe", "ring" or "cmd-sub").
+  const char *kind;
+
+  // The cmds on either end, e.g. "seq | wc".
+  char *label;
+
+  size_t bytes;
+
+  // Whether bytes is known: the shell only sees what passes through a pipe
+  // when one of its ends is a builtin (or the shell itself).
+  bool metered;
+
+  // The pipe's buffer size in bytes (0 if unknown).
+  size_t capacity;
+} cmd_pipe_stat;
+
+// cmd_term_stat totals the runs of children started for one term.
+typedef struct cmd_term_stat {
+  char *term;
+  size_t runs;
+  size_t timeouts;
+
+  // The total and longest wall time of the runs, in seconds.
+  double total;
+  double max;
+} cmd_term_stat;
+
+// cmd_stats collects an executor's stats while they're enabled (see
+// TURTLE_STATS in main.c).
+//
+// Pipeline threads record stats too, so they're guarded by lock.
+typedef struct cmd_stats {
+  GArray *pipes;
+
+  // cmd_term_stat* by term.
+  GHashTable *terms;
+
+  // The cache builtin's lookups: hits (including those read from its
+  // directory, which are also counted in cache_disk_hits) and misses.
+  size_t cache_hits;
+  size_t cache_disk_hits;
+  size_t cache_misses;
+
+  GMutex lock;
+} cmd_stats;
+
+cmd_stats *cmd_stats_new(void);
+
+void cmd_stats_free(cmd_stats *stats);
+
+void cmd_stats_add_pipe(cmd_stats *stats, const char *kind, char *label,
+                        size_t bytes, bool metered, size_t capacity);
+
+void cmd_stats_add_cmd(cmd_stats *stats, const char *term, double elapsed,
+                       bool timed_out);
+
+void cmd_stats_add_cache(cmd_stats *stats, bool hit, bool from_disk);
+
+void cmd_stats_print(cmd_stats *stats, int fd);
@@ -0,0 +1,320 @@
+#include "cmd_test.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// cmd_test_parser walks the args of an expression.
+typedef struct cmd_test_parser {
+  char **args;
+  int argc;
+  int pos;
+
+  // The directory relative paths are resolved against (or AT_FDCWD).
+  int dirfd;
+
+  // The first error hit (or NULL).
+  const char *err;
+} cmd_test_parser;
+
+static bool cmd_test_parse_or(cmd_test_parser *parser);
+
+// cmd_test_is_unary_op returns whether op is a unary operator.
+static bool cmd_test_is_unary_op(const char *op) {
+  return op[0] == '-' && op[1] != 0 && op[2] == 0 &&
+         strchr("bcdefghLnprsStuwxz", op[1]) != NULL;
+}
+
+// cmd_test_is_binary_op returns whether op is a binary operator.
+static bool cmd_test_is_binary_op(const char *op) {
+  static const char *const ops[] = {"=",   "==",  "!=",  "<",   ">",
+                                    "-eq", "-ne", "-lt", "-le", "-gt",
+                                    "-ge", "-nt", "-ot", "-ef", NULL};
+
+  for (const char *const *o = ops; *o != NULL; o++) {
+    if (strcmp(op, *o) == 0) {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+// cmd_test_unary evaluates a unary operator.
+static bool cmd_test_unary(cmd_test_parser *parser, const char *op,
+                           const char *arg) {
+  struct stat st;
+
+  switch (op[1]) {
+  case 'n':
+    return *arg != 0;
+  case 'z':
+    return *arg == 0;
+  case 't': {
+    char *end;
+    long fd = strtol(arg, &end, 10);
+    return *arg != 0 && *end == 0 && fd >= 0 && fd <= INT_MAX &&
+           isatty((int)fd);
+  }
+  case 'r':
+    return faccessat(parser->dirfd, arg, R_OK, 0) == 0;
+  case 'w':
+    return faccessat(parser->dirfd, arg, W_OK, 0) == 0;
+  case 'x':
+    return faccessat(parser->dirfd, arg, X_OK, 0) == 0;
+  case 'h':
+  case 'L':
+    return fstatat(parser->dirfd, arg, &st, AT_SYMLINK_NOFOLLOW) == 0 &&
+           S_ISLNK(st.st_mode);
+  default:
+    break;
+  }
+
+  if (fstatat(parser->dirfd, arg, &st, 0) != 0) {
+    return false;
+  }
+
+  switch (op[1]) {
+  case 'e':
+    return true;
+  case 'f':
+    return S_ISREG(st.st_mode);
+  case 'd':
+    return S_ISDIR(st.st_mode);
+  case 'b':
+    return S_ISBLK(st.st_mode);
+  case 'c':
+    return S_ISCHR(st.st_mode);
+  case 'p':
+    return S_ISFIFO(st.st_mode);
+  case 'S':
+    return S_ISSOCK(st.st_mode);
+  case 's':
+    return st.st_size > 0;
+  case 'g':
+    return (st.st_mode & S_ISGID) != 0;
+  case 'u':
+    return (st.st_mode & S_ISUID) != 0;
+  default:
+    parser->err = "unknown unary operator";
+    return false;
+  }
+}
+
+// cmd_test_int parses an integer operand.
+static long long cmd_test_int(cmd_test_parser *parser, const char *str) {
+  while (*str == ' ' || *str == '\t') {
+    str++;
+  }
+
+  char *end;
+  errno = 0;
+  long long n = strtoll(str, &end, 10);
+
+  while (*end == ' ' || *end == '\t') {
+    end++;
+  }
+
+  if (end == str || *end != 0 || errno != 0) {
+    parser->err = "integer expression expected";
+  }
+
+  return n;
+}
+
+// cmd_test_mtime_cmp compares the mtimes of two files, with a missing file
+// being older than any other.
+static int cmd_test_mtime_cmp(int dirfd, const char *a, const char *b) {
+  struct stat sa, sb;
+  bool has_a = fstatat(dirfd, a, &sa, 0) == 0;
+  bool has_b = fstatat(dirfd, b, &sb, 0) == 0;
+
+  if (!has_a || !has_b) {
+    return has_a - has_b;
+  }
+
+  if (sa.st_mtim.tv_sec != sb.st_mtim.tv_sec) {
+    return sa.st_mtim.tv_sec < sb.st_mtim.tv_sec ? -1 : 1;
+  }
+
+  if (sa.st_mtim.tv_nsec != sb.st_mtim.tv_nsec) {
+    return sa.st_mtim.tv_nsec < sb.st_mtim.tv_nsec ? -1 : 1;
+  }
+
+  return 0;
+}
+
+// cmd_test_binary evaluates a binary operator.
+static bool cmd_test_binary(cmd_test_parser *parser, const char *a,
+                            const char *op, const char *b) {
+  if (strcmp(op, "=") == 0 || strcmp(op, "==") == 0) {
+    return strcmp(a, b) == 0;
+  }
+  if (strcmp(op, "!=") == 0) {
+    return strcmp(a, b) != 0;
+  }
+  if (strcmp(op, "<") == 0) {
+    return strcmp(a, b) < 0;
+  }
+  if (strcmp(op, ">") == 0) {
+    return strcmp(a, b) > 0;
+  }
+  if (strcmp(op, "-nt") == 0) {
+    return cmd_test_mtime_cmp(parser->dirfd, a, b) > 0;
+  }
+  if (strcmp(op, "-ot") == 0) {
+    return cmd_test_mtime_cmp(parser->dirfd, a, b) < 0;
+  }
+  if (strcmp(op, "-ef") == 0) {
+    struct stat sa, sb;
+    return fstatat(parser->dirfd, a, &sa, 0) == 0 &&
+           fstatat(parser->dirfd, b, &sb, 0) == 0 && sa.st_dev == sb.st_dev &&
+           sa.st_ino == sb.st_ino;
+  }
+
+  long long x = cmd_test_int(parser, a);
+  long long y = cmd_test_int(parser, b);
+
+  switch (op[1] << 8 | op[2]) {
+  case 'e' << 8 | 'q':
+    return x == y;
+  case 'n' << 8 | 'e':
+    return x != y;
+  case 'l' << 8 | 't':
+    return x < y;
+  case 'l' << 8 | 'e':
+    return x <= y;
+  case 'g' << 8 | 't':
+    return x > y;
+  default:
+    return x >= y;
+  }
+}
+
+// cmd_test_peek returns the arg at the cursor (or NULL at the end).
+static const char *cmd_test_peek(cmd_test_parser *parser, int offset) {
+  int i = parser->pos + offset;
+
+  return i < parser->argc ? parser->args[i] : NULL;
+}
+
+// cmd_test_parse_primary parses "( expr )", "-op arg", "arg op arg" or "arg".
+static bool cmd_test_parse_primary(cmd_test_parser *parser) {
+  const char *arg = cmd_test_peek(parser, 0);
+  if (arg == NULL) {
+    parser->err = "argument expected";
+    return false;
+  }
+
+  // A binary operator takes precedence, so e.g. "-n = -n" compares strings.
+  const char *op = cmd_test_peek(parser, 1);
+  if (op != NULL && cmd_test_is_binary_op(op) &&
+      cmd_test_peek(parser, 2) != NULL) {
+    parser->pos += 3;
+    return cmd_test_binary(parser, arg, op, parser->args[parser->pos - 1]);
+  }
+
+  if (strcmp(arg, "(") == 0) {
+    parser->pos++;
+    bool res = cmd_test_parse_or(parser);
+
+    const char *close = cmd_test_peek(parser, 0);
+    if (close == NULL || strcmp(close, ")") != 0) {
+      parser->err = "')' expected";
+      return false;
+    }
+
+    parser->pos++;
+    return res;
+  }
+
+  if (cmd_test_is_unary_op(arg) && op != NULL) {
+    parser->pos += 2;
+    return cmd_test_unary(parser, arg, op);
+  }
+
+  parser->pos++;
+  return *arg != 0;
+}
+
+// cmd_test_parse_not parses "! expr" (or a primary).
+static bool cmd_test_parse_not(cmd_test_parser *parser) {
+  const char *arg = cmd_test_peek(parser, 0);
+  if (arg != NULL && strcmp(arg, "!") == 0 &&
+      cmd_test_peek(parser, 1) != NULL) {
+    parser->pos++;
+    return !cmd_test_parse_not(parser);
+  }
+
+  return cmd_test_parse_primary(parser);
+}
+
+// cmd_test_parse_and parses "expr -a expr ...".
+static bool cmd_test_parse_and(cmd_test_parser *parser) {
+  bool res = cmd_test_parse_not(parser);
+
+  const char *arg;
+  while ((arg = cmd_test_peek(parser, 0)) != NULL && strcmp(arg, "-a") == 0) {
+    parser->pos++;
+    res = cmd_test_parse_not(parser) && res;
+  }
+
+  return res;
+}
+
+// cmd_test_parse_or parses "expr -o expr ...".
+static bool cmd_test_parse_or(cmd_test_parser *parser) {
+  bool res = cmd_test_parse_and(parser);
+
+  const char *arg;
+  while ((arg = cmd_test_peek(parser, 0)) != NULL && strcmp(arg, "-o") == 0) {
+    parser->pos++;
+    res = cmd_test_parse_and(parser) || res;
+  }
+
+  return res;
+}
+
+int cmd_test(int dirfd, char **args, int argc, const char **err) {
+  cmd_test_parser parser = {
+      .args = args, .argc = argc, .pos = 0, .dirfd = dirfd, .err = NULL};
+
+  // Like POSIX, decide up to four args by how many there are, so e.g. "! = x"
+  // and "( -n )" mean what they look like.
+  bool negate = false;
+  if (argc >= 2 && argc <= 4 && strcmp(args[0], "!") == 0 &&
+      !(argc == 3 && cmd_test_is_binary_op(args[1]))) {
+    negate = true;
+    parser.pos++;
+  } else if (argc >= 3 && argc <= 4 && strcmp(args[0], "(") == 0 &&
+             strcmp(args[argc - 1], ")") == 0 &&
+             !(argc == 3 && cmd_test_is_binary_op(args[1]))) {
+    parser.pos++;
+    parser.argc--;
+  }
+
+  bool res = false;
+  int remaining = parser.argc - parser.pos;
+
+  if (remaining == 1) {
+    res = *args[parser.pos] != 0;
+    parser.pos++;
+  } else if (remaining > 1) {
+    res = cmd_test_parse_or(&parser);
+  }
+
+  if (parser.err == NULL && parser.pos < parser.argc) {
+    parser.err = "too many arguments";
+  }
+
+  if (parser.err != NULL) {
+    *err = parser.err;
+    return 2;
+  }
+
+  return res != negate ? 0 : 1;
+}
@@ -0,0 +1,8 @@
+#pragma once
+
+// cmd_test evaluates the args of a test(1) (or "[ ... ]") expression,
+// returning 0 if it's true and 1 if it's false, or 2 (with err set to a
+// message) if it's malformed.
+//
+// Relative paths are resolved against dirfd (which can be AT_FDCWD).
+int cmd_test(int dirfd, char **args, int argc, const char **err);
@@ -0,0 +1,134 @@
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+
+#include "fd_copy.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
+
+// The most we ask the kernel to move per call.
+#define FD_COPY_CHUNK_SIZE (1 << 30)
+
+// The buffer size for the read/write fallback.
+#define FD_COPY_BUF_SIZE (128 * 1024)
+
+// fd_copy_kernel_unsupported returns whether errno means the fast path just
+// isn't supported for these fds (so we should fall back), rather than a real
+// error.
+static inline bool fd_copy_kernel_unsupported(void) {
+  return errno == EINVAL || errno == ENOSYS || errno == EXDEV ||
+         errno == EOPNOTSUPP || errno == EBADF;
+}
+
+static ssize_t fd_copy_read_write(int in_fd, int out_fd) {
+  char *buf = malloc(FD_COPY_BUF_SIZE);
+  ssize_t total = 0;
+
+  for (;;) {
+    ssize_t n = read(in_fd, buf, FD_COPY_BUF_SIZE);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+
+    if (n <= 0) {
+      free(buf);
+      return n < 0 ? -1 : total;
+    }
+
+    for (ssize_t written = 0; written < n;) {
+      ssize_t m = write(out_fd, buf + written, (size_t)(n - written));
+      if (m < 0 && errno == EINTR) {
+        continue;
+      }
+
+      if (m < 0) {
+        free(buf);
+        return -1;
+      }
+
+      written += m;
+    }
+
+    total += n;
+  }
+}
+
+#ifdef __linux__
+// fd_copy_linux moves the data using whichever zero-copy syscall suits the
+// fds, returning -1 with errno set to ENOSYS if none do (or the first call
+// reports it's unsupported) so the caller can fall back.
+//
+// Each syscall is only abandoned for the fallback before any bytes have
+// moved; after that, errors are real.
+static ssize_t fd_copy_linux(int in_fd, int out_fd, struct stat *in_st,
+                             struct stat *out_st) {
+  ssize_t total = 0;
+  ssize_t n;
+
+  // file -> file
+  if (S_ISREG(in_st->st_mode) && S_ISREG(out_st->st_mode)) {
+    while ((n = copy_file_range(in_fd, NULL, out_fd, NULL,
+                                FD_COPY_CHUNK_SIZE, 0)) > 0 ||
+           (n < 0 && errno == EINTR)) {
+      total += n > 0 ? n : 0;
+    }
+
+    if (n == 0 || total > 0 || !fd_copy_kernel_unsupported()) {
+      return n == 0 ? total : -1;
+    }
+  }
+
+  // pipe -> anything, anything -> pipe
+  if (S_ISFIFO(in_st->st_mode) || S_ISFIFO(out_st->st_mode)) {
+    while ((n = splice(in_fd, NULL, out_fd, NULL, FD_COPY_CHUNK_SIZE,
+                       SPLICE_F_MOVE | SPLICE_F_MORE)) > 0 ||
+           (n < 0 && errno == EINTR)) {
+      total += n > 0 ? n : 0;
+    }
+
+    if (n == 0 || total > 0 || !fd_copy_kernel_unsupported()) {
+      return n == 0 ? total : -1;
+    }
+  }
+
+  // file -> anything
+  if (S_ISREG(in_st->st_mode)) {
+    while ((n = sendfile(out_fd, in_fd, NULL, FD_COPY_CHUNK_SIZE)) > 0 ||
+           (n < 0 && errno == EINTR)) {
+      total += n > 0 ? n : 0;
+    }
+
+    if (n == 0 || total > 0 || !fd_copy_kernel_unsupported()) {
+      return n == 0 ? total : -1;
+    }
+  }
+
+  errno = ENOSYS;
+  return -1;
+}
+#endif
+
+ssize_t fd_copy(int in_fd, int out_fd) {
+#ifdef __linux__
+  struct stat in_st, out_st;
+  if (fstat(in_fd, &in_st) == 0 && fstat(out_fd, &out_st) == 0) {
+    // Appending to a file rules out copy_file_range/splice/sendfile.
+    int out_flags = fcntl(out_fd, F_GETFL);
+    if (out_flags >= 0 && !(out_flags & O_APPEND)) {
+      ssize_t n = fd_copy_linux(in_fd, out_fd, &in_st, &out_st);
+      if (n >= 0 || errno != ENOSYS) {
+        return n;
+      }
+    }
+  }
+#endif
+
+  return fd_copy_read_write(in_fd, out_fd);
+}
@@ -0,0 +1,13 @@
+#pragma once
+
+#include <stdbool.h>
+#include <sys/types.h>
+
+// fd_copy copies everything from in_fd (from its current offset) to out_fd,
+// letting the kernel move the data where it can: copy_file_range between
+// regular files, splice when either side is a pipe, and sendfile from a
+// regular file to anything else, falling back to a large-buffer read/write
+// loop.
+//
+// Returns the number of bytes copied, or -1 (with errno set) on error.
+ssize_t fd_copy(int in_fd, int out_fd);
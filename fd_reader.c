@@ -0,0 +1,111 @@
+#include "fd_reader.h"
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// The block size a regular file is read ahead in.
+#define FD_READER_BUF_SIZE (64 * 1024)
+
+fd_reader *fd_reader_new(int fd) {
+  fd_reader *reader = malloc(sizeof(fd_reader));
+  reader->fd = fd;
+  reader->buf = NULL;
+  reader->buf_off = 0;
+  reader->len = 0;
+
+  struct stat st;
+  reader->seekable = fstat(fd, &st) == 0 && S_ISREG(st.st_mode) &&
+                     lseek(fd, 0, SEEK_CUR) >= 0;
+
+  return reader;
+}
+
+// fd_reader_read_bytes reads a record a byte at a time.
+static bool fd_reader_read_bytes(fd_reader *reader, char delim,
+                                 GString *record) {
+  for (;;) {
+    char c;
+    ssize_t n = read(reader->fd, &c, 1);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+
+    if (n <= 0) {
+      return false;
+    }
+
+    if (c == delim) {
+      return true;
+    }
+
+    g_string_append_c(record, c);
+  }
+}
+
+// fd_reader_read appends the next record (without its delim) to record,
+// returning whether it ended in delim (rather than at EOF or an error).
+bool fd_reader_read(fd_reader *reader, char delim, GString *record) {
+  if (!reader->seekable) {
+    return fd_reader_read_bytes(reader, delim, record);
+  }
+
+  off_t off = lseek(reader->fd, 0, SEEK_CUR);
+  if (off < 0) {
+    return false;
+  }
+
+  // Anything else reading the fd moves its offset, which means the block is
+  // no longer ours to pick up from.
+  if (reader->buf == NULL) {
+    reader->buf = malloc(FD_READER_BUF_SIZE);
+  }
+
+  if (off < reader->buf_off || off > reader->buf_off + (off_t)reader->len) {
+    reader->buf_off = off;
+    reader->len = 0;
+  }
+
+  size_t pos = (size_t)(off - reader->buf_off);
+  bool found = false;
+
+  for (;;) {
+    if (pos == reader->len) {
+      reader->buf_off += (off_t)pos;
+      pos = 0;
+
+      ssize_t n;
+      while ((n = pread(reader->fd, reader->buf, FD_READER_BUF_SIZE,
+                        reader->buf_off)) < 0 &&
+             errno == EINTR) {
+      }
+
+      reader->len = n > 0 ? (size_t)n : 0;
+      if (n <= 0) {
+        break;
+      }
+    }
+
+    char *start = reader->buf + pos;
+    char *end = memchr(start, delim, reader->len - pos);
+    if (end != NULL) {
+      g_string_append_len(record, start, end - start);
+      pos += (size_t)(end - start) + 1;
+      found = true;
+      break;
+    }
+
+    g_string_append_len(record, start, (gssize)(reader->len - pos));
+    pos = reader->len;
+  }
+
+  lseek(reader->fd, reader->buf_off + (off_t)pos, SEEK_SET);
+
+  return found;
+}
+
+void fd_reader_free(fd_reader *reader) {
+  free(reader->buf);
+  free(reader);
+}
@@ -0,0 +1,33 @@
+#pragma once
+
+#include "glib.h"
+#include <stdbool.h>
+#include <sys/types.h>
+
+// fd_reader reads delimited records (e.g. lines for the read builtin) from an
+// fd without ever consuming more of it than the records it returns, so
+// whatever reads the fd next (e.g. a child in the body of a "while read"
+// loop) picks up right after them.
+//
+// A regular file is read a large block at a time with pread, and its offset
+// is then moved to just past the record, so a record costs two lseeks rather
+// than a read per byte; a block stays buffered for the next record as long as
+// the offset is still where the reader left it. Anything else (e.g. a pipe,
+// which can't give back what's been read from it) is read a byte at a time.
+typedef struct fd_reader {
+  int fd;
+
+  // Whether fd is a regular file, so it can be read ahead of the record.
+  bool seekable;
+
+  // The file offset buf starts at, and the bytes buffered from there.
+  char *buf;
+  off_t buf_off;
+  size_t len;
+} fd_reader;
+
+fd_reader *fd_reader_new(int fd);
+
+bool fd_reader_read(fd_reader *reader, char delim, GString *record);
+
+void fd_reader_free(fd_reader *reader);
@@ -0,0 +1,179 @@
+#include "field_split.h"
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+// field_split_ifs_init prepares the IFS chars for splitting (chars is NULL if
+// IFS is unset, which means the default).
+void field_split_ifs_init(field_split_ifs *ifs, const char *chars, size_t len) {
+  if (chars == NULL) {
+    chars = " \t\n";
+    len = 3;
+  }
+
+  memset(ifs->space, 0, sizeof(ifs->space));
+  memset(ifs->delim, 0, sizeof(ifs->delim));
+
+  for (size_t i = 0; i < len; i++) {
+    unsigned char c = (unsigned char)chars[i];
+
+    if (c == ' ' || c == '\t' || c == '\n') {
+      ifs->space[c] = true;
+    } else {
+      ifs->delim[c] = true;
+    }
+  }
+
+  ifs->empty = len == 0;
+  ifs->is_default = len == 3 && ifs->space[' '] && ifs->space['\t'] &&
+                    ifs->space['\n'];
+}
+
+static void field_split_add(GArray *slices, size_t start, size_t len) {
+  field_split_slice slice = {.start = start, .len = len};
+  g_array_append_val(slices, slice);
+}
+
+// field_split_space_mask returns a mask of which of the 32 bytes at str are
+// ' ', '\t' or '\n'.
+static inline uint32_t field_split_space_mask(const char *str) {
+#if defined(__AVX2__)
+  __m256i v = _mm256_loadu_si256((const __m256i *)(const void *)str);
+  __m256i spaces = _mm256_or_si256(
+      _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8(' ')),
+                      _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\t'))),
+      _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\n')));
+
+  return (uint32_t)_mm256_movemask_epi8(spaces);
+#elif defined(__SSE2__)
+  uint32_t mask = 0;
+
+  for (int half = 0; half < 2; half++) {
+    __m128i v =
+        _mm_loadu_si128((const __m128i *)(const void *)(str + half * 16));
+    __m128i spaces =
+        _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(' ')),
+                                  _mm_cmpeq_epi8(v, _mm_set1_epi8('\t'))),
+                     _mm_cmpeq_epi8(v, _mm_set1_epi8('\n')));
+
+    mask |= (uint32_t)_mm_movemask_epi8(spaces) << (half * 16);
+  }
+
+  return mask;
+#else
+  uint32_t mask = 0;
+
+  for (int i = 0; i < 32; i++) {
+    if (str[i] == ' ' || str[i] == '\t' || str[i] == '\n') {
+      mask |= (uint32_t)1 << i;
+    }
+  }
+
+  return mask;
+#endif
+}
+
+// field_split_default splits str on the default IFS, where every separator is
+// whitespace and so fields are just the runs of non-whitespace.
+//
+// It finds the runs 32 bytes at a time: each block's separators become a
+// bitmask, and the boundaries are the bits where it flips, so a long field (or
+// a long run of separators) costs one compare per block.
+static void field_split_default(const char *str, size_t len, GArray *slices) {
+  bool in_field = false;
+  size_t start = 0;
+  size_t i = 0;
+
+  for (; i + 32 <= len; i += 32) {
+    uint32_t spaces = field_split_space_mask(str + i);
+
+    // The bits where the current field (or gap) could end.
+    uint32_t flips = in_field ? spaces : ~spaces;
+
+    while (flips != 0) {
+      unsigned bit = (unsigned)__builtin_ctz(flips);
+
+      if (in_field) {
+        field_split_add(slices, start, i + bit - start);
+      } else {
+        start = i + bit;
+      }
+
+      in_field = !in_field;
+
+      uint32_t above = bit == 31 ? 0 : ~(uint32_t)0 << (bit + 1);
+      flips = (in_field ? spaces : ~spaces) & above;
+    }
+  }
+
+  for (; i < len; i++) {
+    bool space = str[i] == ' ' || str[i] == '\t' || str[i] == '\n';
+
+    if (in_field && space) {
+      field_split_add(slices, start, i - start);
+    } else if (!in_field && !space) {
+      start = i;
+    }
+
+    in_field = !space;
+  }
+
+  if (in_field) {
+    field_split_add(slices, start, len - start);
+  }
+}
+
+// field_split splits str into fields per the POSIX IFS rules, appending a
+// field_split_slice for each to slices.
+//
+// Whitespace at either end is trimmed and whitespace around a separator is
+// part of it; each non-whitespace IFS char ends a field, so two in a row
+// delimit an empty one (but one at the very end doesn't start another).
+void field_split(field_split_ifs *ifs, const char *str, size_t len,
+                 GArray *slices) {
+  if (ifs->empty) {
+    if (len > 0) {
+      field_split_add(slices, 0, len);
+    }
+
+    return;
+  }
+
+  if (ifs->is_default) {
+    field_split_default(str, len, slices);
+    return;
+  }
+
+  const unsigned char *s = (const unsigned char *)str;
+  size_t i = 0;
+
+  while (i < len && ifs->space[s[i]]) {
+    i++;
+  }
+
+  while (i < len) {
+    size_t start = i;
+    while (i < len && !ifs->space[s[i]] && !ifs->delim[s[i]]) {
+      i++;
+    }
+
+    field_split_add(slices, start, i - start);
+
+    while (i < len && ifs->space[s[i]]) {
+      i++;
+    }
+
+    if (i < len && ifs->delim[s[i]]) {
+      i++;
+
+      while (i < len && ifs->space[s[i]]) {
+        i++;
+      }
+    }
+  }
+}
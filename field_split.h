@@ -0,0 +1,31 @@
+#pragma once
+
+#include "glib.h"
+#include <stdbool.h>
+#include <stddef.h>
+
+// field_split_ifs is an IFS value prepared for splitting.
+typedef struct field_split_ifs {
+  // Whether each byte is IFS whitespace (which is trimmed and collapses with
+  // the separators around it) or another IFS char (each of which ends a
+  // field).
+  bool space[256];
+  bool delim[256];
+
+  // Whether IFS is the default " \t\n" (which has a vectorized splitter).
+  bool is_default;
+
+  // Whether IFS is empty (so nothing is split).
+  bool empty;
+} field_split_ifs;
+
+// field_split_slice is a field's bytes within the split string.
+typedef struct field_split_slice {
+  size_t start;
+  size_t len;
+} field_split_slice;
+
+void field_split_ifs_init(field_split_ifs *ifs, const char *chars, size_t len);
+
+void field_split(field_split_ifs *ifs, const char *str, size_t len,
+                 GArray *slices);
@@ -1,14 +1,25 @@
+#include "batch.h"
 #include "cmd.h"
 #include "cmd_executor.h"
+#include "cmd_history.h"
 #include "cmd_parser.h"
 #include "glib.h"
+#include "parse_pool.h"
+#include "script_reader.h"
+#include "server.h"
 #include "utils.h"
 #include <locale.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <sys/resource.h>
 #include <unistd.h>
 #include <wchar.h>
 
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
+
 #pragma clang diagnostic ignored "-Weverything"
 #pragma clang diagnostic push
 #include <readline/history.h>
@@ -20,6 +31,222 @@ void onexit(int signal) {
   exit(0);
 }
 
+// stats_executor is the executor whose stats are printed on exit.
+static cmd_executor *stats_executor = NULL;
+
+void print_stats(void) {
+  cmd_stats_print(stats_executor->stats, STDERR_FILENO);
+}
+
+// memstats_executor is the executor whose memory use is reported on exit.
+static cmd_executor *memstats_executor = NULL;
+
+// print_memstats reports the peak RSS, the heap bytes still in use and how
+// much of the executor's scratch arena was used.
+void print_memstats(void) {
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+
+  // ru_maxrss is in bytes on macOS and KB everywhere else.
+#ifdef __APPLE__
+  long peak_rss_kb = usage.ru_maxrss / 1024;
+#else
+  long peak_rss_kb = usage.ru_maxrss;
+#endif
+
+  dprintf(STDERR_FILENO, "turtle: memstats: peak_rss_kb %ld\n", peak_rss_kb);
+
+#ifdef __GLIBC__
+#if __GLIBC__ > 2 || __GLIBC_MINOR__ >= 33
+  struct mallinfo2 info = mallinfo2();
+  dprintf(STDERR_FILENO, "turtle: memstats: live_bytes %zu\n",
+          info.uordblks + info.hblkhd);
+#endif
+#endif
+
+  arena *a = memstats_executor->arena;
+  dprintf(STDERR_FILENO,
+          "turtle: memstats: arena_bytes %zu peak %zu reserved %zu\n", a->used,
+          a->peak, a->reserved);
+}
+
+// coproc_executor is the executor whose coprocs are torn down on exit.
+static cmd_executor *coproc_executor = NULL;
+
+void close_coprocs(void) { cmd_executor_close_coprocs(coproc_executor); }
+
+// new_executor creates the shell's executor, collecting stats to print on
+// exit if TURTLE_STATS is set (and reporting its memory use if
+// TURTLE_MEMSTATS is).
+cmd_executor *new_executor(void) {
+  cmd_executor *executor = cmd_executor_new();
+
+  char *stats = getenv("TURTLE_STATS");
+  if (stats != NULL && *stats != 0 && stats_executor == NULL) {
+    executor->stats = cmd_stats_new();
+    stats_executor = executor;
+    atexit(print_stats);
+  }
+
+  char *memstats = getenv("TURTLE_MEMSTATS");
+  if (memstats != NULL && *memstats != 0 && memstats_executor == NULL) {
+    memstats_executor = executor;
+    atexit(print_memstats);
+  }
+
+  if (coproc_executor == NULL) {
+    coproc_executor = executor;
+    atexit(close_coprocs);
+  }
+
+  return executor;
+}
+
+// completion_executor is the executor whose cmds the prompt completes.
+static cmd_executor *completion_executor = NULL;
+
+// complete_cmd generates the cmd names matching text for readline, one per
+// call (with state 0 for the first).
+static char *complete_cmd(const char *text, int state) {
+  static GPtrArray *matches = NULL;
+  static guint next = 0;
+
+  if (state == 0) {
+    if (matches == NULL) {
+      matches = g_ptr_array_new();
+    }
+
+    // Readline frees the matches it's handed, so only drop the ones it never
+    // got.
+    for (guint i = next; i < matches->len; i++) {
+      free(g_ptr_array_index(matches, i));
+    }
+    g_ptr_array_set_size(matches, 0);
+    next = 0;
+
+    cmd_executor_complete_cmd(completion_executor, text, matches);
+  }
+
+  return next < matches->len ? g_ptr_array_index(matches, next++) : NULL;
+}
+
+// complete completes cmd names where a cmd name goes, leaving everything else
+// (args, and paths anywhere) to readline's filename completion.
+static char **complete(const char *text, int start, int end) {
+  int i = start;
+  while (i > 0 && strchr(" \t", rl_line_buffer[i - 1]) != NULL) {
+    i--;
+  }
+
+  bool cmd_pos = i == 0 || strchr(";|&(`", rl_line_buffer[i - 1]) != NULL;
+  if (!cmd_pos || strchr(text, '/') != NULL) {
+    return NULL;
+  }
+
+  return rl_completion_matches(text, complete_cmd);
+}
+
+// How many of the latest history lines the up-arrow reaches (older ones are
+// only found by searching).
+#define HISTORY_RECENT 1000
+
+// shell_history is the history file the prompt's lines are saved to and
+// searched in.
+static cmd_history *shell_history = NULL;
+
+// open_history opens the history file ($HISTFILE, or ~/.turtle_history if
+// that's unset) and loads its latest lines for the up-arrow.
+static void open_history(void) {
+  char *filename = getenv("HISTFILE");
+  char *home_filename = NULL;
+
+  if (filename == NULL && getenv("HOME") != NULL) {
+    home_filename = g_strconcat(getenv("HOME"), "/.turtle_history", NULL);
+    filename = home_filename;
+  }
+
+  if (filename != NULL && *filename != 0) {
+    shell_history = cmd_history_open(filename);
+  }
+
+  free(home_filename);
+
+  if (shell_history == NULL) {
+    return;
+  }
+
+  GPtrArray *lines = g_ptr_array_new();
+  cmd_history_recent(shell_history, HISTORY_RECENT, lines);
+
+  for (guint i = 0; i < lines->len; i++) {
+    add_history(g_ptr_array_index(lines, i));
+    free(g_ptr_array_index(lines, i));
+  }
+
+  g_ptr_array_free(lines, true);
+}
+
+// search_history searches the whole history file as a query is typed, showing
+// the latest line containing it (Ctrl-R again goes back to an older one).
+//
+// Enter runs the line found, Ctrl-G goes back to the line as it was and any
+// other key stops searching and is handled as usual.
+static int search_history(int count, int key) {
+  GString *query = g_string_new(NULL);
+  char *orig = strdup(rl_line_buffer);
+  size_t pos = SIZE_MAX;
+  bool failed = false;
+
+  for (;;) {
+    rl_message("(%sreverse-i-search)`%s': ", failed ? "failed " : "",
+               query->str);
+
+    int c = rl_read_key();
+    size_t from;
+
+    if (c == key) {
+      from = pos;
+    } else if (c == 127 || c == '\b') {
+      if (query->len > 0) {
+        g_string_truncate(query, query->len - 1);
+      }
+
+      from = SIZE_MAX;
+    } else if (c == CTRL('G')) {
+      rl_replace_line(orig, 0);
+      rl_point = rl_end;
+      break;
+    } else if (c >= ' ') {
+      g_string_append_c(query, (char)c);
+
+      // The line found so far may still match.
+      from = pos == SIZE_MAX ? SIZE_MAX : pos + 1;
+    } else {
+      if (c != ESC) {
+        rl_execute_next(c);
+      }
+      break;
+    }
+
+    size_t found_pos = from;
+    char *found = cmd_history_search(shell_history, query->str, &found_pos);
+    failed = found == NULL && query->len > 0;
+
+    if (found != NULL) {
+      pos = found_pos;
+      rl_replace_line(found, 0);
+      rl_point = (int)(strstr(found, query->str) - found);
+      free(found);
+    }
+  }
+
+  rl_clear_message();
+  free(orig);
+  g_string_free(query, true);
+
+  return 0;
+}
+
 int main(int argc, char **argv) {
   // Set up signal handlers.
   if (signal(SIGINT, SIG_IGN) != SIG_IGN) {
@@ -30,6 +257,12 @@ int main(int argc, char **argv) {
   char *cmd_str = NULL;
   unsigned int sleep_time = 0;
   char *script_filename = NULL;
+  char *serve_path = NULL;
+  char *client_path = NULL;
+  bool batch = false;
+  int jobs = 0;
+  char *manifest = NULL;
+  int parse_jobs = 0;
   GList *gargs = NULL;
 
   for (int i = 1; i < argc; i++) {
@@ -39,6 +272,23 @@ int main(int argc, char **argv) {
     } else if (strcmp(argv[i], "--sleep") == 0) {
       i++;
       sleep_time = (unsigned int)atoi(argv[i]);
+    } else if (strcmp(argv[i], "--serve") == 0) {
+      i++;
+      serve_path = argv[i];
+    } else if (strcmp(argv[i], "--client") == 0) {
+      i++;
+      client_path = argv[i];
+    } else if (strcmp(argv[i], "--batch") == 0) {
+      batch = true;
+    } else if (strcmp(argv[i], "-j") == 0) {
+      i++;
+      jobs = atoi(argv[i]);
+    } else if (strcmp(argv[i], "--manifest") == 0) {
+      i++;
+      manifest = argv[i];
+    } else if (strcmp(argv[i], "--parse-jobs") == 0) {
+      i++;
+      parse_jobs = atoi(argv[i]);
     } else {
       if (script_filename == NULL) {
         script_filename = argv[i];
@@ -52,25 +302,102 @@ int main(int argc, char **argv) {
     sleep(sleep_time);
   }
 
-  if (script_filename != NULL) {
+  // If we're a server, serve until we're killed.
+  if (serve_path != NULL) {
+    return server_run(serve_path);
+  }
+
+  // If we're a client, hand the cmd or script off to the server.
+  if (client_path != NULL) {
+    if (cmd_str == NULL && script_filename == NULL) {
+      giveup("--client requires -c or a script");
+    }
+
+    exit(server_client_run(client_path, cmd_str, script_filename, gargs));
+  }
+
+  // If we're running a batch, run every script we were given (and every one
+  // in the manifest) on a pool of workers.
+  if (batch) {
+    GPtrArray *paths = g_ptr_array_new();
+    if (manifest != NULL) {
+      batch_read_manifest(manifest, paths);
+    }
+
+    if (script_filename != NULL) {
+      g_ptr_array_add(paths, script_filename);
+    }
+
+    for (GList *arg = gargs; arg != NULL; arg = arg->next) {
+      g_ptr_array_add(paths, arg->data);
+    }
+
+    exit(batch_run(paths, jobs));
+  }
+
+  // If we were given a script (or stdin isn't a terminal and there's nothing
+  // else to run), execute it chunk by chunk.
+  if (script_filename != NULL ||
+      (cmd_str == NULL && !isatty(STDIN_FILENO))) {
     cmd_parser *parser = cmd_parser_new();
-    cmd_executor *executor = cmd_executor_new();
+    cmd_executor *executor = new_executor();
     int status;
 
-    FILE *script_file = fopen(script_filename, "r");
+    script_reader *reader =
+        script_filename == NULL || strcmp(script_filename, "-") == 0
+            ? script_reader_new(STDIN_FILENO)
+            : script_reader_open(script_filename);
 
-    char line[BUFSIZ];
-    while ((fgets(line, sizeof(line), script_file)) != NULL) {
-      cmd_parser_set_next(parser, line);
+    char **args = g_list_charptr_to_argv(gargs, (int)g_list_length(gargs));
+    cmd_executor_set_args(
+        executor, script_filename != NULL ? script_filename : "turtle", args);
+    free(args);
 
-      cmd *cmd = cmd_parser_parse_next(parser);
-      if ((status = cmd_executor_exec(executor, cmd)) != 0) {
-        return status;
+    // Big generated scripts can be parsed on several threads ahead of being
+    // executed.
+    if (parse_jobs > 0) {
+      parse_pool *pool = parse_pool_new(reader, parse_jobs);
+
+      parse_pool_chunk *chunk;
+      while ((chunk = parse_pool_next(pool)) != NULL) {
+        for (GList *node = chunk->cmds; node != NULL; node = node->next) {
+          if ((status = cmd_executor_exec(executor, node->data)) != 0) {
+            return status;
+          }
+        }
+
+        if (chunk->err != NULL) {
+          fputs(chunk->err, stderr);
+          exit(1);
+        }
+
+        parse_pool_release(pool, chunk);
       }
 
-      cmd_free(cmd);
+      parse_pool_free(pool);
+      script_reader_free(reader);
+      cmd_parser_free(parser);
+
+      exit(0);
+    }
+
+    char *chunk;
+    while ((chunk = script_reader_next(reader)) != NULL) {
+      cmd_parser_set_next(parser, chunk);
+
+      cmd *cmd;
+      while ((cmd = cmd_parser_parse_next(parser)) != NULL) {
+        if ((status = cmd_executor_exec(executor, cmd)) != 0) {
+          return status;
+        }
+
+        cmd_free(cmd);
+      }
     }
 
+    script_reader_free(reader);
+    cmd_parser_free(parser);
+
     exit(0);
   }
 
@@ -78,7 +405,7 @@ int main(int argc, char **argv) {
   if (cmd_str != NULL) {
     cmd_parser *parser = cmd_parser_new();
     cmd_parser_set_next(parser, cmd_str);
-    cmd_executor *executor = cmd_executor_new();
+    cmd_executor *executor = new_executor();
 
     cmd *cmd;
     while ((cmd = cmd_parser_parse_next(parser)) != NULL) {
@@ -86,14 +413,27 @@ int main(int argc, char **argv) {
       if ((status = cmd_executor_exec(executor, cmd)) != 0) {
         exit(status);
       }
+
+      cmd_free(cmd);
     }
 
+    cmd_parser_free(parser);
+
     exit(0);
   }
 
   // Otherwise, we're in interactive mode.
   cmd_parser *parser = cmd_parser_new();
-  cmd_executor *executor = cmd_executor_new();
+  cmd_executor *executor = new_executor();
+
+  completion_executor = executor;
+  rl_attempted_completion_function = complete;
+
+  open_history();
+  if (shell_history != NULL) {
+    rl_bind_key(CTRL('R'), search_history);
+  }
+
   char *line = NULL;
   int status;
   for (;;) {
@@ -105,6 +445,10 @@ int main(int argc, char **argv) {
     line = readline("🐢> ");
     if (line && *line) {
       add_history(line);
+
+      if (shell_history != NULL) {
+        cmd_history_add(shell_history, line);
+      }
     }
 
     cmd_parser_set_next(parser, line);
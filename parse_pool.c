@@ -0,0 +1,134 @@
+#include "parse_pool.h"
+#include "cmd.h"
+#include "cmd_parser.h"
+#include <setjmp.h>
+#include <stdlib.h>
+
+// How big a chunk to hand each thread, which is big enough that the overhead
+// per chunk doesn't matter and small enough that its cmds are still in cache
+// when they're executed and freed.
+#define PARSE_POOL_CHUNK_SIZE (16 * 1024)
+
+// How many chunks per thread can be queued ahead of the one being executed.
+#define PARSE_POOL_WINDOW_PER_JOB 4
+
+// parse_pool_chunk_free frees a chunk and its cmds.
+static void parse_pool_chunk_free(parse_pool_chunk *chunk) {
+  g_list_free_full(chunk->cmds, (GDestroyNotify)cmd_free);
+  free(chunk->err);
+  free(chunk->src);
+  free(chunk);
+}
+
+// parse_pool_parse parses a chunk on one of the pool's threads, or frees it
+// once it's been released.
+static void parse_pool_parse(gpointer data, gpointer user_data) {
+  parse_pool_chunk *chunk = data;
+  parse_pool *pool = user_data;
+
+  if (chunk->done) {
+    parse_pool_chunk_free(chunk);
+    return;
+  }
+
+  cmd_parser *parser = cmd_parser_new();
+
+  jmp_buf err_jmp;
+  parser->err_jmp = &err_jmp;
+
+  if (setjmp(err_jmp) != 0) {
+    chunk->err = parser->err;
+    parser->err = NULL;
+  } else {
+    cmd_parser_set_next(parser, chunk->src);
+
+    cmd *c;
+    while ((c = cmd_parser_parse_next(parser)) != NULL) {
+      chunk->cmds = g_list_prepend(chunk->cmds, c);
+    }
+  }
+
+  chunk->cmds = g_list_reverse(chunk->cmds);
+  cmd_parser_free(parser);
+
+  g_mutex_lock(&pool->lock);
+  chunk->done = true;
+  g_cond_broadcast(&pool->parsed);
+  g_mutex_unlock(&pool->lock);
+}
+
+// parse_pool_new creates a pool that parses the script from reader on jobs
+// threads.
+parse_pool *parse_pool_new(script_reader *reader, int jobs) {
+  parse_pool *pool = malloc(sizeof(parse_pool));
+  pool->reader = reader;
+  pool->exhausted = false;
+  pool->threads = g_thread_pool_new(parse_pool_parse, pool, jobs, true, NULL);
+  g_mutex_init(&pool->lock);
+  g_cond_init(&pool->parsed);
+  pool->chunks = g_ptr_array_new();
+  pool->window = (guint)jobs * PARSE_POOL_WINDOW_PER_JOB;
+
+  return pool;
+}
+
+// parse_pool_next returns the next chunk once it's been parsed (which the
+// caller hands back with parse_pool_release), or NULL once the script has
+// been exhausted.
+parse_pool_chunk *parse_pool_next(parse_pool *pool) {
+  while (!pool->exhausted && pool->chunks->len < pool->window) {
+    char *src = script_reader_take(pool->reader, PARSE_POOL_CHUNK_SIZE);
+    if (src == NULL) {
+      pool->exhausted = true;
+      break;
+    }
+
+    parse_pool_chunk *chunk = malloc(sizeof(parse_pool_chunk));
+    chunk->src = src;
+    chunk->cmds = NULL;
+    chunk->err = NULL;
+    chunk->done = false;
+
+    g_ptr_array_add(pool->chunks, chunk);
+    g_thread_pool_push(pool->threads, chunk, NULL);
+  }
+
+  if (pool->chunks->len == 0) {
+    return NULL;
+  }
+
+  parse_pool_chunk *chunk = g_ptr_array_remove_index(pool->chunks, 0);
+
+  g_mutex_lock(&pool->lock);
+  while (!chunk->done) {
+    g_cond_wait(&pool->parsed, &pool->lock);
+  }
+  g_mutex_unlock(&pool->lock);
+
+  return chunk;
+}
+
+// parse_pool_release hands a chunk back to be freed on the pool's threads.
+//
+// Its cmds were malloc'd on one of them, and freeing them there keeps the
+// memory cycling through the pool's malloc caches. Freeing them on the caller
+// instead sends every malloc and free down malloc's slow path, which costs
+// more than the parsing saves.
+void parse_pool_release(parse_pool *pool, parse_pool_chunk *chunk) {
+  g_thread_pool_push(pool->threads, chunk, NULL);
+}
+
+// parse_pool_free waits for any chunks still being parsed or freed and frees
+// them along with the pool.
+void parse_pool_free(parse_pool *pool) {
+  g_thread_pool_free(pool->threads, false, true);
+
+  for (guint i = 0; i < pool->chunks->len; i++) {
+    parse_pool_chunk_free(g_ptr_array_index(pool->chunks, i));
+  }
+
+  g_ptr_array_free(pool->chunks, true);
+  g_cond_clear(&pool->parsed);
+  g_mutex_clear(&pool->lock);
+  free(pool);
+}
@@ -0,0 +1,50 @@
+#pragma once
+
+#include "glib.h"
+#include "script_reader.h"
+#include <stdbool.h>
+
+// parse_pool_chunk is a chunk of a script and the cmds parsed from it.
+typedef struct parse_pool_chunk {
+  char *src;
+
+  // GList<cmd*> in order. If the chunk had a parse error, these are the cmds
+  // before it, and err is its message.
+  GList *cmds;
+  char *err;
+
+  // Whether the chunk has been parsed (and so, when it's pushed to the pool
+  // again, is to be freed).
+  bool done;
+} parse_pool_chunk;
+
+// parse_pool parses a big script on a pool of threads, ahead of the caller
+// executing it.
+//
+// The script is split into chunks of whole logical lines (see
+// script_reader_take), each parsed on its own thread by its own parser, and
+// handed back in order. Parsing a chunk never depends on executing the ones
+// before it, so the only thing the threads share is the interned var names.
+typedef struct parse_pool {
+  script_reader *reader;
+  bool exhausted;
+
+  GThreadPool *threads;
+  GMutex lock;
+
+  // Signalled when a chunk has been parsed.
+  GCond parsed;
+
+  // The chunks (parse_pool_chunk*) being parsed, in order, and how many can
+  // be at once.
+  GPtrArray *chunks;
+  guint window;
+} parse_pool;
+
+parse_pool *parse_pool_new(script_reader *reader, int jobs);
+
+parse_pool_chunk *parse_pool_next(parse_pool *pool);
+
+void parse_pool_release(parse_pool *pool, parse_pool_chunk *chunk);
+
+void parse_pool_free(parse_pool *pool);
@@ -0,0 +1,318 @@
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+
+#include "path_glob.h"
+#include "pattern.h"
+#include <dirent.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+
+#define PATH_GLOB_DENTS_SIZE (64 * 1024)
+
+// path_glob_entry is an entry of a directory listing.
+typedef struct path_glob_entry {
+  // Where the entry's name starts in the listing's names.
+  size_t name;
+  size_t len;
+
+  // The entry's DT_* type (or DT_UNKNOWN if the filesystem doesn't say).
+  unsigned char type;
+} path_glob_entry;
+
+// path_glob_dir is a directory listing (without "." and "..").
+typedef struct path_glob_dir {
+  // The entries' names, each NUL-terminated, back to back.
+  GString *names;
+
+  // path_glob_entry[]
+  GArray *entries;
+} path_glob_dir;
+
+static void path_glob_dir_free(path_glob_dir *dir) {
+  g_string_free(dir->names, true);
+  g_array_free(dir->entries, true);
+  free(dir);
+}
+
+// path_glob_dir_add adds an entry to the listing, unless it's "." or "..".
+static void path_glob_dir_add(path_glob_dir *dir, const char *name,
+                              unsigned char type) {
+  if (name[0] == '.' && (name[1] == 0 || (name[1] == '.' && name[2] == 0))) {
+    return;
+  }
+
+  size_t len = strlen(name);
+  path_glob_entry entry = {.name = dir->names->len, .len = len, .type = type};
+
+  g_string_append_len(dir->names, name, (gssize)len + 1);
+  g_array_append_val(dir->entries, entry);
+}
+
+#ifdef SYS_getdents64
+// path_glob_dirent64 is the record getdents64 fills its buffer with.
+typedef struct path_glob_dirent64 {
+  uint64_t d_ino;
+  int64_t d_off;
+  unsigned short d_reclen;
+  unsigned char d_type;
+  char d_name[];
+} path_glob_dirent64;
+#endif
+
+// path_glob_read_dir lists the directory at path (relative to dirfd), which is
+// empty if it can't be read.
+//
+// On Linux the entries are read straight from getdents64 in large batches,
+// rather than one readdir call (and, for big directories, many small
+// getdents calls) at a time.
+static path_glob_dir *path_glob_read_dir(int dirfd, const char *path) {
+  path_glob_dir *dir = malloc(sizeof(path_glob_dir));
+  dir->names = g_string_new(NULL);
+  dir->entries = g_array_new(false, false, sizeof(path_glob_entry));
+
+  int fd = openat(dirfd, path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (fd < 0) {
+    return dir;
+  }
+
+#ifdef SYS_getdents64
+  char *buf = malloc(PATH_GLOB_DENTS_SIZE);
+
+  long n;
+  while ((n = syscall(SYS_getdents64, fd, buf, PATH_GLOB_DENTS_SIZE)) > 0) {
+    for (long off = 0; off < n;) {
+      path_glob_dirent64 *dent = (path_glob_dirent64 *)(void *)(buf + off);
+      path_glob_dir_add(dir, dent->d_name, dent->d_type);
+
+      off += dent->d_reclen;
+    }
+  }
+
+  free(buf);
+  close(fd);
+#else
+  DIR *d = fdopendir(fd);
+  if (d == NULL) {
+    close(fd);
+    return dir;
+  }
+
+  struct dirent *dent;
+  while ((dent = readdir(d)) != NULL) {
+    path_glob_dir_add(dir, dent->d_name, dent->d_type);
+  }
+
+  closedir(d);
+#endif
+
+  return dir;
+}
+
+path_glob_cache *path_glob_cache_new(void) {
+  path_glob_cache *cache = malloc(sizeof(path_glob_cache));
+  cache->dirs = g_hash_table_new_full(g_str_hash, g_str_equal, free,
+                                      (GDestroyNotify)path_glob_dir_free);
+
+  return cache;
+}
+
+// path_glob_cache_clear drops the cached listings.
+void path_glob_cache_clear(path_glob_cache *cache) {
+  if (g_hash_table_size(cache->dirs) > 0) {
+    g_hash_table_remove_all(cache->dirs);
+  }
+}
+
+void path_glob_cache_free(path_glob_cache *cache) {
+  g_hash_table_destroy(cache->dirs);
+  free(cache);
+}
+
+// path_glob_cache_get returns the listing of the directory that prefix (a
+// matched path so far, ending with a '/', or "" for the working directory)
+// names, reading it (relative to dirfd) if it hasn't been yet.
+static path_glob_dir *path_glob_cache_get(path_glob_cache *cache, int dirfd,
+                                          const char *prefix) {
+  const char *path = *prefix != 0 ? prefix : ".";
+
+  path_glob_dir *dir = g_hash_table_lookup(cache->dirs, path);
+  if (dir == NULL) {
+    dir = path_glob_read_dir(dirfd, path);
+    g_hash_table_insert(cache->dirs, strdup(path), dir);
+  }
+
+  return dir;
+}
+
+// path_glob_is_dir returns whether path (relative to dirfd) is a directory (or
+// a link to one), going by type if the listing knows it.
+static bool path_glob_is_dir(int dirfd, const char *path, unsigned char type) {
+  if (type == DT_DIR) {
+    return true;
+  }
+
+  if (type != DT_LNK && type != DT_UNKNOWN) {
+    return false;
+  }
+
+  struct stat st;
+  return fstatat(dirfd, path, &st, 0) == 0 && S_ISDIR(st.st_mode);
+}
+
+// path_glob_expand_component matches one '/'-separated component of a glob
+// against what's under each of the prefixes, returning the matching paths.
+//
+// If dirs_only is set, only directories are kept (since there are more
+// components to match under them).
+static GPtrArray *path_glob_expand_component(path_glob_cache *cache,
+                                             int dirfd, GPtrArray *prefixes,
+                                             const char *src, size_t len,
+                                             bool dirs_only) {
+  GPtrArray *res = g_ptr_array_new();
+  pattern *pat = pattern_compile(src, len);
+
+  for (guint i = 0; i < prefixes->len; i++) {
+    const char *prefix = g_ptr_array_index(prefixes, i);
+
+    // A literal component doesn't need the directory to be read; whether it
+    // exists is checked once the whole path is known.
+    if (pat->literal) {
+      g_ptr_array_add(res, g_strconcat(prefix, pat->buf, NULL));
+      continue;
+    }
+
+    path_glob_dir *dir = path_glob_cache_get(cache, dirfd, prefix);
+
+    for (guint j = 0; j < dir->entries->len; j++) {
+      path_glob_entry *entry = &g_array_index(dir->entries, path_glob_entry, j);
+      const char *name = dir->names->str + entry->name;
+
+      // Hidden files are only matched by an explicit leading '.'.
+      if (name[0] == '.' && !pat->leading_dot) {
+        continue;
+      }
+
+      if (!pattern_match(pat, name, entry->len)) {
+        continue;
+      }
+
+      char *path = g_strconcat(prefix, name, NULL);
+      if (dirs_only && !path_glob_is_dir(dirfd, path, entry->type)) {
+        free(path);
+        continue;
+      }
+
+      g_ptr_array_add(res, path);
+    }
+  }
+
+  pattern_free(pat);
+
+  return res;
+}
+
+static int path_glob_cmp(const void *a, const void *b) {
+  return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+// path_glob_expand appends the paths matching the glob (in which "\" escapes
+// a char) to matches in sorted order, returning how many there were.
+//
+// A relative glob is matched under dirfd (which can be AT_FDCWD).
+size_t path_glob_expand(path_glob_cache *cache, int dirfd, const char *glob,
+                        size_t len, GPtrArray *matches) {
+  const char *end = glob + len;
+  const char *c = glob;
+
+  // Keep any leading slashes as they are.
+  while (c < end && *c == '/') {
+    c++;
+  }
+
+  GPtrArray *paths = g_ptr_array_new();
+  g_ptr_array_add(paths, g_strndup(glob, (gsize)(c - glob)));
+
+  bool trailing_slash = false;
+  bool literal_tail = false;
+
+  while (c < end && paths->len > 0) {
+    const char *slash = memchr(c, '/', (size_t)(end - c));
+    const char *component_end = slash != NULL ? slash : end;
+
+    // Skip over repeated slashes to see if there's another component.
+    const char *next = component_end;
+    while (next < end && *next == '/') {
+      next++;
+    }
+
+    bool last = next == end;
+    trailing_slash = last && slash != NULL;
+    literal_tail = !pattern_has_meta(c, (size_t)(component_end - c));
+
+    GPtrArray *res =
+        path_glob_expand_component(cache, dirfd, paths, c,
+                                   (size_t)(component_end - c),
+                                   !last || trailing_slash);
+
+    for (guint i = 0; i < paths->len; i++) {
+      free(g_ptr_array_index(paths, i));
+    }
+    g_ptr_array_set_size(paths, 0);
+
+    for (guint i = 0; i < res->len; i++) {
+      char *path = g_ptr_array_index(res, i);
+      g_ptr_array_add(paths, last ? path : g_strconcat(path, "/", NULL));
+      if (!last) {
+        free(path);
+      }
+    }
+
+    g_ptr_array_free(res, true);
+    c = next;
+  }
+
+  size_t count = 0;
+  for (guint i = 0; i < paths->len; i++) {
+    char *path = g_ptr_array_index(paths, i);
+
+    // Paths ending in a literal component haven't been checked yet.
+    struct stat st;
+    bool exists = true;
+    if (literal_tail) {
+      exists = trailing_slash
+                   ? fstatat(dirfd, path, &st, 0) == 0 && S_ISDIR(st.st_mode)
+                   : fstatat(dirfd, path, &st, AT_SYMLINK_NOFOLLOW) == 0;
+    }
+
+    if (!exists) {
+      free(path);
+      continue;
+    }
+
+    if (trailing_slash) {
+      char *with_slash = g_strconcat(path, "/", NULL);
+      free(path);
+      path = with_slash;
+    }
+
+    g_ptr_array_add(matches, path);
+    count++;
+  }
+
+  g_ptr_array_free(paths, true);
+
+  qsort(matches->pdata + matches->len - count, count, sizeof(char *),
+        path_glob_cmp);
+
+  return count;
+}
@@ -0,0 +1,24 @@
+#pragma once
+
+#include "glib.h"
+#include <stddef.h>
+
+// path_glob_cache holds the directory listings read while expanding globs, so
+// several globs over the same directory (e.g. "*.log *.gz" in a big spool dir)
+// only read it once.
+//
+// Listings aren't invalidated, so a cache should only live as long as a single
+// cmd's expansions.
+typedef struct path_glob_cache {
+  // GHashTable<char* path, path_glob_dir*>
+  GHashTable *dirs;
+} path_glob_cache;
+
+path_glob_cache *path_glob_cache_new(void);
+
+void path_glob_cache_clear(path_glob_cache *cache);
+
+void path_glob_cache_free(path_glob_cache *cache);
+
+size_t path_glob_expand(path_glob_cache *cache, int dirfd, const char *glob,
+                        size_t len, GPtrArray *matches);
@@ -0,0 +1,371 @@
+#include "path_index.h"
+#include <dirent.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// How often the directories' mtimes are checked for lookups (completions
+// always check).
+#define PATH_INDEX_RECHECK_USECS 1000000
+
+// How many lookups there have to be before building the index is worth it (a
+// run that only spawns a cmd or two is over before a build would pay off).
+#define PATH_INDEX_MIN_LOOKUPS 4
+
+// path_index_dir is the executables in one of PATH's directories.
+typedef struct path_index_dir {
+  char *path;
+
+  // The directory's mtime when it was read (zero if it doesn't exist).
+  time_t mtime;
+  long mtime_nsec;
+
+  // char*[]
+  GPtrArray *names;
+} path_index_dir;
+
+static void path_index_dir_free(path_index_dir *dir) {
+  for (guint i = 0; i < dir->names->len; i++) {
+    free(g_ptr_array_index(dir->names, i));
+  }
+
+  g_ptr_array_free(dir->names, true);
+  free(dir->path);
+  free(dir);
+}
+
+// path_index_dirs_free frees the directories (some of which may have been
+// moved out and left NULL).
+static void path_index_dirs_free(GPtrArray *dirs) {
+  for (guint i = 0; i < dirs->len; i++) {
+    if (g_ptr_array_index(dirs, i) != NULL) {
+      path_index_dir_free(g_ptr_array_index(dirs, i));
+    }
+  }
+
+  g_ptr_array_free(dirs, true);
+}
+
+// path_index_stat gets the directory's mtime, returning false if it doesn't
+// exist.
+static bool path_index_stat(const char *path, time_t *mtime, long *nsec) {
+  struct stat st;
+  if (stat(path, &st) != 0 || !S_ISDIR(st.st_mode)) {
+    *mtime = 0;
+    *nsec = 0;
+    return false;
+  }
+
+  *mtime = st.st_mtime;
+#ifdef __APPLE__
+  *nsec = st.st_mtimespec.tv_nsec;
+#else
+  *nsec = st.st_mtim.tv_nsec;
+#endif
+
+  return true;
+}
+
+// path_index_read_dir lists the executables in the directory.
+static path_index_dir *path_index_read_dir(const char *path) {
+  path_index_dir *dir = malloc(sizeof(path_index_dir));
+  dir->path = strdup(path);
+  dir->names = g_ptr_array_new();
+
+  if (!path_index_stat(path, &dir->mtime, &dir->mtime_nsec)) {
+    return dir;
+  }
+
+  DIR *d = opendir(path);
+  if (d == NULL) {
+    return dir;
+  }
+
+  struct dirent *dent;
+  while ((dent = readdir(d)) != NULL) {
+    if (dent->d_name[0] == '.' || dent->d_type == DT_DIR) {
+      continue;
+    }
+
+    struct stat st;
+    if (fstatat(dirfd(d), dent->d_name, &st, 0) == 0 &&
+        S_ISREG(st.st_mode) && (st.st_mode & 0111) != 0) {
+      g_ptr_array_add(dir->names, strdup(dent->d_name));
+    }
+  }
+
+  closedir(d);
+
+  return dir;
+}
+
+// path_index_changed returns whether any of the directories in path differ
+// from the indexed ones (or have been modified since they were read).
+static bool path_index_changed(path_index *index, const char *path) {
+  if (index->path == NULL || strcmp(index->path, path) != 0) {
+    return true;
+  }
+
+  for (guint i = 0; i < index->dirs->len; i++) {
+    path_index_dir *dir = g_ptr_array_index(index->dirs, i);
+
+    time_t mtime;
+    long nsec;
+    path_index_stat(dir->path, &mtime, &nsec);
+    if (mtime != dir->mtime || nsec != dir->mtime_nsec) {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+static int path_index_name_cmp(const void *a, const void *b) {
+  return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+// path_index_refresh brings the index up to date with path, re-reading only
+// the directories that are new or have changed.
+//
+// Only one refresh runs at a time (see refreshing), so the old directories can
+// be read without the lock; lookups keep using the old tables until the new
+// ones are swapped in.
+static void path_index_refresh(path_index *index, char *path) {
+  gchar **paths = g_strsplit(path, ":", -1);
+  GPtrArray *old_dirs = index->dirs;
+  GPtrArray *dirs = g_ptr_array_new();
+  bool relative = false;
+
+  for (gchar **p = paths; *p != NULL; p++) {
+    if (**p != '/') {
+      relative = true;
+      continue;
+    }
+
+    path_index_dir *dir = NULL;
+    for (guint i = 0; old_dirs != NULL && i < old_dirs->len; i++) {
+      path_index_dir *old = g_ptr_array_index(old_dirs, i);
+      if (old == NULL || strcmp(old->path, *p) != 0) {
+        continue;
+      }
+
+      time_t mtime;
+      long nsec;
+      path_index_stat(old->path, &mtime, &nsec);
+      if (mtime == old->mtime && nsec == old->mtime_nsec) {
+        dir = old;
+        old_dirs->pdata[i] = NULL;
+      }
+      break;
+    }
+
+    g_ptr_array_add(dirs, dir != NULL ? dir : path_index_read_dir(*p));
+  }
+
+  g_strfreev(paths);
+
+  // Earlier directories win, as they would in a PATH search.
+  GHashTable *cmds = g_hash_table_new(g_str_hash, g_str_equal);
+  GPtrArray *names = g_ptr_array_new();
+
+  for (guint i = 0; i < dirs->len; i++) {
+    path_index_dir *dir = g_ptr_array_index(dirs, i);
+
+    for (guint j = 0; j < dir->names->len; j++) {
+      char *name = g_ptr_array_index(dir->names, j);
+      if (!g_hash_table_contains(cmds, name)) {
+        g_hash_table_insert(cmds, name, dir->path);
+        g_ptr_array_add(names, name);
+      }
+    }
+  }
+
+  qsort(names->pdata, names->len, sizeof(char *), path_index_name_cmp);
+
+  g_mutex_lock(&index->lock);
+
+  char *old_path = index->path;
+  GHashTable *old_cmds = index->cmds;
+  GPtrArray *old_names = index->names;
+
+  index->path = path;
+  index->dirs = dirs;
+  index->cmds = cmds;
+  index->names = names;
+  index->relative = relative;
+  index->ready = true;
+  index->refreshing = false;
+  g_cond_broadcast(&index->refreshed);
+
+  g_mutex_unlock(&index->lock);
+
+  free(old_path);
+  if (old_dirs != NULL) {
+    path_index_dirs_free(old_dirs);
+    g_hash_table_destroy(old_cmds);
+    g_ptr_array_free(old_names, true);
+  }
+}
+
+// path_index_build_job is a refresh to run on a background thread.
+typedef struct path_index_build_job {
+  path_index *index;
+  char *path;
+} path_index_build_job;
+
+static gpointer path_index_build(gpointer data) {
+  path_index_build_job *job = data;
+  path_index_refresh(job->index, job->path);
+  free(job);
+
+  return NULL;
+}
+
+// path_index_check starts a refresh if the index might be out of date with
+// path: in the background if it has to be (re)built from scratch, otherwise
+// on the calling thread.
+static void path_index_check(path_index *index, const char *path,
+                             bool force) {
+  gint64 now = g_get_monotonic_time();
+
+  g_mutex_lock(&index->lock);
+
+  bool new_path = index->path == NULL || strcmp(index->path, path) != 0;
+  bool recent = now - index->checked < PATH_INDEX_RECHECK_USECS;
+  if (index->refreshing || (!new_path && !force && recent)) {
+    g_mutex_unlock(&index->lock);
+    return;
+  }
+
+  index->checked = now;
+
+  // Checking the mtimes only reads the directories' own inodes, so do that
+  // before committing to a refresh.
+  if (!new_path && !path_index_changed(index, path)) {
+    g_mutex_unlock(&index->lock);
+    return;
+  }
+
+  index->refreshing = true;
+  g_mutex_unlock(&index->lock);
+
+  if (new_path) {
+    path_index_build_job *job = malloc(sizeof(path_index_build_job));
+    job->index = index;
+    job->path = strdup(path);
+
+    g_thread_unref(g_thread_new("path-index", path_index_build, job));
+  } else {
+    path_index_refresh(index, strdup(path));
+  }
+}
+
+path_index *path_index_new(void) {
+  path_index *index = malloc(sizeof(path_index));
+  g_mutex_init(&index->lock);
+  g_cond_init(&index->refreshed);
+  index->path = NULL;
+  index->dirs = NULL;
+  index->cmds = NULL;
+  index->names = NULL;
+  index->relative = false;
+  index->ready = false;
+  index->refreshing = false;
+  index->checked = 0;
+  index->lookups = 0;
+
+  return index;
+}
+
+// path_index_lookup returns the file name would run as under path (which the
+// caller frees), or NULL if the index can't say, e.g. because it's still
+// being built.
+char *path_index_lookup(path_index *index, const char *path,
+                        const char *name) {
+  g_mutex_lock(&index->lock);
+  bool worth_it = ++index->lookups >= PATH_INDEX_MIN_LOOKUPS;
+  g_mutex_unlock(&index->lock);
+
+  if (!worth_it) {
+    return NULL;
+  }
+
+  path_index_check(index, path, false);
+
+  g_mutex_lock(&index->lock);
+
+  char *file = NULL;
+  if (index->ready && !index->relative && strcmp(index->path, path) == 0) {
+    const char *dir = g_hash_table_lookup(index->cmds, name);
+    if (dir != NULL) {
+      file = g_strconcat(dir, "/", name, NULL);
+    }
+  }
+
+  g_mutex_unlock(&index->lock);
+
+  return file;
+}
+
+// path_index_complete appends copies of the names of the executables under
+// path that start with prefix to matches, waiting for the index to be built
+// if it has to.
+void path_index_complete(path_index *index, const char *path,
+                         const char *prefix, GPtrArray *matches) {
+  path_index_check(index, path, true);
+
+  g_mutex_lock(&index->lock);
+
+  while (index->refreshing) {
+    g_cond_wait(&index->refreshed, &index->lock);
+  }
+
+  if (index->ready) {
+    // Binary search for the first name that isn't before prefix.
+    size_t len = strlen(prefix);
+    guint lo = 0;
+    guint hi = index->names->len;
+
+    while (lo < hi) {
+      guint mid = lo + (hi - lo) / 2;
+      if (strcmp(g_ptr_array_index(index->names, mid), prefix) < 0) {
+        lo = mid + 1;
+      } else {
+        hi = mid;
+      }
+    }
+
+    for (guint i = lo; i < index->names->len; i++) {
+      const char *name = g_ptr_array_index(index->names, i);
+      if (strncmp(name, prefix, len) != 0) {
+        break;
+      }
+
+      g_ptr_array_add(matches, strdup(name));
+    }
+  }
+
+  g_mutex_unlock(&index->lock);
+}
+
+void path_index_free(path_index *index) {
+  // Let any background build finish first.
+  g_mutex_lock(&index->lock);
+  while (index->refreshing) {
+    g_cond_wait(&index->refreshed, &index->lock);
+  }
+  g_mutex_unlock(&index->lock);
+
+  free(index->path);
+  if (index->dirs != NULL) {
+    path_index_dirs_free(index->dirs);
+    g_hash_table_destroy(index->cmds);
+    g_ptr_array_free(index->names, true);
+  }
+
+  g_cond_clear(&index->refreshed);
+  g_mutex_clear(&index->lock);
+  free(index);
+}
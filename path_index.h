@@ -0,0 +1,53 @@
+#pragma once
+
+#include "glib.h"
+#include <stdbool.h>
+
+// path_index indexes the executables in PATH's directories, so a cmd can be
+// found without trying each directory in turn and cmd names can be completed
+// without reading them all on every keypress.
+//
+// It's built on a background thread once cmds have been looked up a few times
+// (and again if PATH changes). After that, the directories' mtimes are checked
+// at most once a second and only the ones that changed are read again. Lookups
+// never wait for a build: until the index is ready they return NULL and the
+// caller searches PATH itself.
+typedef struct path_index {
+  GMutex lock;
+
+  // Signalled when a build or refresh finishes.
+  GCond refreshed;
+
+  // The PATH the index is for, and its directories (path_index_dir*) in order.
+  char *path;
+  GPtrArray *dirs;
+
+  // GHashTable<char* name, char* dir> of the first directory each executable
+  // is in.
+  GHashTable *cmds;
+
+  // The executables' names, sorted and without duplicates.
+  GPtrArray *names;
+
+  // Whether PATH has a relative directory, whose contents depend on the cwd
+  // (so lookups can't be answered from the index).
+  bool relative;
+
+  bool ready;
+  bool refreshing;
+
+  // When the directories' mtimes were last checked (in monotonic usecs).
+  gint64 checked;
+
+  // How many lookups there have been.
+  unsigned lookups;
+} path_index;
+
+path_index *path_index_new(void);
+
+char *path_index_lookup(path_index *index, const char *path, const char *name);
+
+void path_index_complete(path_index *index, const char *path,
+                         const char *prefix, GPtrArray *matches);
+
+void path_index_free(path_index *index);
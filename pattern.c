@@ -0,0 +1,328 @@
+#include "pattern.h"
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+
+// pattern_char_class is a "[:name:]" char class.
+typedef struct pattern_char_class {
+  const char *name;
+  int (*matches)(int c);
+} pattern_char_class;
+
+static const pattern_char_class pattern_char_classes[] = {
+    {"alnum", isalnum}, {"alpha", isalpha}, {"blank", isblank},
+    {"cntrl", iscntrl}, {"digit", isdigit}, {"graph", isgraph},
+    {"lower", islower}, {"print", isprint}, {"punct", ispunct},
+    {"space", isspace}, {"upper", isupper}, {"xdigit", isxdigit},
+    {NULL, NULL},
+};
+
+// pattern_class_add adds the named "[:name:]" class's bytes to class.
+static void pattern_class_add(uint8_t class[32], const char *name, size_t len) {
+  for (const pattern_char_class *cc = pattern_char_classes; cc->name != NULL;
+       cc++) {
+    if (strlen(cc->name) == len && memcmp(cc->name, name, len) == 0) {
+      for (int c = 0; c < 256; c++) {
+        if (cc->matches(c)) {
+          class[c >> 3] |= (uint8_t)(1 << (c & 7));
+        }
+      }
+
+      return;
+    }
+  }
+}
+
+// pattern_compile_class compiles the bracket expression at start into class.
+//
+// Returns the length of the bracket expression (or 0 if it's unterminated, in
+// which case the '[' is just a literal).
+static size_t pattern_compile_class(const char *start, const char *end,
+                                    uint8_t class[32]) {
+  const char *c = start + 1;
+  memset(class, 0, 32);
+
+  bool negate = c < end && (*c == '!' || *c == '^');
+  if (negate) {
+    c++;
+  }
+
+  // A ']' right after the '[' (or "[!") is a member, not the end.
+  const char *first = c;
+
+  while (c < end) {
+    if (*c == ']' && c != first) {
+      if (negate) {
+        for (int i = 0; i < 32; i++) {
+          class[i] = (uint8_t)~class[i];
+        }
+      }
+
+      return (size_t)(c + 1 - start);
+    }
+
+    if (*c == '[' && c + 1 < end && c[1] == ':') {
+      const char *name = c + 2;
+      const char *close = name;
+      while (close + 1 < end && !(close[0] == ':' && close[1] == ']')) {
+        close++;
+      }
+
+      if (close + 1 < end) {
+        pattern_class_add(class, name, (size_t)(close - name));
+        c = close + 2;
+        continue;
+      }
+    }
+
+    if (*c == '\\' && c + 1 < end) {
+      c++;
+    }
+    unsigned char lo = (unsigned char)*c++;
+    unsigned char hi = lo;
+
+    if (c + 1 < end && *c == '-' && c[1] != ']') {
+      c++;
+      if (*c == '\\' && c + 1 < end) {
+        c++;
+      }
+      hi = (unsigned char)*c++;
+    }
+
+    for (int b = lo; b <= hi; b++) {
+      class[b >> 3] |= (uint8_t)(1 << (b & 7));
+    }
+  }
+
+  return 0;
+}
+
+// pattern_compile compiles the pattern in src.
+pattern *pattern_compile(const char *src, size_t len) {
+  pattern *pat = malloc(sizeof(pattern));
+
+  // Every op takes at least one byte of src.
+  pat->ops = malloc((len + 1) * sizeof(pattern_op));
+  pat->ops_len = 0;
+  pat->buf = malloc(len + 1);
+  pat->min_len = 0;
+  pat->leading_dot = false;
+
+  size_t buf_len = 0;
+  const char *end = src + len;
+  const char *c = src;
+
+  while (c < end) {
+    pattern_op *last = pat->ops_len > 0 ? &pat->ops[pat->ops_len - 1] : NULL;
+    pattern_op *op = &pat->ops[pat->ops_len];
+
+    if (*c == '*') {
+      // Consecutive stars are the same as one.
+      if (last == NULL || last->type != PATTERN_OP_STAR) {
+        op->type = PATTERN_OP_STAR;
+        pat->ops_len++;
+      }
+
+      c++;
+      continue;
+    }
+
+    if (*c == '?') {
+      op->type = PATTERN_OP_ANY;
+      pat->ops_len++;
+      pat->min_len++;
+
+      c++;
+      continue;
+    }
+
+    if (*c == '[') {
+      size_t class_len = pattern_compile_class(c, end, op->class);
+      if (class_len > 0) {
+        op->type = PATTERN_OP_CLASS;
+        pat->ops_len++;
+        pat->min_len++;
+
+        c += class_len;
+        continue;
+      }
+    }
+
+    if (*c == '\\' && c + 1 < end) {
+      c++;
+    }
+
+    if (pat->ops_len == 0 && *c == '.') {
+      pat->leading_dot = true;
+    }
+
+    // Extend the previous literal run (or start a new one).
+    if (last != NULL && last->type == PATTERN_OP_LIT) {
+      last->len++;
+    } else {
+      op->type = PATTERN_OP_LIT;
+      op->lit = pat->buf + buf_len;
+      op->len = 1;
+      pat->ops_len++;
+    }
+
+    pat->buf[buf_len++] = *c++;
+    pat->min_len++;
+  }
+
+  pat->buf[buf_len] = 0;
+  pat->literal = pat->ops_len == 0 ||
+                 (pat->ops_len == 1 && pat->ops[0].type == PATTERN_OP_LIT);
+
+  return pat;
+}
+
+// pattern_match returns whether the pattern matches all of str.
+bool pattern_match(pattern *pat, const char *str, size_t len) {
+  if (len < pat->min_len) {
+    return false;
+  }
+
+  if (pat->literal) {
+    return len == pat->min_len && memcmp(str, pat->buf, len) == 0;
+  }
+
+  // Literal runs at either end can only match in one place, so check those
+  // first to reject most strings (e.g. for "*.c") without any backtracking.
+  pattern_op *first = &pat->ops[0];
+  if (first->type == PATTERN_OP_LIT &&
+      memcmp(str, first->lit, first->len) != 0) {
+    return false;
+  }
+
+  pattern_op *last = &pat->ops[pat->ops_len - 1];
+  if (last->type == PATTERN_OP_LIT &&
+      memcmp(str + len - last->len, last->lit, last->len) != 0) {
+    return false;
+  }
+
+  // Match greedily, and on a mismatch let the most recent star take one more
+  // byte (earlier stars never need to, since the later one can take anything
+  // they would have).
+  size_t i = 0;
+  size_t s = 0;
+  size_t star_i = SIZE_MAX;
+  size_t star_s = 0;
+
+  while (i < pat->ops_len || s < len) {
+    if (i < pat->ops_len) {
+      pattern_op *op = &pat->ops[i];
+
+      switch (op->type) {
+      case PATTERN_OP_STAR:
+        // A trailing star matches whatever is left.
+        if (i + 1 == pat->ops_len) {
+          return true;
+        }
+
+        star_i = i++;
+        star_s = s;
+        continue;
+
+      case PATTERN_OP_LIT:
+        if (len - s >= op->len && memcmp(str + s, op->lit, op->len) == 0) {
+          s += op->len;
+          i++;
+          continue;
+        }
+        break;
+
+      case PATTERN_OP_ANY:
+        if (s < len) {
+          s++;
+          i++;
+          continue;
+        }
+        break;
+
+      case PATTERN_OP_CLASS: {
+        unsigned char b = s < len ? (unsigned char)str[s] : 0;
+        if (s < len && (op->class[b >> 3] & (1 << (b & 7))) != 0) {
+          s++;
+          i++;
+          continue;
+        }
+        break;
+      }
+
+      default:
+        break;
+      }
+    }
+
+    if (star_i == SIZE_MAX || star_s >= len) {
+      return false;
+    }
+
+    s = ++star_s;
+    i = star_i + 1;
+  }
+
+  return true;
+}
+
+void pattern_free(pattern *pat) {
+  free(pat->ops);
+  free(pat->buf);
+  free(pat);
+}
+
+// pattern_has_meta returns whether src has an unescaped "*", "?" or "[" (i.e.
+// whether it's a pattern rather than a literal).
+bool pattern_has_meta(const char *src, size_t len) {
+  for (size_t i = 0; i < len; i++) {
+    switch (src[i]) {
+    case '\\':
+      i++;
+      break;
+
+    case '*':
+    case '?':
+      return true;
+
+    // A '[' is only a bracket expression if it's closed (so e.g. the test
+    // builtin's "[" isn't a pattern).
+    case '[': {
+      size_t j = i + 1;
+      if (j < len && (src[j] == '!' || src[j] == '^')) {
+        j++;
+      }
+
+      const char *close =
+          j + 1 < len ? memchr(src + j + 1, ']', len - j - 1) : NULL;
+      if (close != NULL) {
+        return true;
+      }
+      break;
+    }
+
+    default:
+      break;
+    }
+  }
+
+  return false;
+}
+
+// pattern_unescape removes the "\" escapes from str in place, returning its new
+// length.
+size_t pattern_unescape(char *str, size_t len) {
+  size_t j = 0;
+
+  for (size_t i = 0; i < len; i++) {
+    if (str[i] == '\\' && i + 1 < len) {
+      i++;
+    }
+
+    str[j++] = str[i];
+  }
+
+  str[j] = 0;
+
+  return j;
+}
@@ -0,0 +1,57 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// pattern is a shell pattern ("*", "?", "[...]" and "\" escapes, as used by
+// globs and case) compiled once into a list of ops, so matching it against
+// many strings (e.g. every entry of a directory) doesn't re-parse it.
+//
+// Matching is bytewise (a multibyte char is several "?"s).
+
+typedef enum pattern_op_type {
+  PATTERN_OP_LIT,
+  PATTERN_OP_ANY,
+  PATTERN_OP_STAR,
+  PATTERN_OP_CLASS,
+} pattern_op_type;
+
+typedef struct pattern_op {
+  pattern_op_type type;
+
+  // For a LIT, the run of bytes (pointing into the pattern's buf).
+  const char *lit;
+  size_t len;
+
+  // For a CLASS, the bytes it matches.
+  uint8_t class[32];
+} pattern_op;
+
+typedef struct pattern {
+  pattern_op *ops;
+  size_t ops_len;
+
+  // The unescaped literal bytes, which the LIT ops point into.
+  char *buf;
+
+  // The fewest bytes a match can have.
+  size_t min_len;
+
+  // Whether the pattern is just a LIT (or is empty).
+  bool literal;
+
+  // Whether the pattern starts with a literal '.' (which a glob needs to match
+  // a hidden file).
+  bool leading_dot;
+} pattern;
+
+pattern *pattern_compile(const char *src, size_t len);
+
+bool pattern_match(pattern *pat, const char *str, size_t len);
+
+void pattern_free(pattern *pat);
+
+bool pattern_has_meta(const char *src, size_t len);
+
+size_t pattern_unescape(char *str, size_t len);
@@ -0,0 +1,175 @@
+#include "ring_buffer.h"
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+ring_buffer *ring_buffer_new(size_t cap) {
+  size_t pow2_cap = 4096;
+  while (pow2_cap < cap) {
+    pow2_cap <<= 1;
+  }
+
+  ring_buffer *ring = malloc(sizeof(ring_buffer));
+  ring->buf = malloc(pow2_cap);
+  ring->cap = pow2_cap;
+  atomic_init(&ring->head, 0);
+  atomic_init(&ring->tail, 0);
+  atomic_init(&ring->write_closed, false);
+  atomic_init(&ring->read_closed, false);
+  atomic_init(&ring->waiters, 0);
+  g_mutex_init(&ring->lock);
+  g_cond_init(&ring->cond);
+
+  return ring;
+}
+
+void ring_buffer_free(ring_buffer *ring) {
+  g_mutex_clear(&ring->lock);
+  g_cond_clear(&ring->cond);
+  free(ring->buf);
+  free(ring);
+}
+
+// ring_buffer_wake wakes the other side if it's parked.
+//
+// The caller has just published progress with a seq_cst store, and a parking
+// thread bumps waiters before rechecking the counters, so either it sees the
+// progress or we see it waiting (and it can't miss the broadcast, since it
+// holds the lock until it's actually waiting).
+static void ring_buffer_wake(ring_buffer *ring) {
+  if (atomic_load(&ring->waiters) > 0) {
+    g_mutex_lock(&ring->lock);
+    g_cond_broadcast(&ring->cond);
+    g_mutex_unlock(&ring->lock);
+  }
+}
+
+// ring_buffer_write_reserve returns the number of contiguous bytes free in the
+// buffer (storing where they start in span), blocking until there are some.
+//
+// Returns 0 if the reader has closed its end.
+size_t ring_buffer_write_reserve(ring_buffer *ring, char **span) {
+  size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+  size_t head = atomic_load(&ring->head);
+
+  if (tail - head == ring->cap && !atomic_load(&ring->read_closed)) {
+    g_mutex_lock(&ring->lock);
+    atomic_fetch_add(&ring->waiters, 1);
+
+    while ((head = atomic_load(&ring->head), tail - head == ring->cap) &&
+           !atomic_load(&ring->read_closed)) {
+      g_cond_wait(&ring->cond, &ring->lock);
+    }
+
+    atomic_fetch_sub(&ring->waiters, 1);
+    g_mutex_unlock(&ring->lock);
+  }
+
+  if (atomic_load(&ring->read_closed)) {
+    return 0;
+  }
+
+  size_t off = tail & (ring->cap - 1);
+  *span = ring->buf + off;
+
+  return MIN(ring->cap - (tail - head), ring->cap - off);
+}
+
+// ring_buffer_write_commit publishes len bytes written to the reserved span.
+void ring_buffer_write_commit(ring_buffer *ring, size_t len) {
+  size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+  atomic_store(&ring->tail, tail + len);
+
+  ring_buffer_wake(ring);
+}
+
+// ring_buffer_read_peek returns the number of contiguous bytes readable from
+// the buffer (storing where they start in span), blocking until there are
+// some.
+//
+// Returns 0 once the writer has closed its end and everything's been read.
+size_t ring_buffer_read_peek(ring_buffer *ring, char **span) {
+  size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+  size_t tail = atomic_load(&ring->tail);
+
+  if (tail == head) {
+    g_mutex_lock(&ring->lock);
+    atomic_fetch_add(&ring->waiters, 1);
+
+    for (;;) {
+      if ((tail = atomic_load(&ring->tail)) != head) {
+        break;
+      }
+
+      // Recheck tail after seeing the close, since the writer's last commit
+      // may have landed between the two loads.
+      if (atomic_load(&ring->write_closed)) {
+        tail = atomic_load(&ring->tail);
+        break;
+      }
+
+      g_cond_wait(&ring->cond, &ring->lock);
+    }
+
+    atomic_fetch_sub(&ring->waiters, 1);
+    g_mutex_unlock(&ring->lock);
+  }
+
+  size_t off = head & (ring->cap - 1);
+  *span = ring->buf + off;
+
+  return MIN(tail - head, ring->cap - off);
+}
+
+// ring_buffer_read_consume releases len bytes of the peeked span back to the
+// writer.
+void ring_buffer_read_consume(ring_buffer *ring, size_t len) {
+  size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+  atomic_store(&ring->head, head + len);
+
+  ring_buffer_wake(ring);
+}
+
+// ring_buffer_write writes all of buf, blocking as needed.
+//
+// Returns -1 (with errno set to EPIPE) if the reader closed its end first.
+ssize_t ring_buffer_write(ring_buffer *ring, const char *buf, size_t len) {
+  for (size_t written = 0; written < len;) {
+    char *span;
+    size_t n = ring_buffer_write_reserve(ring, &span);
+    if (n == 0) {
+      errno = EPIPE;
+      return -1;
+    }
+
+    n = MIN(n, len - written);
+    memcpy(span, buf + written, n);
+    ring_buffer_write_commit(ring, n);
+
+    written += n;
+  }
+
+  return (ssize_t)len;
+}
+
+// ring_buffer_read reads up to len bytes into buf, blocking until there are
+// any; like read(2), it returns 0 at EOF.
+ssize_t ring_buffer_read(ring_buffer *ring, char *buf, size_t len) {
+  char *span;
+  size_t n = MIN(ring_buffer_read_peek(ring, &span), len);
+
+  memcpy(buf, span, n);
+  ring_buffer_read_consume(ring, n);
+
+  return (ssize_t)n;
+}
+
+void ring_buffer_close_write(ring_buffer *ring) {
+  atomic_store(&ring->write_closed, true);
+  ring_buffer_wake(ring);
+}
+
+void ring_buffer_close_read(ring_buffer *ring) {
+  atomic_store(&ring->read_closed, true);
+  ring_buffer_wake(ring);
+}
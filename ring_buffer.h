@@ -0,0 +1,54 @@
+#pragma once
+
+#include "glib.h"
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+// ring_buffer is a single-producer/single-consumer byte queue for connecting
+// pipeline stages running on threads inside the shell.
+//
+// The fast path is lock-free: the writer only ever advances tail and the
+// reader head, so each side just loads the other's counter. Only a side that
+// finds the buffer full (or empty) takes the lock to park itself until the
+// other side makes progress or closes its end.
+typedef struct ring_buffer {
+  char *buf;
+
+  // The buffer size; always a power of two so positions can be masked.
+  size_t cap;
+
+  // The total bytes ever read and written; masked by cap - 1 to index buf.
+  _Atomic size_t head;
+  _Atomic size_t tail;
+
+  _Atomic bool write_closed;
+  _Atomic bool read_closed;
+
+  // The number of threads parked (or about to park) on cond.
+  _Atomic int waiters;
+
+  GMutex lock;
+  GCond cond;
+} ring_buffer;
+
+ring_buffer *ring_buffer_new(size_t cap);
+
+void ring_buffer_free(ring_buffer *ring);
+
+size_t ring_buffer_write_reserve(ring_buffer *ring, char **span);
+
+void ring_buffer_write_commit(ring_buffer *ring, size_t len);
+
+size_t ring_buffer_read_peek(ring_buffer *ring, char **span);
+
+void ring_buffer_read_consume(ring_buffer *ring, size_t len);
+
+ssize_t ring_buffer_write(ring_buffer *ring, const char *buf, size_t len);
+
+ssize_t ring_buffer_read(ring_buffer *ring, char *buf, size_t len);
+
+void ring_buffer_close_write(ring_buffer *ring);
+
+void ring_buffer_close_read(ring_buffer *ring);
@@ -0,0 +1,579 @@
+#include "script_reader.h"
+#include "utils.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define SCRIPT_READER_BLOCK_SIZE (256 * 1024)
+
+// script_reader_map maps a regular file so that it's followed by at least one
+// zero byte, which lets the parser treat the mapping as a C string.
+//
+// The file is mapped over an anonymous (zero-filled) reservation that is one
+// byte longer than the file; the kernel zero-fills the tail of the last file
+// page, and if the file ends exactly on a page boundary the following
+// anonymous page provides the terminator.
+static bool script_reader_map(script_reader *reader, size_t len) {
+  size_t page_size = (size_t)sysconf(_SC_PAGESIZE);
+  size_t map_len = ((len + 1) + page_size - 1) & ~(page_size - 1);
+
+  char *reservation = mmap(NULL, map_len, PROT_READ,
+                           MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (reservation == MAP_FAILED) {
+    return false;
+  }
+
+  char *buf = mmap(reservation, len, PROT_READ, MAP_PRIVATE | MAP_FIXED,
+                   reader->fd, 0);
+  if (buf == MAP_FAILED) {
+    munmap(reservation, map_len);
+    return false;
+  }
+
+  madvise(buf, len, MADV_SEQUENTIAL);
+
+  reader->buf = buf;
+  reader->len = len;
+  reader->mapped = true;
+  reader->map_len = map_len;
+
+  return true;
+}
+
+script_reader *script_reader_new(int fd) {
+  script_reader *reader = malloc(sizeof(script_reader));
+  reader->fd = fd;
+  reader->buf = NULL;
+  reader->len = 0;
+  reader->cap = 0;
+  reader->mapped = false;
+  reader->map_len = 0;
+  reader->start = 0;
+  reader->scan = 0;
+  reader->saved_at = 0;
+  reader->saved = 0;
+  reader->eof = false;
+  reader->in_single_quote = false;
+  reader->in_double_quote = false;
+  reader->in_comment = false;
+  reader->escaped = false;
+  reader->sub_depth = 0;
+  reader->arith_depth = 0;
+  reader->word_len = 0;
+  reader->cmd_pos = true;
+  reader->compound_depth = 0;
+  reader->heredoc_delim = NULL;
+  reader->heredoc_delim_started = false;
+  reader->heredocs = g_ptr_array_new();
+  reader->in_heredoc = false;
+  reader->heredoc_index = 0;
+  reader->heredoc_line = 0;
+
+  struct stat st;
+  if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+    if (st.st_size == 0) {
+      reader->eof = true;
+    } else if (script_reader_map(reader, (size_t)st.st_size)) {
+      reader->eof = true;
+    }
+  }
+
+  return reader;
+}
+
+script_reader *script_reader_open(const char *path) {
+  int fd;
+  if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0) {
+    giveup("script_reader_open: failed to open '%s'", path);
+  }
+
+  return script_reader_new(fd);
+}
+
+// script_reader_is_word_char returns whether c continues an unquoted word.
+static bool script_reader_is_word_char(char c) {
+  switch (c) {
+  case ' ':
+  case '\t':
+  case '\n':
+  case ';':
+  case '&':
+  case '|':
+  case '(':
+  case ')':
+  case '<':
+  case '>':
+  case '\'':
+  case '"':
+  case '`':
+  case '$':
+  case '#':
+    return false;
+
+  default:
+    return true;
+  }
+}
+
+// script_reader_at_word_start returns whether the byte at scan starts a word
+// (so e.g. a '#' there starts a comment rather than being part of a word).
+static bool script_reader_at_word_start(script_reader *reader) {
+  if (reader->scan == 0) {
+    return true;
+  }
+
+  switch (reader->buf[reader->scan - 1]) {
+  case ' ':
+  case '\t':
+  case '\n':
+  case ';':
+  case '&':
+  case '|':
+  case '(':
+  case ')':
+  case '<':
+  case '>':
+    return true;
+
+  default:
+    return false;
+  }
+}
+
+// script_reader_end_word tracks compound cmds by looking at the word that just
+// ended, if it's a reserved word where a cmd name would go.
+static void script_reader_end_word(script_reader *reader) {
+  if (reader->word_len == 0) {
+    return;
+  }
+
+  size_t len = reader->word_len;
+  reader->word_len = 0;
+
+  bool was_cmd_pos = reader->cmd_pos;
+  reader->cmd_pos = false;
+
+  if (!was_cmd_pos || len >= sizeof(reader->word)) {
+    return;
+  }
+
+  reader->word[len] = 0;
+  const char *word = reader->word;
+
+  if (strcmp(word, "if") == 0 || strcmp(word, "while") == 0 ||
+      strcmp(word, "until") == 0 || strcmp(word, "{") == 0) {
+    reader->compound_depth++;
+    reader->cmd_pos = true;
+  } else if (strcmp(word, "for") == 0 || strcmp(word, "case") == 0) {
+    reader->compound_depth++;
+  } else if (strcmp(word, "fi") == 0 || strcmp(word, "done") == 0 ||
+             strcmp(word, "esac") == 0 || strcmp(word, "}") == 0) {
+    if (reader->compound_depth > 0) {
+      reader->compound_depth--;
+    }
+  } else if (strcmp(word, "then") == 0 || strcmp(word, "do") == 0 ||
+             strcmp(word, "else") == 0 || strcmp(word, "elif") == 0 ||
+             strcmp(word, "!") == 0) {
+    reader->cmd_pos = true;
+  }
+}
+
+// script_reader_scan_heredoc_delim feeds c to the here-doc delimiter being
+// read, returning whether it was part of it.
+//
+// The delimiter's quotes are dropped, since all that matters here is the text
+// that ends the body.
+static bool script_reader_scan_heredoc_delim(script_reader *reader, char c) {
+  GString *delim = reader->heredoc_delim;
+
+  if (!reader->heredoc_delim_started) {
+    // A third '<' makes it a here-string.
+    if (c == '<' && delim->len == 1) {
+      g_string_free(delim, true);
+      reader->heredoc_delim = NULL;
+
+      return false;
+    }
+
+    if (c == '-' && reader->buf[reader->scan - 1] == '<') {
+      delim->str[0] = '-';
+      return true;
+    }
+
+    if (c == ' ' || c == '\t') {
+      return true;
+    }
+  }
+
+  if (c == '\'' || c == '"' || c == '\\') {
+    reader->heredoc_delim_started = true;
+    return true;
+  }
+
+  if (script_reader_is_word_char(c)) {
+    g_string_append_c(delim, c);
+    reader->heredoc_delim_started = true;
+    return true;
+  }
+
+  if (reader->heredoc_delim_started) {
+    g_ptr_array_add(reader->heredocs, g_string_free(delim, false));
+  } else {
+    g_string_free(delim, true);
+  }
+
+  reader->heredoc_delim = NULL;
+
+  return false;
+}
+
+// script_reader_clear_heredocs forgets the current line's here-docs.
+static void script_reader_clear_heredocs(script_reader *reader) {
+  for (guint i = 0; i < reader->heredocs->len; i++) {
+    free(g_ptr_array_index(reader->heredocs, i));
+  }
+
+  g_ptr_array_set_size(reader->heredocs, 0);
+}
+
+// script_reader_end_heredoc_line checks whether the here-doc body line ending
+// at scan is the current body's delimiter, moving on to the next body (or out
+// of the bodies) if so.
+static void script_reader_end_heredoc_line(script_reader *reader) {
+  const char *line = reader->buf + reader->heredoc_line;
+  const char *end = reader->buf + reader->scan;
+  const char *delim =
+      g_ptr_array_index(reader->heredocs, reader->heredoc_index);
+
+  if (delim[0] == '-') {
+    while (line < end && *line == '\t') {
+      line++;
+    }
+  }
+
+  size_t len = strlen(delim + 1);
+  if ((size_t)(end - line) == len && memcmp(line, delim + 1, len) == 0 &&
+      ++reader->heredoc_index == reader->heredocs->len) {
+    reader->in_heredoc = false;
+    script_reader_clear_heredocs(reader);
+  }
+
+  reader->heredoc_line = reader->scan + 1;
+}
+
+// script_reader_scan advances the scanner over any unscanned bytes and
+// returns the offset just past the last logical line boundary it saw (or 0 if
+// there wasn't one).
+//
+// If stop_at is non-zero, it stops at the first boundary at or past stop_at.
+static size_t script_reader_scan(script_reader *reader, size_t stop_at) {
+  size_t boundary = 0;
+
+  for (; reader->scan < reader->len; reader->scan++) {
+    char c = reader->buf[reader->scan];
+
+    // Here-doc bodies are taken as they are, up to their delimiter lines.
+    if (reader->in_heredoc) {
+      if (c == '\n') {
+        script_reader_end_heredoc_line(reader);
+
+        if (!reader->in_heredoc && reader->sub_depth == 0 &&
+            reader->compound_depth == 0) {
+          boundary = reader->scan + 1;
+
+          if (stop_at != 0 && boundary >= stop_at) {
+            reader->scan++;
+            return boundary;
+          }
+        }
+      }
+
+      continue;
+    }
+
+    if (reader->in_comment) {
+      if (c == '\n') {
+        reader->in_comment = false;
+      } else {
+        continue;
+      }
+    }
+
+    // The byte after a '\' is taken as it is (and a "\\\n" joins lines).
+    if (reader->escaped) {
+      reader->escaped = false;
+      continue;
+    }
+
+    if (reader->in_single_quote) {
+      reader->in_single_quote = c != '\'';
+      continue;
+    }
+
+    if (reader->in_double_quote) {
+      reader->escaped = c == '\\';
+      reader->in_double_quote = c != '"';
+      continue;
+    }
+
+    if (reader->heredoc_delim != NULL &&
+        script_reader_scan_heredoc_delim(reader, c)) {
+      continue;
+    }
+
+    if (script_reader_is_word_char(c)) {
+      if (reader->word_len < sizeof(reader->word)) {
+        reader->word[reader->word_len] = c;
+      }
+      reader->word_len++;
+      reader->escaped = c == '\\';
+
+      continue;
+    }
+
+    script_reader_end_word(reader);
+
+    switch (c) {
+    case '\'':
+      reader->in_single_quote = true;
+      reader->cmd_pos = false;
+      break;
+
+    case '"':
+      reader->in_double_quote = true;
+      reader->cmd_pos = false;
+      break;
+
+    case '#':
+      // "$#" is a param and "a#b" a word, not comments.
+      reader->in_comment = script_reader_at_word_start(reader);
+      break;
+
+    case '$':
+    case '`':
+      reader->cmd_pos = false;
+      break;
+
+    case ';':
+    case '&':
+    case '|':
+      reader->cmd_pos = true;
+      break;
+
+    case '(': {
+      reader->cmd_pos = true;
+
+      // Count every paren inside a sub, so e.g. the "(1+2)" in
+      // "$(( (1+2)*3 ))" doesn't end it early, as well as the second paren of
+      // a "((", which starts arithmetic.
+      char prev = reader->scan > 0 ? reader->buf[reader->scan - 1] : 0;
+      if (reader->sub_depth > 0 || prev == '$' || prev == '<' || prev == '(') {
+        reader->sub_depth++;
+      }
+
+      if (prev == '(' && reader->arith_depth == 0) {
+        reader->arith_depth = reader->sub_depth;
+      }
+      break;
+    }
+
+    case ')':
+      reader->cmd_pos = true;
+      if (reader->sub_depth > 0) {
+        reader->sub_depth--;
+      }
+      if (reader->sub_depth < reader->arith_depth) {
+        reader->arith_depth = 0;
+      }
+      break;
+
+    case '<':
+      // A "<<" (but not a "<<<", or a shift) is followed by a here-doc's
+      // delimiter.
+      if (reader->arith_depth == 0 && reader->scan > 1 &&
+          reader->buf[reader->scan - 1] == '<' &&
+          reader->buf[reader->scan - 2] != '<') {
+        reader->heredoc_delim = g_string_new("=");
+        reader->heredoc_delim_started = false;
+      }
+      break;
+
+    case '\n':
+      reader->cmd_pos = true;
+
+      // The line's here-doc bodies start on the next one.
+      if (reader->heredocs->len > 0) {
+        reader->in_heredoc = true;
+        reader->heredoc_index = 0;
+        reader->heredoc_line = reader->scan + 1;
+        break;
+      }
+
+      if (reader->sub_depth == 0 && reader->compound_depth == 0) {
+        boundary = reader->scan + 1;
+
+        if (stop_at != 0 && boundary >= stop_at) {
+          reader->scan++;
+          return boundary;
+        }
+      }
+      break;
+
+    default:
+      break;
+    }
+  }
+
+  return boundary;
+}
+
+// script_reader_fill reads the next block from the fd, compacting and growing
+// the buffer as needed so that a logical line of any length fits.
+static void script_reader_fill(script_reader *reader) {
+  if (reader->start > 0) {
+    memmove(reader->buf, reader->buf + reader->start,
+            reader->len - reader->start);
+
+    reader->len -= reader->start;
+    reader->scan -= reader->start;
+    if (reader->in_heredoc) {
+      reader->heredoc_line -= reader->start;
+    }
+    reader->start = 0;
+  }
+
+  // Always leave room for the NUL terminator.
+  if (reader->cap - reader->len < SCRIPT_READER_BLOCK_SIZE + 1) {
+    reader->cap = reader->cap == 0 ? SCRIPT_READER_BLOCK_SIZE + 1
+                                   : reader->cap * 2;
+    reader->buf = realloc(reader->buf, reader->cap);
+  }
+
+  ssize_t n;
+  do {
+    n = read(reader->fd, reader->buf + reader->len,
+             reader->cap - reader->len - 1);
+  } while (n < 0 && errno == EINTR);
+
+  if (n < 0) {
+    giveup("script_reader_fill: read failed");
+  }
+
+  if (n == 0) {
+    reader->eof = true;
+  }
+
+  reader->len += (size_t)n;
+}
+
+// script_reader_next returns the next chunk of whole logical lines, or NULL
+// once the script has been exhausted.
+//
+// The returned pointer is only valid until the next call.
+char *script_reader_next(script_reader *reader) {
+  if (reader->mapped) {
+    if (reader->start != 0) {
+      return NULL;
+    }
+
+    reader->start = reader->len;
+    return reader->buf;
+  }
+
+  // Restore the byte we clobbered to terminate the previous chunk.
+  if (reader->saved_at != 0) {
+    reader->buf[reader->saved_at] = reader->saved;
+    reader->start = reader->saved_at;
+    reader->saved_at = 0;
+  }
+
+  for (;;) {
+    size_t boundary = script_reader_scan(reader, 0);
+
+    if (boundary == 0 && reader->eof) {
+      boundary = reader->len;
+    }
+
+    if (boundary > reader->start) {
+      char *chunk = reader->buf + reader->start;
+
+      reader->saved_at = boundary;
+      reader->saved = reader->buf[boundary];
+      reader->buf[boundary] = 0;
+
+      return chunk;
+    }
+
+    if (reader->eof) {
+      return NULL;
+    }
+
+    script_reader_fill(reader);
+  }
+}
+
+// script_reader_take returns a copy of the next chunk of whole logical lines
+// (which the caller frees), or NULL once the script has been exhausted.
+//
+// Unlike script_reader_next, chunks are split at the first boundary at least
+// min_len bytes in (even in a mapped file), and stay valid after the next
+// call, so they can be parsed concurrently. The two mustn't be mixed.
+char *script_reader_take(script_reader *reader, size_t min_len) {
+  size_t boundary = 0;
+
+  for (;;) {
+    size_t found = script_reader_scan(reader, reader->start + min_len);
+    if (found != 0) {
+      boundary = found;
+    }
+
+    bool enough = boundary != 0 && boundary - reader->start >= min_len;
+    if (!enough && reader->eof) {
+      boundary = reader->len;
+    }
+
+    if ((enough || reader->eof) && boundary > reader->start) {
+      char *chunk =
+          strndup(reader->buf + reader->start, boundary - reader->start);
+      reader->start = boundary;
+
+      return chunk;
+    }
+
+    if (reader->eof) {
+      return NULL;
+    }
+
+    // Filling moves what's left of the buffer down to its start.
+    size_t start = reader->start;
+    script_reader_fill(reader);
+    if (boundary != 0) {
+      boundary -= start;
+    }
+  }
+}
+
+void script_reader_free(script_reader *reader) {
+  if (reader->mapped) {
+    munmap(reader->buf, reader->map_len);
+  } else {
+    free(reader->buf);
+  }
+
+  if (reader->fd > STDERR_FILENO) {
+    close(reader->fd);
+  }
+
+  if (reader->heredoc_delim != NULL) {
+    g_string_free(reader->heredoc_delim, true);
+  }
+
+  script_reader_clear_heredocs(reader);
+  g_ptr_array_free(reader->heredocs, true);
+
+  free(reader);
+}
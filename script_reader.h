@@ -0,0 +1,81 @@
+#pragma once
+
+#include "glib.h"
+#include <stdbool.h>
+#include <stddef.h>
+
+// script_reader hands out NUL-terminated chunks of a script that end on a
+// logical line boundary (i.e. never in the middle of a quoted string, a
+// `$(...)`/`<(...)` sub or a compound cmd like `if ...; fi`), so each chunk
+// can be handed straight to a cmd_parser.
+//
+// Regular files are mmap'd and returned as a single chunk without copying;
+// everything else (pipes, ttys, sockets) is read in large blocks.
+typedef struct script_reader {
+  int fd;
+
+  char *buf;
+  size_t len;
+  size_t cap;
+
+  // Whether buf is an mmap of the whole file (and its mapped length).
+  bool mapped;
+  size_t map_len;
+
+  // Offset of the first byte not yet handed out.
+  size_t start;
+
+  // Offset of the first byte not yet scanned for a line boundary.
+  size_t scan;
+
+  // The byte that was overwritten with a NUL to terminate the last chunk.
+  size_t saved_at;
+  char saved;
+
+  bool eof;
+
+  // Scanner state carried across reads.
+  bool in_single_quote;
+  bool in_double_quote;
+  bool in_comment;
+  bool escaped;
+  int sub_depth;
+
+  // The sub_depth of the innermost "((" (whose "<<"s are shifts, not
+  // here-docs), or 0 if there isn't one.
+  int arith_depth;
+
+  // The unquoted word being scanned (only its first few bytes are kept, which
+  // is enough to spot reserved words), whether it's where a cmd name would
+  // go, and how many compound cmds are open.
+  char word[8];
+  size_t word_len;
+  bool cmd_pos;
+  int compound_depth;
+
+  // The delimiter being read after a "<<" (or NULL), and whether any of it
+  // has been seen yet.
+  GString *heredoc_delim;
+  bool heredoc_delim_started;
+
+  // GPtrArray<char*> of the delimiters of the here-docs on the current line,
+  // whose bodies follow it (each prefixed with '-' if the body's leading tabs
+  // are stripped, or '=' if not).
+  GPtrArray *heredocs;
+
+  // Whether the here-doc bodies are being scanned, which one, and where its
+  // current line starts.
+  bool in_heredoc;
+  guint heredoc_index;
+  size_t heredoc_line;
+} script_reader;
+
+script_reader *script_reader_new(int fd);
+
+script_reader *script_reader_open(const char *path);
+
+char *script_reader_next(script_reader *reader);
+
+char *script_reader_take(script_reader *reader, size_t min_len);
+
+void script_reader_free(script_reader *reader);
@@ -0,0 +1,586 @@
+#include "server.h"
+#include "cmd.h"
+#include "cmd_executor.h"
+#include "cmd_parser.h"
+#include "glib.h"
+#include "script_reader.h"
+#include "utils.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <setjmp.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+extern char **environ;
+
+#ifdef __APPLE__
+#define st_mtim st_mtimespec
+#endif
+
+#define SERVER_REQ_SCRIPT 0
+#define SERVER_REQ_CMD 1
+
+// The largest request payload we'll accept (the payload holds the client's
+// args and environment, which the kernel already limits to far less).
+#define SERVER_MAX_PAYLOAD (64 * 1024 * 1024)
+
+// The number of parsed scripts/cmds to keep before starting over.
+#define SERVER_SCRIPT_CACHE_SIZE 256
+
+// server_script is a parsed script (or -c cmd) kept around for reuse.
+typedef struct server_script {
+  // Held by the cache and by each request executing the script.
+  int refs;
+
+  // GList<cmd*>
+  GList *cmds;
+
+  // For scripts, the file's mtime and size when it was parsed.
+  struct timespec mtime;
+  off_t size;
+} server_script;
+
+// server_request is a decoded client request; its strings point into payload.
+typedef struct server_request {
+  int fds[3];
+
+  char *payload;
+
+  uint32_t kind;
+  char *source;
+  char *cwd;
+
+  // NULL-terminated.
+  char **args;
+  char **envp;
+} server_request;
+
+// server_payload_reader walks the fields of a request payload.
+typedef struct server_payload_reader {
+  char *next;
+  char *end;
+} server_payload_reader;
+
+// GHashTable<char* key, server_script*>; keys are "f:<path>" or "c:<cmd>".
+static GHashTable *scripts = NULL;
+static GMutex scripts_lock;
+
+// server_script_new returns an empty script holding a single ref.
+static server_script *server_script_new(void) {
+  server_script *script = malloc(sizeof(server_script));
+  script->refs = 1;
+  script->cmds = NULL;
+  script->size = 0;
+
+  return script;
+}
+
+static server_script *server_script_ref(server_script *script) {
+  g_atomic_int_inc(&script->refs);
+
+  return script;
+}
+
+static void server_script_unref(server_script *script) {
+  if (!g_atomic_int_dec_and_test(&script->refs)) {
+    return;
+  }
+
+  g_list_free_full(script->cmds, (GDestroyNotify)cmd_free);
+  free(script);
+}
+
+// server_parse parses every cmd in src, returning false (and freeing anything
+// parsed so far) on a parse error.
+static bool server_parse(char *src, GList **cmds) {
+  cmd_parser *parser = cmd_parser_new();
+
+  jmp_buf err_jmp;
+  parser->err_jmp = &err_jmp;
+
+  if (setjmp(err_jmp) != 0) {
+    fputs(parser->err, stderr);
+    g_list_free_full(*cmds, (GDestroyNotify)cmd_free);
+    *cmds = NULL;
+    cmd_parser_free(parser);
+
+    return false;
+  }
+
+  cmd_parser_set_next(parser, src);
+
+  cmd *c;
+  while ((c = cmd_parser_parse_next(parser)) != NULL) {
+    *cmds = g_list_append(*cmds, c);
+  }
+
+  cmd_parser_free(parser);
+
+  return true;
+}
+
+// server_parse_script parses the script at path, returning NULL if it
+// couldn't be read or parsed.
+static server_script *server_parse_script(const char *path, struct stat *st) {
+  int fd;
+  if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0) {
+    return NULL;
+  }
+
+  server_script *script = server_script_new();
+  script->mtime = st->st_mtim;
+  script->size = st->st_size;
+
+  script_reader *reader = script_reader_new(fd);
+
+  char *chunk;
+  bool ok = true;
+  while (ok && (chunk = script_reader_next(reader)) != NULL) {
+    GList *cmds = NULL;
+    ok = server_parse(chunk, &cmds);
+    script->cmds = g_list_concat(script->cmds, cmds);
+  }
+
+  script_reader_free(reader);
+
+  if (!ok) {
+    server_script_unref(script);
+    return NULL;
+  }
+
+  return script;
+}
+
+// server_get_script returns a ref to the parsed script for the request,
+// parsing it (and caching the result) if we haven't seen it, or if the file
+// has changed since we did.
+//
+// Requests on other workers may still be executing a script that's dropped
+// from the cache (once it's full, or when its file changes), so each holds its
+// own ref.
+static server_script *server_get_script(server_request *req) {
+  struct stat st;
+  if (req->kind == SERVER_REQ_SCRIPT && stat(req->source, &st) < 0) {
+    return NULL;
+  }
+
+  GString *key = g_string_new(req->kind == SERVER_REQ_SCRIPT ? "f:" : "c:");
+  key = g_string_append(key, req->source);
+
+  g_mutex_lock(&scripts_lock);
+  if (scripts == NULL) {
+    scripts = g_hash_table_new_full(g_str_hash, g_str_equal, free,
+                                    (GDestroyNotify)server_script_unref);
+  }
+
+  server_script *script = g_hash_table_lookup(scripts, key->str);
+  if (script != NULL &&
+      (req->kind == SERVER_REQ_CMD ||
+       (script->size == st.st_size &&
+        script->mtime.tv_sec == st.st_mtim.tv_sec &&
+        script->mtime.tv_nsec == st.st_mtim.tv_nsec))) {
+    server_script_ref(script);
+    g_mutex_unlock(&scripts_lock);
+    g_string_free(key, true);
+
+    return script;
+  }
+  g_mutex_unlock(&scripts_lock);
+
+  if (req->kind == SERVER_REQ_SCRIPT) {
+    script = server_parse_script(req->source, &st);
+  } else {
+    script = server_script_new();
+
+    if (!server_parse(req->source, &script->cmds)) {
+      server_script_unref(script);
+      script = NULL;
+    }
+  }
+
+  if (script == NULL) {
+    g_string_free(key, true);
+    return NULL;
+  }
+
+  g_mutex_lock(&scripts_lock);
+  if (g_hash_table_size(scripts) >= SERVER_SCRIPT_CACHE_SIZE) {
+    g_hash_table_remove_all(scripts);
+  }
+
+  g_hash_table_replace(scripts, g_string_free(key, false),
+                       server_script_ref(script));
+  g_mutex_unlock(&scripts_lock);
+
+  return script;
+}
+
+static bool server_read_full(int fd, void *buf, size_t len) {
+  char *next = buf;
+  while (len > 0) {
+    ssize_t n = read(fd, next, len);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+
+    if (n <= 0) {
+      return false;
+    }
+
+    next += n;
+    len -= (size_t)n;
+  }
+
+  return true;
+}
+
+static bool server_write_full(int fd, const void *buf, size_t len) {
+  const char *next = buf;
+  while (len > 0) {
+    ssize_t n = write(fd, next, len);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+
+    if (n < 0) {
+      return false;
+    }
+
+    next += n;
+    len -= (size_t)n;
+  }
+
+  return true;
+}
+
+static bool server_payload_read_u32(server_payload_reader *reader,
+                                    uint32_t *res) {
+  if ((size_t)(reader->end - reader->next) < sizeof(uint32_t)) {
+    return false;
+  }
+
+  memcpy(res, reader->next, sizeof(uint32_t));
+  reader->next += sizeof(uint32_t);
+
+  return true;
+}
+
+// server_payload_read_str returns the next NUL-terminated string in the
+// payload (in place).
+static char *server_payload_read_str(server_payload_reader *reader) {
+  uint32_t len;
+  if (!server_payload_read_u32(reader, &len) ||
+      (size_t)(reader->end - reader->next) < (size_t)len + 1 ||
+      reader->next[len] != 0) {
+    return NULL;
+  }
+
+  char *str = reader->next;
+  reader->next += len + 1;
+
+  return str;
+}
+
+static char **server_payload_read_strv(server_payload_reader *reader) {
+  uint32_t len;
+  if (!server_payload_read_u32(reader, &len) ||
+      len > (size_t)(reader->end - reader->next)) {
+    return NULL;
+  }
+
+  char **strv = malloc(((size_t)len + 1) * sizeof(char *));
+  for (uint32_t i = 0; i < len; i++) {
+    if ((strv[i] = server_payload_read_str(reader)) == NULL) {
+      free(strv);
+      return NULL;
+    }
+  }
+  strv[len] = NULL;
+
+  return strv;
+}
+
+static void server_payload_append_u32(GString *payload, uint32_t val) {
+  g_string_append_len(payload, (const char *)&val, sizeof(uint32_t));
+}
+
+static void server_payload_append_str(GString *payload, const char *str) {
+  size_t len = strlen(str);
+
+  server_payload_append_u32(payload, (uint32_t)len);
+  g_string_append_len(payload, str, (gssize)len + 1);
+}
+
+// server_recv_request reads a request (and the fds sent with it) from the
+// connection, returning false if it was malformed.
+static bool server_recv_request(int conn, server_request *req) {
+  uint32_t payload_len;
+  struct iovec iov = {.iov_base = &payload_len, .iov_len = sizeof(payload_len)};
+
+  union {
+    char buf[CMSG_SPACE(sizeof(req->fds))];
+    struct cmsghdr align;
+  } control;
+
+  struct msghdr msg = {
+      .msg_iov = &iov,
+      .msg_iovlen = 1,
+      .msg_control = control.buf,
+      .msg_controllen = sizeof(control.buf),
+  };
+
+  ssize_t n;
+  do {
+    n = recvmsg(conn, &msg, 0);
+  } while (n < 0 && errno == EINTR);
+
+  struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+  if (n != sizeof(payload_len) || cmsg == NULL ||
+      cmsg->cmsg_type != SCM_RIGHTS ||
+      cmsg->cmsg_len != CMSG_LEN(sizeof(req->fds))) {
+    return false;
+  }
+
+  memcpy(req->fds, CMSG_DATA(cmsg), sizeof(req->fds));
+  for (int i = 0; i < 3; i++) {
+    fcntl(req->fds[i], F_SETFD, FD_CLOEXEC);
+  }
+
+  req->args = NULL;
+  req->envp = NULL;
+
+  if (payload_len > SERVER_MAX_PAYLOAD ||
+      (req->payload = malloc(payload_len)) == NULL ||
+      !server_read_full(conn, req->payload, payload_len)) {
+    return false;
+  }
+
+  server_payload_reader reader = {
+      .next = req->payload,
+      .end = req->payload + payload_len,
+  };
+
+  return server_payload_read_u32(&reader, &req->kind) &&
+         (req->source = server_payload_read_str(&reader)) != NULL &&
+         (req->cwd = server_payload_read_str(&reader)) != NULL &&
+         (req->args = server_payload_read_strv(&reader)) != NULL &&
+         (req->envp = server_payload_read_strv(&reader)) != NULL;
+}
+
+// server_exec runs the request's script with a fresh executor, returning its
+// exit status.
+static int server_exec(server_request *req) {
+  server_script *script = server_get_script(req);
+  if (script == NULL) {
+    dprintf(req->fds[2], "turtle: failed to load '%s'\n", req->source);
+    return 127;
+  }
+
+  // We share our own cwd with every other worker, so paths the executor opens
+  // itself are resolved against the client's through an fd for it.
+  int cwd_fd = open(req->cwd, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (cwd_fd < 0) {
+    dprintf(req->fds[2], "turtle: can't open cwd '%s': %s\n", req->cwd,
+            strerror(errno));
+    server_script_unref(script);
+    return 1;
+  }
+
+  cmd_executor *executor = cmd_executor_new_with_env(req->envp);
+  executor->stdin_fno = req->fds[0];
+  executor->stdout_fno = req->fds[1];
+  executor->stderr_fno = req->fds[2];
+  executor->cwd = req->cwd;
+  executor->cwd_fd = cwd_fd;
+  cmd_executor_set_args(executor,
+                        req->kind == SERVER_REQ_SCRIPT ? req->source
+                                                           : "turtle",
+                        req->args);
+
+  int status = 0;
+  for (GList *node = script->cmds; node != NULL; node = node->next) {
+    if ((status = cmd_executor_exec(executor, node->data)) != 0) {
+      break;
+    }
+  }
+
+  cmd_executor_free(executor);
+  close(cwd_fd);
+  server_script_unref(script);
+
+  return status;
+}
+
+// server_handle serves a single connection on a worker thread.
+static void server_handle(gpointer data, gpointer user_data) {
+  (void)user_data;
+
+  int conn = GPOINTER_TO_INT(data);
+
+  server_request req = {
+      .fds = {-1, -1, -1},
+      .payload = NULL,
+  };
+
+  if (server_recv_request(conn, &req)) {
+    int32_t status = server_exec(&req);
+    server_write_full(conn, &status, sizeof(status));
+  }
+
+  for (int i = 0; i < 3; i++) {
+    if (req.fds[i] >= 0) {
+      close(req.fds[i]);
+    }
+  }
+
+  free(req.args);
+  free(req.envp);
+  free(req.payload);
+  close(conn);
+}
+
+static int server_socket(const char *sock_path, struct sockaddr_un *addr) {
+  if (strlen(sock_path) >= sizeof(addr->sun_path)) {
+    giveup("server: socket path too long: %s", sock_path);
+  }
+
+  memset(addr, 0, sizeof(*addr));
+  addr->sun_family = AF_UNIX;
+  strcpy(addr->sun_path, sock_path);
+
+  int fd;
+  if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+    giveup("server: socket failed");
+  }
+
+  fcntl(fd, F_SETFD, FD_CLOEXEC);
+
+  return fd;
+}
+
+// server_run listens on sock_path and serves requests until killed.
+int server_run(const char *sock_path) {
+  signal(SIGPIPE, SIG_IGN);
+
+  struct sockaddr_un addr;
+  int fd = server_socket(sock_path, &addr);
+
+  unlink(sock_path);
+  if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+    giveup("server: bind to '%s' failed", sock_path);
+  }
+
+  if (listen(fd, SOMAXCONN) < 0) {
+    giveup("server: listen failed");
+  }
+
+  GThreadPool *pool = g_thread_pool_new(
+      server_handle, NULL, (gint)g_get_num_processors(), true, NULL);
+
+  for (;;) {
+    int conn = accept(fd, NULL, NULL);
+    if (conn < 0) {
+      if (errno == EINTR || errno == ECONNABORTED) {
+        continue;
+      }
+
+      giveup("server: accept failed");
+    }
+
+    fcntl(conn, F_SETFD, FD_CLOEXEC);
+    g_thread_pool_push(pool, GINT_TO_POINTER(conn), NULL);
+  }
+}
+
+// server_client_run forwards a cmd (or script and its args) to the server at
+// sock_path along with our stdio, cwd and environment, and returns the exit
+// status the server replies with.
+int server_client_run(const char *sock_path, char *cmd_str,
+                      char *script_filename, GList *args) {
+  GString *payload = g_string_new(NULL);
+
+  if (cmd_str != NULL) {
+    server_payload_append_u32(payload, SERVER_REQ_CMD);
+    server_payload_append_str(payload, cmd_str);
+  } else {
+    // The server doesn't share our cwd, so send it an absolute path.
+    char path[PATH_MAX];
+    server_payload_append_u32(payload, SERVER_REQ_SCRIPT);
+    server_payload_append_str(payload, realpath(script_filename, path) != NULL
+                                           ? path
+                                           : script_filename);
+  }
+
+  char cwd[PATH_MAX];
+  server_payload_append_str(payload,
+                            getcwd(cwd, sizeof(cwd)) != NULL ? cwd : "/");
+
+  server_payload_append_u32(payload, g_list_length(args));
+  for (GList *node = args; node != NULL; node = node->next) {
+    server_payload_append_str(payload, node->data);
+  }
+
+  uint32_t envc = 0;
+  while (environ[envc] != NULL) {
+    envc++;
+  }
+
+  server_payload_append_u32(payload, envc);
+  for (uint32_t i = 0; i < envc; i++) {
+    server_payload_append_str(payload, environ[i]);
+  }
+
+  struct sockaddr_un addr;
+  int fd = server_socket(sock_path, &addr);
+  if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+    giveup("client: connect to '%s' failed", sock_path);
+  }
+
+  // Send the payload length along with our stdio, then the payload itself.
+  uint32_t payload_len = (uint32_t)payload->len;
+  struct iovec iov = {.iov_base = &payload_len, .iov_len = sizeof(payload_len)};
+
+  int fds[3] = {STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO};
+  union {
+    char buf[CMSG_SPACE(sizeof(fds))];
+    struct cmsghdr align;
+  } control;
+  memset(&control, 0, sizeof(control));
+
+  struct msghdr msg = {
+      .msg_iov = &iov,
+      .msg_iovlen = 1,
+      .msg_control = control.buf,
+      .msg_controllen = sizeof(control.buf),
+  };
+
+  struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+  memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+  if (sendmsg(fd, &msg, 0) != sizeof(payload_len) ||
+      !server_write_full(fd, payload->str, payload->len)) {
+    giveup("client: send failed");
+  }
+
+  g_string_free(payload, true);
+
+  int32_t status;
+  if (!server_read_full(fd, &status, sizeof(status))) {
+    giveup("client: server hung up without a status");
+  }
+
+  close(fd);
+
+  return status;
+}
@@ -0,0 +1,16 @@
+#pragma once
+
+#include "glib.h"
+
+// The server runs scripts and cmds on behalf of clients connecting over a
+// Unix socket, so frequent invocations don't each pay for process startup
+// and parsing.
+//
+// A client sends its stdin/stdout/stderr (as SCM_RIGHTS), cwd, environment,
+// args and either a script path or cmd text; the server runs it on a worker
+// thread with its own executor and replies with the exit status.
+
+int server_run(const char *sock_path);
+
+int server_client_run(const char *sock_path, char *cmd_str,
+                      char *script_filename, GList *args);
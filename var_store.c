@@ -0,0 +1,451 @@
+#include "var_store.h"
+#include "glib.h"
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Interned names are shared by every parser and executor, so slots mean the
+// same thing everywhere (and parsers on different threads share them).
+static GMutex names_lock;
+static GHashTable *slots_by_name = NULL;
+static GPtrArray *names_by_slot = NULL;
+
+// Each thread also keeps its own GHashTable<char* name, slot> of the names
+// it's interned (keyed by the shared copies), so threads parsing at the same
+// time only take names_lock for names they haven't seen yet.
+static pthread_key_t local_slots_key;
+static pthread_once_t local_slots_once = PTHREAD_ONCE_INIT;
+
+static void var_store_init_local_slots(void) {
+  pthread_key_create(&local_slots_key, (void (*)(void *))g_hash_table_unref);
+}
+
+var_value *var_value_new(const char *str, size_t len) {
+  var_value *value = malloc(sizeof(var_value));
+  value->refs = 1;
+  value->len = len;
+  value->cap = len + 1;
+  value->str = malloc(value->cap);
+  value->head = NULL;
+
+  memcpy(value->str, str, len);
+  value->str[len] = 0;
+
+  return value;
+}
+
+var_value *var_value_ref(var_value *value) {
+  value->refs++;
+
+  return value;
+}
+
+void var_value_unref(var_value *value) {
+  // Release chunk chains iteratively so long chains can't blow the stack.
+  while (value != NULL && --value->refs == 0) {
+    var_value *head = value->head;
+
+    free(value->str);
+    free(value);
+
+    value = head;
+  }
+}
+
+// var_value_tail_len returns the number of bytes stored in the value itself
+// (i.e. excluding its head).
+static size_t var_value_tail_len(var_value *value) {
+  return value->head != NULL ? value->len - value->head->len : value->len;
+}
+
+// var_value_append appends to the value, taking ownership of the caller's ref
+// and returning a ref to the result.
+//
+// Uniquely owned values grow in place (doubling their capacity), so repeated
+// appends are amortized O(len); shared values are left untouched and become
+// the head of a new chunk.
+var_value *var_value_append(var_value *value, const char *str, size_t len) {
+  if (len == 0) {
+    return value;
+  }
+
+  if (value->refs > 1) {
+    var_value *chunk = var_value_new(str, len);
+    chunk->head = value;
+    chunk->len = value->len + len;
+
+    return chunk;
+  }
+
+  size_t tail_len = var_value_tail_len(value);
+  if (tail_len + len + 1 > value->cap) {
+    value->cap = MAX(value->cap * 2, tail_len + len + 1);
+    value->str = realloc(value->str, value->cap);
+  }
+
+  memcpy(value->str + tail_len, str, len);
+  value->str[tail_len + len] = 0;
+  value->len += len;
+
+  return value;
+}
+
+// var_value_reserve makes room for at least len more bytes at the end of a
+// uniquely owned value with no head and returns where they start (storing how
+// many bytes are free there in avail), so callers like read(2) can fill it
+// directly; var_value_commit then keeps the bytes written.
+char *var_value_reserve(var_value *value, size_t len, size_t *avail) {
+  if (value->len + len + 1 > value->cap) {
+    value->cap = MAX(value->cap * 2, value->len + len + 1);
+    value->str = realloc(value->str, value->cap);
+  }
+
+  *avail = value->cap - value->len - 1;
+
+  return value->str + value->len;
+}
+
+void var_value_commit(var_value *value, size_t len) {
+  value->len += len;
+  value->str[value->len] = 0;
+}
+
+// var_value_truncate shortens a uniquely owned value with no head.
+void var_value_truncate(var_value *value, size_t len) {
+  value->len = len;
+  value->str[len] = 0;
+}
+
+// var_value_str returns the value's whole contents, flattening it first if
+// it's a chunk.
+const char *var_value_str(var_value *value) {
+  if (value->head == NULL) {
+    return value->str;
+  }
+
+  char *str = malloc(value->len + 1);
+  str[value->len] = 0;
+
+  // Copy each chunk's bytes into place, working back from the end.
+  size_t end = value->len;
+  for (var_value *chunk = value; chunk != NULL; chunk = chunk->head) {
+    size_t chunk_len = var_value_tail_len(chunk);
+    end -= chunk_len;
+
+    memcpy(str + end, chunk->str, chunk_len);
+  }
+
+  free(value->str);
+  value->str = str;
+  value->cap = value->len + 1;
+
+  var_value_unref(value->head);
+  value->head = NULL;
+
+  return value->str;
+}
+
+// var_store_intern returns the slot for the given name, assigning the next
+// free slot the first time a name is seen.
+int var_store_intern(const char *name, size_t len) {
+  pthread_once(&local_slots_once, var_store_init_local_slots);
+
+  GHashTable *local_slots = pthread_getspecific(local_slots_key);
+  if (local_slots == NULL) {
+    local_slots = g_hash_table_new(g_str_hash, g_str_equal);
+    pthread_setspecific(local_slots_key, local_slots);
+  }
+
+  // Names are short, so look them up without copying them where we can.
+  char buf[64];
+  char *key = len < sizeof(buf) ? buf : malloc(len + 1);
+  memcpy(key, name, len);
+  key[len] = 0;
+
+  gpointer slot;
+  if (g_hash_table_lookup_extended(local_slots, key, NULL, &slot)) {
+    if (key != buf) {
+      free(key);
+    }
+
+    return GPOINTER_TO_INT(slot);
+  }
+
+  g_mutex_lock(&names_lock);
+
+  if (slots_by_name == NULL) {
+    slots_by_name = g_hash_table_new(g_str_hash, g_str_equal);
+    names_by_slot = g_ptr_array_new();
+  }
+
+  gpointer shared_key;
+  if (!g_hash_table_lookup_extended(slots_by_name, key, &shared_key, &slot)) {
+    shared_key = key != buf ? key : strdup(key);
+    key = NULL;
+    slot = GINT_TO_POINTER(names_by_slot->len);
+
+    g_ptr_array_add(names_by_slot, shared_key);
+    g_hash_table_insert(slots_by_name, shared_key, slot);
+  }
+
+  g_mutex_unlock(&names_lock);
+
+  if (key != NULL && key != buf) {
+    free(key);
+  }
+
+  g_hash_table_insert(local_slots, shared_key, slot);
+
+  return GPOINTER_TO_INT(slot);
+}
+
+const char *var_store_slot_name(int slot) {
+  g_mutex_lock(&names_lock);
+  const char *name = g_ptr_array_index(names_by_slot, (guint)slot);
+  g_mutex_unlock(&names_lock);
+
+  return name;
+}
+
+var_store *var_store_new(void) {
+  var_store *store = malloc(sizeof(var_store));
+  store->slots = NULL;
+  store->len = 0;
+  store->envp = malloc(sizeof(char *));
+  store->envp[0] = NULL;
+  store->envc = 0;
+  store->envp_cap = 1;
+  store->envp_slots = NULL;
+  store->env_dirty_slots = g_array_new(false, false, sizeof(int));
+  store->pending_envp = NULL;
+
+  return store;
+}
+
+void var_store_free(var_store *store) {
+  for (size_t i = 0; i < store->len; i++) {
+    var_value_unref(store->slots[i].value);
+    free(store->slots[i].env_entry);
+  }
+
+  free(store->slots);
+  free(store->envp);
+  free(store->envp_slots);
+  g_array_free(store->env_dirty_slots, true);
+  free(store);
+}
+
+static var_slot *var_store_slot(var_store *store, int slot) {
+  if ((size_t)slot >= store->len) {
+    size_t len = store->len == 0 ? 64 : store->len;
+    while (len <= (size_t)slot) {
+      len *= 2;
+    }
+
+    store->slots = realloc(store->slots, len * sizeof(var_slot));
+    for (size_t i = store->len; i < len; i++) {
+      store->slots[i] = (var_slot){
+          .value = NULL,
+          .exported = false,
+          .env_dirty = false,
+          .env_entry = NULL,
+          .env_index = -1,
+      };
+    }
+    store->len = len;
+  }
+
+  return &store->slots[slot];
+}
+
+var_value *var_store_get(var_store *store, int slot) {
+  var_store_import_pending(store);
+
+  if ((size_t)slot >= store->len) {
+    return NULL;
+  }
+
+  return store->slots[slot].value;
+}
+
+static void var_store_mark_env_dirty(var_store *store, int slot) {
+  var_slot *s = var_store_slot(store, slot);
+  if (!s->env_dirty) {
+    s->env_dirty = true;
+    g_array_append_val(store->env_dirty_slots, slot);
+  }
+}
+
+// var_store_set stores the value in the slot, taking ownership of the caller's
+// ref and releasing the value it replaces.
+void var_store_set(var_store *store, int slot, var_value *value) {
+  var_store_import_pending(store);
+
+  var_slot *s = var_store_slot(store, slot);
+
+  var_value_unref(s->value);
+  s->value = value;
+
+  if (s->exported) {
+    var_store_mark_env_dirty(store, slot);
+  }
+}
+
+// var_store_take removes the slot's value and returns the store's ref to it,
+// so the caller can append to it in place before setting it back.
+var_value *var_store_take(var_store *store, int slot) {
+  var_store_import_pending(store);
+
+  if ((size_t)slot >= store->len) {
+    return NULL;
+  }
+
+  var_value *value = store->slots[slot].value;
+  store->slots[slot].value = NULL;
+
+  return value;
+}
+
+void var_store_export(var_store *store, int slot) {
+  var_store_import_pending(store);
+
+  var_slot *s = var_store_slot(store, slot);
+  if (!s->exported) {
+    s->exported = true;
+    var_store_mark_env_dirty(store, slot);
+  }
+}
+
+// var_store_import_pending interns, stores and exports every "name=value" in
+// the envp passed to var_store_import_env, if that hasn't happened yet.
+//
+// Since that mutates the store on what looks like a read, it must be done
+// before the store is shared with another thread.
+void var_store_import_pending(var_store *store) {
+  char **envp = store->pending_envp;
+  if (envp == NULL) {
+    return;
+  }
+
+  store->pending_envp = NULL;
+
+  for (char **env = envp; *env != NULL; env++) {
+    char *eq = strchr(*env, '=');
+    if (eq == NULL) {
+      continue;
+    }
+
+    int slot = var_store_intern(*env, (size_t)(eq - *env));
+    var_store_set(store, slot, var_value_new(eq + 1, strlen(eq + 1)));
+    var_store_export(store, slot);
+  }
+}
+
+// var_store_import_env imports envp into the store (which must outlive it).
+//
+// Nothing's actually imported until the store is first used, so a cmd that
+// never touches a var (e.g. "turtle -c true") never pays for it.
+void var_store_import_env(var_store *store, char **envp) {
+  var_store_import_pending(store);
+  store->pending_envp = envp;
+}
+
+// var_store_env_entry returns a new "name=value" string for the slot.
+char *var_store_env_entry(int slot, var_value *value) {
+  const char *name = var_store_slot_name(slot);
+  size_t name_len = strlen(name);
+
+  char *entry = malloc(name_len + 1 + value->len + 1);
+  memcpy(entry, name, name_len);
+  entry[name_len] = '=';
+  memcpy(entry + name_len + 1, var_value_str(value), value->len + 1);
+
+  return entry;
+}
+
+static void var_store_envp_reserve(var_store *store, size_t n) {
+  if (store->envp_cap >= n + 1) {
+    return;
+  }
+
+  size_t cap = store->envp_cap * 2;
+  while (cap < n + 1) {
+    cap *= 2;
+  }
+
+  store->envp = realloc(store->envp, cap * sizeof(char *));
+  store->envp_slots = realloc(store->envp_slots, cap * sizeof(int));
+  store->envp_cap = cap;
+}
+
+// var_store_flush_env_slot brings a single dirty slot's envp entry up to date.
+static void var_store_flush_env_slot(var_store *store, int slot) {
+  var_slot *s = &store->slots[slot];
+  s->env_dirty = false;
+
+  free(s->env_entry);
+  s->env_entry = NULL;
+
+  // Exported and set: add or replace its entry.
+  if (s->exported && s->value != NULL) {
+    s->env_entry = var_store_env_entry(slot, s->value);
+
+    if (s->env_index < 0) {
+      var_store_envp_reserve(store, store->envc + 1);
+
+      s->env_index = (int)store->envc;
+      store->envp_slots[store->envc] = slot;
+      store->envc++;
+    }
+
+    store->envp[s->env_index] = s->env_entry;
+    return;
+  }
+
+  // Otherwise, drop its entry (if it has one) by moving the last entry into
+  // its place.
+  if (s->env_index >= 0) {
+    size_t last = store->envc - 1;
+
+    store->envp[s->env_index] = store->envp[last];
+    store->envp_slots[s->env_index] = store->envp_slots[last];
+    store->slots[store->envp_slots[last]].env_index = s->env_index;
+
+    store->envc--;
+    s->env_index = -1;
+  }
+}
+
+// var_store_envp returns the NULL-terminated environment for child processes,
+// regenerating only the entries of exported vars that changed since the last
+// call.
+//
+// The returned array always has room for spare more entries (plus the NULL
+// terminator) so callers can overlay per-command vars in a forked child
+// without reallocating.
+char **var_store_envp(var_store *store, size_t spare) {
+  var_store_import_pending(store);
+
+  for (guint i = 0; i < store->env_dirty_slots->len; i++) {
+    var_store_flush_env_slot(store,
+                             g_array_index(store->env_dirty_slots, int, i));
+  }
+  g_array_set_size(store->env_dirty_slots, 0);
+
+  var_store_envp_reserve(store, store->envc + spare);
+  store->envp[store->envc] = NULL;
+
+  return store->envp;
+}
+
+// var_store_env_index returns the index of the slot's entry in the envp
+// returned by the last call to var_store_envp (or -1 if it has none).
+int var_store_env_index(var_store *store, int slot) {
+  var_store_import_pending(store);
+
+  if ((size_t)slot >= store->len) {
+    return -1;
+  }
+
+  return store->slots[slot].env_index;
+}
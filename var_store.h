@@ -0,0 +1,109 @@
+#pragma once
+
+#include "glib.h"
+#include <stdbool.h>
+#include <stddef.h>
+
+// var_value is a length-prefixed, refcounted variable value.
+//
+// Values are shared (not copied) between the store, expansions and argv; take
+// a ref with var_value_ref to keep one alive past the next assignment.
+//
+// A value's contents never change once it's shared, but a uniquely owned
+// value can be appended to in place (see var_value_append). Appending to a
+// shared value instead produces a chunk that refers to the shared value as its
+// head and holds only the appended bytes; var_value_str flattens chunks the
+// first time the whole value is actually needed.
+typedef struct var_value {
+  int refs;
+
+  // The length of the whole value (including any head).
+  size_t len;
+
+  // The value's bytes (NUL-terminated); for a chunk, only the bytes after
+  // head.
+  char *str;
+  size_t cap;
+
+  struct var_value *head;
+} var_value;
+
+var_value *var_value_new(const char *str, size_t len);
+
+var_value *var_value_ref(var_value *value);
+
+void var_value_unref(var_value *value);
+
+var_value *var_value_append(var_value *value, const char *str, size_t len);
+
+const char *var_value_str(var_value *value);
+
+char *var_value_reserve(var_value *value, size_t len, size_t *avail);
+
+void var_value_commit(var_value *value, size_t len);
+
+void var_value_truncate(var_value *value, size_t len);
+
+typedef struct var_slot {
+  // NULL means unset.
+  var_value *value;
+
+  bool exported;
+
+  // Whether the slot's envp entry is stale.
+  bool env_dirty;
+
+  // The slot's "name=value" entry and its index in envp (or -1).
+  char *env_entry;
+  int env_index;
+} var_slot;
+
+// var_store holds an executor's variables in an array indexed by the slot
+// each name was interned to (see var_store_intern).
+//
+// It also maintains the envp for child processes: changes to exported vars
+// only mark their slot dirty, and var_store_envp patches just those entries.
+typedef struct var_store {
+  var_slot *slots;
+  size_t len;
+
+  // char*[envp_cap]; NULL-terminated at envc.
+  char **envp;
+  size_t envc;
+  size_t envp_cap;
+
+  // The slot each envp entry belongs to.
+  int *envp_slots;
+
+  // Slots whose env entry needs to be regenerated.
+  GArray *env_dirty_slots;
+
+  // The environment still to be imported (see var_store_import_env).
+  char **pending_envp;
+} var_store;
+
+int var_store_intern(const char *name, size_t len);
+
+const char *var_store_slot_name(int slot);
+
+var_store *var_store_new(void);
+
+void var_store_free(var_store *store);
+
+var_value *var_store_get(var_store *store, int slot);
+
+void var_store_set(var_store *store, int slot, var_value *value);
+
+var_value *var_store_take(var_store *store, int slot);
+
+void var_store_export(var_store *store, int slot);
+
+void var_store_import_env(var_store *store, char **envp);
+
+void var_store_import_pending(var_store *store);
+
+char *var_store_env_entry(int slot, var_value *value);
+
+char **var_store_envp(var_store *store, size_t spare);
+
+int var_store_env_index(var_store *store, int slot);